@@ -0,0 +1,165 @@
+#include "alignment.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+namespace
+{
+    using namespace DynamiCL;
+
+    // levels smaller than this in either dimension have too few pixels to
+    // tell translations apart
+    size_t const s_minLevelSize = 16;
+
+    // grey levels this close to the median are too noisy to threshold
+    int const s_noise = 4;
+
+    /**
+     * @Return grey level of @a pixel, from 0 to 255, weighting its
+     * components like Ward does
+     */
+    inline int greyLevel(RGBA<float> const& pixel)
+    {
+        float grey = (54.0f * pixel.r + 183.0f * pixel.g + 19.0f * pixel.b) / 256.0f;
+        return static_cast<int>(std::min(std::max(grey, 0.0f), 1.0f) * 255.0f + 0.5f);
+    }
+
+    int roundedShift(int n, size_t level)
+    {
+        return static_cast<int>(std::floor(n / static_cast<double>(1 << level) + 0.5));
+    }
+}
+
+namespace DynamiCL
+{
+
+    Translation Translation::atLevel(size_t level) const
+    {
+        Translation t = { roundedShift(x, level), roundedShift(y, level) };
+        return t;
+    }
+
+    void ThresholdBitmaps::assign(std::vector<view_type> const& gaussians)
+    {
+        size_t numLevels = 0;
+        while (numLevels < gaussians.size()
+               && gaussians[numLevels].width() >= s_minLevelSize
+               && gaussians[numLevels].height() >= s_minLevelSize)
+        {
+            ++numLevels;
+        }
+        levels_.resize(numLevels);
+
+        std::vector<int> greys;
+        for (size_t i = 0; i < numLevels; ++i)
+        {
+            view_type const& gaussian = gaussians[i];
+            Level& level = levels_[i];
+            level.width = gaussian.width();
+            level.height = gaussian.height();
+
+            size_t const numPixels = gaussian.totalSize();
+            greys.resize(numPixels);
+
+            std::array<size_t, 256> histogram = {{ 0 }};
+            for (size_t p = 0; p < numPixels; ++p)
+            {
+                greys[p] = greyLevel(gaussian.begin()[p]);
+                ++histogram[greys[p]];
+            }
+
+            int median = 0;
+            for (size_t count = 0; median < 255; ++median)
+            {
+                count += histogram[median];
+                if (2 * count >= numPixels)
+                {
+                    break;
+                }
+            }
+
+            level.bitmap.resize(numPixels);
+            level.exclusion.resize(numPixels);
+            for (size_t p = 0; p < numPixels; ++p)
+            {
+                level.bitmap[p] = greys[p] > median;
+                level.exclusion[p] = std::abs(greys[p] - median) > s_noise;
+            }
+        }
+    }
+
+    Translation ThresholdBitmaps::offsetFrom(ThresholdBitmaps const& reference) const
+    {
+        if (levels_.size() != reference.levels_.size()
+            || (!levels_.empty() && (levels_[0].width != reference.levels_[0].width
+                                     || levels_[0].height != reference.levels_[0].height)))
+        {
+            throw std::invalid_argument("Only bitmaps of images of the same size can be aligned.");
+        }
+
+        // no move first, so that ties keep the image where it is
+        static int const moves[9][2] = { {0, 0},
+                                         {-1, -1}, {0, -1}, {1, -1},
+                                         {-1, 0},           {1, 0},
+                                         {-1, 1},  {0, 1},  {1, 1} };
+
+        Translation shift = { 0, 0 };
+        for (size_t level = levels_.size(); level-- > 0; )
+        {
+            shift.x *= 2;
+            shift.y *= 2;
+
+            Translation best = shift;
+            size_t fewest = std::numeric_limits<size_t>::max();
+            for (auto const& move : moves)
+            {
+                int dx = shift.x + move[0];
+                int dy = shift.y + move[1];
+                size_t count = differences(levels_[level], reference.levels_[level], dx, dy);
+                if (count < fewest)
+                {
+                    fewest = count;
+                    best.x = dx;
+                    best.y = dy;
+                }
+            }
+            shift = best;
+        }
+
+        return shift;
+    }
+
+    size_t ThresholdBitmaps::differences(Level const& image, Level const& reference, int dx, int dy)
+    {
+        long const width = image.width;
+        long const height = image.height;
+
+        // only where the translated image overlaps the reference
+        long const firstX = std::max(0L, -static_cast<long>(dx));
+        long const lastX = std::min(width, width - dx);
+        long const firstY = std::max(0L, -static_cast<long>(dy));
+        long const lastY = std::min(height, height - dy);
+
+        size_t count = 0;
+        for (long y = firstY; y < lastY; ++y)
+        {
+            size_t const refRow = y * width + firstX;
+            size_t const row = (y + dy) * width + firstX + dx;
+
+            uint8_t const* refBits = reference.bitmap.data() + refRow;
+            uint8_t const* refUsed = reference.exclusion.data() + refRow;
+            uint8_t const* bits = image.bitmap.data() + row;
+            uint8_t const* used = image.exclusion.data() + row;
+
+            for (long x = 0; x < lastX - firstX; ++x)
+            {
+                count += (bits[x] ^ refBits[x]) & used[x] & refUsed[x];
+            }
+        }
+        return count;
+    }
+
+}
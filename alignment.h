@@ -0,0 +1,96 @@
+#ifndef ALIGNMENT_H_Q7HM3ZPT
+#define ALIGNMENT_H_Q7HM3ZPT
+
+#include <cstdint>
+#include <vector>
+
+#include "host_image.hpp"
+
+namespace DynamiCL
+{
+
+    /**
+     * Translation of an image onto another, in pixels. A pixel at (x, y)
+     * of the other image matches the one at (x + this->x, y + this->y) of
+     * the translated image.
+     */
+    struct Translation
+    {
+        int x;
+        int y;
+
+        /**
+         * @Return the translation at @a level of a pyramid, whose first
+         * level this one is for, rounded to the nearest pixel of that level
+         *
+         * Each level is rounded on its own, so it is off by at most half
+         * of its pixels, 2^(level-1) pixels of the first level, and two
+         * neighbouring levels by at most a pixel of the finer one from
+         * each other. Translations from ThresholdBitmaps::offsetFrom()
+         * are whole pixels of the level searched from, so up to that
+         * level there is no error at all, and the coarser levels only
+         * hold detail larger than theirs.
+         */
+        Translation atLevel(size_t level) const;
+
+        bool isZero() const { return x == 0 && y == 0; }
+    };
+
+    /**
+     * Median threshold bitmaps of the gaussian levels of an image, as in
+     * Ward's alignment of exposures. Each pixel is 1 if it is brighter
+     * than the median of its level, and pixels close to the median are
+     * left out, so bitmaps of differently exposed images match wherever
+     * the images show the same thing.
+     */
+    class ThresholdBitmaps
+    {
+    public:
+        typedef HostImageView<RGBA<float>, 2> view_type;
+
+        ThresholdBitmaps() { }
+
+        /**
+         * Threshold @a gaussians, which go from largest to smallest, each
+         * half the size of the previous one, rounded up
+         */
+        explicit ThresholdBitmaps(std::vector<view_type> const& gaussians)
+        {
+            assign(gaussians);
+        }
+
+        /**
+         * Same as the constructor, but keeps the memory of the bitmaps
+         * there were, so that thresholding images of the same size over
+         * and over allocates nothing
+         */
+        void assign(std::vector<view_type> const& gaussians);
+
+        bool empty() const { return levels_.empty(); }
+
+        /**
+         * Search the translation of the image of these bitmaps onto that
+         * of @a reference, from the smallest level to the largest, which
+         * the result is in pixels of. Each level refines the translation
+         * by a pixel at most, so the translation is found up to 2^levels
+         * pixels in each direction.
+         */
+        Translation offsetFrom(ThresholdBitmaps const& reference) const;
+
+    private:
+        struct Level
+        {
+            size_t width;
+            size_t height;
+            std::vector<uint8_t> bitmap;    ///< 1 above the median
+            std::vector<uint8_t> exclusion; ///< 0 close to the median
+        };
+
+        std::vector<Level> levels_; ///< from largest to smallest
+
+        static size_t differences(Level const& image, Level const& reference, int dx, int dy);
+    };
+
+}
+
+#endif /* end of include guard: ALIGNMENT_H_Q7HM3ZPT */
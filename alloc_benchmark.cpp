@@ -0,0 +1,132 @@
+/**
+ * Compares the allocation policies of array_ptr on arrays the size of a
+ * merge group's arena:
+ *
+ *   alloc_benchmark [megabytes] [numa node]
+ *
+ * For every policy, it measures the first touch of the whole array, the
+ * bandwidth of copying one array into another, as the pyramid code does,
+ * and a walk touching one pixel per 4 KB page in random order, which is
+ * bound by TLB misses. Giving a node other than the one the benchmark
+ * runs on shows the cost of remote memory.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+namespace
+{
+    using namespace DynamiCL;
+
+    typedef std::chrono::high_resolution_clock clock_type;
+
+    struct Pixel
+    {
+        float components[4];
+    };
+
+    typedef array_ptr<Pixel, 256> array_type;
+
+    double secondsSince(clock_type::time_point start)
+    {
+        return std::chrono::duration<double>(clock_type::now() - start).count();
+    }
+
+    /**
+     * @Return huge pages backing anonymous memory of this process, in kB
+     */
+    size_t anonHugePagesKb()
+    {
+        std::ifstream smaps("/proc/self/smaps_rollup");
+        std::string line;
+        while (std::getline(smaps, line))
+        {
+            if (line.compare(0, 14, "AnonHugePages:") == 0)
+            {
+                return std::strtoull(line.c_str() + 14, nullptr, 10);
+            }
+        }
+        return 0;
+    }
+
+    void run(char const* name, AllocationPolicy const& policy, size_t numPixels)
+    {
+        size_t const bytes = numPixels * sizeof(Pixel);
+        size_t const hugeBefore = anonHugePagesKb();
+
+        // first touch is where pages are faulted in and placed
+        auto start = clock_type::now();
+        array_type src(numPixels, policy);
+        array_type dst(numPixels, policy);
+        std::memset(src.ptr(), 1, bytes);
+        std::memset(dst.ptr(), 0, bytes);
+        double touch = secondsSince(start);
+
+        size_t const hugeMb = (anonHugePagesKb() - std::min(hugeBefore, anonHugePagesKb())) / 1024;
+
+        double copy = 1e9;
+        for (int i = 0; i < 3; ++i)
+        {
+            start = clock_type::now();
+            std::copy(src.begin(), src.end(), dst.begin());
+            copy = std::min(copy, secondsSince(start));
+        }
+
+        // one pixel per page, in an order the prefetcher cannot guess
+        size_t const pixelsPerPage = 4096 / sizeof(Pixel);
+        std::vector<size_t> pages(numPixels / pixelsPerPage);
+        std::iota(pages.begin(), pages.end(), 0);
+        std::shuffle(pages.begin(), pages.end(), std::mt19937(42));
+
+        float sum = 0.0f;
+        start = clock_type::now();
+        for (size_t page : pages)
+        {
+            sum += src.ptr()[page * pixelsPerPage].components[0];
+        }
+        double walk = secondsSince(start);
+
+        std::cout << std::setw(12) << name
+                  << std::setw(12) << std::fixed << std::setprecision(1) << touch * 1e3
+                  << std::setw(12) << 2.0 * bytes / copy / 1e9
+                  << std::setw(12) << std::setprecision(2) << walk * 1e9 / std::max<size_t>(pages.size(), 1)
+                  << std::setw(12) << hugeMb
+                  << (sum < 0 ? " " : "") // keep the walk from being optimized out
+                  << std::endl;
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    size_t megabytes = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1024;
+    int node = argc > 2 ? std::atoi(argv[2]) : currentNumaNode();
+
+    size_t const numPixels = (megabytes << 20) / sizeof(Pixel);
+
+    std::cout << "Two arrays of " << megabytes << " MB, running on node " << currentNumaNode()
+              << ", memory on node " << node << "\n\n"
+              << std::setw(12) << "policy"
+              << std::setw(12) << "touch ms"
+              << std::setw(12) << "copy GB/s"
+              << std::setw(12) << "walk ns"
+              << std::setw(12) << "huge MB" << std::endl;
+
+    typedef AllocationPolicy::Pages Pages;
+    run("malloc",      AllocationPolicy(),                         numPixels);
+    run("small",       AllocationPolicy(Pages::SMALL, node),       numPixels);
+    run("transparent", AllocationPolicy(Pages::TRANSPARENT, node), numPixels);
+    run("huge",        AllocationPolicy(Pages::HUGE, node),        numPixels);
+
+    return 0;
+}
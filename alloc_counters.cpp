@@ -0,0 +1,48 @@
+#include "alloc_counters.h"
+
+#include <atomic>
+
+namespace
+{
+    std::atomic<size_t> s_hostAllocations(0);
+    std::atomic<size_t> s_hostBytes(0);
+    std::atomic<size_t> s_deviceAllocations(0);
+    std::atomic<size_t> s_deviceBytes(0);
+}
+
+namespace DynamiCL
+{
+
+    AllocationCounts AllocationCounts::current()
+    {
+        AllocationCounts counts;
+        counts.hostAllocations = s_hostAllocations;
+        counts.hostBytes = s_hostBytes;
+        counts.deviceAllocations = s_deviceAllocations;
+        counts.deviceBytes = s_deviceBytes;
+        return counts;
+    }
+
+    AllocationCounts AllocationCounts::operator -(AllocationCounts const& other) const
+    {
+        AllocationCounts diff;
+        diff.hostAllocations = hostAllocations - other.hostAllocations;
+        diff.hostBytes = hostBytes - other.hostBytes;
+        diff.deviceAllocations = deviceAllocations - other.deviceAllocations;
+        diff.deviceBytes = deviceBytes - other.deviceBytes;
+        return diff;
+    }
+
+    void countHostAllocation(size_t bytes)
+    {
+        ++s_hostAllocations;
+        s_hostBytes += bytes;
+    }
+
+    void countDeviceAllocation(size_t bytes)
+    {
+        ++s_deviceAllocations;
+        s_deviceBytes += bytes;
+    }
+
+}
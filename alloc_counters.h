@@ -0,0 +1,49 @@
+#ifndef ALLOC_COUNTERS_H_R6DW2KXM
+#define ALLOC_COUNTERS_H_R6DW2KXM
+
+#include <cstddef>
+
+namespace DynamiCL
+{
+
+    /**
+     * Allocations made by the process so far. Taking the difference of
+     * two shows what a stretch of work allocated, e.g. to check that
+     * merging frame after frame of a timelapse allocates no more device
+     * images, and no more image memory, once the first frame is done.
+     * Recording kernels, and the events between them, still makes small
+     * allocations for every frame.
+     */
+    struct AllocationCounts
+    {
+        size_t hostAllocations;
+        size_t hostBytes;
+        size_t deviceAllocations; ///< device images, other than those using host memory
+        size_t deviceBytes;
+
+        /**
+         * @Return counts since the process started
+         */
+        static AllocationCounts current();
+
+        AllocationCounts operator -(AllocationCounts const& other) const;
+
+        bool empty() const { return hostAllocations == 0 && deviceAllocations == 0; }
+    };
+
+    /**
+     * Count a host allocation of @a bytes, however small. Memory of
+     * array_ptr, from malloc or mmap, is always counted. Operator new only
+     * counts in builds that link alloc_hooks.cpp, which replaces it, as
+     * the test suite does.
+     */
+    void countHostAllocation(size_t bytes);
+
+    /**
+     * Count a device allocation of @a bytes
+     */
+    void countDeviceAllocation(size_t bytes);
+
+}
+
+#endif /* end of include guard: ALLOC_COUNTERS_H_R6DW2KXM */
@@ -0,0 +1,48 @@
+#include "alloc_counters.h"
+
+#include <cstdlib>
+#include <new>
+
+/*
+ * Replacements of the global allocation functions, so that every
+ * allocation of any library counts too. Only the test suite links them,
+ * to check what a stretch of work allocates, so that the program itself
+ * keeps the default ones. Apart from counting, they are the same as the
+ * default ones, minus the new handler, which nothing here installs.
+ */
+
+namespace
+{
+    void* allocate(size_t bytes)
+    {
+        DynamiCL::countHostAllocation(bytes);
+
+        // operator new may not return null, even for 0 bytes
+        void* p = std::malloc(bytes ? bytes : 1);
+        if (!p)
+        {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+}
+
+void* operator new(size_t bytes)
+{
+    return allocate(bytes);
+}
+
+void* operator new[](size_t bytes)
+{
+    return allocate(bytes);
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    std::free(p);
+}
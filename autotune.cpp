@@ -0,0 +1,546 @@
+#include "autotune.h"
+#include "cl_utils.h"
+#include "host_pyramid.h"
+#include "kernel.hpp"
+#include "pending_image.h"
+#include "pyr_impl.h"
+#include "utils.h"
+
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+namespace
+{
+    using namespace DynamiCL;
+
+    typedef std::vector<cl_float4> Pixels;
+    typedef KernelTuning::local_size_type local_size_type;
+
+    // odd sizes, so padding of global ranges gets exercised
+    size_t const s_benchWidth = 1021;
+    size_t const s_benchHeight = 769;
+
+    // launches timed per candidate, after a warm up launch
+    size_t const s_repetitions = 5;
+
+    char const* const s_optionSets[] = {
+        "",
+        "-cl-mad-enable",
+        "-cl-fast-relaxed-math",
+        "-cl-fast-relaxed-math -cl-mad-enable"
+    };
+
+    // square levels timed on both device and host, to find the crossover
+    size_t const s_crossoverDims[] = { 4, 8, 16, 32, 64, 128, 256 };
+
+    local_size_type const s_localSizes[] = {
+        {{ 8, 8 }},
+        {{ 16, 16 }},
+        {{ 16, 8 }},
+        {{ 32, 8 }},
+        {{ 32, 4 }},
+        {{ 64, 4 }},
+        {{ 64, 1 }},
+        {{ 128, 1 }},
+        {{ 256, 1 }}
+    };
+
+    /**
+     * A kernel to tune, with its arguments already allocated
+     */
+    struct TuningCase
+    {
+        char const* name;
+        std::array<size_t, 2> range;
+        std::function<cl::Kernel (cl::Program const&)> instantiate;
+        std::function<Pixels ()> readOutput;
+    };
+
+    template <typename CLImage>
+    typename detail::image_traits<CLImage>::climage_type
+    randomImage(ComputeContext const& context,
+                std::array<size_t, detail::image_traits<CLImage>::N> const& dims,
+                std::mt19937& gen)
+    {
+        // keep weights in alpha away from zero, so fusing never divides by it
+        std::uniform_real_distribution<float> d(0.05f, 1.0f);
+
+        size_t numPixels = 1;
+        for (size_t dim : dims)
+        {
+            numPixels *= dim;
+        }
+
+        Pixels pixels(numPixels);
+        for (cl_float4& pixel : pixels)
+        {
+            pixel.s[0] = d(gen);
+            pixel.s[1] = d(gen);
+            pixel.s[2] = d(gen);
+            pixel.s[3] = d(gen);
+        }
+
+        return createCLImage<CLImage>(context, dims, pixels.data());
+    }
+
+    /**
+     * Values of the arguments of kernel @a name that follow its images
+     */
+    std::vector<cl_float4> trailingArgs(std::string const& name)
+    {
+        if (name == "compute_quality")
+        {
+            return { QualityWeights().toFloat4() };
+        }
+        return {};
+    }
+
+    /**
+     * Tune kernel @a name, writing into @a output from @a inputs
+     */
+    template <typename CLImage, typename... Inputs>
+    TuningCase makeCase(ComputeContext const& context,
+                        char const* name,
+                        std::array<size_t, 2> const& range,
+                        CLImage const& output,
+                        Inputs const&... inputs)
+    {
+        TuningCase out;
+        out.name = name;
+        out.range = range;
+        out.instantiate =
+            [=](cl::Program const& program)
+            {
+                Kernel kernel = { program, name, Kernel::Range::DESTINATION, trailingArgs(name) };
+                return kernel.build(inputs..., output);
+            };
+        out.readOutput =
+            [&context, output]()
+            {
+                std::array<size_t, 2> dims = getDims(output);
+                Pixels pixels(dims[0] * dims[1]);
+                PendingImage<CLImage>(context, output).readInto(pixels.data());
+                return pixels;
+            };
+        return out;
+    }
+
+    /**
+     * Allocate arguments for every kernel the pyramids use
+     */
+    template <typename CLImage>
+    std::vector<TuningCase> makeCases(ComputeContext const& context, size_t groupSize)
+    {
+        typedef typename detail::image_traits<CLImage>::array_type array_type;
+        typedef std::array<size_t, 2> dims_type;
+
+        std::random_device rd;
+        std::mt19937 gen(rd());
+
+        dims_type const full = {{ s_benchWidth, s_benchHeight }};
+        dims_type const halfWidth = {{ halveDimension(s_benchWidth), s_benchHeight }};
+        dims_type const halfHeight = {{ s_benchWidth, halveDimension(s_benchHeight) }};
+        dims_type const doubleWidth = {{ 2 * s_benchWidth, s_benchHeight }};
+        dims_type const doubleHeight = {{ s_benchWidth, 2 * s_benchHeight }};
+        dims_type const half = {{ halveDimension(s_benchWidth), halveDimension(s_benchHeight) }};
+
+        CLImage a = randomImage<CLImage>(context, full, gen);
+        CLImage b = randomImage<CLImage>(context, full, gen);
+        array_type layers = randomImage<array_type>(context, {{ s_benchWidth, s_benchHeight, groupSize }}, gen);
+        CLImage lower = randomImage<CLImage>(context, half, gen);
+
+        auto output = [&](dims_type const& dims) { return createCLImage<CLImage>(context, dims); };
+
+        std::vector<TuningCase> cases;
+        cases.push_back(makeCase(context, "downsample_row", halfWidth, output(halfWidth), a));
+        cases.push_back(makeCase(context, "downsample_col", halfHeight, output(halfHeight), a));
+        cases.push_back(makeCase(context, "upsample_row", full, output(doubleWidth), a));
+        cases.push_back(makeCase(context, "upsample_col", full, output(doubleHeight), a));
+        cases.push_back(makeCase(context, "create_laplacian", full, output(full), a, b));
+        cases.push_back(makeCase(context, "collapse_level", full, output(full), a, b));
+        cases.push_back(makeCase(context, "fuse_level", full, output(full), layers));
+        cases.push_back(makeCase(context, "fuse_collapse_level", full, output(full), layers, lower));
+        cases.push_back(makeCase(context, "compute_quality", full, output(full), a));
+        cases.push_back(makeCase(context, "compute_measures", full, output(full), a));
+        return cases;
+    }
+
+    /**
+     * @Return seconds taken by a launch of @a kernel
+     */
+    double timeKernel(ComputeContext const& context,
+                      cl::Kernel const& kernel,
+                      cl::NDRange const& global,
+                      cl::NDRange const& local)
+    {
+        // warm up, which also shakes out launch failures
+        context.queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local);
+        context.queue.finish();
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < s_repetitions; ++i)
+        {
+            context.queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local);
+        }
+        context.queue.finish();
+        auto end = std::chrono::steady_clock::now();
+
+        return std::chrono::duration<double>(end - start).count() / s_repetitions;
+    }
+
+    /**
+     * Outputs are normalized, so an error of 1e-4 is a small fraction
+     * of an 8-bit step. Quality weights are larger, hence the relative term.
+     */
+    bool withinTolerance(Pixels const& actual, Pixels const& expected)
+    {
+        for (size_t i = 0; i < actual.size(); ++i)
+        {
+            for (size_t c = 0; c < 4; ++c)
+            {
+                float a = actual[i].s[c];
+                float b = expected[i].s[c];
+                if (!(std::fabs(a - b) <= 1e-4f * (1.0f + std::fabs(b))))
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    KernelTuning tuneCases(ComputeContext const& context,
+                           char const* filename,
+                           ProgramVariant const& variant,
+                           std::vector<TuningCase> const& cases)
+    {
+        // reference outputs, with default options and work-group sizes
+        std::vector<Pixels> expected;
+        std::string const defines = variant.defines();
+        cl::Program reference = buildProgram(context.context, context.device, filename, defines);
+        for (TuningCase const& c : cases)
+        {
+            context.queue.enqueueNDRangeKernel(c.instantiate(reference),
+                                               cl::NullRange,
+                                               toNDRange(c.range),
+                                               cl::NullRange);
+            expected.push_back(c.readOutput());
+        }
+
+        KernelTuning best;
+        double bestTime = std::numeric_limits<double>::infinity();
+
+        for (char const* options : s_optionSets)
+        {
+            cl::Program program = buildProgram(context.context, context.device, filename,
+                                               defines + " " + options);
+
+            KernelTuning tuning;
+            tuning.buildOptions = options;
+            double totalTime = 0;
+            bool valid = true;
+
+            for (size_t i = 0; i < cases.size() && valid; ++i)
+            {
+                TuningCase const& c = cases[i];
+                cl::Kernel kernel = c.instantiate(program);
+
+                double fastest = timeKernel(context, kernel, toNDRange(c.range), cl::NullRange);
+                valid = withinTolerance(c.readOutput(), expected[i]);
+
+                size_t maxSize =
+                    kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(context.device);
+
+                for (local_size_type const& local : s_localSizes)
+                {
+                    if (!valid || local[0] * local[1] > maxSize)
+                    {
+                        continue;
+                    }
+
+                    cl::NDRange global(roundUp(c.range[0], local[0]),
+                                       roundUp(c.range[1], local[1]));
+                    double time;
+                    try
+                    {
+                        time = timeKernel(context, kernel, global, cl::NDRange(local[0], local[1]));
+                    }
+                    catch (cl::Error const&)
+                    {
+                        // size exceeds a per-dimension limit of the device
+                        continue;
+                    }
+
+                    if (time < fastest && withinTolerance(c.readOutput(), expected[i]))
+                    {
+                        fastest = time;
+                        tuning.localSizes[c.name] = local;
+                    }
+                }
+
+                totalTime += fastest;
+            }
+
+            std::cout << "Options \"" << options << "\": ";
+            if (valid)
+            {
+                std::cout << totalTime * 1000 << " ms" << std::endl;
+            }
+            else
+            {
+                std::cout << "outside of tolerance" << std::endl;
+            }
+
+            if (valid && totalTime < bestTime)
+            {
+                best = tuning;
+                bestTime = totalTime;
+            }
+        }
+
+        return best;
+    }
+
+    /**
+     * @Return seconds taken by @a run, after a warm up run
+     */
+    double timeRuns(std::function<void ()> const& run)
+    {
+        run();
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < s_repetitions; ++i)
+        {
+            run();
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        return std::chrono::duration<double>(end - start).count() / s_repetitions;
+    }
+
+    /**
+     * Time building a pyramid level on the device, including reading it
+     * back, against building it on the host, for increasing level sizes.
+     *
+     * @Return pixels in the largest level the host is faster at, or 0 if
+     * the device is faster at all of them.
+     */
+    template <typename CLImage>
+    size_t measureHostCrossover(ComputeContext const& context, cl::Program const& program)
+    {
+        typedef HostImage<host_pixel_type, 2> image_type;
+
+        std::random_device rd;
+        std::mt19937 gen(rd());
+        std::uniform_real_distribution<float> d(0.05f, 1.0f);
+
+        size_t crossover = 0;
+        for (size_t dim : s_crossoverDims)
+        {
+            size_t half = halveDimension(dim);
+            image_type source(dim, dim);
+            image_type upper(dim, dim);
+            image_type lower(half, half);
+
+            for (host_pixel_type& pixel : source.view())
+            {
+                for (float& c : pixel.components)
+                {
+                    c = d(gen);
+                }
+            }
+
+            PendingImage<CLImage> image = makePendingImage<CLImage>(context, source.view());
+            double deviceTime = timeRuns(
+                [&]()
+                {
+                    ImagePyramid::LevelPair<CLImage> pair = createPyramidLevel(image, program);
+                    pair.upper.readInto(upper.view().rawData());
+                    pair.lower.readInto(lower.view().rawData());
+                });
+
+            double hostTime = timeRuns(
+                [&]()
+                {
+                    std::vector<host_view_type> levels = { upper.view(), lower.view() };
+                    std::copy(source.view().begin(), source.view().end(), levels[0].begin());
+                    buildHostLevels(levels);
+                });
+
+            std::cout << "Level " << dim << "x" << dim << ": "
+                      << "device " << deviceTime * 1000 << " ms, "
+                      << "host " << hostTime * 1000 << " ms" << std::endl;
+
+            if (hostTime >= deviceTime)
+            {
+                break;
+            }
+            crossover = dim * dim;
+        }
+
+        return crossover;
+    }
+
+    template <typename CLImage>
+    KernelTuning tune(ComputeContext const& context,
+                      char const* filename,
+                      ProgramVariant const& variant,
+                      size_t groupSize)
+    {
+        KernelTuning tuning = tuneCases(context, filename, variant,
+                                        makeCases<CLImage>(context, groupSize));
+
+        cl::Program program = buildProgram(context.context, context.device, filename,
+                                           variant.defines() + " " + tuning.buildOptions);
+        tuning.hostLevelPixels = measureHostCrossover<CLImage>(context, program);
+
+        return tuning;
+    }
+
+    /**
+     * Replace characters that do not belong in file names
+     */
+    std::string sanitize(std::string const& s)
+    {
+        std::string out;
+        for (char c : s)
+        {
+            if (std::isalnum(static_cast<unsigned char>(c)) || c == '.' || c == '-')
+            {
+                out += c;
+            }
+            else if (c != '\0')
+            {
+                out += '_';
+            }
+        }
+        return out;
+    }
+
+}
+
+namespace DynamiCL
+{
+
+    KernelTuning autotune(ComputeContext const& context,
+                          char const* filename,
+                          ProgramVariant const& variant)
+    {
+        // fuse as many images as the variant expects
+        size_t groupSize = variant.groupSize > 0 ? variant.groupSize : 3;
+
+        if (context.storage == ImageStorage::BUFFER)
+        {
+            return tune<BufferImage2D>(context, filename, variant, groupSize);
+        }
+
+        return tune<cl::Image2D>(context, filename, variant, groupSize);
+    }
+
+    std::string tuningPath(ComputeContext const& context, char const* filename)
+    {
+        char const* home = std::getenv("HOME");
+        std::string dir = home ? std::string(home) + "/.dynamicl" : std::string(".dynamicl");
+        ::mkdir(dir.c_str(), 0755);
+
+        // changes to kernels invalidate previous results
+        std::ifstream in(filename);
+        std::stringstream source;
+        source << in.rdbuf();
+
+        std::stringstream name;
+        name << sanitize(context.device.getInfo<CL_DEVICE_VENDOR>()) << '-'
+             << sanitize(context.device.getInfo<CL_DEVICE_NAME>()) << '-'
+             << sanitize(context.device.getInfo<CL_DRIVER_VERSION>()) << '-'
+             << sanitize(stripExtension(filename)) << '-'
+             << std::hex << std::hash<std::string>()(source.str())
+             << ".tuning";
+
+        return dir + "/" + name.str();
+    }
+
+    bool loadTuning(std::string const& path, KernelTuning& tuning)
+    {
+        std::ifstream in(path);
+        if (!in)
+        {
+            return false;
+        }
+
+        KernelTuning loaded;
+        bool hasOptions = false;
+
+        std::string line;
+        while (std::getline(in, line))
+        {
+            std::istringstream fields(line);
+            std::string key;
+            fields >> key;
+
+            if (key == "options")
+            {
+                std::getline(fields >> std::ws, loaded.buildOptions);
+                hasOptions = true;
+            }
+            else if (key == "local")
+            {
+                std::string name;
+                local_size_type local;
+                if (!(fields >> name >> local[0] >> local[1]) || local[0] == 0 || local[1] == 0)
+                {
+                    return false;
+                }
+                loaded.localSizes[name] = local;
+            }
+            else if (key == "host_levels")
+            {
+                if (!(fields >> loaded.hostLevelPixels))
+                {
+                    return false;
+                }
+            }
+            else if (!key.empty() && key[0] != '#')
+            {
+                return false;
+            }
+        }
+
+        if (!hasOptions)
+        {
+            return false;
+        }
+
+        tuning = loaded;
+        return true;
+    }
+
+    void saveTuning(std::string const& path, KernelTuning const& tuning)
+    {
+        std::ofstream out(path);
+        if (!out)
+        {
+            throw std::runtime_error("Could not write tuning results to " + path);
+        }
+
+        out << "# DynamiCL kernel tuning\n";
+        out << "options " << tuning.buildOptions << "\n";
+        out << "host_levels " << tuning.hostLevelPixels << "\n";
+        for (auto const& entry : tuning.localSizes)
+        {
+            out << "local " << entry.first << " "
+                << entry.second[0] << " " << entry.second[1] << "\n";
+        }
+    }
+
+}
@@ -0,0 +1,46 @@
+#ifndef AUTOTUNE_H_R7KX2NQP
+#define AUTOTUNE_H_R7KX2NQP
+
+#include "cl_common.h"
+
+#include <string>
+
+namespace DynamiCL
+{
+
+    /**
+     * Benchmark @a variant of the pyramid kernels in @a filename on the
+     * device of @a context, trying out candidate work-group sizes and
+     * build options.
+     *
+     * Build options that change any output beyond a small tolerance are
+     * rejected. A kernel only gets a tuned work-group size if it beats
+     * the one chosen by the driver. Pyramid levels are also built on the
+     * host, to find the size below which they should stay there.
+     *
+     * @Return the fastest valid tuning found
+     */
+    KernelTuning autotune(ComputeContext const& context,
+                          char const* filename,
+                          ProgramVariant const& variant = ProgramVariant());
+
+    /**
+     * @Return path of the file that holds tuning results for kernels in
+     * @a filename on the device of @a context.
+     *
+     * Files live in ~/.dynamicl, keyed by device, driver version, and
+     * kernel source, so any of those changing leads to tuning again.
+     */
+    std::string tuningPath(ComputeContext const& context, char const* filename);
+
+    /**
+     * Read tuning results saved at @a path into @a tuning.
+     * @Return false if there are no valid results at @a path.
+     */
+    bool loadTuning(std::string const& path, KernelTuning& tuning);
+
+    void saveTuning(std::string const& path, KernelTuning const& tuning);
+
+}
+
+#endif /* end of include guard: AUTOTUNE_H_R7KX2NQP */
@@ -0,0 +1,409 @@
+#include "band_merge.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "host_pyramid.h"
+#include "pyr_impl.h"
+
+namespace
+{
+    using namespace DynamiCL;
+
+    typedef BandMerge::pixel_type pixel_type;
+
+    /**
+     * Rows kept by rings whose readers look back by a few rows at most
+     */
+    size_t const s_bandRows = 8;
+
+    /**
+     * @Return rows kept of the fused level @a level of a pyramid of
+     * @a numLevels. Fused rows wait to be collapsed until the levels below
+     * are fused, which takes inputs 2^(numLevels-level) rows further down.
+     */
+    size_t fusedRows(size_t level, size_t numLevels)
+    {
+        return (size_t(1) << (numLevels + 1 - level)) + s_bandRows;
+    }
+
+    inline long clampRow(long y, size_t height)
+    {
+        return std::min(std::max(y, 0L), static_cast<long>(height) - 1);
+    }
+
+    /**
+     * The last rows of an image, up to a fixed number of them, in a ring
+     */
+    class RowRing
+    {
+        size_t width_;
+        size_t capacity_;
+        std::vector<pixel_type> rows_;
+        long next_; ///< number of rows pushed so far
+
+    public:
+        RowRing(size_t width, size_t capacity)
+            : width_(width), capacity_(capacity), rows_(width * capacity), next_(0)
+        { }
+
+        long numRows() const { return next_; }
+
+        /**
+         * @Return memory of the next row, replacing the oldest one held
+         */
+        pixel_type* push()
+        {
+            pixel_type* row = &rows_[(next_ % capacity_) * width_];
+            ++next_;
+            return row;
+        }
+
+        pixel_type const* row(long y) const
+        {
+            if (y >= next_ || y < next_ - static_cast<long>(capacity_))
+            {
+                throw std::logic_error("Row is outside of the band held.");
+            }
+            return &rows_[(y % capacity_) * width_];
+        }
+    };
+}
+
+namespace DynamiCL
+{
+
+    struct BandMerge::Impl
+    {
+        struct Level
+        {
+            size_t width;
+            size_t height;
+            std::vector<RowRing> gaussians; ///< one per input
+            std::vector<RowRing> halfRows;  ///< gaussians halved along rows, above the last level
+            RowRing fused;     ///< fused laplacians, or gaussians at the last level
+            RowRing collapsed;
+
+            // rows of the level below upsampled along columns, then rows
+            std::vector<pixel_type> columns;
+            std::vector<pixel_type> upsampled;
+            std::vector<pixel_type> acc;
+            std::vector<float> weightSums;
+
+            Level(size_t width, size_t height, size_t lowerWidth, size_t fusedRows)
+                : width(width),
+                  height(height),
+                  fused(width, fusedRows),
+                  collapsed(width, s_bandRows),
+                  columns(lowerWidth),
+                  upsampled(width),
+                  acc(width),
+                  weightSums(width)
+            { }
+        };
+
+        std::array<float, 3> weights;
+        std::vector<RowRing> sources; ///< rows of each input
+        std::vector<Level> levels;
+        std::vector<RowReader> const* readers;
+        bool merged;
+
+        bool isLast(size_t l) const { return l + 1 == levels.size(); }
+
+        pixel_type const* sourceRow(size_t i, long y)
+        {
+            y = clampRow(y, levels[0].height);
+            while (sources[i].numRows() <= y)
+            {
+                pixel_type* row = sources[i].push();
+                (*readers)[i](row);
+
+                // like decoded images
+                for (size_t x = 0; x < levels[0].width; ++x)
+                {
+                    row[x].a = 1.0f;
+                }
+            }
+            return sources[i].row(y);
+        }
+
+        pixel_type const* halfRow(size_t l, size_t i, long y)
+        {
+            Level& level = levels[l];
+            y = clampRow(y, level.height);
+            while (level.halfRows[i].numRows() <= y)
+            {
+                long r = level.halfRows[i].numRows();
+                advanceGaussians(l, r);
+                downsampleHostRow(level.gaussians[i].row(r), level.width, level.halfRows[i].push());
+            }
+            return level.halfRows[i].row(y);
+        }
+
+        void advanceGaussians(size_t l, long y)
+        {
+            y = clampRow(y, levels[l].height);
+            while (levels[l].gaussians[0].numRows() <= y)
+            {
+                produceGaussian(l);
+            }
+        }
+
+        /**
+         * Build the next row of the gaussians of level @a l, and fuse the
+         * rows that only waited for it
+         */
+        void produceGaussian(size_t l)
+        {
+            Level& level = levels[l];
+            long const y = level.gaussians[0].numRows();
+
+            for (size_t i = 0; i < level.gaussians.size(); ++i)
+            {
+                if (l == 0)
+                {
+                    std::array<pixel_type const*, 3> rows = {{
+                        sourceRow(i, y - 1), sourceRow(i, y), sourceRow(i, y + 1) }};
+                    weighHostRow(rows, level.width, weights, level.gaussians[i].push());
+                }
+                else
+                {
+                    std::array<pixel_type const*, 5> rows;
+                    for (long k = 0; k < 5; ++k)
+                    {
+                        rows[k] = halfRow(l - 1, i, 2 * y - 2 + k);
+                    }
+                    downsampleHostColumn(rows, level.width, level.gaussians[i].push());
+                }
+            }
+
+            if (isLast(l))
+            {
+                fuseUpTo(l, y);
+            }
+            if (l > 0)
+            {
+                // rows of the level above up to 2y-1 only need rows of
+                // this level up to y
+                bool const lastRow = y + 1 == static_cast<long>(level.height);
+                fuseUpTo(l - 1, lastRow ? levels[l-1].height - 1 : 2 * y - 1);
+            }
+        }
+
+        /**
+         * Fuse level @a l up to row @a y, all of whose gaussians, and those
+         * of the level below, have to be built already
+         */
+        void fuseUpTo(size_t l, long y)
+        {
+            Level& level = levels[l];
+            while (level.fused.numRows() <= y)
+            {
+                long const r = level.fused.numRows();
+
+                std::fill(level.acc.begin(), level.acc.end(), pixel_type{{ 0.0f, 0.0f, 0.0f, 0.0f }});
+                std::fill(level.weightSums.begin(), level.weightSums.end(), 0.0f);
+
+                for (size_t i = 0; i < level.gaussians.size(); ++i)
+                {
+                    pixel_type const* gaussian = level.gaussians[i].row(r);
+
+                    if (!isLast(l))
+                    {
+                        Level& lower = levels[l+1];
+                        std::array<pixel_type const*, 3> rows = {{
+                            lower.gaussians[i].row(clampRow(r / 2 - 1, lower.height)),
+                            lower.gaussians[i].row(clampRow(r / 2, lower.height)),
+                            lower.gaussians[i].row(clampRow(r / 2 + 1, lower.height)) }};
+                        upsampleHostColumn(rows, r & 1, lower.width, level.columns.data());
+                        upsampleHostRow(level.columns.data(), lower.width,
+                                        level.upsampled.data(), level.width);
+                    }
+
+                    for (size_t x = 0; x < level.width; ++x)
+                    {
+                        pixel_type pix = gaussian[x];
+                        if (!isLast(l))
+                        {
+                            // laplacian, keeping the alpha of the gaussian
+                            for (size_t c = 0; c < 3; ++c)
+                            {
+                                pix.components[c] -= level.upsampled[x].components[c];
+                            }
+                        }
+
+                        level.weightSums[x] += pix.a;
+                        for (size_t c = 0; c < 4; ++c)
+                        {
+                            level.acc[x].components[c] += pix.components[c] * pix.a;
+                        }
+                    }
+                }
+
+                pixel_type* out = level.fused.push();
+                for (size_t x = 0; x < level.width; ++x)
+                {
+                    for (size_t c = 0; c < 4; ++c)
+                    {
+                        out[x].components[c] = level.acc[x].components[c] / level.weightSums[x];
+                    }
+                }
+            }
+        }
+
+        pixel_type const* fusedRow(size_t l, long y)
+        {
+            Level& level = levels[l];
+            y = clampRow(y, level.height);
+            if (level.fused.numRows() <= y)
+            {
+                // rows are fused as soon as the gaussians they need are built
+                if (isLast(l))
+                {
+                    advanceGaussians(l, y);
+                }
+                else
+                {
+                    advanceGaussians(l + 1, y / 2 + 1);
+                }
+            }
+            return level.fused.row(y);
+        }
+
+        pixel_type const* collapsedRow(size_t l, long y)
+        {
+            Level& level = levels[l];
+            y = clampRow(y, level.height);
+            while (level.collapsed.numRows() <= y)
+            {
+                long const r = level.collapsed.numRows();
+
+                if (isLast(l))
+                {
+                    pixel_type const* fused = fusedRow(l, r);
+                    std::copy(fused, fused + level.width, level.collapsed.push());
+                    continue;
+                }
+
+                std::array<pixel_type const*, 3> rows = {{
+                    collapsedRow(l + 1, r / 2 - 1), collapsedRow(l + 1, r / 2), collapsedRow(l + 1, r / 2 + 1) }};
+                // last, as getting rows below may fuse more rows
+                pixel_type const* fused = fusedRow(l, r);
+
+                Level& lower = levels[l+1];
+                upsampleHostColumn(rows, r & 1, lower.width, level.columns.data());
+                upsampleHostRow(level.columns.data(), lower.width, level.upsampled.data(), level.width);
+
+                pixel_type* out = level.collapsed.push();
+                for (size_t x = 0; x < level.width; ++x)
+                {
+                    for (size_t c = 0; c < 4; ++c)
+                    {
+                        float v = level.upsampled[x].components[c] + fused[x].components[c];
+                        // clamped at every level, as the device collapses
+                        out[x].components[c] = std::min(std::max(v, 0.0f), 1.0f);
+                    }
+                }
+            }
+            return level.collapsed.row(y);
+        }
+    };
+
+    BandMerge::BandMerge(size_t width, size_t height, size_t numInputs, size_t numLevels,
+                         QualityWeights const& weights)
+        : impl_(new Impl)
+    {
+        if (numLevels == 0 || numLevels > calculateNumLevels(width, height))
+        {
+            throw std::invalid_argument("Pyramids of the images cannot have that many levels.");
+        }
+        if (numInputs == 0)
+        {
+            throw std::invalid_argument("Need images to merge.");
+        }
+
+        impl_->weights = {{ weights.contrast, weights.saturation, weights.exposedness }};
+        impl_->readers = nullptr;
+        impl_->merged = false;
+        impl_->sources.assign(numInputs, RowRing(width, s_bandRows));
+
+        for (size_t l = 0; l < numLevels; ++l)
+        {
+            size_t levelWidth = levelDimension(width, l);
+            bool last = l + 1 == numLevels;
+
+            impl_->levels.push_back(Impl::Level(levelWidth,
+                                                levelDimension(height, l),
+                                                last ? 0 : halveDimension(levelWidth),
+                                                fusedRows(l, numLevels)));
+
+            Impl::Level& level = impl_->levels.back();
+            level.gaussians.assign(numInputs, RowRing(levelWidth, s_bandRows));
+            if (!last)
+            {
+                level.halfRows.assign(numInputs, RowRing(halveDimension(levelWidth), s_bandRows));
+            }
+        }
+    }
+
+    BandMerge::~BandMerge() { }
+
+    size_t BandMerge::footprint(size_t width, size_t numInputs, size_t numLevels)
+    {
+        // rows of the inputs
+        size_t pixels = numInputs * s_bandRows * width;
+
+        for (size_t l = 0; l < numLevels; ++l)
+        {
+            size_t levelWidth = levelDimension(width, l);
+            bool last = l + 1 == numLevels;
+
+            // gaussians, and their halved rows
+            pixels += numInputs * s_bandRows * levelWidth;
+            if (!last)
+            {
+                pixels += numInputs * s_bandRows * halveDimension(levelWidth);
+            }
+
+            // fused and collapsed rows, and rows for fusing and upsampling
+            pixels += (fusedRows(l, numLevels) + s_bandRows + 3) * levelWidth;
+        }
+
+        return pixels * sizeof(pixel_type);
+    }
+
+    size_t BandMerge::levelsWithin(size_t width, size_t height, size_t numInputs,
+                                   size_t hostBytes)
+    {
+        for (size_t numLevels = calculateNumLevels(width, height); numLevels > 0; --numLevels)
+        {
+            if (footprint(width, numInputs, numLevels) <= hostBytes)
+            {
+                return numLevels;
+            }
+        }
+        return 0;
+    }
+
+    void BandMerge::merge(std::vector<RowReader> const& inputs, RowWriter const& output)
+    {
+        if (inputs.size() != impl_->sources.size())
+        {
+            throw std::invalid_argument("Need a reader for every input of the merge.");
+        }
+        if (impl_->merged)
+        {
+            throw std::logic_error("Images have already been merged.");
+        }
+        impl_->merged = true;
+        impl_->readers = &inputs;
+
+        for (size_t y = 0; y < impl_->levels[0].height; ++y)
+        {
+            output(impl_->collapsedRow(0, y));
+        }
+
+        impl_->readers = nullptr;
+    }
+
+}
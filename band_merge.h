@@ -0,0 +1,84 @@
+#ifndef BAND_MERGE_H_K8PV2NDX
+#define BAND_MERGE_H_K8PV2NDX
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "cl_common.h"
+#include "host_image.hpp"
+
+namespace DynamiCL
+{
+
+    /**
+     * Merges images too large to hold in memory, like gigapixel panoramas,
+     * streaming them through in bands of rows, the way enblend does.
+     *
+     * Rows of the inputs are read as the pyramids need them. Each level of
+     * each pyramid only keeps a few rows around, in rings, and merged rows
+     * are written out as soon as all levels that contribute to them are
+     * fused. Memory is proportional to the width of the images, and grows
+     * with 2^levels, as coarse levels reach that many rows further down
+     * the image. Fused levels buffer those rows, once for all inputs.
+     *
+     * Everything runs on the host, with the operations of host_pyramid.h.
+     * Results are those of a merge of whole images on the host with the
+     * same number of levels.
+     */
+    class BandMerge
+    {
+    public:
+        typedef RGBA<float> pixel_type;
+
+        /**
+         * Read the next row of an input into the passed pixels
+         */
+        typedef std::function<void(pixel_type*)> RowReader;
+
+        /**
+         * Take the next row of the merged image
+         */
+        typedef std::function<void(pixel_type const*)> RowWriter;
+
+        /**
+         * Merge @a numInputs images of @a width x @a height, weighing
+         * their pixels with @a weights, over pyramids of @a numLevels,
+         * which can be at most calculateNumLevels(width, height).
+         *
+         * @throws std::invalid_argument if there are too many levels.
+         */
+        BandMerge(size_t width, size_t height, size_t numInputs, size_t numLevels,
+                  QualityWeights const& weights = QualityWeights());
+        ~BandMerge();
+
+        BandMerge(BandMerge const&) = delete;
+        BandMerge& operator =(BandMerge const&) = delete;
+
+        /**
+         * @Return host memory a merge with these parameters uses, which
+         * does not depend on the height of the images
+         */
+        static size_t footprint(size_t width, size_t numInputs, size_t numLevels);
+
+        /**
+         * @Return the most levels, up to calculateNumLevels(width, height),
+         * a merge can have within @a hostBytes, or 0 if not even one fits
+         */
+        static size_t levelsWithin(size_t width, size_t height, size_t numInputs,
+                                   size_t hostBytes);
+
+        /**
+         * Merge the images read by @a inputs, one reader per input, row by
+         * row into @a output. Can only be called once.
+         */
+        void merge(std::vector<RowReader> const& inputs, RowWriter const& output);
+
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
+    };
+
+}
+
+#endif /* end of include guard: BAND_MERGE_H_K8PV2NDX */
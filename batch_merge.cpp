@@ -0,0 +1,375 @@
+#include "batch_merge.h"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include "kernel.hpp"
+#include "pyr_impl.h"
+
+namespace
+{
+    using namespace DynamiCL;
+
+    typedef std::array<size_t, 2> dims_type;
+
+    /**
+     * Images of the same dimensions, one after another in a buffer, and
+     * the events to wait for before reading them
+     */
+    struct Stack
+    {
+        BufferImage2D image; ///< of the dimensions of a single layer
+        size_t layers;
+        EventList events;
+    };
+
+    Stack makeStack(ComputeContext const& context, dims_type const& dims, size_t layers)
+    {
+        Stack stack;
+        stack.image = createCLImage<BufferImage2D>(context, {{ dims[0], dims[1] * layers }});
+        stack.image.dims = dims;
+        stack.layers = layers;
+        return stack;
+    }
+
+    /**
+     * Run @a kernel on every layer of @a inputs, writing a new stack of
+     * layers of @a dims
+     */
+    Stack processLayers(ComputeContext const& context,
+                        Kernel const& kernel,
+                        std::vector<Stack const*> const& inputs,
+                        dims_type const& dims)
+    {
+        Stack const& first = *inputs.front();
+        Stack out = makeStack(context, dims, first.layers);
+
+        std::vector<BufferImage2D> images;
+        EventList waitFor;
+        for (Stack const* input : inputs)
+        {
+            images.push_back(input->image);
+            waitFor.append(input->events);
+        }
+
+        dims_type const& range = kernel.range == Kernel::Range::SOURCE ? first.image.dims : dims;
+        cl::Kernel clkernel = kernel.buildWith(images, out.image);
+        out.events.push_back(kernel.enqueue(context, clkernel,
+                                            cl::NDRange(range[0], range[1], out.layers),
+                                            &waitFor));
+        return out;
+    }
+
+    /**
+     * Fuse every @a groupSize layers of @a levels into a layer
+     */
+    Stack fuseLayers(ComputeContext const& context,
+                     cl::Program const& program,
+                     Stack const& levels,
+                     size_t groupSize)
+    {
+        dims_type const& dims = levels.image.dims;
+        Stack out = makeStack(context, dims, levels.layers / groupSize);
+
+        BufferImage2DArray groups = { levels.image.buffer, {{ dims[0], dims[1], groupSize }} };
+
+        Kernel kernel = {program, "fuse_level", Kernel::Range::DESTINATION};
+        cl::Kernel clkernel = kernel.build(groups, out.image);
+        out.events.push_back(kernel.enqueue(context, clkernel,
+                                            cl::NDRange(dims[0], dims[1], out.layers),
+                                            &levels.events));
+        return out;
+    }
+
+    /**
+     * Weigh every layer of @a levels with @a weights, from the matching
+     * layer of @a measures, in place
+     */
+    void weighLayers(ComputeContext const& context,
+                     cl::Program const& program,
+                     Stack const& measures,
+                     cl_float4 const& weights,
+                     Stack& levels)
+    {
+        dims_type const& dims = levels.image.dims;
+
+        EventList waitFor = measures.events;
+        waitFor.append(levels.events);
+
+        Kernel kernel = {program, "weigh_level", Kernel::Range::DESTINATION, { weights }};
+        cl::Kernel clkernel = kernel.build(measures.image, levels.image);
+        cl::Event weighed = kernel.enqueue(context, clkernel,
+                                           cl::NDRange(dims[0], dims[1], levels.layers),
+                                           &waitFor);
+        levels.events.clear();
+        levels.events.push_back(weighed);
+    }
+
+    std::vector<cl_float4> toFloat4(std::vector<QualityWeights> const& weights)
+    {
+        std::vector<cl_float4> out;
+        for (QualityWeights const& w : weights)
+        {
+            out.push_back(w.toFloat4());
+        }
+        return out;
+    }
+}
+
+namespace DynamiCL
+{
+
+    const size_t BatchMerge::maxPixels;
+
+    BatchMerge::BatchMerge(ComputeContext const& context,
+                           cl::Program const& program,
+                           size_t width,
+                           size_t height,
+                           size_t groupSize,
+                           size_t batchSize,
+                           std::vector<QualityWeights> const& weights)
+        : context_(context),
+          program_(program),
+          width_(width),
+          height_(height),
+          groupSize_(groupSize),
+          batchSize_(batchSize),
+          numLevels_(calculateNumLevels(width, height)),
+          weights_(toFloat4(weights)),
+          numImages_(0)
+    {
+        if (context.storage != ImageStorage::BUFFER)
+        {
+            throw std::invalid_argument("Batches are only merged in buffers.");
+        }
+        if (width * height * groupSize * batchSize == 0)
+        {
+            throw std::invalid_argument("Batch would not hold any images.");
+        }
+        if (weights.empty())
+        {
+            throw std::invalid_argument("Batch would not merge its images at all.");
+        }
+
+        inputs_ = array_ptr<pixel_type, 256>(width * height * groupSize * batchSize);
+        merged_ = array_ptr<pixel_type, 256>(width * height * batchSize);
+    }
+
+    BatchMerge::BatchMerge(ComputeContext const& context,
+                           cl::Program const& program,
+                           size_t width,
+                           size_t height,
+                           size_t groupSize,
+                           size_t batchSize,
+                           QualityWeights const& weights)
+        : BatchMerge(context, program, width, height, groupSize, batchSize,
+                     std::vector<QualityWeights>(1, weights))
+    { }
+
+    MemoryBudget::Footprint BatchMerge::footprint(size_t width, size_t height,
+                                                  size_t groupSize, size_t batchSize,
+                                                  size_t numVariants)
+    {
+        size_t const imageBytes = width * height * sizeof(pixel_type);
+        size_t const layers = groupSize * batchSize;
+
+        MemoryBudget::Footprint footprint;
+        // inputs, and merged images, which variants take turns on
+        footprint.hostBytes = (layers + batchSize) * imageBytes;
+        // building a level takes its gaussians, their halved rows and
+        // columns, the rows doubled again and the laplacians, all of which
+        // are a little over 4 stacks. fused levels of all groups take a
+        // third more than their images.
+        footprint.deviceBytes = 5 * layers * imageBytes + 2 * batchSize * imageBytes;
+        if (numVariants > 1)
+        {
+            // laplacians are kept for every variant, along with gaussians
+            // of the measures, which take a stack more while built
+            footprint.deviceBytes += layers * imageBytes;
+        }
+        // the largest allocation is a stack of the first level
+        footprint.bytesPerRow = width * sizeof(pixel_type);
+        footprint.rows = height * layers;
+        return footprint;
+    }
+
+    size_t BatchMerge::batchSizeWithin(size_t width, size_t height, size_t groupSize,
+                                       size_t maxBatchSize, MemoryBudget::Limits const& limits,
+                                       size_t numVariants)
+    {
+        for (size_t batchSize = maxBatchSize; batchSize > 0; --batchSize)
+        {
+            MemoryBudget::Footprint fp = footprint(width, height, groupSize, batchSize, numVariants);
+            if (fp.hostBytes <= limits.hostBytes
+                && fp.deviceBytes <= limits.deviceBytes
+                && fp.bytesPerRow * fp.rows <= limits.maxAllocBytes)
+            {
+                return batchSize;
+            }
+        }
+        return 0;
+    }
+
+    BatchMerge::view_type BatchMerge::nextSlot()
+    {
+        if (full())
+        {
+            throw std::invalid_argument("Batch already holds as many groups as it can.");
+        }
+
+        pixel_type* slot = inputs_.ptr() + numImages_ * width_ * height_;
+        ++numImages_;
+        return view_type({{ width_, height_ }}, slot);
+    }
+
+    void BatchMerge::mergeInto(std::vector<view_type>& dests)
+    {
+        if (numImages_ % groupSize_ != 0)
+        {
+            throw std::logic_error("Images of the batch do not make up whole groups.");
+        }
+
+        size_t const numGroups = numImages_ / groupSize_;
+        size_t const numVariants = weights_.size();
+        if (dests.size() != numGroups * numVariants)
+        {
+            throw std::invalid_argument("Need a destination for every merge of the batch.");
+        }
+        for (view_type const& dest : dests)
+        {
+            if (dest.width() != width_ || dest.height() != height_)
+            {
+                throw std::invalid_argument("Destinations differ in size from the images of the batch.");
+            }
+        }
+        if (numGroups == 0)
+        {
+            return;
+        }
+
+        std::cout << "Merging a batch of " << numGroups << " groups" << std::endl;
+
+        Kernel row = {program_, "downsample_row", Kernel::Range::DESTINATION};
+        Kernel col = {program_, "downsample_col", Kernel::Range::DESTINATION};
+        Kernel upcol = {program_, "upsample_col", Kernel::Range::SOURCE};
+        Kernel uprow = {program_, "upsample_row", Kernel::Range::SOURCE};
+        Kernel createLaplacian = {program_, "create_laplacian", Kernel::Range::SOURCE};
+        Kernel collapse = {program_, "collapse_level", Kernel::Range::SOURCE};
+
+        dims_type dims = {{ width_, height_ }};
+
+        // all images in a single transfer
+        Stack inputs = makeStack(context_, dims, numImages_);
+        cl::Event written;
+        context_.queue.enqueueWriteBuffer(inputs.image.buffer, CL_FALSE, 0,
+                                          numImages_ * width_ * height_ * sizeof(pixel_type),
+                                          inputs_.ptr(), nullptr, &written);
+        inputs.events.push_back(written);
+
+        // with several weights, the pyramids are built once, along with
+        // gaussians of the measures, and only weighed for each merge
+        bool const measured = numVariants > 1;
+        Stack gaussians;
+        Stack measures;
+        if (measured)
+        {
+            Kernel compute = {program_, "compute_measures", Kernel::Range::SOURCE};
+            measures = processLayers(context_, compute, { &inputs }, dims);
+            gaussians = std::move(inputs);
+        }
+        else
+        {
+            Kernel quality = {program_, "compute_quality", Kernel::Range::SOURCE,
+                              { weights_.front() }};
+            gaussians = processLayers(context_, quality, { &inputs }, dims);
+        }
+
+        // laplacians are fused as soon as they are built, so only the
+        // fused pyramid is kept around, unless they are weighed again
+        std::vector<Stack> fused;
+        std::vector<Stack> laplacianLevels;
+        std::vector<Stack> measureLevels;
+        for (size_t level = 0; level + 1 < numLevels_; ++level)
+        {
+            dims_type const halfRowDims = {{ halveDimension(dims[0]), dims[1] }};
+            dims_type const halfDims = {{ halveDimension(dims[0]), halveDimension(dims[1]) }};
+
+            Stack halfRows = processLayers(context_, row, { &gaussians }, halfRowDims);
+            Stack lower = processLayers(context_, col, { &halfRows }, halfDims);
+            Stack upCols = processLayers(context_, upcol, { &lower }, halfRowDims);
+            Stack upRows = processLayers(context_, uprow, { &upCols }, dims);
+            Stack laplacians = processLayers(context_, createLaplacian, { &gaussians, &upRows }, dims);
+
+            if (measured)
+            {
+                Stack measureRows = processLayers(context_, row, { &measures }, halfRowDims);
+                Stack lowerMeasures = processLayers(context_, col, { &measureRows }, halfDims);
+                laplacianLevels.push_back(std::move(laplacians));
+                measureLevels.push_back(std::move(measures));
+                measures = std::move(lowerMeasures);
+            }
+            else
+            {
+                fused.push_back(fuseLayers(context_, program_, laplacians, groupSize_));
+            }
+
+            gaussians = std::move(lower);
+            dims = halfDims;
+        }
+
+        if (measured)
+        {
+            laplacianLevels.push_back(std::move(gaussians));
+            measureLevels.push_back(std::move(measures));
+        }
+        else
+        {
+            fused.push_back(fuseLayers(context_, program_, gaussians, groupSize_));
+        }
+
+        for (size_t variant = 0; variant < numVariants; ++variant)
+        {
+            if (measured)
+            {
+                for (size_t level = 0; level < numLevels_; ++level)
+                {
+                    weighLayers(context_, program_, measureLevels[level], weights_[variant],
+                                laplacianLevels[level]);
+                    fused.push_back(fuseLayers(context_, program_, laplacianLevels[level], groupSize_));
+                }
+            }
+
+            // collapse the fused pyramids of all groups at once
+            Stack collapsed = std::move(fused.back());
+            fused.pop_back();
+            while (!fused.empty())
+            {
+                Stack const& upper = fused.back();
+                dims_type const upColDims = {{ collapsed.image.dims[0], upper.image.dims[1] }};
+
+                Stack upCols = processLayers(context_, upcol, { &collapsed }, upColDims);
+                Stack upRows = processLayers(context_, uprow, { &upCols }, upper.image.dims);
+                collapsed = processLayers(context_, collapse, { &upRows, &upper }, upper.image.dims);
+
+                fused.pop_back();
+            }
+
+            // and read them back at once. the read waits for every fuse,
+            // so the next weights can go into the levels right after.
+            WaitList wait(collapsed.events);
+            context_.queue.enqueueReadBuffer(collapsed.image.buffer, CL_TRUE, 0,
+                                             numGroups * width_ * height_ * sizeof(pixel_type),
+                                             merged_.ptr(), wait.get());
+
+            for (size_t i = 0; i < numGroups; ++i)
+            {
+                pixel_type const* image = merged_.ptr() + i * width_ * height_;
+                std::copy(image, image + width_ * height_, dests[i * numVariants + variant].begin());
+            }
+        }
+
+        numImages_ = 0;
+    }
+
+}
@@ -0,0 +1,132 @@
+#ifndef BATCH_MERGE_H_Q7WD3MZE
+#define BATCH_MERGE_H_Q7WD3MZE
+
+#include <vector>
+
+#include "cl_common.h"
+#include "host_image.hpp"
+#include "memory_budget.h"
+#include "utils.h"
+
+namespace DynamiCL
+{
+
+    /**
+     * Merges many groups of small images at once, like for thumbnails or
+     * proxies, where the launches and transfers of a MergeGroup per group
+     * take longer than the merge itself.
+     *
+     * Images of all groups of a batch are packed one after another into a
+     * single buffer, as a stack of layers, and go through the kernels of
+     * buffer_kernels.cl with a range over all layers. A batch is uploaded
+     * once, takes a launch per step of each level for all of its groups,
+     * and its merged images are read back at once.
+     *
+     * Everything stays on the device, fused levels included, so only
+     * images of up to maxPixels are worth merging this way.
+     *
+     * Merging with several QualityWeights uploads the batch and builds
+     * its pyramids once, along with gaussian pyramids of the quality
+     * measures, like MergeGroup::mergeVariantsInto(). Only the weighing
+     * of the levels, fusing and collapsing are done for each of them.
+     */
+    class BatchMerge
+    {
+    public:
+        typedef RGBA<float> pixel_type;
+        typedef HostImageView<pixel_type, 2> view_type;
+
+        /**
+         * Images larger than this are better off merged group by group
+         */
+        static const size_t maxPixels = 1 << 20;
+
+        /**
+         * Merge up to @a batchSize groups of @a groupSize images of
+         * @a width x @a height at once, once for each of @a weights.
+         * @a context has to store images in buffers, and @a program has
+         * to be built for it, for groups of any size or of @a groupSize.
+         *
+         * @throws std::invalid_argument if @a context does not use
+         * buffers, or if a batch would hold no images or merge none.
+         */
+        BatchMerge(ComputeContext const& context,
+                   cl::Program const& program,
+                   size_t width,
+                   size_t height,
+                   size_t groupSize,
+                   size_t batchSize,
+                   std::vector<QualityWeights> const& weights);
+
+        /**
+         * Merge the groups once, weighing their pixels with @a weights
+         */
+        BatchMerge(ComputeContext const& context,
+                   cl::Program const& program,
+                   size_t width,
+                   size_t height,
+                   size_t groupSize,
+                   size_t batchSize,
+                   QualityWeights const& weights = QualityWeights());
+
+        BatchMerge(BatchMerge const&) = delete;
+        BatchMerge& operator =(BatchMerge const&) = delete;
+
+        /**
+         * @Return host and device memory a batch with these parameters
+         * uses, merging with @a numVariants weights, the largest device
+         * allocation being its stack of images
+         */
+        static MemoryBudget::Footprint footprint(size_t width, size_t height,
+                                                 size_t groupSize, size_t batchSize,
+                                                 size_t numVariants = 1);
+
+        /**
+         * @Return the most groups, up to @a maxBatchSize, a batch can hold
+         * within @a limits, or 0 if not even one fits
+         */
+        static size_t batchSizeWithin(size_t width, size_t height, size_t groupSize,
+                                      size_t maxBatchSize, MemoryBudget::Limits const& limits,
+                                      size_t numVariants = 1);
+
+        /**
+         * @Return memory of the next image of the batch, to decode into.
+         * Images of a group follow each other.
+         *
+         * @throws std::invalid_argument if the batch is full.
+         */
+        view_type nextSlot();
+
+        size_t numImages() const { return numImages_; }
+        size_t numVariants() const { return weights_.size(); }
+        bool full() const { return numImages_ == groupSize_ * batchSize_; }
+
+        /**
+         * Merge the groups added so far into @a dests, one per group and
+         * weights, the merges of a group following each other in the order
+         * of the weights, and empty the batch for the next one.
+         *
+         * @throws std::logic_error if the images do not make up whole
+         * groups, and std::invalid_argument if there is not a destination
+         * of the dimensions of the images for every merge.
+         */
+        void mergeInto(std::vector<view_type>& dests);
+
+    private:
+        ComputeContext const& context_;
+        cl::Program program_;
+        size_t const width_;
+        size_t const height_;
+        size_t const groupSize_;
+        size_t const batchSize_;
+        size_t const numLevels_;
+        std::vector<cl_float4> const weights_;
+
+        array_ptr<pixel_type, 256> inputs_; ///< images of all groups, one after another
+        array_ptr<pixel_type, 256> merged_; ///< merged images, as they are read back
+        size_t numImages_;
+    };
+
+}
+
+#endif /* end of include guard: BATCH_MERGE_H_Q7WD3MZE */
@@ -0,0 +1,623 @@
+// Buffer-backed versions of the kernels in kernels.cl.
+//
+// Images are tightly packed float4 pixels, row after row, and every image
+// argument is followed by its dimensions. Reads clamp to the edge just like
+// the sampler in kernels.cl, but go through plain global memory loads, which
+// is much faster on CPU runtimes.
+//
+// The global range may be padded up to a multiple of a tuned work-group
+// size, so every kernel returns early for work items outside its range.
+//
+// The kernels that merges go through also run on stacks of images of the same
+// dimensions, one after another in a buffer, with a third dimension of the
+// range going over the layers. Batches of small images get merged this way
+// with a launch per step for all of them.
+
+// Programs may be specialized through defines (see ProgramVariant):
+//   GROUP_SIZE           number of images fused at once, so the loop in
+//                        fuse_level can be unrolled
+//   QUALITY_CONTRAST,
+//   QUALITY_SATURATION,
+//   QUALITY_EXPOSEDNESS  set to 0 to drop a term from the quality measures
+#ifndef QUALITY_CONTRAST
+#define QUALITY_CONTRAST 1
+#endif
+#ifndef QUALITY_SATURATION
+#define QUALITY_SATURATION 1
+#endif
+#ifndef QUALITY_EXPOSEDNESS
+#define QUALITY_EXPOSEDNESS 1
+#endif
+
+/**
+ * Index of a pixel in a packed image, with coordinates clamped to the edge.
+ */
+inline int clamped_index(int2 dim, int2 coord)
+{
+    coord = clamp(coord, (int2)(0, 0), dim - 1);
+    return coord.y * dim.x + coord.x;
+}
+
+inline float4 read_pixel(__global const float4* image, int2 dim, int2 coord)
+{
+    return image[clamped_index(dim, coord)];
+}
+
+inline void write_pixel(__global float4* image, int2 dim, int2 coord, float4 value)
+{
+    image[coord.y * dim.x + coord.x] = value;
+}
+
+/**
+ * Layer get_global_id(2) of a stack of images of @a dim, which is the image
+ * itself for ranges of two dimensions.
+ */
+inline __global const float4* input_layer(__global const float4* image, int2 dim)
+{
+    return image + get_global_id(2) * dim.x * dim.y;
+}
+
+inline __global float4* output_layer(__global float4* image, int2 dim)
+{
+    return image + get_global_id(2) * dim.x * dim.y;
+}
+
+/***************************************************************************
+ *                            Gaussian Kernels                             *
+ ***************************************************************************/
+
+// sampling kernel for laplacian/gaussian pyramids
+__constant const float sampling_kernel[5] = {
+    01.f/16.f, 04.f/16.f, 06.f/16.f, 04.f/16.f, 01.f/16.f
+};
+
+__kernel void downsample_row(__global const float4* input_image, int2 input_dim,
+                             __global float4* output_image, int2 output_dim)
+{
+    input_image = input_layer(input_image, input_dim);
+    output_image = output_layer(output_image, output_dim);
+
+    int2 out_coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(out_coord >= output_dim))
+    {
+        return;
+    }
+
+    int2 in_coord = (int2)( out_coord.x * 2, out_coord.y );
+
+    float4 sample = 0.0f;
+    for (int i = -2; i < 3; ++i)
+    {
+        sample += read_pixel(input_image, input_dim, in_coord+(int2)(i, 0)) * sampling_kernel[2+i];
+    }
+
+    write_pixel(output_image, output_dim, out_coord, sample);
+}
+
+__kernel void downsample_col(__global const float4* input_image, int2 input_dim,
+                             __global float4* output_image, int2 output_dim)
+{
+    input_image = input_layer(input_image, input_dim);
+    output_image = output_layer(output_image, output_dim);
+
+    int2 out_coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(out_coord >= output_dim))
+    {
+        return;
+    }
+
+    int2 in_coord = (int2)( out_coord.x, out_coord.y * 2 );
+
+    float4 sample = 0.0f;
+    for (int i = -2; i < 3; ++i)
+    {
+        sample += read_pixel(input_image, input_dim, in_coord+(int2)(0, i)) * sampling_kernel[2+i];
+    }
+
+    write_pixel(output_image, output_dim, out_coord, sample);
+}
+
+/**
+ * Create two pixels at once, while upsamling.
+ * Dimensions of problem are same as input image.
+ * Corner case arises when output has odd num of pixels.
+ */
+__kernel void upsample_col(__global const float4* input_image, int2 input_dim,
+                           __global float4* output_image, int2 output_dim)
+{
+    input_image = input_layer(input_image, input_dim);
+    output_image = output_layer(output_image, output_dim);
+
+    int2 in_coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(in_coord >= input_dim))
+    {
+        return;
+    }
+
+    int2 out_coord = (int2)( in_coord.x, in_coord.y * 2 );
+
+    // the 3 input pixels that contribute to the two pixels in output
+    float4 in0 = read_pixel(input_image, input_dim, in_coord+(int2)(0, -1));
+    float4 in1 = read_pixel(input_image, input_dim, in_coord);
+    float4 in2 = read_pixel(input_image, input_dim, in_coord+(int2)(0, 1));
+
+    float4 out0 = (   in0 * sampling_kernel[0]
+                    + in1 * sampling_kernel[2]
+                    + in2 * sampling_kernel[0])
+                  * 2;
+
+    float4 out1 = (   in1 * sampling_kernel[1]
+                    + in2 * sampling_kernel[1])
+                  * 2;
+
+    write_pixel(output_image, output_dim, out_coord, out0);
+
+    // corner case when output has odd number of pixels.
+    // do not write out the second output pixel
+    if (out_coord.y + 1 >= output_dim.y)
+    {
+        return;
+    }
+
+    write_pixel(output_image, output_dim, out_coord+(int2)(0,1), out1);
+}
+
+__kernel void upsample_row(__global const float4* input_image, int2 input_dim,
+                           __global float4* output_image, int2 output_dim)
+{
+    input_image = input_layer(input_image, input_dim);
+    output_image = output_layer(output_image, output_dim);
+
+    int2 in_coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(in_coord >= input_dim))
+    {
+        return;
+    }
+
+    int2 out_coord = (int2)( in_coord.x * 2, in_coord.y);
+
+    // the 3 input pixels that contribute to the two pixels in output
+    float4 in0 = read_pixel(input_image, input_dim, in_coord+(int2)(-1, 0));
+    float4 in1 = read_pixel(input_image, input_dim, in_coord);
+    float4 in2 = read_pixel(input_image, input_dim, in_coord+(int2)(1, 0));
+
+    float4 out0 = (   in0 * sampling_kernel[0]
+                    + in1 * sampling_kernel[2]
+                    + in2 * sampling_kernel[0])
+                  * 2;
+
+    float4 out1 = (   in1 * sampling_kernel[1]
+                    + in2 * sampling_kernel[1])
+                  * 2;
+
+    write_pixel(output_image, output_dim, out_coord, out0);
+
+    // corner case when output has odd number of pixels.
+    // do not write out the second output pixel
+    if (out_coord.x + 1 >= output_dim.x)
+    {
+        return;
+    }
+
+    write_pixel(output_image, output_dim, out_coord+(int2)(1,0), out1);
+}
+
+/***************************************************************************
+ *                         Pyramid Related Kernels                         *
+ ***************************************************************************/
+
+/**
+ * Given the original image and the gaussian blurred image create the
+ * laplacian by subtracting the two, preserving the original alpha.
+ */
+__kernel void create_laplacian(__global const float4* original, int2 original_dim,
+                               __global const float4* blurred, int2 blurred_dim,
+                               __global float4* laplacian, int2 laplacian_dim)
+{
+    original = input_layer(original, original_dim);
+    blurred = input_layer(blurred, blurred_dim);
+    laplacian = output_layer(laplacian, laplacian_dim);
+
+    int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= laplacian_dim))
+    {
+        return;
+    }
+
+    int index = coord.y * laplacian_dim.x + coord.x;
+
+    float4 o = original[index];
+    float4 l = o - blurred[index];
+    l.s3 = o.s3; // preserve original alpha;
+
+    laplacian[index] = l;
+}
+
+__kernel void collapse_level(__global const float4* blurred, int2 blurred_dim,
+                             __global const float4* laplacian, int2 laplacian_dim,
+                             __global float4* collapsed, int2 collapsed_dim)
+{
+    blurred = input_layer(blurred, blurred_dim);
+    laplacian = input_layer(laplacian, laplacian_dim);
+    collapsed = output_layer(collapsed, collapsed_dim);
+
+    int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= collapsed_dim))
+    {
+        return;
+    }
+
+    int index = coord.y * collapsed_dim.x + coord.x;
+
+    float4 c = blurred[index] + laplacian[index];
+    // clamped at every level, like collapse_level of kernels.cl
+    c = clamp(c, 0.0f, 1.0f);
+
+    collapsed[index] = c;
+}
+
+/**
+ * Layers of the array follow each other in memory.
+ */
+__kernel void fuse_level(__global const float4* array, int4 array_dim,
+                         __global float4* fused, int2 fused_dim)
+{
+    // all layers of the array for each fused layer
+    array += get_global_id(2) * array_dim.x * array_dim.y * array_dim.z;
+    fused = output_layer(fused, fused_dim);
+
+    int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= fused_dim))
+    {
+        return;
+    }
+
+    int index = coord.y * fused_dim.x + coord.x;
+    int layer_size = array_dim.x * array_dim.y;
+
+#ifdef GROUP_SIZE
+    int const depth = GROUP_SIZE;
+#else
+    int depth = array_dim.z;
+#endif
+
+    float4 acc = 0.0f;
+    float weight_sum = 0.0f; // sum of all weights in alpha channel
+
+#ifdef GROUP_SIZE
+    #pragma unroll
+#endif
+    for (int i = 0; i < depth; ++i)
+    {
+        float4 pix = array[i * layer_size + index];
+
+        // accumulate weight
+        weight_sum += pix.s3;
+
+        // multiply by own weight
+        acc += pix * pix.s3;
+    }
+
+    // divide by weight sum to normalize
+    acc /= weight_sum;
+
+    fused[index] = acc;
+}
+
+/**
+ * Same as fuse_level, but layer i is read translated by shifts[i], given in
+ * pixels of the first level of the pyramid and rounded to those of @a level.
+ * Pixels translated off a layer clamp to its edge.
+ */
+__kernel void fuse_level_aligned(__global const float4* array, int4 array_dim,
+                                 __global float4* fused, int2 fused_dim,
+                                 __constant int2* shifts,
+                                 int level)
+{
+    int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= fused_dim))
+    {
+        return;
+    }
+
+    int2 layer_dim = array_dim.xy;
+    int layer_size = layer_dim.x * layer_dim.y;
+
+#ifdef GROUP_SIZE
+    int const depth = GROUP_SIZE;
+#else
+    int depth = array_dim.z;
+#endif
+
+    float const scale = 1.0f / (float)(1 << level);
+
+    float4 acc = 0.0f;
+    float weight_sum = 0.0f; // sum of all weights in alpha channel
+
+#ifdef GROUP_SIZE
+    #pragma unroll
+#endif
+    for (int i = 0; i < depth; ++i)
+    {
+        int2 shift = convert_int2(floor(convert_float2(shifts[i]) * scale + 0.5f));
+        float4 pix = array[i * layer_size + clamped_index(layer_dim, coord + shift)];
+
+        weight_sum += pix.s3;
+        acc += pix * pix.s3;
+    }
+
+    acc /= weight_sum;
+
+    fused[coord.y * fused_dim.x + coord.x] = acc;
+}
+
+/**
+ * One pixel upsampled from three, like upsample_col and upsample_row do:
+ * the first of the two they write for even coordinates, the second for odd
+ */
+inline float4 upsample_taps(float4 in0, float4 in1, float4 in2, int odd)
+{
+    if (odd)
+    {
+        return (   in1 * sampling_kernel[1]
+                 + in2 * sampling_kernel[1])
+               * 2;
+    }
+    return (   in0 * sampling_kernel[0]
+             + in1 * sampling_kernel[2]
+             + in2 * sampling_kernel[0])
+           * 2;
+}
+
+/**
+ * The pixel at @a coord of @a lower upsampled by upsample_col and then
+ * upsample_row, computed on its own from the 3x3 pixels around coord / 2
+ */
+inline float4 upsampled_pixel(__global const float4* lower, int2 lower_dim, int2 coord)
+{
+    int2 in_coord = coord / 2;
+    float4 columns[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        int2 c = in_coord + (int2)(i - 1, 0);
+        columns[i] = upsample_taps(read_pixel(lower, lower_dim, c + (int2)(0, -1)),
+                                   read_pixel(lower, lower_dim, c),
+                                   read_pixel(lower, lower_dim, c + (int2)(0, 1)),
+                                   coord.y & 1);
+    }
+    return upsample_taps(columns[0], columns[1], columns[2], coord.x & 1);
+}
+
+/**
+ * fuse_level and collapse_level at once: fuses the level, and adds it to
+ * @a lower, the collapsed level below, upsampled. The fused level is never
+ * written out.
+ */
+__kernel void fuse_collapse_level(__global const float4* array, int4 array_dim,
+                                  __global const float4* lower, int2 lower_dim,
+                                  __global float4* collapsed, int2 collapsed_dim)
+{
+    int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= collapsed_dim))
+    {
+        return;
+    }
+
+    int index = coord.y * collapsed_dim.x + coord.x;
+    int layer_size = array_dim.x * array_dim.y;
+
+#ifdef GROUP_SIZE
+    int const depth = GROUP_SIZE;
+#else
+    int depth = array_dim.z;
+#endif
+
+    float4 acc = 0.0f;
+    float weight_sum = 0.0f; // sum of all weights in alpha channel
+
+#ifdef GROUP_SIZE
+    #pragma unroll
+#endif
+    for (int i = 0; i < depth; ++i)
+    {
+        float4 pix = array[i * layer_size + index];
+
+        weight_sum += pix.s3;
+        acc += pix * pix.s3;
+    }
+
+    acc /= weight_sum;
+
+    float4 c = upsampled_pixel(lower, lower_dim, coord) + acc;
+    // clamped like collapse_level, which this stands in for
+    c = clamp(c, 0.0f, 1.0f);
+
+    collapsed[index] = c;
+}
+
+/**
+ * Same as fuse_collapse_level, but fuses like fuse_level_aligned.
+ */
+__kernel void fuse_collapse_level_aligned(__global const float4* array, int4 array_dim,
+                                          __global const float4* lower, int2 lower_dim,
+                                          __global float4* collapsed, int2 collapsed_dim,
+                                          __constant int2* shifts,
+                                          int level)
+{
+    int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= collapsed_dim))
+    {
+        return;
+    }
+
+    int2 layer_dim = array_dim.xy;
+    int layer_size = layer_dim.x * layer_dim.y;
+
+#ifdef GROUP_SIZE
+    int const depth = GROUP_SIZE;
+#else
+    int depth = array_dim.z;
+#endif
+
+    float const scale = 1.0f / (float)(1 << level);
+
+    float4 acc = 0.0f;
+    float weight_sum = 0.0f; // sum of all weights in alpha channel
+
+#ifdef GROUP_SIZE
+    #pragma unroll
+#endif
+    for (int i = 0; i < depth; ++i)
+    {
+        int2 shift = convert_int2(floor(convert_float2(shifts[i]) * scale + 0.5f));
+        float4 pix = array[i * layer_size + clamped_index(layer_dim, coord + shift)];
+
+        weight_sum += pix.s3;
+        acc += pix * pix.s3;
+    }
+
+    acc /= weight_sum;
+
+    float4 c = upsampled_pixel(lower, lower_dim, coord) + acc;
+    c = clamp(c, 0.0f, 1.0f);
+
+    collapsed[coord.y * collapsed_dim.x + coord.x] = c;
+}
+
+/***************************************************************************
+ *                          HDR Quality Measures                           *
+ ***************************************************************************/
+
+/**
+ * Return the standard deviation squared, of R, G, B component values in a pixel
+ */
+inline float sigma_squared_rgb(float4 pixel)
+{
+    float4 squared = pown(pixel, 2);
+    float mean = ((float)pixel.s0 + pixel.s1 + pixel.s2) / 3.0f;
+    float mean_squared = pown(mean, 2);
+    float mean_of_squared = ((float)squared.s0 + squared.s1 + squared.s2) / 3.0f;
+
+    return sqrt(fabs(mean_of_squared - mean_squared));
+}
+
+// uses gaussian distribution
+inline float well_exposedness_naive(float4 pixel)
+{
+    float const denominator = 0.08f; // sigma^2 * 2, where sigma = 0.2
+    float4 component_wise = exp( (float4) - (pown( pixel - 0.5f, 2 ) / denominator) );
+
+    // create single measure for pixel
+    return component_wise.s0 + component_wise.s1 + component_wise.s2;
+}
+
+// part of quality measure.
+__constant const float discreet_laplacian[3][3] = {
+    0.5f/6.f, 1.f/6.f, 0.5f/6.f,
+     1.f/6.f,   -1.f,   1.f/6.f,
+    0.5f/6.f, 1.f/6.f, 0.5f/6.f
+};
+
+/**
+ * The quality measures of the pixel at @a coord: contrast, saturation and
+ * exposedness, in that order. Measures dropped by QUALITY_* defines are 0.
+ */
+inline float4 quality_measures(__global const float4* input_image, int2 input_dim, int2 coord)
+{
+    float4 pixel = read_pixel(input_image, input_dim, coord);
+    float4 measures = 0.0f;
+
+#if QUALITY_CONTRAST
+    // find laplacian at pixel per component
+    float4 laplacian = 0.0f;
+    for (int i = -1; i < 2; ++i)
+    {
+        for (int j = -1; j < 2; ++j)
+        {
+            laplacian += read_pixel(input_image, input_dim, coord+(int2)(i, j))
+                             * discreet_laplacian[1+i][1+j];
+        }
+    }
+
+    measures.s0 = fast_length(fabs(laplacian));
+#endif
+
+#if QUALITY_SATURATION
+    measures.s1 = sigma_squared_rgb(pixel);
+#endif
+
+#if QUALITY_EXPOSEDNESS
+    measures.s2 = well_exposedness_naive(pixel);
+#endif
+
+    return measures;
+}
+
+/**
+ * Assign the quality of each pixel to its alpha channel: the sum of its
+ * quality measures, multiplied by the matching components of @a weights
+ * (see QualityWeights).
+ */
+__kernel void compute_quality(__global const float4* input_image, int2 input_dim,
+                              __global float4* output_image, int2 output_dim,
+                              float4 weights)
+{
+    input_image = input_layer(input_image, input_dim);
+    output_image = output_layer(output_image, output_dim);
+
+    int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= output_dim))
+    {
+        return;
+    }
+
+    float4 pixel = read_pixel(input_image, input_dim, coord);
+
+    // assign quality measure to alpha channel
+    pixel.s3 = dot(quality_measures(input_image, input_dim, coord), weights);
+
+    write_pixel(output_image, output_dim, coord, pixel);
+}
+
+/**
+ * Write out the quality measures themselves, so that they can be
+ * weighted in several ways later, without computing them again.
+ */
+__kernel void compute_measures(__global const float4* input_image, int2 input_dim,
+                               __global float4* output_image, int2 output_dim)
+{
+    input_image = input_layer(input_image, input_dim);
+    output_image = output_layer(output_image, output_dim);
+
+    int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= output_dim))
+    {
+        return;
+    }
+
+    write_pixel(output_image, output_dim, coord, quality_measures(input_image, input_dim, coord));
+}
+
+/**
+ * Assign the quality of each pixel of @a level to its alpha channel, from
+ * @a measures written by compute_measures, or gaussians of them, like
+ * compute_quality does. Weighing is linear, so a level of a pyramid gets
+ * the weights it would have had if they were assigned before building it.
+ * Only batches use it, so there is no image version.
+ */
+__kernel void weigh_level(__global const float4* measures, int2 measures_dim,
+                          __global float4* level, int2 level_dim,
+                          float4 weights)
+{
+    measures = input_layer(measures, measures_dim);
+    level = output_layer(level, level_dim);
+
+    int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= level_dim))
+    {
+        return;
+    }
+
+    int index = coord.y * level_dim.x + coord.x;
+    level[index].s3 = dot(measures[index], weights);
+}
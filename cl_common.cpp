@@ -1,5 +1,6 @@
 #include "cl_common.h"
 
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -8,6 +9,10 @@
 namespace
 {
 
+    // storage of the wait list of each thread, and whether it is taken
+    thread_local std::vector<cl::Event> s_waitList;
+    thread_local bool s_waitListTaken = false;
+
     /* Find a GPU or CPU associated with the first available platform */
     void createDevices(std::vector<cl::Device>& devices)
     {
@@ -48,6 +53,28 @@ namespace
         return sstr.str();
     }
 
+    /**
+     * Compile @a source into a program for @a dev
+     */
+    cl::Program buildProgramSource(cl::Context const& ctx, cl::Device dev,
+                                   std::string const& source, std::string const& options)
+    {
+        cl::Program program(ctx, source);
+
+        /* Build program */
+        try {
+            program.build(std::vector<cl::Device>(1, dev), options.c_str());
+        }
+        catch (cl::Error const& e) {
+            /* Output build log on failure */
+            // TODO: rethrow with build log as message
+            std::cerr << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(dev) << std::endl;
+            exit(1);
+        }
+
+        return program;
+    }
+
 }
 
 namespace DynamiCL
@@ -120,41 +147,199 @@ namespace DynamiCL
         return "Unknown Error";
     }
 
+    ImageStorage preferredStorage(cl::Device const& device)
+    {
+        if (device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU)
+        {
+            return ImageStorage::BUFFER;
+        }
+
+        if (!device.getInfo<CL_DEVICE_IMAGE_SUPPORT>())
+        {
+            return ImageStorage::BUFFER;
+        }
+
+        return ImageStorage::IMAGE;
+    }
+
+    bool prefersZeroCopy(cl::Device const& device)
+    {
+        if (char const* zeroCopy = std::getenv("DYNAMICL_ZERO_COPY"))
+        {
+            return std::string(zeroCopy) != "0";
+        }
+
+        return device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
+    }
+
+    const size_t EventList::capacity;
+
+    void EventList::push_back(cl::Event const& event)
+    {
+        if (size_ == capacity)
+        {
+            throw std::length_error("Too many events to wait for.");
+        }
+        events_[size_++] = event;
+    }
+
+    void EventList::clear()
+    {
+        for (size_t i = 0; i < size_; ++i)
+        {
+            events_[i] = cl::Event();
+        }
+        size_ = 0;
+    }
+
+    WaitList::WaitList(EventList const& events)
+        : events_(s_waitList)
+    {
+        if (s_waitListTaken)
+        {
+            throw std::logic_error("Only one wait list can exist on a thread at a time.");
+        }
+        s_waitListTaken = true;
+        events_.assign(events.begin(), events.end());
+    }
+
+    WaitList::~WaitList()
+    {
+        // keeps the capacity, but not the events
+        events_.clear();
+        s_waitListTaken = false;
+    }
+
+    void DeviceImagePool::releaseAll(cl::CommandQueue const& queue)
+    {
+        queue.finish();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (Entry& entry : entries_)
+        {
+            entry.inUse = false;
+        }
+    }
+
     ComputeContext::ComputeContext()
         : device(getBestDevice()),
           context(device), 
-          queue(context, device)
+          queue(context, device),
+          storage(preferredStorage(device)),
+          zeroCopy(prefersZeroCopy(device))
+    { }
+
+    ComputeContext::ComputeContext(ImageStorage s)
+        : device(getBestDevice()),
+          context(device), 
+          queue(context, device),
+          storage(s),
+          zeroCopy(prefersZeroCopy(device))
     { }
 
+    ComputeContext::ComputeContext(ComputeContext const& other, cl::CommandQueue const& q)
+        : device(other.device),
+          context(other.context),
+          queue(q),
+          storage(other.storage),
+          zeroCopy(other.zeroCopy),
+          tuning(other.tuning)
+    {
+        std::lock_guard<std::mutex> lock(other.programsMutex);
+        programs = other.programs;
+    }
+
     DeviceCapabilities::DeviceCapabilities(cl::Device device)
         : memSize(device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>()),
           maxAllocSize(device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>())
-    {
-        // TODO: find device capabilities
-        std::cout << "Max Size: " << memSize << std::endl;
-        std::cout << "Max Alloc Size: " << maxAllocSize << std::endl;
-    }
+    { }
 
-    cl::Program buildProgram(cl::Context const& ctx, cl::Device dev, char const* filename)
+    cl::Program buildProgram(cl::Context const& ctx, cl::Device dev, char const* filename,
+                             std::string const& options)
     {
         /* Read program file and place content into buffer */
         std::string program_source = slurp(std::ifstream(filename));
 
-        /* Create program from file */
-        cl::Program program(ctx, program_source);
+        return buildProgramSource(ctx, dev, program_source, options);
+    }
 
-        /* Build program */
-        try {
-            program.build();
+
+    char const* kernelFile(ComputeContext const& context)
+    {
+        if (context.storage == ImageStorage::BUFFER)
+        {
+            return "buffer_kernels.cl";
         }
-        catch (cl::Error const& e) {
-            /* Output build log on failure */
-            // TODO: rethrow with build log as message
-            std::cerr << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(dev) << std::endl;
-            exit(1);
+
+        return "kernels.cl";
+    }
+
+    std::string ProgramVariant::defines() const
+    {
+        std::stringstream sstr;
+        if (groupSize > 0)
+        {
+            sstr << "-D GROUP_SIZE=" << groupSize << " ";
         }
+        sstr << "-D QUALITY_CONTRAST=" << contrast
+             << " -D QUALITY_SATURATION=" << saturation
+             << " -D QUALITY_EXPOSEDNESS=" << exposedness;
+        return sstr.str();
+    }
 
-        return program;
+    QualityWeights QualityWeights::parse(std::string const& s)
+    {
+        static const std::map<std::string, QualityWeights> presets = {
+            { "default",  QualityWeights() },
+            { "detail",   QualityWeights(6.0f, 1.5f, 0.2f) },
+            { "vivid",    QualityWeights(3.0f, 3.0f, 0.2f) },
+            { "even",     QualityWeights(1.0f, 1.0f, 1.0f) },
+            { "exposure", QualityWeights(1.0f, 0.5f, 1.0f) }
+        };
+
+        auto it = presets.find(s);
+        if (it != presets.end())
+        {
+            return it->second;
+        }
+
+        QualityWeights weights;
+        char comma1 = 0;
+        char comma2 = 0;
+        std::istringstream in(s);
+        if (!(in >> weights.contrast >> comma1 >> weights.saturation >> comma2 >> weights.exposedness)
+            || comma1 != ',' || comma2 != ','
+            || !(in >> std::ws).eof())
+        {
+            throw std::invalid_argument("Unknown quality weights: " + s);
+        }
+        return weights;
+    }
+
+    cl::Program buildProgram(ComputeContext const& context, ProgramVariant const& variant)
+    {
+        std::string options = variant.defines();
+        if (!context.tuning.buildOptions.empty())
+        {
+            options += " " + context.tuning.buildOptions;
+        }
+
+        std::lock_guard<std::mutex> lock(context.programsMutex);
+
+        auto it = context.programs.find(options);
+        if (it == context.programs.end())
+        {
+            // kernels for small pyramid levels work with any storage
+            std::string source = slurp(std::ifstream(kernelFile(context)))
+                               + "\n"
+                               + slurp(std::ifstream("small_levels.cl"));
+
+            cl::Program program = buildProgramSource(context.context, context.device,
+                                                     source, options);
+            it = context.programs.insert(std::make_pair(options, program)).first;
+        }
+
+        return it->second;
     }
 
 }
@@ -8,10 +8,19 @@
 #include <CL/cl.hpp>
 #endif
 
+#include <algorithm>
 #include <array>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <type_traits>
+#include <typeinfo>
+#include <vector>
 #include <iostream>
 
+#include "alloc_counters.h"
+
 /**
  * Some missing traits from OpenCL C++ headers
  */
@@ -37,6 +46,143 @@ namespace DynamiCL
 {
     char const* clErrorToStr(cl_int err);
 
+    /**
+     * How images live on a device: as OpenCL image objects read through
+     * samplers, or as plain buffers of packed float4 pixels.
+     */
+    enum class ImageStorage
+    {
+        IMAGE,
+        BUFFER
+    };
+
+    /**
+     * Choose the storage that runs fastest on @a device. CPU runtimes
+     * emulate samplers in software, so they get buffers.
+     */
+    ImageStorage preferredStorage(cl::Device const& device);
+
+    /**
+     * Whether images on @a device should be created over host memory and
+     * read through mappings, instead of being copied in and out. True for
+     * CPU runtimes and integrated GPUs, whose device memory is host
+     * memory, unless the environment variable DYNAMICL_ZERO_COPY is "0".
+     */
+    bool prefersZeroCopy(cl::Device const& device);
+
+    /**
+     * Tuning parameters of kernels on a particular device:
+     * options to build programs with, the work-group size
+     * of each kernel that has been tuned, and the size below which
+     * pyramid levels are faster to process on the host.
+     */
+    struct KernelTuning
+    {
+        typedef std::array<size_t, 2> local_size_type;
+
+        std::string buildOptions;
+        std::map<std::string, local_size_type> localSizes;
+        size_t hostLevelPixels; ///< largest level processed on the host, 0 for none
+
+        KernelTuning()
+            : hostLevelPixels(0)
+        { }
+
+        /**
+         * Find the tuned work-group size of kernel @a name.
+         * @Return false if the kernel has not been tuned.
+         */
+        bool find(std::string const& name, local_size_type& localSize) const
+        {
+            auto it = localSizes.find(name);
+            if (it == localSizes.end())
+            {
+                return false;
+            }
+            localSize = it->second;
+            return true;
+        }
+    };
+
+    /**
+     * Device images kept for reuse, so that work repeated on images of the
+     * same dimensions, like the frames of a timelapse, only allocates
+     * device memory the first time.
+     *
+     * An image handed out is in use until its owner calls releaseAll(),
+     * at a point where it holds none of them anymore, like the end of a
+     * merge. Until then it is never handed out again, as nothing in
+     * OpenCL tells reliably whether commands still use it. The pool holds
+     * as many images of each kind as were in use between two releases.
+     */
+    class DeviceImagePool
+    {
+    public:
+        typedef std::array<size_t, 3> key_type; ///< dimensions, padded with 1s
+
+        /**
+         * Point @a image to a free image of type CLImage, created with
+         * @a dims and @a flags, which is in use from now on.
+         * @Return false if there is none.
+         */
+        template <typename CLImage>
+        bool reuse(key_type const& dims, cl_mem_flags flags, CLImage& image)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (Entry& entry : entries_)
+            {
+                if (!entry.inUse
+                    && *entry.type == typeid(CLImage)
+                    && entry.dims == dims
+                    && entry.flags == flags)
+                {
+                    entry.inUse = true;
+                    image = *static_cast<CLImage const*>(entry.image.get());
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * Keep @a image for reuse, once it is released
+         */
+        template <typename CLImage>
+        void add(key_type const& dims, cl_mem_flags flags, CLImage const& image)
+        {
+            Entry entry = { &typeid(CLImage), dims, flags, true, std::make_shared<CLImage>(image) };
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            entries_.push_back(std::move(entry));
+        }
+
+        /**
+         * Wait for @a queue, which all commands on the images of the pool
+         * go to, and make all of them free to reuse. Callers must not
+         * hold on to any image from the pool past this point.
+         */
+        void releaseAll(cl::CommandQueue const& queue);
+
+        size_t size() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return entries_.size();
+        }
+
+    private:
+        struct Entry
+        {
+            std::type_info const* type;
+            key_type dims;
+            cl_mem_flags flags;
+            bool inUse; ///< since it was handed out, until the next release
+            std::shared_ptr<void> image;
+        };
+
+        mutable std::mutex mutex_;
+        std::vector<Entry> entries_;
+    };
+
     /**
      * Initializes the necessary handles to run OpenCL computations
      */
@@ -45,8 +191,26 @@ namespace DynamiCL
         cl::Device const device;
         cl::Context const context;
         cl::CommandQueue const queue;
+        ImageStorage const storage;
+        bool const zeroCopy; ///< whether images share memory with the host
+        KernelTuning tuning; ///< empty unless loaded or autotuned
+
+        /// program variants built so far, keyed by their build options
+        mutable std::map<std::string, cl::Program> programs;
+        mutable std::mutex programsMutex;
+
+        /// device images to reuse, if set, which contexts never share
+        mutable std::unique_ptr<DeviceImagePool> imagePool;
 
         ComputeContext();
+        explicit ComputeContext(ImageStorage storage);
+
+        /**
+         * Share the device, context, storage, tuning and programs of
+         * @a other, but enqueue on @a queue, so that work submitted
+         * through each can overlap on the device.
+         */
+        ComputeContext(ComputeContext const& other, cl::CommandQueue const& queue);
     };
 
     /**
@@ -64,7 +228,90 @@ namespace DynamiCL
     };
 
     /* Create program from a file and compile it */
-    cl::Program buildProgram(cl::Context const& ctx, cl::Device dev, char const* filename);
+    cl::Program buildProgram(cl::Context const& ctx, cl::Device dev, char const* filename,
+                             std::string const& options = "");
+
+    /**
+     * @Return the kernel source file implementing the pyramid kernels
+     * for the storage used by @a context.
+     */
+    char const* kernelFile(ComputeContext const& context);
+
+    /**
+     * Compile-time configuration of the pyramid kernels, which is fixed
+     * for a whole job. Passed to the kernels as -D defines, so that the
+     * loop over a group is unrolled and unused quality measures drop out.
+     */
+    struct ProgramVariant
+    {
+        size_t groupSize; ///< images fused at once, or 0 to find out at runtime
+
+        // terms of the quality measure
+        bool contrast;
+        bool saturation;
+        bool exposedness;
+
+        explicit ProgramVariant(size_t groupSize = 0)
+            : groupSize(groupSize),
+              contrast(true),
+              saturation(true),
+              exposedness(true)
+        { }
+
+        /**
+         * @Return build options defining this variant
+         */
+        std::string defines() const;
+    };
+
+    /**
+     * Build @a variant of the pyramid kernels for the storage of
+     * @a context, together with the kernels for small levels, and
+     * with the tuned build options of @a context.
+     *
+     * Programs are cached in the context, so asking for the same
+     * variant again is cheap.
+     */
+    cl::Program buildProgram(ComputeContext const& context, ProgramVariant const& variant);
+
+    /**
+     * Multipliers of the contrast, saturation and exposedness measures
+     * that add up to the quality of a pixel. Unlike a ProgramVariant, they
+     * are passed to compute_quality as an argument, so trying another
+     * balance needs no rebuild.
+     */
+    struct QualityWeights
+    {
+        float contrast;
+        float saturation;
+        float exposedness;
+
+        explicit QualityWeights(float contrast = 3.0f,
+                                float saturation = 1.5f,
+                                float exposedness = 0.2f)
+            : contrast(contrast),
+              saturation(saturation),
+              exposedness(exposedness)
+        { }
+
+        /**
+         * @Return weights in the layout of the measures written by
+         * compute_measures, as the float4 argument of compute_quality
+         */
+        cl_float4 toFloat4() const
+        {
+            cl_float4 weights = {{ contrast, saturation, exposedness, 0.0f }};
+            return weights;
+        }
+
+        /**
+         * Parse either the name of a preset ("default", "detail", "vivid",
+         * "even" or "exposure"), or three comma separated weights.
+         *
+         * @throws std::invalid_argument if @a s is neither
+         */
+        static QualityWeights parse(std::string const& s);
+    };
 
     /***************************************************************************
      *                           cl::Vector helpers                            *
@@ -117,10 +364,126 @@ namespace DynamiCL
 
     };
 
+    /***************************************************************************
+     *                           cl::Event helpers                             *
+     ***************************************************************************/
+
+    /**
+     * Events to wait for, held in place rather than on the heap, as every
+     * kernel of every frame has a list of them. Holds up to @a capacity,
+     * which is more than a pyramid has levels.
+     */
+    class EventList
+    {
+    public:
+        static const size_t capacity = 32;
+
+        EventList() : size_(0) { }
+
+        EventList(EventList const& other) : size_(0) { append(other); }
+
+        EventList& operator =(EventList const& other)
+        {
+            if (this != &other)
+            {
+                clear();
+                append(other);
+            }
+            return *this;
+        }
+
+        /**
+         * @throws std::length_error if the list is full
+         */
+        void push_back(cl::Event const& event);
+
+        void append(EventList const& other) { append(other.begin(), other.end()); }
+
+        template <typename It>
+        void append(It first, It last)
+        {
+            for (; first != last; ++first)
+            {
+                push_back(*first);
+            }
+        }
+
+        /**
+         * Let go of the events, so that the runtime can free them
+         */
+        void clear();
+
+        size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+
+        cl::Event const* begin() const { return events_.data(); }
+        cl::Event const* end() const { return events_.data() + size_; }
+
+    private:
+        std::array<cl::Event, capacity> events_;
+        size_t size_;
+    };
+
+    /**
+     * @a events as the enqueue functions of cl.hpp take them, in a vector
+     * of the calling thread that keeps its capacity from one list to the
+     * next. Only one can exist on a thread at a time.
+     */
+    class WaitList
+    {
+    public:
+        /**
+         * @throws std::logic_error if the thread already has one
+         */
+        explicit WaitList(EventList const& events);
+        ~WaitList();
+
+        WaitList(WaitList const&) = delete;
+        WaitList& operator =(WaitList const&) = delete;
+
+        /**
+         * @Return the events, valid for as long as this is
+         */
+        std::vector<cl::Event> const* get() const { return &events_; }
+
+    private:
+        std::vector<cl::Event>& events_;
+    };
+
     /***************************************************************************
      *                           cl::Image helpers                             *
      ***************************************************************************/
 
+    /**
+     * An image stored in a plain OpenCL buffer as tightly packed RGBA float
+     * pixels, row after row (and layer after layer for arrays).
+     *
+     * Kernels receive the buffer followed by its dimensions, and do their
+     * own clamping at the edges.
+     */
+    template <size_t N>
+    struct BufferImage
+    {
+        cl::Buffer buffer;
+        std::array<size_t, N> dims;
+
+        /**
+         * @Return number of bytes the image occupies
+         */
+        size_t bytes() const
+        {
+            size_t pixels = 1;
+            for (size_t d : dims)
+            {
+                pixels *= d;
+            }
+            return pixels * sizeof(cl_float4);
+        }
+    };
+
+    typedef BufferImage<2> BufferImage2D;
+    typedef BufferImage<3> BufferImage2DArray;
+
     namespace detail
     {
         /**
@@ -161,6 +524,8 @@ namespace DynamiCL
             static const cl_mem_object_type mem_type = CL_MEM_OBJECT_IMAGE2D;
             typedef cl::Image2D climage_type;
 
+            typedef cl::Image2DArray array_type;
+
             static constexpr cl_int dim_info[N] =
                 { CL_IMAGE_WIDTH, CL_IMAGE_HEIGHT };
         };
@@ -189,6 +554,23 @@ namespace DynamiCL
                 { CL_IMAGE_WIDTH, CL_IMAGE_HEIGHT, CL_IMAGE_DEPTH };
         };
 
+        template <>
+        struct image_traits<BufferImage2D>
+        {
+            static const size_t N = 2;
+            static const bool is_array = false;
+            typedef BufferImage2D climage_type;
+            typedef BufferImage2DArray array_type;
+        };
+
+        template <>
+        struct image_traits<BufferImage2DArray>
+        {
+            static const size_t N = 3;
+            static const bool is_array = true;
+            typedef BufferImage2DArray climage_type;
+        };
+
 
         template <typename CLImage>
         CLImage
@@ -255,8 +637,119 @@ namespace DynamiCL
             return CLImage(mem);
         }
 
+        /**
+         * Buffers only need their size in bytes, so skip the image
+         * descriptor entirely.
+         */
+        template <size_t N>
+        BufferImage<N>
+        construct_buffer_image(cl::Context const& context,
+                               std::array<size_t, N> const& dims,
+                               cl_mem_flags flags,
+                               void* host_ptr)
+        {
+            BufferImage<N> image = { cl::Buffer(), dims };
+            image.buffer = cl::Buffer(context, flags, image.bytes(), host_ptr);
+            return image;
+        }
+
+        template <typename CLImage>
+        struct image_constructor
+        {
+            static CLImage construct(cl::Context const& context,
+                        std::array<size_t, image_traits<CLImage>::N> const& dims,
+                        cl_mem_flags flags,
+                        void* host_ptr)
+            {
+                return construct_image<CLImage>(context, dims, flags, host_ptr);
+            }
+        };
+
+        template <size_t N>
+        struct image_constructor<BufferImage<N>>
+        {
+            static BufferImage<N> construct(cl::Context const& context,
+                        std::array<size_t, N> const& dims,
+                        cl_mem_flags flags,
+                        void* host_ptr)
+            {
+                return construct_buffer_image<N>(context, dims, flags, host_ptr);
+            }
+        };
+
+        /**
+         * What a DeviceImagePool needs to hand out an image again:
+         * its memory object, and a way to fill it from the host
+         */
+        template <typename CLImage>
+        struct pooled_image
+        {
+            static void write(cl::CommandQueue const& queue, CLImage const& image,
+                              DeviceImagePool::key_type const& dims, void* host_ptr)
+            {
+                cl::size_t<3> origin;
+                cl::size_t<3> region;
+                for (size_t i = 0; i < 3; ++i)
+                {
+                    origin.push_back(0);
+                    region.push_back(dims[i]);
+                }
+                queue.enqueueWriteImage(image, CL_TRUE, origin, region, 0, 0, host_ptr);
+            }
+        };
+
+        template <size_t N>
+        struct pooled_image<BufferImage<N>>
+        {
+            static void write(cl::CommandQueue const& queue, BufferImage<N> const& image,
+                              DeviceImagePool::key_type const&, void* host_ptr)
+            {
+                queue.enqueueWriteBuffer(image.buffer, CL_TRUE, 0, image.bytes(), host_ptr);
+            }
+        };
+
+        /**
+         * @Return @a dims padded with 1s to three dimensions
+         */
+        template <size_t N>
+        DeviceImagePool::key_type pool_key(std::array<size_t, N> const& dims)
+        {
+            DeviceImagePool::key_type key = {{ 1, 1, 1 }};
+            std::copy(dims.begin(), dims.end(), key.begin());
+            return key;
+        }
+
     }
 
+    /**
+     * Alignment of host memory that images can be created over in
+     * zero-copy mode, which is that of array_ptr storage
+     */
+    size_t const zeroCopyAlignment = 256;
+
+    /**
+     * @Return whether an image created over @a hostPtr with @a c shares
+     * its memory, rather than copying it
+     */
+    inline bool sharesHostMemory(ComputeContext const& c, void const* hostPtr)
+    {
+        return c.zeroCopy
+            && hostPtr
+            && reinterpret_cast<size_t>(hostPtr) % zeroCopyAlignment == 0;
+    }
+
+    /**
+     * Create an image of @a dims, initialized from @a hostPtr if given.
+     *
+     * In zero-copy mode, images use aligned host memory in place, and
+     * others are allocated where the host can map them. The host must
+     * not read or write memory an image uses in place until the image is
+     * released and the commands using it are complete, as when a blocking
+     * read of a result has returned.
+     *
+     * With an image pool on @a c, free images from it are reused, and
+     * new ones are added to it, in use until the pool is released.
+     */
     template <typename CLImage>
     typename detail::image_traits<CLImage>::climage_type
     createCLImage(ComputeContext const& c,
@@ -267,13 +760,47 @@ namespace DynamiCL
         if (!hostPtr)
         {
             flags |= CL_MEM_HOST_READ_ONLY;
+            if (c.zeroCopy)
+            {
+                flags |= CL_MEM_ALLOC_HOST_PTR;
+            }
+        }
+        else if (sharesHostMemory(c, hostPtr))
+        {
+            flags |= CL_MEM_USE_HOST_PTR;
         }
         else
         {
             flags |= CL_MEM_COPY_HOST_PTR;
         }
 
-        return detail::construct_image<CLImage>(c.context, dims, flags, hostPtr);
+        // images over host memory allocate none of their own
+        if (flags & CL_MEM_USE_HOST_PTR)
+        {
+            return detail::image_constructor<CLImage>::construct(c.context, dims, flags, hostPtr);
+        }
+
+        typedef detail::pooled_image<CLImage> pooled;
+        DeviceImagePool::key_type const key = detail::pool_key(dims);
+
+        CLImage image;
+        if (c.imagePool && c.imagePool->reuse(key, flags, image))
+        {
+            if (hostPtr)
+            {
+                pooled::write(c.queue, image, key, hostPtr);
+            }
+            return image;
+        }
+
+        image = detail::image_constructor<CLImage>::construct(c.context, dims, flags, hostPtr);
+        countDeviceAllocation(key[0] * key[1] * key[2] * sizeof(cl_float4));
+
+        if (c.imagePool)
+        {
+            c.imagePool->add(key, flags, image);
+        }
+        return image;
     }
 
     namespace detail
@@ -342,6 +869,24 @@ namespace DynamiCL
         return dims;
     }
 
+    /**
+     * Buffer images carry their dimensions with them
+     */
+    template <size_t N>
+    std::array<size_t, N>
+    getDims(BufferImage<N> const& image)
+    {
+        return image.dims;
+    }
+
+    /**
+     * Round @a n up to the nearest multiple of @a multiple
+     */
+    inline size_t roundUp(size_t n, size_t multiple)
+    {
+        return ((n + multiple - 1) / multiple) * multiple;
+    }
+
     inline cl::NDRange toNDRange(std::array<size_t, 1> dims)
     {
         return cl::NDRange(dims[0]);
@@ -33,6 +33,7 @@ namespace DynamiCL
         struct dimension_traits<2>
         {
             typedef cl::Image2D climage_type;
+            typedef BufferImage2D buffer_type;
         };
 
         template <>
@@ -63,15 +64,77 @@ namespace DynamiCL
     /**
      * Takes an image currently on the host, and transforms
      * it inplace using an OpenCL kernel.
+     *
+     * The image is stored on the device as the context prefers, so
+     * @a kernel must come from the matching kernel file.
      */
     template <typename PixType, size_t N>
     void processImageInPlace(HostImageView<PixType, N>&& image,
                               Kernel const& kernel,
                               ComputeContext const& context)
     {
-        makePendingImage<typename detail::dimension_traits<N>::climage_type>(context, image)
-            .process(kernel)
-            .readInto(image.rawData());
+        // in zero-copy mode, the input image is over the memory the result
+        // goes to, so it is released before the host writes there
+        if (context.storage == ImageStorage::BUFFER)
+        {
+            auto result = makePendingImage<typename detail::dimension_traits<N>::buffer_type>(context, image)
+                .process(kernel);
+            result.readInto(image.rawData());
+        }
+        else
+        {
+            auto result = makePendingImage<typename detail::dimension_traits<N>::climage_type>(context, image)
+                .process(kernel);
+            result.readInto(image.rawData());
+        }
+    }
+
+    namespace detail
+    {
+
+        template <typename CLImage, typename PixType, size_t N>
+        void process_image_into(HostImageView<PixType, N> const& image,
+                                Kernel const& kernel,
+                                ComputeContext const& context,
+                                HostImageView<PixType, N>& dest)
+        {
+            PendingImage<CLImage> input = makePendingImage<CLImage>(context, image);
+
+            // with zero-copy, the kernel writes straight into dest, and
+            // reading it is only a matter of mapping it
+            if (sharesHostMemory(context, dest.rawData()))
+            {
+                input.process(kernel, createCLImage<CLImage>(context, dest.dimensions(),
+                                                             dest.rawData()))
+                     .readInto(dest.rawData());
+                return;
+            }
+
+            input.process(kernel).readInto(dest.rawData());
+        }
+
+    }
+
+    /**
+     * Like processImageInPlace, but writes the result into @a dest,
+     * which must have the dimensions of @a image.
+     */
+    template <typename PixType, size_t N>
+    void processImageInto(HostImageView<PixType, N> const& image,
+                          Kernel const& kernel,
+                          ComputeContext const& context,
+                          HostImageView<PixType, N>& dest)
+    {
+        if (context.storage == ImageStorage::BUFFER)
+        {
+            detail::process_image_into<typename detail::dimension_traits<N>::buffer_type>(
+                    image, kernel, context, dest);
+        }
+        else
+        {
+            detail::process_image_into<typename detail::dimension_traits<N>::climage_type>(
+                    image, kernel, context, dest);
+        }
     }
 
     template <typename PixType, typename CLImage>
@@ -7,8 +7,11 @@
 #include <type_traits>
 #include <cassert>
 #include <memory>
+#include <numeric>
+#include <vector>
 
 #include "utils.h"
+#include "parallel.hpp"
 
 namespace DynamiCL
 {
@@ -353,7 +356,7 @@ namespace DynamiCL
                                 subimage.dimensions().end(),
                                 view().dimensions().begin() ) );
 
-            writePtr = std::copy( subimage.begin(), subimage.end(), writePtr );
+            writePtr = parallelCopy( subimage.begin(), subimage.end(), writePtr );
         }
     }
 
@@ -0,0 +1,485 @@
+#include "host_pyramid.h"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+    using namespace DynamiCL;
+
+    // a whole pixel in one SIMD register, through the vector extensions of
+    // GCC, which map to SSE or NEON depending on the target
+    typedef float float4_t __attribute__ ((vector_size (16)));
+
+    // same as sampling_kernel in the kernel files
+    float const s_samplingKernel[5] = {
+        01.f/16.f, 04.f/16.f, 06.f/16.f, 04.f/16.f, 01.f/16.f
+    };
+
+    inline float4_t splat(float f)
+    {
+        float4_t v = { f, f, f, f };
+        return v;
+    }
+
+    inline float4_t load(host_pixel_type const& pixel)
+    {
+        float4_t v;
+        std::memcpy(&v, pixel.components, sizeof(v));
+        return v;
+    }
+
+    inline void store(host_pixel_type& pixel, float4_t v)
+    {
+        std::memcpy(pixel.components, &v, sizeof(v));
+    }
+
+    /**
+     * A packed image, whose reads clamp to the edge like the kernels' do
+     */
+    struct Plane
+    {
+        host_pixel_type* data;
+        long width;
+        long height;
+
+        Plane(host_pixel_type* data, size_t width, size_t height)
+            : data(data), width(width), height(height)
+        { }
+
+        explicit Plane(host_view_type& view)
+            : data(view.begin()), width(view.width()), height(view.height())
+        { }
+
+        // only ever read from
+        explicit Plane(host_view_type const& view)
+            : data(const_cast<host_pixel_type*>(view.begin())),
+              width(view.width()),
+              height(view.height())
+        { }
+
+        float4_t read(long x, long y) const
+        {
+            x = std::min(std::max(x, 0L), width - 1);
+            y = std::min(std::max(y, 0L), height - 1);
+            return load(data[y * width + x]);
+        }
+
+        void write(long x, long y, float4_t v)
+        {
+            store(data[y * width + x], v);
+        }
+    };
+
+    /**
+     * Downsample @a input into @a output along (@a dx, @a dy), which is
+     * (1,0) for rows and (0,1) for columns.
+     */
+    void downsample(Plane const& input, Plane& output, long dx, long dy)
+    {
+        for (long y = 0; y < output.height; ++y)
+        {
+            for (long x = 0; x < output.width; ++x)
+            {
+                long inX = x * (1 + dx);
+                long inY = y * (1 + dy);
+
+                float4_t sample = splat(0.0f);
+                for (long k = -2; k < 3; ++k)
+                {
+                    sample += input.read(inX + dx * k, inY + dy * k) * splat(s_samplingKernel[2+k]);
+                }
+                output.write(x, y, sample);
+            }
+        }
+    }
+
+    /**
+     * Value of pixel (@a x, @a y) of @a input upsampled along (@a dx, @a dy)
+     */
+    inline float4_t upsampledPixel(Plane const& input, long x, long y, long dx, long dy)
+    {
+        long inX = x / (1 + dx);
+        long inY = y / (1 + dy);
+        bool odd = (dx ? x : y) & 1;
+
+        float4_t in1 = input.read(inX, inY);
+        float4_t in2 = input.read(inX + dx, inY + dy);
+
+        if (odd)
+        {
+            return (   in1 * splat(s_samplingKernel[1])
+                     + in2 * splat(s_samplingKernel[1]))
+                   * splat(2.0f);
+        }
+
+        float4_t in0 = input.read(inX - dx, inY - dy);
+        return (   in0 * splat(s_samplingKernel[0])
+                 + in1 * splat(s_samplingKernel[2])
+                 + in2 * splat(s_samplingKernel[0]))
+               * splat(2.0f);
+    }
+
+    // same as discreet_laplacian in the kernel files
+    float const s_discreteLaplacian[3][3] = {
+        { 0.5f/6.f, 1.f/6.f, 0.5f/6.f },
+        {  1.f/6.f,   -1.f,   1.f/6.f },
+        { 0.5f/6.f, 1.f/6.f, 0.5f/6.f }
+    };
+
+    /**
+     * Quality measures of pixel @a x of the middle one of three @a rows
+     * of @a width pixels, as quality_measures in the kernel files computes
+     * them: contrast, saturation and exposedness
+     */
+    float4_t qualityMeasures(host_pixel_type const* const rows[3], long width, long x)
+    {
+        float4_t laplacian = splat(0.0f);
+        for (long i = -1; i < 2; ++i)
+        {
+            long sx = std::min(std::max(x + i, 0L), width - 1);
+            for (long j = -1; j < 2; ++j)
+            {
+                laplacian += load(rows[1+j][sx]) * splat(s_discreteLaplacian[1+i][1+j]);
+            }
+        }
+
+        float4_t pixel = load(rows[1][x]);
+        float4_t measures = splat(0.0f);
+
+        measures[0] = std::sqrt(  laplacian[0] * laplacian[0] + laplacian[1] * laplacian[1]
+                                + laplacian[2] * laplacian[2] + laplacian[3] * laplacian[3]);
+
+        float mean = (pixel[0] + pixel[1] + pixel[2]) / 3.0f;
+        float meanOfSquared = (pixel[0] * pixel[0] + pixel[1] * pixel[1] + pixel[2] * pixel[2]) / 3.0f;
+        measures[1] = std::sqrt(std::fabs(meanOfSquared - mean * mean));
+
+        // sigma^2 * 2, where sigma = 0.2
+        float const denominator = 0.08f;
+        for (int c = 0; c < 3; ++c)
+        {
+            float d = pixel[c] - 0.5f;
+            measures[2] += std::exp(-(d * d) / denominator);
+        }
+
+        return measures;
+    }
+
+    void upsample(Plane const& input, Plane& output, long dx, long dy)
+    {
+        for (long y = 0; y < output.height; ++y)
+        {
+            for (long x = 0; x < output.width; ++x)
+            {
+                output.write(x, y, upsampledPixel(input, x, y, dx, dy));
+            }
+        }
+    }
+}
+
+namespace DynamiCL
+{
+
+    void buildHostLevels(std::vector<host_view_type>& levels)
+    {
+        std::vector<host_pixel_type> scratch;
+
+        for (size_t level = 0; level + 1 < levels.size(); ++level)
+        {
+            Plane gaussian(levels[level]);
+            Plane lower(levels[level+1]);
+
+            // image with halved rows, later reused for upsampled columns
+            scratch.resize(lower.width * gaussian.height);
+            Plane rows(scratch.data(), lower.width, gaussian.height);
+
+            downsample(gaussian, rows, 1, 0);
+            downsample(rows, lower, 0, 1);
+            upsample(lower, rows, 0, 1);
+
+            // upsample rows on the fly while creating the laplacian
+            for (long y = 0; y < gaussian.height; ++y)
+            {
+                for (long x = 0; x < gaussian.width; ++x)
+                {
+                    float4_t o = gaussian.read(x, y);
+                    float4_t l = o - upsampledPixel(rows, x, y, 1, 0);
+                    l[3] = o[3]; // preserve original alpha
+
+                    gaussian.write(x, y, l);
+                }
+            }
+        }
+    }
+
+    void collapseHostLevels(std::vector<host_view_type>& levels)
+    {
+        if (levels.empty())
+        {
+            return;
+        }
+
+        std::vector<host_pixel_type> scratch;
+
+        // start from the smallest level
+        for (size_t level = levels.size() - 1; level-- > 0; )
+        {
+            Plane lower(levels[level+1]);
+            Plane upper(levels[level]);
+
+            scratch.resize(lower.width * upper.height);
+            Plane columns(scratch.data(), lower.width, upper.height);
+
+            upsample(lower, columns, 0, 1);
+
+            for (long y = 0; y < upper.height; ++y)
+            {
+                for (long x = 0; x < upper.width; ++x)
+                {
+                    float4_t c = upsampledPixel(columns, x, y, 1, 0) + upper.read(x, y);
+                    // as collapse_level does on the device
+                    for (int i = 0; i < 4; ++i)
+                    {
+                        c[i] = std::min(std::max(c[i], 0.0f), 1.0f);
+                    }
+
+                    upper.write(x, y, c);
+                }
+            }
+        }
+    }
+
+    void fuseHostLevel(host_fuse_view_type const& array, host_view_type& dest,
+                       std::vector<Translation> const& offsets)
+    {
+        size_t const layerSize = dest.totalSize();
+        size_t const depth = array.depth();
+
+        host_pixel_type const* layers = array.begin();
+        host_pixel_type* fused = dest.begin();
+
+        if (!offsets.empty())
+        {
+            long const width = dest.width();
+            long const height = dest.height();
+
+            for (long y = 0; y < height; ++y)
+            {
+                for (long x = 0; x < width; ++x)
+                {
+                    float4_t acc = splat(0.0f);
+                    float weightSum = 0.0f;
+
+                    for (size_t layer = 0; layer < depth; ++layer)
+                    {
+                        long sx = std::min(std::max(x + offsets[layer].x, 0L), width - 1);
+                        long sy = std::min(std::max(y + offsets[layer].y, 0L), height - 1);
+                        float4_t pix = load(layers[layer * layerSize + sy * width + sx]);
+
+                        weightSum += pix[3];
+                        acc += pix * splat(pix[3]);
+                    }
+
+                    store(fused[y * width + x], acc / splat(weightSum));
+                }
+            }
+            return;
+        }
+
+        for (size_t i = 0; i < layerSize; ++i)
+        {
+            float4_t acc = splat(0.0f);
+            float weightSum = 0.0f; // sum of all weights in alpha channel
+
+            for (size_t layer = 0; layer < depth; ++layer)
+            {
+                float4_t pix = load(layers[layer * layerSize + i]);
+
+                weightSum += pix[3];
+                acc += pix * splat(pix[3]);
+            }
+
+            store(fused[i], acc / splat(weightSum));
+        }
+    }
+
+    void buildGaussianHostLevels(std::vector<host_view_type>& levels)
+    {
+        std::vector<host_pixel_type> scratch;
+
+        for (size_t level = 0; level + 1 < levels.size(); ++level)
+        {
+            Plane upper(levels[level]);
+            Plane lower(levels[level+1]);
+
+            scratch.resize(lower.width * upper.height);
+            Plane rows(scratch.data(), lower.width, upper.height);
+
+            downsample(upper, rows, 1, 0);
+            downsample(rows, lower, 0, 1);
+        }
+    }
+
+    void weighHostLevel(host_view_type const& measures,
+                        std::array<float, 3> const& weights,
+                        host_view_type& level)
+    {
+        float4_t const w = { weights[0], weights[1], weights[2], 0.0f };
+
+        host_pixel_type const* in = measures.begin();
+        host_pixel_type* out = level.begin();
+        size_t const numPixels = level.totalSize();
+
+        for (size_t i = 0; i < numPixels; ++i)
+        {
+            float4_t weighted = load(in[i]) * w;
+            out[i].a = weighted[0] + weighted[1] + weighted[2];
+        }
+    }
+
+    void measureHostLevel(host_view_type const& image, host_view_type& measures)
+    {
+        long const width = image.width();
+        long const height = image.height();
+        host_pixel_type const* in = image.begin();
+        host_pixel_type* out = measures.begin();
+
+        for (long y = 0; y < height; ++y)
+        {
+            host_pixel_type const* rows[3] = {
+                in + std::max(y - 1, 0L) * width,
+                in + y * width,
+                in + std::min(y + 1, height - 1) * width
+            };
+            for (long x = 0; x < width; ++x)
+            {
+                store(out[y * width + x], qualityMeasures(rows, width, x));
+            }
+        }
+    }
+
+    void downsampleHostRow(host_pixel_type const* row, size_t width, host_pixel_type* out)
+    {
+        Plane input(const_cast<host_pixel_type*>(row), width, 1);
+        Plane output(out, (width + 1) / 2, 1);
+        downsample(input, output, 1, 0);
+    }
+
+    void downsampleHostColumn(std::array<host_pixel_type const*, 5> const& rows,
+                              size_t width,
+                              host_pixel_type* out)
+    {
+        for (size_t x = 0; x < width; ++x)
+        {
+            float4_t sample = splat(0.0f);
+            for (size_t k = 0; k < 5; ++k)
+            {
+                sample += load(rows[k][x]) * splat(s_samplingKernel[k]);
+            }
+            store(out[x], sample);
+        }
+    }
+
+    void upsampleHostColumn(std::array<host_pixel_type const*, 3> const& rows,
+                            bool odd,
+                            size_t width,
+                            host_pixel_type* out)
+    {
+        for (size_t x = 0; x < width; ++x)
+        {
+            float4_t in0 = load(rows[0][x]);
+            float4_t in1 = load(rows[1][x]);
+            float4_t in2 = load(rows[2][x]);
+
+            // same as upsampledPixel, along columns
+            if (odd)
+            {
+                store(out[x], (   in1 * splat(s_samplingKernel[1])
+                                + in2 * splat(s_samplingKernel[1]))
+                              * splat(2.0f));
+            }
+            else
+            {
+                store(out[x], (   in0 * splat(s_samplingKernel[0])
+                                + in1 * splat(s_samplingKernel[2])
+                                + in2 * splat(s_samplingKernel[0]))
+                              * splat(2.0f));
+            }
+        }
+    }
+
+    void upsampleHostRow(host_pixel_type const* row, size_t width,
+                         host_pixel_type* out, size_t outWidth)
+    {
+        Plane input(const_cast<host_pixel_type*>(row), width, 1);
+        for (size_t x = 0; x < outWidth; ++x)
+        {
+            store(out[x], upsampledPixel(input, x, 0, 1, 0));
+        }
+    }
+
+    void weighHostRow(std::array<host_pixel_type const*, 3> const& rows,
+                      size_t width,
+                      std::array<float, 3> const& weights,
+                      host_pixel_type* out)
+    {
+        float4_t const w = { weights[0], weights[1], weights[2], 0.0f };
+        host_pixel_type const* const planeRows[3] = { rows[0], rows[1], rows[2] };
+
+        for (size_t x = 0; x < width; ++x)
+        {
+            float4_t weighted = qualityMeasures(planeRows, width, x) * w;
+            out[x] = rows[1][x];
+            out[x].a = weighted[0] + weighted[1] + weighted[2];
+        }
+    }
+
+    void downscaleHostImage(host_view_type const& input, host_view_type& output)
+    {
+        long const outWidth = output.width();
+        long const outHeight = output.height();
+
+        Plane source(input);
+        if (source.width == outWidth && source.height == outHeight)
+        {
+            parallelCopy(input.begin(), input.end(), output.begin());
+            return;
+        }
+
+        // levels in between alternate between two buffers. they are kept
+        // per thread, so that downscaling a sequence of images of the same
+        // size only allocates them for the first.
+        thread_local std::vector<host_pixel_type> rows;
+        thread_local std::vector<host_pixel_type> levels[2];
+        size_t current = 0;
+
+        while (source.width != outWidth || source.height != outHeight)
+        {
+            long width = (source.width + 1) / 2;
+            long height = (source.height + 1) / 2;
+            if (width < outWidth || height < outHeight)
+            {
+                throw std::invalid_argument("Output dimensions are not those of a level of the input image.");
+            }
+
+            rows.resize(width * source.height);
+            Plane halfRows(rows.data(), width, source.height);
+            downsample(source, halfRows, 1, 0);
+
+            Plane lower(output);
+            if (width != outWidth || height != outHeight)
+            {
+                levels[current].resize(width * height);
+                lower = Plane(levels[current].data(), width, height);
+                current = 1 - current;
+            }
+            downsample(halfRows, lower, 0, 1);
+
+            source = lower;
+        }
+    }
+
+}
@@ -0,0 +1,130 @@
+#ifndef HOST_PYRAMID_H_W4FJ2LQE
+#define HOST_PYRAMID_H_W4FJ2LQE
+
+#include <array>
+#include <vector>
+
+#include "alignment.h"
+#include "host_image.hpp"
+
+namespace DynamiCL
+{
+
+    /**
+     * Host implementations of the pyramid operations, for levels too small
+     * to be worth a round trip to the device. They compute exactly what the
+     * kernels compute, one float4 pixel per SIMD register.
+     *
+     * Levels go from largest to smallest, and each is half the size of the
+     * previous one, rounded up.
+     */
+    typedef RGBA<float> host_pixel_type;
+    typedef HostImageView<host_pixel_type, 2> host_view_type;
+    typedef HostImageView<host_pixel_type, 3> host_fuse_view_type;
+
+    /**
+     * Build a pyramid in @a levels, whose first level holds a gaussian
+     * image. Leaves laplacians in all but the last level, which gets the
+     * smallest gaussian.
+     */
+    void buildHostLevels(std::vector<host_view_type>& levels);
+
+    /**
+     * Collapse the pyramid in @a levels into its first level, in place.
+     * The last level has to hold a gaussian image.
+     */
+    void collapseHostLevels(std::vector<host_view_type>& levels);
+
+    /**
+     * Fuse the layers of @a array, weighted by their alpha, into @a dest.
+     * If @a offsets are given, one per layer, each layer is read translated
+     * by its offset, clamping to its edges like the fuse_level_aligned
+     * kernel does.
+     */
+    void fuseHostLevel(host_fuse_view_type const& array, host_view_type& dest,
+                       std::vector<Translation> const& offsets = std::vector<Translation>());
+
+    /**
+     * Downsample @a input into @a output, halving it as many times as it
+     * takes to reach the dimensions of @a output. Gives the gaussian of
+     * the corresponding level of a pyramid built from @a input.
+     *
+     * @throws std::invalid_argument if @a output does not have the
+     * dimensions of any such level.
+     */
+    void downscaleHostImage(host_view_type const& input, host_view_type& output);
+
+    /**
+     * Build a gaussian pyramid in @a levels, whose first level holds the
+     * source image. Every level gets the downsampled previous one.
+     */
+    void buildGaussianHostLevels(std::vector<host_view_type>& levels);
+
+    /**
+     * Set the alpha of every pixel of @a level to the sum of its quality
+     * @a measures (contrast, saturation, exposedness), multiplied by the
+     * matching @a weights. Along with buildGaussianHostLevels, this gives
+     * the weights a pyramid would have had, had it been built from an
+     * image whose quality came from those weights.
+     */
+    void weighHostLevel(host_view_type const& measures,
+                        std::array<float, 3> const& weights,
+                        host_view_type& level);
+
+    /**
+     * Write the quality measures of every pixel of @a image (contrast,
+     * saturation, exposedness) into the colour channels of @a measures,
+     * like the compute_measures kernel does.
+     */
+    void measureHostLevel(host_view_type const& image, host_view_type& measures);
+
+    /*
+     * Row by row versions of the operations above, for images that are
+     * processed a few rows at a time (see BandMerge). Rows are packed
+     * pixels. Rows around the one computed are passed top to bottom, with
+     * those beyond the image clamped to its edge, and the results are
+     * those of the whole image operations.
+     */
+
+    /**
+     * Halve @a row of @a width pixels into @a out, of halveDimension(width)
+     * pixels
+     */
+    void downsampleHostRow(host_pixel_type const* row, size_t width, host_pixel_type* out);
+
+    /**
+     * Downsample the five @a rows, of @a width pixels, around row 2y of an
+     * image into row y of @a out
+     */
+    void downsampleHostColumn(std::array<host_pixel_type const*, 5> const& rows,
+                              size_t width,
+                              host_pixel_type* out);
+
+    /**
+     * Upsample the three @a rows, of @a width pixels, around row y/2 of an
+     * image into row y of @a out, @a odd telling whether y is
+     */
+    void upsampleHostColumn(std::array<host_pixel_type const*, 3> const& rows,
+                            bool odd,
+                            size_t width,
+                            host_pixel_type* out);
+
+    /**
+     * Double @a row of @a width pixels into @a out, of @a outWidth pixels
+     */
+    void upsampleHostRow(host_pixel_type const* row, size_t width,
+                         host_pixel_type* out, size_t outWidth);
+
+    /**
+     * Copy the middle one of three @a rows of @a width pixels into @a out,
+     * setting the alpha of each pixel to its quality measures multiplied
+     * by @a weights, like measureHostLevel and weighHostLevel together do
+     */
+    void weighHostRow(std::array<host_pixel_type const*, 3> const& rows,
+                      size_t width,
+                      std::array<float, 3> const& weights,
+                      host_pixel_type* out);
+
+}
+
+#endif /* end of include guard: HOST_PYRAMID_H_W4FJ2LQE */
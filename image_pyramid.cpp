@@ -1,27 +1,79 @@
 #include "image_pyramid.h"
 #include "cl_utils.h"
+#include "host_pyramid.h"
 #include "save_image.h"
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 
+namespace
+{
+    template <typename View>
+    size_t viewBytes(View const& view)
+    {
+        return view.totalSize() * sizeof(*view.begin());
+    }
+}
 
 namespace DynamiCL
 {
-    void ImagePyramid::initPyramid( NextLevelFunc const& createNext )
+    template <typename CLImage>
+    void ImagePyramid::initPyramid( NextLevelFunc<CLImage> const& createNext,
+                                    BuildSmallLevelsFunc<CLImage> const& buildSmall,
+                                    size_t hostLevelPixels )
     {
-        Pending2DImage image = makePendingImage<climage_type>(context_, views_[0]);
+        // the device builds levels up to the first host level, which it
+        // only reads back as a gaussian, for the host to carry on from
+        size_t firstHost = firstHostLevel(views_, hostLevelPixels);
+        if (firstHost == 0)
+        {
+            buildHostLevels(views_);
+            return;
+        }
+        size_t deviceEnd = std::min(firstHost + 1, views_.size());
+
+        PendingImage<CLImage> image = makePendingImage<CLImage>(context_, views_[0]);
+        bool builtSmall = false;
+
+        // levels are read back while the device carries on with the next
+        EventList reads;
 
         // create levels one at a time
-        for (size_t level = 1; level < views_.size(); ++level)
+        for (size_t level = 1; level < deviceEnd; ++level)
         {
-            LevelPair pair = createNext(image);
+            // build the remaining small levels all at once
+            if (buildSmall && isSmallLevel(views_[level-1]))
+            {
+                std::vector<view_type> smallLevels(views_.begin() + (level-1),
+                                                   views_.begin() + deviceEnd);
+                buildSmall(image, smallLevels);
+                builtSmall = true;
+                break;
+            }
 
-            pair.upper.readInto(views_[level-1].rawData());
+            // the source image may be over the memory of the first level
+            // already, and commands on images over the same memory are
+            // undefined, so only the other levels are created over theirs
+            LevelPair<CLImage> pair = createNext(image, level > 1 ? views_[level-1].rawData()
+                                                                  : nullptr);
+
+            reads.push_back(pair.upper.readIntoAsync(views_[level-1].rawData()));
 
             image = std::move(pair.lower);
         }
 
-        image.readInto(views_.back().rawData()); // read last level
+        if (!builtSmall)
+        {
+            // read last device level
+            reads.push_back(image.readIntoAsync(views_[deviceEnd-1].rawData()));
+        }
+        waitForEvents(reads);
+
+        if (deviceEnd < views_.size())
+        {
+            std::vector<view_type> hostLevels(views_.begin() + (deviceEnd-1), views_.end());
+            buildHostLevels(hostLevels);
+        }
 
         //for (size_t level = 0; level < views_.size(); ++level)
         //{
@@ -51,58 +103,21 @@ namespace DynamiCL
                                           
     //}
 
-    ImagePyramid::ImagePyramid( ComputeContext const& context,
+    template <typename CLImage>
+    ImagePyramid ImagePyramid::build( ComputeContext const& context,
               std::vector<view_type>&& levelViews,
-              NextLevelFunc const& createNext)
-        : context_(context),
-          views_(std::move(levelViews))
-    {
-        initPyramid(createNext);
-    }
-
-    void ImagePyramid::collapseInto(CollapseLevelFunc collapseLevel,
-            view_type& dest)
+              NextLevelFunc<CLImage> const& createNext,
+              BuildSmallLevelsFunc<CLImage> const& buildSmall,
+              size_t hostLevelPixels)
     {
-        //std::vector<image_type> levels = this->releaseLevels();
-        std::vector<view_type> levels = std::move(views_);
-
-        // extracts next level
-        auto nextLevel =
-            [&]() -> view_type
-            {
-                if (levels.empty())
-                {
-                    return view_type();
-                }
-                view_type i = std::move(levels.back());
-                levels.pop_back();
-                return i;
-            };
-
-        auto lower = nextLevel();
-        Pending2DImage result = makePendingImage<climage_type>(context_, lower);
-        auto upper = nextLevel();
-
-        // keep collapsing layers
-        while(upper.valid())
-        {
-            Pending2DImage u = makePendingImage<climage_type>(context_, upper);
-            // create pair to pass to the collapser
-            LevelPair pair {std::move(u), std::move(result)};
-
-            // collapse using passed function
-            result = collapseLevel(pair);
-
-            // save upper layer for later
-            lower = std::move(upper);
-            upper = nextLevel();
-        }
-
-        result.readInto(dest.rawData());
+        ImagePyramid pyramid(context, std::move(levelViews));
+        pyramid.initPyramid(createNext, buildSmall, hostLevelPixels);
+        return pyramid;
     }
 
+    template <typename CLImage>
     ImagePyramid ImagePyramid::fuse(std::vector<ImagePyramid>& pyramids,
-                                    FuseLevelsFunc fuseLevels)
+                                    FuseLevelsFunc<CLImage> fuseLevels)
     {
         size_t numPyramids = pyramids.size();
         assert (numPyramids > 1); // need to merge more than one
@@ -177,8 +192,9 @@ namespace DynamiCL
             HostImage<pixel_type, 3> levelArray(singleLevel);
             singleLevel.clear(); // deallocate subimages
 
-            Pending2DImageArray clarray =
-                makePendingImage<cl::Image2DArray>(context, levelArray.view());
+            auto clarray =
+                makePendingImage<typename detail::image_traits<CLImage>::array_type>(
+                        context, levelArray.view());
 
             //std::stringstream sstr;
             //sstr << "level_test" << level << ".tiff";
@@ -191,7 +207,7 @@ namespace DynamiCL
                       << dims[1] << " x "
                       << dims[2] << std::endl;
 
-            Pending2DImage fused = fuseLevels(clarray);
+            PendingImage<CLImage> fused = fuseLevels(clarray, level);
 
             fused.readInto(fusedPyramid.views_[level].rawData());
             //fusedLevels.push_back(makeHostImage<RGBA<float>>(fused));
@@ -202,38 +218,114 @@ namespace DynamiCL
         return fusedPyramid;
     }
 
-    void ImagePyramid::fuseInto(ComputeContext const& context,
+    size_t ImagePyramid::fuseHostAndSmallLevels(std::vector<fuse_view_type>& fuseViews,
+                                                std::vector<view_type>& dest,
+                                                FuseSmallLevelsFunc const& fuseSmall,
+                                                size_t hostLevelPixels,
+                                                std::vector<Translation> const& shifts)
+    {
+        size_t numLevels = firstHostLevel(fuseViews, hostLevelPixels);
+
+        // fuse the host levels right where they are
+        std::vector<Translation> levelShifts(shifts.size());
+        for (size_t level = numLevels; level < fuseViews.size(); ++level)
+        {
+            for (size_t i = 0; i < shifts.size(); ++i)
+            {
+                levelShifts[i] = shifts[i].atLevel(level);
+            }
+            fuseHostLevel(fuseViews[level], dest[level], levelShifts);
+        }
+
+        // fuse all the small levels at once, leaving the rest
+        size_t firstSmall = std::min(firstSmallLevel(fuseViews), numLevels);
+        if (fuseSmall && shifts.empty() && numLevels - firstSmall > 1)
+        {
+            std::vector<fuse_view_type> smallArrays(fuseViews.begin() + firstSmall,
+                                                    fuseViews.begin() + numLevels);
+            std::vector<view_type> smallDest(dest.begin() + firstSmall, dest.begin() + numLevels);
+            fuseSmall(smallArrays, smallDest);
+
+            numLevels = firstSmall;
+        }
+
+        return numLevels;
+    }
+
+    template <typename CLImage>
+    void ImagePyramid::fuseCollapseInto(ComputeContext const& context,
                      std::vector<fuse_view_type>& fuseViews,
-                     FuseLevelsFunc const& fuseLevel, 
-                     std::vector<view_type>& dest)
+                     FuseLevelsFunc<CLImage> const& fuseLevel,
+                     FuseCollapseLevelFunc<CLImage> const& fuseCollapseLevel,
+                     std::vector<view_type>& levels,
+                     view_type& dest,
+                     FuseSmallLevelsFunc const& fuseSmall,
+                     CollapseSmallLevelsFunc<CLImage> const& collapseSmall,
+                     size_t hostLevelPixels,
+                     std::vector<Translation> const& shifts)
     {
-        size_t numLevels = fuseViews.size();
-        // fuse all levels
-        //for (auto& fuseView : fuseViews)
-        for (size_t level = 0; level < numLevels; ++level)
+        typedef typename detail::image_traits<CLImage>::array_type array_type;
+
+        size_t numLevels = fuseHostAndSmallLevels(fuseViews, levels,
+                                                  collapseSmall ? fuseSmall : FuseSmallLevelsFunc(),
+                                                  hostLevelPixels, shifts);
+        size_t const firstHost = firstHostLevel(fuseViews, hostLevelPixels);
+
+        // collapse the levels fused so far. the host levels are collapsed
+        // first, and the result takes their place as the last level.
+        std::vector<view_type> coarse(levels.begin() + numLevels, levels.end());
+        if (firstHost < levels.size())
         {
-            // create a pending image array from fuse view
-            Pending2DImageArray clarray =
-                makePendingImage<cl::Image2DArray>(context, fuseViews[level]);
+            std::vector<view_type> hostLevels(coarse.begin() + (firstHost - numLevels), coarse.end());
+            collapseHostLevels(hostLevels);
 
-            //std::stringstream sstr;
-            //sstr << "level_test" << level << ".tiff";
-            ////saveTiff16(makeHostImage<RGBA<float>>(fused), sstr.str());
-            //saveTiff16(image_type(std::move(levelArray)).view(), sstr.str());
+            if (firstHost == 0)
+            {
+                std::copy(hostLevels.front().begin(), hostLevels.front().end(), dest.begin());
+                return;
+            }
+            coarse.erase(coarse.begin() + (firstHost - numLevels + 1), coarse.end());
+        }
 
-            auto dims = clarray.dimensions();
-            std::cout << "Dimensions: "
-                      << dims[0] << " x "
-                      << dims[1] << " x "
-                      << dims[2] << std::endl;
+        PendingImage<CLImage> result(context);
+        if (coarse.size() > 1)
+        {
+            result = collapseSmall(coarse);
+        }
+        else if (!coarse.empty())
+        {
+            result = makePendingImage<CLImage>(context, coarse.front());
+        }
+        else
+        {
+            // the smallest level is a gaussian, with nothing below it
+            --numLevels;
+            auto clarray = makePendingImage<array_type>(context, fuseViews[numLevels]);
+            result = fuseLevel(clarray, numLevels);
+        }
 
-            Pending2DImage fused = fuseLevel(clarray);
+        for (size_t level = numLevels; level > 0; )
+        {
+            --level;
 
-            fused.readInto(dest[level].rawData());
-            //fusedLevels.push_back(makeHostImage<RGBA<float>>(fused));
+            // read the next level of spilled pyramids in while this one is
+            // uploaded, and let go of the previous one
+            if (level > 0)
+            {
+                prefetchPages(fuseViews[level-1].rawData(), viewBytes(fuseViews[level-1]));
+            }
+            if (level + 1 < fuseViews.size())
+            {
+                retirePages(fuseViews[level+1].rawData(), viewBytes(fuseViews[level+1]));
+            }
+
+            auto clarray = makePendingImage<array_type>(context, fuseViews[level]);
+            result = fuseCollapseLevel(clarray, result, level);
         }
 
-        std::cout << "Fused " << numLevels << " levels" << std::endl;
+        result.readInto(dest.rawData());
+
+        std::cout << "Fused and collapsed " << numLevels << " levels" << std::endl;
     }
 
     std::vector<ImagePyramid::view_type> ImagePyramid::createPyramidViews(
@@ -281,5 +373,49 @@ namespace DynamiCL
         return numPixels;
     }
 
+    /***************************************************************************
+     *                    Instantiations for each storage                      *
+     ***************************************************************************/
+
+    template ImagePyramid ImagePyramid::build<cl::Image2D>(
+            ComputeContext const&,
+            std::vector<view_type>&&,
+            NextLevelFunc<cl::Image2D> const&,
+            BuildSmallLevelsFunc<cl::Image2D> const&,
+            size_t);
+    template ImagePyramid ImagePyramid::fuse<cl::Image2D>(
+            std::vector<ImagePyramid>&, FuseLevelsFunc<cl::Image2D>);
+    template void ImagePyramid::fuseCollapseInto<cl::Image2D>(
+            ComputeContext const&,
+            std::vector<fuse_view_type>&,
+            FuseLevelsFunc<cl::Image2D> const&,
+            FuseCollapseLevelFunc<cl::Image2D> const&,
+            std::vector<view_type>&,
+            view_type&,
+            FuseSmallLevelsFunc const&,
+            CollapseSmallLevelsFunc<cl::Image2D> const&,
+            size_t,
+            std::vector<Translation> const&);
+
+    template ImagePyramid ImagePyramid::build<BufferImage2D>(
+            ComputeContext const&,
+            std::vector<view_type>&&,
+            NextLevelFunc<BufferImage2D> const&,
+            BuildSmallLevelsFunc<BufferImage2D> const&,
+            size_t);
+    template ImagePyramid ImagePyramid::fuse<BufferImage2D>(
+            std::vector<ImagePyramid>&, FuseLevelsFunc<BufferImage2D>);
+    template void ImagePyramid::fuseCollapseInto<BufferImage2D>(
+            ComputeContext const&,
+            std::vector<fuse_view_type>&,
+            FuseLevelsFunc<BufferImage2D> const&,
+            FuseCollapseLevelFunc<BufferImage2D> const&,
+            std::vector<view_type>&,
+            view_type&,
+            FuseSmallLevelsFunc const&,
+            CollapseSmallLevelsFunc<BufferImage2D> const&,
+            size_t,
+            std::vector<Translation> const&);
+
 } /* DynamiCL */ 
 
@@ -1,6 +1,7 @@
 #ifndef IMAGE_PYRAMID_H_ZSOHJD6F
 #define IMAGE_PYRAMID_H_ZSOHJD6F
 
+#include "alignment.h"
 #include "utils.h"
 #include "cl_common.h"
 #include "pending_image.h"
@@ -32,10 +33,11 @@ namespace DynamiCL
         /**
          * An image pair, of two levels of a pyramid
          */
+        template <typename CLImage>
         struct LevelPair
         {
-            Pending2DImage upper;
-            Pending2DImage lower;
+            PendingImage<CLImage> upper;
+            PendingImage<CLImage> lower;
         };
 
         /**
@@ -45,19 +47,99 @@ namespace DynamiCL
         typedef std::function< size_t(size_t) > HalvingFunc;
 
         /**
-         * Creates a new level
+         * Creates a new level, given the host memory its upper level is
+         * read back to
          */
-        typedef std::function< LevelPair(Pending2DImage const&) > NextLevelFunc;
+        template <typename CLImage>
+        using NextLevelFunc = std::function< LevelPair<CLImage>(PendingImage<CLImage> const&, void*) >;
 
         /**
-         * Collapses two levels
+         * Fuses several pyramids at a single layer, given the image array
+         * of that layer and its level
          */
-        typedef std::function< Pending2DImage(LevelPair const&) > CollapseLevelFunc;
+        template <typename CLImage>
+        using FuseLevelsFunc = std::function< PendingImage<CLImage>(
+                PendingImage<typename detail::image_traits<CLImage>::array_type> const&,
+                size_t) >;
 
         /**
-         * Fuses several pyramids at a single layer
+         * Fuses several pyramids at a single layer like FuseLevelsFunc, and
+         * collapses the result with the collapsed level below it
          */
-        typedef std::function< Pending2DImage(PendingImage<cl::Image2DArray> const&) > FuseLevelsFunc;
+        template <typename CLImage>
+        using FuseCollapseLevelFunc = std::function< PendingImage<CLImage>(
+                PendingImage<typename detail::image_traits<CLImage>::array_type> const&,
+                PendingImage<CLImage> const&,
+                size_t) >;
+
+        /**
+         * Builds all remaining levels at once, from the image of a small
+         * level, reading them into the passed views
+         */
+        template <typename CLImage>
+        using BuildSmallLevelsFunc = std::function< void(PendingImage<CLImage> const&,
+                                                         std::vector<view_type>&) >;
+
+        /**
+         * Collapses all small levels at once, into the largest of them
+         */
+        template <typename CLImage>
+        using CollapseSmallLevelsFunc = std::function< PendingImage<CLImage>(
+                std::vector<view_type> const&) >;
+
+        /**
+         * Fuses several pyramids at all small levels at once
+         */
+        typedef std::function< void(std::vector<fuse_view_type> const&,
+                                    std::vector<view_type>&) > FuseSmallLevelsFunc;
+
+        /**
+         * Levels no larger than this in either dimension are small.
+         * Small levels fit in local memory, so they can all be processed
+         * together by a single work-group, instead of with launches for
+         * every level. Has to match SMALL_LEVEL_DIM in small_levels.cl.
+         */
+        static const size_t smallLevelDim = 32;
+
+        template <typename View>
+        static bool isSmallLevel(View const& level)
+        {
+            return level.width() <= smallLevelDim
+                && level.height() <= smallLevelDim;
+        }
+
+        /**
+         * @Return index of the first small level in @a levels,
+         * which go from largest to smallest.
+         */
+        template <typename View>
+        static size_t firstSmallLevel(std::vector<View> const& levels)
+        {
+            size_t level = 0;
+            while (level < levels.size() && !isSmallLevel(levels[level]))
+            {
+                ++level;
+            }
+            return level;
+        }
+
+        /**
+         * @Return index of the first level in @a levels with no more than
+         * @a hostLevelPixels pixels per layer. Those levels are processed
+         * on the host, as they are not worth a round trip to the device.
+         * No level is, if @a hostLevelPixels is 0.
+         */
+        template <typename View>
+        static size_t firstHostLevel(std::vector<View> const& levels, size_t hostLevelPixels)
+        {
+            size_t level = 0;
+            while (level < levels.size()
+                    && levels[level].width() * levels[level].height() > hostLevelPixels)
+            {
+                ++level;
+            }
+            return level;
+        }
 
         /**
          * Construct an image puramid with @a numLevels levels,
@@ -69,9 +151,22 @@ namespace DynamiCL
                       //HalvingFunc const&,
                       //NextLevelFunc const&);
 
-        ImagePyramid( ComputeContext const& context,
-                      std::vector<view_type>&& levelViews,
-                      NextLevelFunc const&);
+        /**
+         * Construct a pyramid in the memory of @a levelViews, whose first
+         * level already holds the source image. Device images are of type
+         * CLImage while the pyramid is built.
+         *
+         * If @a buildSmall is given, it builds all small levels at once.
+         * Levels of up to @a hostLevelPixels pixels are built on the host,
+         * from the last level read back from the device.
+         */
+        template <typename CLImage>
+        static ImagePyramid build( ComputeContext const& context,
+                                   std::vector<view_type>&& levelViews,
+                                   NextLevelFunc<CLImage> const&,
+                                   BuildSmallLevelsFunc<CLImage> const& buildSmall
+                                        = BuildSmallLevelsFunc<CLImage>(),
+                                   size_t hostLevelPixels = 0);
 
         /**
          * Create a pyramid from the guts of another.
@@ -106,26 +201,44 @@ namespace DynamiCL
          */
         std::vector<view_type> const& levels() const { return views_; }
 
-        /**
-         * Returns collapsed image from image pyramid.
-         *
-         * TODO: view is first subimage in arena. 
-         * @note Pyramid is left empty (no levels), to save memory.
-         */
-        void collapseInto(CollapseLevelFunc, view_type&);
-
         /**
          * Fuses passed-in pyramids into one.
          *
          * @note input pyramids are left empty: this frees up memory as soon as
          * it is not needed.
          */
-        static ImagePyramid fuse(std::vector<ImagePyramid>& pyramids, FuseLevelsFunc);
+        template <typename CLImage>
+        static ImagePyramid fuse(std::vector<ImagePyramid>& pyramids, FuseLevelsFunc<CLImage>);
 
-        static void fuseInto(ComputeContext const& context,
+        /**
+         * Fuses pyramids, whose levels are laid out as image arrays in
+         * @a fuseViews, and collapses the result into @a dest, from coarse
+         * to fine levels. Each level on the device is fused and added to
+         * the collapsed level below by @a fuseCollapseLevel in one go, so
+         * it is never held on the host.
+         * Only host levels and small levels are fused into @a levels first.
+         * Levels of up to @a hostLevelPixels pixels are fused and collapsed
+         * on the host, and the small ones by @a fuseSmall and
+         * @a collapseSmall, which are only used together. @a fuseLevel
+         * fuses the smallest level if there are no such levels.
+         *
+         * If @a shifts are given, one per pyramid in pixels of the first
+         * level, the host reads each pyramid translated by its shift, like
+         * fuseHostLevel does; the passed functions must do the same.
+         * @a fuseSmall is not used then, as it knows of no shifts.
+         */
+        template <typename CLImage>
+        static void fuseCollapseInto(ComputeContext const& context,
                          std::vector<fuse_view_type>& fuseViews,
-                         FuseLevelsFunc const&,
-                         std::vector<view_type>& dest);
+                         FuseLevelsFunc<CLImage> const& fuseLevel,
+                         FuseCollapseLevelFunc<CLImage> const& fuseCollapseLevel,
+                         std::vector<view_type>& levels,
+                         view_type& dest,
+                         FuseSmallLevelsFunc const& fuseSmall = FuseSmallLevelsFunc(),
+                         CollapseSmallLevelsFunc<CLImage> const& collapseSmall
+                                = CollapseSmallLevelsFunc<CLImage>(),
+                         size_t hostLevelPixels = 0,
+                         std::vector<Translation> const& shifts = std::vector<Translation>());
 
         static std::vector<view_type>
         createPyramidViews(size_t width,
@@ -148,7 +261,29 @@ namespace DynamiCL
         ComputeContext const& context_; ///< context for OpenCL operations
         std::vector<view_type> views_;
 
-        void initPyramid( NextLevelFunc const& createNext);
+        ImagePyramid( ComputeContext const& context,
+                      std::vector<view_type>&& levelViews)
+            : context_(context),
+              views_(std::move(levelViews))
+        { }
+
+        /**
+         * Fuses the host levels of @a fuseViews, and the small ones if
+         * @a fuseSmall is given and there are no @a shifts, into @a dest.
+         *
+         * @Return number of levels left to fuse on the device, which
+         * are the first ones
+         */
+        static size_t fuseHostAndSmallLevels(std::vector<fuse_view_type>& fuseViews,
+                                             std::vector<view_type>& dest,
+                                             FuseSmallLevelsFunc const& fuseSmall,
+                                             size_t hostLevelPixels,
+                                             std::vector<Translation> const& shifts);
+
+        template <typename CLImage>
+        void initPyramid( NextLevelFunc<CLImage> const& createNext,
+                          BuildSmallLevelsFunc<CLImage> const& buildSmall,
+                          size_t hostLevelPixels);
     };
 
 }
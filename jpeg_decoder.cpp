@@ -0,0 +1,227 @@
+#include "jpeg_decoder.h"
+#include "utils.h"
+
+#include <cstdio>
+#include <csetjmp>
+#include <stdexcept>
+#include <vector>
+
+#include <jpeglib.h>
+
+namespace
+{
+    /**
+     * libjpeg reports fatal errors through a callback that must not return.
+     * Jump back into the decoder, which turns the error into an exception.
+     */
+    struct ErrorManager
+    {
+        jpeg_error_mgr pub;
+        std::jmp_buf jumpBuffer;
+        char message[JMSG_LENGTH_MAX];
+    };
+
+    void errorExit(j_common_ptr cinfo)
+    {
+        ErrorManager* err = reinterpret_cast<ErrorManager*>(cinfo->err);
+        (*cinfo->err->format_message)(cinfo, err->message);
+        std::longjmp(err->jumpBuffer, 1);
+    }
+
+    /**
+     * Lookup table from an 8-bit sample to a normalized float
+     */
+    struct SampleTable
+    {
+        float values[256];
+
+        SampleTable()
+        {
+            for (size_t i = 0; i < 256; ++i)
+            {
+                values[i] = static_cast<float>(i) / 255.0f;
+            }
+        }
+    };
+
+    SampleTable const s_sampleTable;
+}
+
+namespace DynamiCL
+{
+
+    struct JpegDecoder::Impl
+    {
+        jpeg_decompress_struct cinfo;
+        ErrorManager err;
+        FILE* file;
+        bool started;             ///< whether decoding has started
+        std::vector<JSAMPLE> row; ///< single scanline of 8-bit RGB samples
+
+        Impl(std::string const& path)
+            : file(std::fopen(path.c_str(), "rb")),
+              started(false)
+        {
+            if (!file)
+            {
+                throw std::runtime_error("Could not open JPEG file: " + path);
+            }
+
+            cinfo.err = jpeg_std_error(&err.pub);
+            err.pub.error_exit = errorExit;
+
+            if (setjmp(err.jumpBuffer))
+            {
+                fail();
+            }
+
+            jpeg_create_decompress(&cinfo);
+            jpeg_stdio_src(&cinfo, file);
+            jpeg_read_header(&cinfo, TRUE);
+
+            if (cinfo.num_components != 3)
+            {
+                close();
+                throw std::runtime_error( "Could not open grayscale image. Only RGB images supported." );
+            }
+
+            cinfo.out_color_space = JCS_RGB;
+            jpeg_calc_output_dimensions(&cinfo);
+        }
+
+        ~Impl()
+        {
+            close();
+        }
+
+        void close()
+        {
+            if (file)
+            {
+                jpeg_destroy_decompress(&cinfo);
+                std::fclose(file);
+                file = nullptr;
+            }
+        }
+
+        /**
+         * Clean up after libjpeg bailed out, and report the error.
+         */
+        void fail()
+        {
+            std::string message(err.message);
+            close();
+            throw std::runtime_error("JPEG decoding failed: " + message);
+        }
+    };
+
+    const size_t JpegDecoder::maxScaleLevel;
+
+    JpegDecoder::JpegDecoder(std::string const& path)
+        : impl_(new Impl(path))
+    { }
+
+    JpegDecoder::~JpegDecoder() { }
+
+    void JpegDecoder::setScaleLevel(size_t level)
+    {
+        if (level > maxScaleLevel)
+        {
+            throw std::invalid_argument("JPEG images can only be scaled down by up to 2^3.");
+        }
+
+        if (impl_->started)
+        {
+            throw std::logic_error("JPEG image has already been decoded.");
+        }
+
+        jpeg_decompress_struct& cinfo = impl_->cinfo;
+        cinfo.scale_num = 1;
+        cinfo.scale_denom = 1u << level;
+        jpeg_calc_output_dimensions(&cinfo);
+    }
+
+    size_t JpegDecoder::width() const
+    {
+        return impl_->cinfo.output_width;
+    }
+
+    size_t JpegDecoder::height() const
+    {
+        return impl_->cinfo.output_height;
+    }
+
+    void JpegDecoder::decodeInto(view_type& dest)
+    {
+        if (dest.width() != width() || dest.height() != height())
+        {
+            throw std::invalid_argument("Destination dimensions differ from those of the JPEG image.");
+        }
+
+        if (impl_->started)
+        {
+            throw std::logic_error("JPEG image has already been decoded.");
+        }
+
+        decodeRows(dest);
+    }
+
+    void JpegDecoder::decodeRows(view_type& rows)
+    {
+        jpeg_decompress_struct& cinfo = impl_->cinfo;
+
+        if (rows.width() != width())
+        {
+            throw std::invalid_argument("Destination width differs from that of the JPEG image.");
+        }
+
+        size_t const rowsLeft = impl_->started ? cinfo.output_height - cinfo.output_scanline : height();
+        if (rows.height() > rowsLeft)
+        {
+            throw std::invalid_argument("JPEG image has fewer rows left than asked for.");
+        }
+
+        if (setjmp(impl_->err.jumpBuffer))
+        {
+            impl_->fail();
+        }
+
+        if (!impl_->started)
+        {
+            impl_->started = true;
+            impl_->row.resize(width() * 3);
+            jpeg_start_decompress(&cinfo);
+        }
+
+        JSAMPROW rowPtr = impl_->row.data();
+        float const* table = s_sampleTable.values;
+        pixel_type* out = rows.begin();
+
+        for (size_t y = 0; y < rows.height(); ++y)
+        {
+            jpeg_read_scanlines(&cinfo, &rowPtr, 1);
+
+            // convert the line while it is still in cache
+            JSAMPLE const* in = impl_->row.data();
+            for (size_t x = 0; x < cinfo.output_width; ++x, ++out, in += 3)
+            {
+                out->r = table[in[0]];
+                out->g = table[in[1]];
+                out->b = table[in[2]];
+                out->a = 1.0f;
+            }
+        }
+
+        if (cinfo.output_scanline == cinfo.output_height)
+        {
+            jpeg_finish_decompress(&cinfo);
+        }
+    }
+
+    bool isJpegPath(std::string const& path)
+    {
+        std::string ext = getExtension(path);
+        return ext == "jpg" || ext == "jpeg";
+    }
+
+}
@@ -0,0 +1,99 @@
+#ifndef JPEG_DECODER_H_Q3TZ8WLD
+#define JPEG_DECODER_H_Q3TZ8WLD
+
+#include <string>
+#include <memory>
+
+#include "host_image.hpp"
+
+namespace DynamiCL
+{
+
+    /**
+     * Decodes a JPEG file one scanline at a time, converting each line
+     * straight into RGBA<float> pixels of a destination view.
+     *
+     * Only a single row of 8-bit samples is ever held in memory, so the
+     * destination buffer (which is what gets uploaded to the device) is
+     * the only full-frame allocation.
+     */
+    class JpegDecoder
+    {
+    public:
+        typedef RGBA<float> pixel_type;
+        typedef HostImageView<pixel_type, 2> view_type;
+
+        /**
+         * Open @a path and read the JPEG header, so that dimensions are
+         * known before any pixel data is decoded.
+         */
+        explicit JpegDecoder(std::string const& path);
+        ~JpegDecoder();
+
+        // disable copying, as the decoder owns a file handle
+        JpegDecoder(JpegDecoder const&) = delete;
+        JpegDecoder& operator =(JpegDecoder const&) = delete;
+
+        /**
+         * Largest number of times decoding can halve the dimensions
+         */
+        static const size_t maxScaleLevel = 3;
+
+        /**
+         * Decode at 1/2^@a level of the full dimensions, which libjpeg
+         * does cheaply by scaling the DCT. Dimensions are rounded up, so
+         * they match those of that level of a pyramid.
+         * Must be called before decoding.
+         *
+         * @throws std::invalid_argument if @a level exceeds maxScaleLevel
+         */
+        void setScaleLevel(size_t level);
+
+        /**
+         * Dimensions the image is decoded at
+         */
+        size_t width() const;
+        size_t height() const;
+
+        std::array<size_t, 2> dimensions() const
+        {
+            return {{ width(), height() }};
+        }
+
+        /**
+         * Decode the whole image into @a dest, which must have the
+         * dimensions of this decoder. Can only be called once.
+         */
+        void decodeInto(view_type& dest);
+        void decodeInto(view_type&& dest)
+        {
+            view_type v = std::move(dest);
+            decodeInto(v);
+        }
+
+        /**
+         * Decode the next rows of the image into @a rows, which must be as
+         * wide as this decoder, and no higher than the rows left. Decodes
+         * an image a band at a time, where decodeInto() decodes it whole.
+         */
+        void decodeRows(view_type& rows);
+        void decodeRows(view_type&& rows)
+        {
+            view_type v = std::move(rows);
+            decodeRows(v);
+        }
+
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
+    };
+
+    /**
+     * @Return whether @a path names a file the JpegDecoder can read,
+     * judging by its extension.
+     */
+    bool isJpegPath(std::string const& path);
+
+}
+
+#endif /* end of include guard: JPEG_DECODER_H_Q3TZ8WLD */
@@ -3,6 +3,8 @@
 
 #include "cl_common.h"
 
+#include <vector>
+
 namespace DynamiCL
 
 {
@@ -24,27 +26,142 @@ namespace DynamiCL
         char const* name;
         Range const range;
 
+        /// values of arguments that follow the images, such as weights
+        std::vector<cl_float4> trailingArgs;
+
         /**
-         * Instantiate a new kernel with the given arguments
+         * Instantiate a new kernel with the given arguments,
+         * followed by trailingArgs
          */
         template <typename... Ts>
         cl::Kernel build(Ts&&... args) const
         {
             cl::Kernel kernel(program, name);
-            build_impl(kernel, 0, std::forward<Ts>(args)...);
+            size_t argIndex = build_impl(kernel, 0, std::forward<Ts>(args)...);
+            for (cl_float4 const& arg : trailingArgs)
+            {
+                kernel.setArg(argIndex++, arg);
+            }
             return kernel;
         }
 
+        /**
+         * Instantiate a new kernel with the images @a inputs, then
+         * @a output, followed by trailingArgs, for inputs that are only
+         * known at run time
+         */
+        template <typename Image>
+        cl::Kernel buildWith(std::vector<Image> const& inputs, Image const& output) const
+        {
+            cl::Kernel kernel(program, name);
+            size_t argIndex = 0;
+            for (Image const& input : inputs)
+            {
+                argIndex = set_arg(kernel, argIndex, input);
+            }
+            argIndex = set_arg(kernel, argIndex, output);
+            for (cl_float4 const& arg : trailingArgs)
+            {
+                kernel.setArg(argIndex++, arg);
+            }
+            return kernel;
+        }
+
+        /**
+         * Enqueue @a clkernel, an instance of this kernel, over @a globalRange.
+         *
+         * Uses the work-group size tuned for this kernel on the device, if
+         * there is one. The range is then padded up to a multiple of the
+         * work-group size, so kernels must ignore work items that fall
+         * outside of their image. Ranges of three dimensions go over a
+         * stack of layers, and only the first two are padded.
+         *
+         * @Return event signalling completion of the kernel
+         */
+        cl::Event enqueue(ComputeContext const& context,
+                          cl::Kernel const& clkernel,
+                          cl::NDRange const& globalRange,
+                          EventList const* waitFor) const
+        {
+            cl::NDRange global = globalRange;
+            cl::NDRange local = cl::NullRange;
+
+            KernelTuning::local_size_type localSize;
+            if (globalRange.dimensions() == 2
+                && context.tuning.find(name, localSize))
+            {
+                size_t const* dims = globalRange;
+                global = cl::NDRange(roundUp(dims[0], localSize[0]),
+                                     roundUp(dims[1], localSize[1]));
+                local = cl::NDRange(localSize[0], localSize[1]);
+            }
+            // a layer of a stack at a time
+            else if (globalRange.dimensions() == 3
+                     && context.tuning.find(name, localSize))
+            {
+                size_t const* dims = globalRange;
+                global = cl::NDRange(roundUp(dims[0], localSize[0]),
+                                     roundUp(dims[1], localSize[1]),
+                                     dims[2]);
+                local = cl::NDRange(localSize[0], localSize[1], 1);
+            }
+
+            WaitList wait(waitFor ? *waitFor : EventList());
+
+            cl::Event complete;
+            context.queue.enqueueNDRangeKernel(clkernel,
+                                       cl::NullRange,
+                                       global,
+                                       local,
+                                       wait.get(),
+                                       &complete);
+            return complete;
+        }
+
     private:
         template <typename T, typename... Ts>
-        static void build_impl(cl::Kernel& kernel, size_t argIndex, T&& arg, Ts&&... rest)
+        static size_t build_impl(cl::Kernel& kernel, size_t argIndex, T&& arg, Ts&&... rest)
         {
-            kernel.setArg(argIndex, std::forward<T>(arg));
-            build_impl(kernel, argIndex+1, std::forward<Ts>(rest)...);
+            argIndex = set_arg(kernel, argIndex, arg);
+            return build_impl(kernel, argIndex, std::forward<Ts>(rest)...);
         }
 
         // no arguments remaining
-        static void build_impl(cl::Kernel&, size_t) { }
+        static size_t build_impl(cl::Kernel&, size_t argIndex) { return argIndex; }
+
+        /**
+         * Set a single argument, returning the index of the next one.
+         */
+        template <typename T>
+        static size_t set_arg(cl::Kernel& kernel, size_t argIndex, T const& arg)
+        {
+            kernel.setArg(argIndex, arg);
+            return argIndex + 1;
+        }
+
+        /**
+         * Buffer images expand into two arguments:
+         * the buffer, followed by its dimensions.
+         */
+        static size_t set_arg(cl::Kernel& kernel, size_t argIndex, BufferImage2D const& arg)
+        {
+            cl_int2 dims = {{ static_cast<cl_int>(arg.dims[0]),
+                              static_cast<cl_int>(arg.dims[1]) }};
+            kernel.setArg(argIndex, arg.buffer);
+            kernel.setArg(argIndex + 1, dims);
+            return argIndex + 2;
+        }
+
+        static size_t set_arg(cl::Kernel& kernel, size_t argIndex, BufferImage2DArray const& arg)
+        {
+            cl_int4 dims = {{ static_cast<cl_int>(arg.dims[0]),
+                              static_cast<cl_int>(arg.dims[1]),
+                              static_cast<cl_int>(arg.dims[2]),
+                              0 }};
+            kernel.setArg(argIndex, arg.buffer);
+            kernel.setArg(argIndex + 1, dims);
+            return argIndex + 2;
+        }
     };
 
 }
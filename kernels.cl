@@ -2,6 +2,26 @@
 __constant const sampler_t g_sampler =
         CLK_FILTER_NEAREST|CLK_NORMALIZED_COORDS_FALSE|CLK_ADDRESS_CLAMP_TO_EDGE;
 
+// NOTE: the global range may be padded up to a multiple of a tuned
+// work-group size, so every kernel returns early for work items that
+// fall outside of the image that defines its range.
+
+// Programs may be specialized through defines (see ProgramVariant):
+//   GROUP_SIZE           number of images fused at once, so the loop in
+//                        fuse_level can be unrolled
+//   QUALITY_CONTRAST,
+//   QUALITY_SATURATION,
+//   QUALITY_EXPOSEDNESS  set to 0 to drop a term from the quality measures
+#ifndef QUALITY_CONTRAST
+#define QUALITY_CONTRAST 1
+#endif
+#ifndef QUALITY_SATURATION
+#define QUALITY_SATURATION 1
+#endif
+#ifndef QUALITY_EXPOSEDNESS
+#define QUALITY_EXPOSEDNESS 1
+#endif
+
 /***************************************************************************
  *                            Gaussian Kernels                             *
  ***************************************************************************/
@@ -15,6 +35,11 @@ __constant const float sampling_kernel[5] = {
 __kernel void downsample_row(__read_only image2d_t input_image, __write_only image2d_t output_image)
 {
     int2 out_coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(out_coord >= get_image_dim(output_image)))
+    {
+        return;
+    }
+
     int2 in_coord = (int2)( out_coord.x * 2, out_coord.y );
 
     float4 sample = 0.0f;
@@ -31,6 +56,11 @@ __kernel void downsample_col(__read_only image2d_t input_image, __write_only ima
 {
 
     int2 out_coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(out_coord >= get_image_dim(output_image)))
+    {
+        return;
+    }
+
     int2 in_coord = (int2)( out_coord.x, out_coord.y * 2 );
 
     float4 sample = 0.0f;
@@ -52,6 +82,11 @@ __kernel void upsample_col(__read_only image2d_t input_image, __write_only image
     int2 out_dim = get_image_dim(output_image);
 
     int2 in_coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(in_coord >= get_image_dim(input_image)))
+    {
+        return;
+    }
+
     int2 out_coord = (int2)( in_coord.x, in_coord.y * 2 );
 
     // the 3 input pixels that contribute to the two pixels in output
@@ -99,6 +134,10 @@ __kernel void create_laplacian(__read_only image2d_t original,
                                __write_only image2d_t laplacian)
 {
     int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= get_image_dim(laplacian)))
+    {
+        return;
+    }
 
     float4 o = read_imagef (original, g_sampler, coord);
     float4 b = read_imagef (blurred, g_sampler, coord);
@@ -117,6 +156,10 @@ __kernel void collapse_level( __read_only image2d_t blurred,
                               __write_only  image2d_t collapsed)
 {
     int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= get_image_dim(collapsed)))
+    {
+        return;
+    }
 
     float4 b = read_imagef (blurred, g_sampler, coord);
     float4 l = read_imagef (laplacian, g_sampler, coord);
@@ -132,11 +175,22 @@ __kernel void fuse_level( __read_only  image2d_array_t array,
                           __write_only image2d_t fused)
 {
     int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= get_image_dim(fused)))
+    {
+        return;
+    }
+#ifdef GROUP_SIZE
+    int const depth = GROUP_SIZE;
+#else
     int depth = get_image_array_size(array);
+#endif
 
     float4 acc = 0.0f;
     float weight_sum = 0.0f; // sum of all weights in alpha channel
 
+#ifdef GROUP_SIZE
+    #pragma unroll
+#endif
     for (int i = 0; i < depth; ++i)
     {
         int4 array_coord = (int4)(coord.x, coord.y, i, 0);
@@ -159,6 +213,177 @@ __kernel void fuse_level( __read_only  image2d_array_t array,
     write_imagef (fused, coord, acc);
 }
 
+/**
+ * Same as fuse_level, but layer i is read translated by shifts[i], given in
+ * pixels of the first level of the pyramid and rounded to those of @a level.
+ * Pixels translated off a layer clamp to its edge.
+ */
+__kernel void fuse_level_aligned( __read_only  image2d_array_t array,
+                                  __write_only image2d_t fused,
+                                  __constant int2* shifts,
+                                  int level)
+{
+    int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= get_image_dim(fused)))
+    {
+        return;
+    }
+#ifdef GROUP_SIZE
+    int const depth = GROUP_SIZE;
+#else
+    int depth = get_image_array_size(array);
+#endif
+
+    float const scale = 1.0f / (float)(1 << level);
+
+    float4 acc = 0.0f;
+    float weight_sum = 0.0f; // sum of all weights in alpha channel
+
+#ifdef GROUP_SIZE
+    #pragma unroll
+#endif
+    for (int i = 0; i < depth; ++i)
+    {
+        int2 shift = convert_int2(floor(convert_float2(shifts[i]) * scale + 0.5f));
+        int4 array_coord = (int4)(coord.x + shift.x, coord.y + shift.y, i, 0);
+        float4 pix = read_imagef (array, g_sampler, array_coord);
+
+        weight_sum += pix.s3;
+        acc += pix * pix.s3;
+    }
+
+    acc /= weight_sum;
+
+    write_imagef (fused, coord, acc);
+}
+
+/**
+ * One pixel upsampled from three, like upsample_col and upsample_row do:
+ * the first of the two they write for even coordinates, the second for odd
+ */
+inline float4 upsample_taps(float4 in0, float4 in1, float4 in2, int odd)
+{
+    if (odd)
+    {
+        return (   in1 * sampling_kernel[1]
+                 + in2 * sampling_kernel[1])
+               * 2;
+    }
+    return (   in0 * sampling_kernel[0]
+             + in1 * sampling_kernel[2]
+             + in2 * sampling_kernel[0])
+           * 2;
+}
+
+/**
+ * The pixel at @a coord of @a lower upsampled by upsample_col and then
+ * upsample_row, computed on its own from the 3x3 pixels around coord / 2
+ */
+inline float4 upsampled_pixel(__read_only image2d_t lower, int2 coord)
+{
+    int2 in_coord = coord / 2;
+    float4 columns[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        int2 c = in_coord + (int2)(i - 1, 0);
+        columns[i] = upsample_taps(read_imagef (lower, g_sampler, c + (int2)(0, -1)),
+                                   read_imagef (lower, g_sampler, c),
+                                   read_imagef (lower, g_sampler, c + (int2)(0, 1)),
+                                   coord.y & 1);
+    }
+    return upsample_taps(columns[0], columns[1], columns[2], coord.x & 1);
+}
+
+/**
+ * fuse_level and collapse_level at once: fuses the level, and adds it to
+ * @a lower, the collapsed level below, upsampled. The fused level is never
+ * written out.
+ */
+__kernel void fuse_collapse_level( __read_only  image2d_array_t array,
+                                   __read_only  image2d_t lower,
+                                   __write_only image2d_t collapsed)
+{
+    int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= get_image_dim(collapsed)))
+    {
+        return;
+    }
+#ifdef GROUP_SIZE
+    int const depth = GROUP_SIZE;
+#else
+    int depth = get_image_array_size(array);
+#endif
+
+    float4 acc = 0.0f;
+    float weight_sum = 0.0f; // sum of all weights in alpha channel
+
+#ifdef GROUP_SIZE
+    #pragma unroll
+#endif
+    for (int i = 0; i < depth; ++i)
+    {
+        int4 array_coord = (int4)(coord.x, coord.y, i, 0);
+        float4 pix = read_imagef (array, g_sampler, array_coord);
+
+        weight_sum += pix.s3;
+        acc += pix * pix.s3;
+    }
+
+    acc /= weight_sum;
+
+    float4 c = upsampled_pixel(lower, coord) + acc;
+    // clamped like collapse_level, which this stands in for
+    c = clamp(c, 0.0f, 1.0f);
+
+    write_imagef (collapsed, coord, c);
+}
+
+/**
+ * Same as fuse_collapse_level, but fuses like fuse_level_aligned.
+ */
+__kernel void fuse_collapse_level_aligned( __read_only  image2d_array_t array,
+                                           __read_only  image2d_t lower,
+                                           __write_only image2d_t collapsed,
+                                           __constant int2* shifts,
+                                           int level)
+{
+    int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= get_image_dim(collapsed)))
+    {
+        return;
+    }
+#ifdef GROUP_SIZE
+    int const depth = GROUP_SIZE;
+#else
+    int depth = get_image_array_size(array);
+#endif
+
+    float const scale = 1.0f / (float)(1 << level);
+
+    float4 acc = 0.0f;
+    float weight_sum = 0.0f; // sum of all weights in alpha channel
+
+#ifdef GROUP_SIZE
+    #pragma unroll
+#endif
+    for (int i = 0; i < depth; ++i)
+    {
+        int2 shift = convert_int2(floor(convert_float2(shifts[i]) * scale + 0.5f));
+        int4 array_coord = (int4)(coord.x + shift.x, coord.y + shift.y, i, 0);
+        float4 pix = read_imagef (array, g_sampler, array_coord);
+
+        weight_sum += pix.s3;
+        acc += pix * pix.s3;
+    }
+
+    acc /= weight_sum;
+
+    float4 c = upsampled_pixel(lower, coord) + acc;
+    c = clamp(c, 0.0f, 1.0f);
+
+    write_imagef (collapsed, coord, c);
+}
+
 /***************************************************************************
  *                          HDR Quality Measures                           *
  ***************************************************************************/
@@ -168,6 +393,11 @@ __kernel void upsample_row(__read_only image2d_t input_image, __write_only image
     int2 out_dim = get_image_dim(output_image);
 
     int2 in_coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(in_coord >= get_image_dim(input_image)))
+    {
+        return;
+    }
+
     int2 out_coord = (int2)( in_coord.x * 2, in_coord.y);
 
     // the 3 input pixels that contribute to the two pixels in output
@@ -249,10 +479,16 @@ __constant const float discreet_laplacian[3][3] = {
     0.5f/6.f, 1.f/6.f, 0.5f/6.f
 };
 
-__kernel void compute_quality(__read_only image2d_t input_image, __write_only image2d_t output_image)
+/**
+ * The quality measures of the pixel at @a coord: contrast, saturation and
+ * exposedness, in that order. Measures dropped by QUALITY_* defines are 0.
+ */
+inline float4 quality_measures(__read_only image2d_t input_image, int2 coord)
 {
-    int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    float4 pixel = read_imagef (input_image, g_sampler, coord);
+    float4 measures = 0.0f;
 
+#if QUALITY_CONTRAST
     // find laplacian at pixel per component
     float4 laplacian = 0.0f;
     for (int i = -1; i < 2; ++i)
@@ -267,25 +503,64 @@ __kernel void compute_quality(__read_only image2d_t input_image, __write_only im
     // laplacian of alpha channel will be zero.
     // to average across channels, just get length of vector
     // TODO benefits to fast_length?
-    float laplacian_measure = fast_length(fabs(laplacian));
+    measures.s0 = fast_length(fabs(laplacian));
+#endif
 
-    float4 pixel = read_imagef (input_image, g_sampler, coord);
+#if QUALITY_SATURATION
+    measures.s1 = sigma_squared_rgb(pixel);
+#endif
 
-    float sigma = sigma_squared_rgb(pixel);
-    float exposedness = well_exposedness_naive(pixel);
+#if QUALITY_EXPOSEDNESS
+    measures.s2 = well_exposedness_naive(pixel);
+#endif
+
+    return measures;
+}
+
+/**
+ * Assign the quality of each pixel to its alpha channel: the sum of its
+ * quality measures, multiplied by the matching components of @a weights
+ * (see QualityWeights).
+ */
+__kernel void compute_quality(__read_only image2d_t input_image, __write_only image2d_t output_image,
+                              float4 weights)
+{
+    int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= get_image_dim(output_image)))
+    {
+        return;
+    }
+
+    float4 pixel = read_imagef (input_image, g_sampler, coord);
 
     // assign quality measure to alpha channel
-    // TODO multiples are ad hoc. do better
-    pixel.s3 = ( laplacian_measure * 3.0f )
-             + ( sigma * 1.5f )
-             + ( exposedness * 0.2f );
+    pixel.s3 = dot(quality_measures(input_image, coord), weights);
 
     write_imagef (output_image, coord, pixel);
 }
 
+/**
+ * Write out the quality measures themselves, so that they can be
+ * weighted in several ways later, without computing them again.
+ */
+__kernel void compute_measures(__read_only image2d_t input_image, __write_only image2d_t output_image)
+{
+    int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= get_image_dim(output_image)))
+    {
+        return;
+    }
+
+    write_imagef (output_image, coord, quality_measures(input_image, coord));
+}
+
 __kernel void compute_quality_bal(__read_only image2d_t input_image, __write_only image2d_t output_image)
 {
     int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= get_image_dim(output_image)))
+    {
+        return;
+    }
     float4 pixel = read_imagef (input_image, g_sampler, coord);
 
     //float sigma = sigma_squared_rgb(pixel);
@@ -303,6 +578,10 @@ __kernel void compute_quality_bal(__read_only image2d_t input_image, __write_onl
 __kernel void compute_quality_sigma(__read_only image2d_t input_image, __write_only image2d_t output_image)
 {
     int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    if (any(coord >= get_image_dim(output_image)))
+    {
+        return;
+    }
     float4 pixel = read_imagef (input_image, g_sampler, coord);
 
     float sigma = sigma_squared_rgb(pixel);
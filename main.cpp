@@ -1,3 +1,5 @@
+#include <cstdlib>
+#include <future>
 #include <iostream>
 #include <memory>
 
@@ -9,17 +11,26 @@
 #include "utils.h"
 #include "merge_group.h"
 #include "save_image.h"
+#include "jpeg_decoder.h"
+#include "autotune.h"
+#include "host_pyramid.h"
+#include "pyr_impl.h"
+#include "pyramid_cache.h"
+#include "memory_budget.h"
+#include "merge_pipeline.h"
+#include "band_merge.h"
+#include "batch_merge.h"
+#include "parallel.hpp"
+#include "recycler.hpp"
+#include "alloc_counters.h"
 
 #include "plumbingplusplus/plumbing.hpp"
 
 namespace DynamiCL
 {
-    typedef HostImage<RGBA<float>, 2> FloatImage;
-        
-    std::shared_ptr< vigra::BasicImage< vigra::RGBValue< vigra::UInt8 >>>
-    loadImage(std::string const& path)
+    std::shared_ptr< InputImage >
+    loadVigraImage(std::string const& path, FrameBuffers* frames = nullptr)
     {
-        typedef vigra::BasicImage< vigra::RGBValue< vigra::UInt8 >> ImgType;
         vigra::ImageImportInfo info(path.c_str());
 
         if(info.isGrayscale())
@@ -29,7 +40,16 @@ namespace DynamiCL
 
         // TODO: check pixel type is uint8
 
-        auto img = std::make_shared<ImgType>( info.width(), info.height() );
+        int const width = info.width();
+        int const height = info.height();
+        auto img = frames
+                 ? frames->inputs.acquire(
+                       [&](InputImage const& image)
+                       {
+                           return image.width() == width && image.height() == height;
+                       },
+                       [&]() { return std::unique_ptr<InputImage>(new InputImage(width, height)); })
+                 : std::make_shared<InputImage>( width, height );
 
         // import the image just read
         importImage(info, destImage(*img));
@@ -60,22 +80,117 @@ namespace DynamiCL
     }
 
     template <typename InComponentType>
-    std::shared_ptr< FloatImage >
-    transformToFloat4(vigra::BasicImage< vigra::RGBValue< InComponentType >> const& in)
+    void
+    transformToFloat4(vigra::BasicImage< vigra::RGBValue< InComponentType >> const& in,
+                      FloatImageView& out)
     {
-        typedef vigra::TinyVector< float, 4 > OutPixelType;
+        // transform using unary function, on all cores
+        parallelTransform(in.begin(), in.end(), out.begin(),
+                          convertPixelToFloat4<InComponentType>);
+    }
 
-        // Create output image
-        auto out = std::make_shared<FloatImage>(in.width(), in.height());
+    /**
+     * Convert @a img into @a dest, downscaling it if @a dest is smaller,
+     * with images recycled from @a frames, if given
+     */
+    void decodeVigraImage(InputImage const& img, FloatImageView& dest, FrameBuffers* frames)
+    {
+        if (dest.width() == static_cast<size_t>(img.width())
+            && dest.height() == static_cast<size_t>(img.height()))
+        {
+            transformToFloat4(img, dest);
+            return;
+        }
+
+        auto full = newFloatImage({{ static_cast<size_t>(img.width()),
+                                     static_cast<size_t>(img.height()) }}, frames);
+        FloatImageView fullView = full->view();
+        transformToFloat4(img, fullView);
+        downscaleHostImage(fullView, dest);
+    }
 
-        // transform using unary function
-        std::transform(in.begin(), in.end(), out->view().begin(),
-                       convertPixelToFloat4<InComponentType>);
-        // TODO: huge bottleneck! must improve
+    /**
+     * Open an image on disk, reading as little as needed to know its
+     * dimensions, which are those at full resolution.
+     *
+     * JPEGs are decoded later, a scanline at a time, straight into the
+     * destination. Other formats are read by vigra up front, and only
+     * converted into the destination later, unless the image is
+     * @a cached: its pyramid is then expected to load from a cache, so
+     * that they are only read if decodeInto is called after all.
+     *
+     * Destinations may be smaller by a factor of 2^@a previewLevel, in
+     * which case JPEGs are downscaled while decoding as far as possible.
+     *
+     * Images read up front take memory from @a budget until they are
+     * released, so opening waits while too many are held already.
+     *
+     * With @a frames, the images needed along the way are recycled.
+     */
+    std::shared_ptr< OpenedImage >
+    openImage(std::string const& path, size_t previewLevel, MemoryBudget& budget,
+              FrameBuffers* frames = nullptr, bool cached = false)
+    {
+        auto out = std::make_shared<OpenedImage>();
+
+        if (isJpegPath(path))
+        {
+            auto decoder = std::make_shared<JpegDecoder>(path);
+            out->dimensions = decoder->dimensions();
+            decoder->setScaleLevel(std::min(previewLevel, JpegDecoder::maxScaleLevel));
+            out->decodeInto =
+                [decoder, frames](FloatImageView& dest)
+                {
+                    if (decoder->width() == dest.width() && decoder->height() == dest.height())
+                    {
+                        decoder->decodeInto(dest);
+                        return;
+                    }
+
+                    // scale down the rest of the way
+                    auto scaled = newFloatImage(decoder->dimensions(), frames);
+                    decoder->decodeInto(scaled->view());
+                    downscaleHostImage(scaled->view(), dest);
+                };
+        }
+        else if (cached)
+        {
+            vigra::ImageImportInfo info(path.c_str());
+            out->dimensions = {{ static_cast<size_t>(info.width()),
+                                 static_cast<size_t>(info.height()) }};
+            out->decodeInto =
+                [path, frames](FloatImageView& dest)
+                {
+                    // the cache entry went missing since, which is rare
+                    // enough to read the image on the merge stage
+                    auto img = loadVigraImage(path, frames);
+                    decodeVigraImage(*img, dest, frames);
+                };
+        }
+        else
+        {
+            vigra::ImageImportInfo info(path.c_str());
+            out->memory = budget.reserve(static_cast<size_t>(info.width()) * info.height() * 3, 0);
+
+            auto img = loadVigraImage(path, frames);
+            out->dimensions = {{ static_cast<size_t>(img->width()),
+                                 static_cast<size_t>(img->height()) }};
+            out->decodeInto =
+                [img, frames](FloatImageView& dest)
+                {
+                    decodeVigraImage(*img, dest, frames);
+                };
+        }
 
         return out;
     }
 
+    std::ostream& operator <<(std::ostream& out, AllocationCounts const& counts)
+    {
+        return out << counts.hostAllocations << " host (" << (counts.hostBytes >> 20) << " MB) and "
+                   << counts.deviceAllocations << " device (" << (counts.deviceBytes >> 20) << " MB) allocations";
+    }
+
     template <typename T>
     void printN(T const* array, size_t n)
     {
@@ -85,75 +200,233 @@ namespace DynamiCL
         }
     }
 
-        // TODO: size may be too large for device
-        // TODO: have to check CL_DEVICE_MAX_MEM_ALLOC_SIZE from getDeviceInfo?
-        //
-
     /**
-     * Function object for merging exposures
+     * Merge each group of @a numExposures of @a paths in bands of rows,
+     * once for each of @a weights, writing merged images row by row into
+     * out<n>.tiff. Pyramids have @a numLevels, or as many as fit in
+     * @a budget if 0.
+     *
+     * Images are never whole in memory, so this merges images of any size.
+     * Only JPEG images can be decoded in bands, and only previewed down to
+     * a level of JpegDecoder::maxScaleLevel.
      */
-    struct mergeHDR
+    void mergeInBands(std::vector<std::string> const& paths,
+                      size_t numExposures,
+                      size_t previewLevel,
+                      size_t numLevels,
+                      std::vector<QualityWeights> const& weights,
+                      MemoryBudget& budget)
     {
-        const size_t numExposures;
-        ComputeContext const& context;
-        cl::Program const& program;
-
-        // from shared_ptr image to shared_ptr of image
-        template <typename InputIt, typename OutputIt>
-        void operator() (InputIt cur, InputIt last, OutputIt dest)
+        if (previewLevel > JpegDecoder::maxScaleLevel)
         {
-            Kernel quality = {program, "compute_quality", Kernel::Range::SOURCE};
+            throw std::invalid_argument("Merging in bands only previews down to 1/8 of the full resolution.");
+        }
 
-            size_t width = 1;
-            size_t height = 1;
-            // TODO replace with move-aware optional
-            std::unique_ptr<MergeGroup> group;
-            while(cur != last)
+        size_t index = 1;
+        for (size_t first = 0; first + numExposures <= paths.size(); first += numExposures)
+        {
+            for (QualityWeights const& w : weights)
             {
-                std::shared_ptr<FloatImage> in = *cur++;
+                std::vector<std::unique_ptr<JpegDecoder>> decoders;
+                for (size_t i = first; i < first + numExposures; ++i)
+                {
+                    if (!isJpegPath(paths[i]))
+                    {
+                        throw std::runtime_error("Only JPEG images can be merged in bands: " + paths[i]);
+                    }
+                    decoders.emplace_back(new JpegDecoder(paths[i]));
+                    decoders.back()->setScaleLevel(previewLevel);
+
+                    if (decoders.back()->dimensions() != decoders.front()->dimensions())
+                    {
+                        throw std::runtime_error("Image dimensions in sequence are not equal!");
+                    }
+                }
 
-                // determine pyramid depth if this is a first image received
-                if (!group)
+                size_t const width = decoders.front()->width();
+                size_t const height = decoders.front()->height();
+
+                size_t const fullLevels = calculateNumLevels(width, height);
+                size_t const levelsFit = BandMerge::levelsWithin(width, height, numExposures,
+                                                                 budget.limits().hostBytes);
+                if (levelsFit == 0)
                 {
-                    width = in->view().width();
-                    height = in->view().height();
+                    throw std::runtime_error("Images are too wide to merge even in bands.");
+                }
 
-                    group.reset(new MergeGroup(context, program, width, height, 3));
+                size_t levels = std::min(numLevels, fullLevels);
+                if (numLevels == 0)
+                {
+                    // fewer levels blend exposures over shorter distances,
+                    // which shows in large, smooth areas
+                    levels = levelsFit;
+                    if (levels < fullLevels)
+                    {
+                        std::cerr << "Warning: only " << levels << " of " << fullLevels
+                                  << " pyramid levels fit in memory, merging with fewer" << std::endl;
+                    }
                 }
-                // if subsequent images in sequence, check that sizes match
-                else if (width != in->view().width() || height != in->view().height()) {
-                    throw std::runtime_error("Image dimensions in sequence are not equal!");
+                else if (levels > levelsFit)
+                {
+                    std::stringstream sstr;
+                    sstr << "Merging in bands with " << levels << " levels does not fit in memory, "
+                         << "at most " << levelsFit << " do.";
+                    throw std::runtime_error(sstr.str());
+                }
+                else if (levels < numLevels)
+                {
+                    std::cerr << "Warning: images only have " << levels << " pyramid levels" << std::endl;
                 }
+                MemoryBudget::Reservation memory =
+                    budget.reserve(BandMerge::footprint(width, numExposures, levels), 0);
 
-                // create quality mask in image
-                // TODO: move this into merge group
-                std::cout << "========================\n"
-                             "Creating Quality Mask.\n"
-                             "========================"
-                          << std::endl;
-                processImageInPlace(in->view(), quality, context);
+                std::vector<BandMerge::RowReader> readers;
+                for (auto& decoder : decoders)
+                {
+                    JpegDecoder* d = decoder.get();
+                    readers.push_back(
+                        [d, width](BandMerge::pixel_type* row)
+                        {
+                            d->decodeRows(JpegDecoder::view_type(std::array<size_t, 2>{{ width, 1 }}, row));
+                        });
+                }
 
-                // add image to group
-                group->addImage(in->view());
+                std::stringstream sstr;
+                sstr << "out" << index++ << ".tiff";
+                TiffRowWriter writer(sstr.str(), width, height);
 
-                // as soon as we can merge, do so
-                if (group->numImages() == 3)
+                std::cout << "Merging in bands, with " << levels << " levels, into "
+                          << sstr.str() << std::endl;
+
+                BandMerge merge(width, height, numExposures, levels, w);
+                merge.merge(readers,
+                            [&](BandMerge::pixel_type const* row) { writer.writeRow(row); });
+            }
+        }
+    }
+
+    /**
+     * Merge each group of @a numExposures of @a paths, once for each of
+     * @a weights, into out<n>.tiff, with up to @a batchSize groups merged
+     * at once, as many as fit in @a budget.
+     *
+     * For small images, like thumbnails or previews, whose merges take
+     * less time than the launches and transfers of a group on its own.
+     * Batches are only merged in buffers, so on a context of another
+     * storage, they get a context of their own, tuned like @a context.
+     */
+    void mergeInBatches(ComputeContext const& context,
+                        std::vector<std::string> const& paths,
+                        size_t numExposures,
+                        size_t previewLevel,
+                        size_t batchSize,
+                        std::vector<QualityWeights> const& weights,
+                        MemoryBudget& budget)
+    {
+        std::unique_ptr<ComputeContext> buffers;
+        if (context.storage != ImageStorage::BUFFER)
+        {
+            buffers.reset(new ComputeContext(ImageStorage::BUFFER));
+            buffers->tuning = context.tuning;
+
+            // work-group sizes are tuned for each kernel file, so take
+            // those of the buffer kernels if they have been tuned
+            KernelTuning bufferTuning;
+            if (loadTuning(tuningPath(*buffers, kernelFile(*buffers)), bufferTuning))
+            {
+                buffers->tuning.localSizes = bufferTuning.localSizes;
+            }
+        }
+        ComputeContext const& batchContext = buffers ? *buffers : context;
+        cl::Program program = buildProgram(batchContext, ProgramVariant(numExposures));
+
+        // a single batch, merged once for each of the weights
+        std::unique_ptr<BatchMerge> batch;
+        MemoryBudget::Reservation memory;
+        size_t width = 0;
+        size_t height = 0;
+        size_t index = 1;
+
+        auto mergeBatches =
+            [&]()
+            {
+                size_t const numMerges = batch->numImages() / numExposures * weights.size();
+
+                // in the order merging group by group writes them
+                std::vector<std::shared_ptr<FloatImage>> merged;
+                std::vector<FloatImageView> views;
+                for (size_t m = 0; m < numMerges; ++m)
+                {
+                    merged.push_back(std::make_shared<FloatImage>(width, height));
+                    views.push_back(merged.back()->view());
+                }
+                batch->mergeInto(views);
+
+                for (auto const& image : merged)
+                {
+                    std::stringstream sstr;
+                    sstr << "out" << index++ << ".tiff";
+                    saveTiff16(image->view(), sstr.str());
+                }
+            };
+
+        for (size_t first = 0; first + numExposures <= paths.size(); first += numExposures)
+        {
+            for (size_t i = first; i < first + numExposures; ++i)
+            {
+                std::shared_ptr<OpenedImage> in = openImage(paths[i], previewLevel, budget);
+
+                if (!batch)
                 {
-                    group->mergeInto(in->view());
-
-                    std::cout << "========================\n"
-                                 "HDR Merge complete.\n"
-                                 "========================"
-                              << std::endl;
-                    *dest = in;
-                    dest++;
-                    std::cout << std::endl;
+                    width = levelDimension(in->dimensions[0], previewLevel);
+                    height = levelDimension(in->dimensions[1], previewLevel);
+                    if (width * height > BatchMerge::maxPixels)
+                    {
+                        throw std::runtime_error("Images are too large to merge in batches, try a preview.");
+                    }
+
+                    // the input being opened holds memory of its own while
+                    // the batch is filled, so the batch has to fit beside it
+                    MemoryBudget::Limits limits = budget.limits();
+                    limits.hostBytes -= std::min(limits.hostBytes, in->memory.hostBytes());
+                    size_t const groups = BatchMerge::batchSizeWithin(width, height, numExposures,
+                                                                      batchSize, limits,
+                                                                      weights.size());
+                    if (groups == 0)
+                    {
+                        throw std::runtime_error("Not even a single group fits in a batch.");
+                    }
+
+                    MemoryBudget::Footprint footprint =
+                        BatchMerge::footprint(width, height, numExposures, groups, weights.size());
+                    memory = budget.reserve(footprint.hostBytes, footprint.deviceBytes);
+
+                    batch.reset(new BatchMerge(batchContext, program, width, height,
+                                               numExposures, groups, weights));
+                    std::cout << "Merging in batches of up to " << groups << " groups" << std::endl;
                 }
+                else if (levelDimension(in->dimensions[0], previewLevel) != width
+                         || levelDimension(in->dimensions[1], previewLevel) != height)
+                {
+                    throw std::runtime_error("Image dimensions in sequence are not equal!");
+                }
+
+                FloatImageView slot = batch->nextSlot();
+                in->decodeInto(slot);
+            }
 
+            if (batch->full())
+            {
+                mergeBatches();
             }
         }
 
-    };
+        // the last batch, which may not be full
+        if (batch && batch->numImages() > 0)
+        {
+            mergeBatches();
+        }
+    }
 
 } /* DynamiCL */ 
 
@@ -168,22 +441,170 @@ int main(int argc, char const *argv[])
     // create device, context, and queue
     ComputeContext gpu;
 
-    // Build program 
-    cl::Program program = buildProgram(gpu.context, gpu.device, "kernels.cl");
+    // kernels are specialized for groups of 3 exposures
+    ProgramVariant variant(3);
+
+    // tune kernels the first time this device is seen
+    std::string tuningFile = tuningPath(gpu, kernelFile(gpu));
+    if (!loadTuning(tuningFile, gpu.tuning))
+    {
+        std::cout << "Tuning kernels for this device..." << std::endl;
+        gpu.tuning = autotune(gpu, kernelFile(gpu), variant);
+        saveTuning(tuningFile, gpu.tuning);
+    }
 
-    // get image paths
+    // levels of up to this many pixels are processed on the host
+    if (char const* hostLevels = std::getenv("DYNAMICL_HOST_LEVEL_PIXELS"))
+    {
+        gpu.tuning.hostLevelPixels = std::strtoul(hostLevels, nullptr, 10);
+    }
+
+    // Build program 
+    cl::Program program = buildProgram(gpu, variant);
+
+    // share memory with other jobs on this host
+    MemoryBudget budget(MemoryBudget::Limits::fromSystem(DeviceCapabilities(gpu.device)));
+
+    // get image paths, after options:
+    //   --preview=<level>  merge at 1/2^level of the full resolution
+    //   --cache=<dir>      keep pyramids of inputs in dir, for later runs
+    //   --weights=<w>      quality weights, as a preset name or "c,s,e".
+    //                      repeat to merge once for each.
+    //   --groups=<n>       merge groups in flight at once, 2 by default
+    //   --frames           inputs are frames of a sequence, like a timelapse,
+    //                      all of the same size. buffers are allocated for the
+    //                      first frames and reused for the rest. prints the
+    //                      image memory, host and device, each frame allocates.
+    //   --window           merge every input with the ones just before it,
+    //                      as for continuous bracketing, instead of merging
+    //                      separate groups
+    //   --align[=<level>]  translate the images of a merge onto each other,
+    //                      for handheld brackets, searching translations
+    //                      from the given pyramid level on, 1 by default
+    //   --bands[=<levels>] merge JPEG images too large for memory, like
+    //                      panoramas, on the host in bands of rows, over
+    //                      pyramids of as many levels as fit by default
+    //   --batch[=<groups>] merge small images, like thumbnails, in batches
+    //                      of up to 64 groups by default, as many as fit,
+    //                      with a launch per step for all of them
+    size_t previewLevel = 0;
+    size_t maxGroups = 2;
+    bool frameMode = false;
+    bool slidingWindow = false;
+    bool align = false;
+    size_t alignLevel = 1;
+    bool bands = false;
+    size_t bandLevels = 0; ///< 0 for as many as fit
+    bool batch = false;
+    size_t batchGroups = 64;
+    std::unique_ptr<PyramidCache> cache;
+    std::vector<QualityWeights> weights;
     std::vector<std::string> paths;
-    std::copy_n( &argv[1], argc-1, std::back_inserter(paths) );
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.compare(0, 10, "--preview=") == 0)
+        {
+            previewLevel = std::strtoul(arg.c_str() + 10, nullptr, 10);
+        }
+        else if (arg.compare(0, 8, "--cache=") == 0)
+        {
+            cache.reset(new PyramidCache(arg.substr(8)));
+        }
+        else if (arg.compare(0, 10, "--weights=") == 0)
+        {
+            weights.push_back(QualityWeights::parse(arg.substr(10)));
+        }
+        else if (arg.compare(0, 9, "--groups=") == 0)
+        {
+            maxGroups = std::max<size_t>(std::strtoul(arg.c_str() + 9, nullptr, 10), 1);
+        }
+        else if (arg == "--frames")
+        {
+            frameMode = true;
+        }
+        else if (arg == "--window")
+        {
+            slidingWindow = true;
+        }
+        else if (arg == "--align")
+        {
+            align = true;
+        }
+        else if (arg.compare(0, 8, "--align=") == 0)
+        {
+            align = true;
+            alignLevel = std::strtoul(arg.c_str() + 8, nullptr, 10);
+        }
+        else if (arg == "--bands")
+        {
+            bands = true;
+        }
+        else if (arg.compare(0, 8, "--bands=") == 0)
+        {
+            bands = true;
+            bandLevels = std::strtoul(arg.c_str() + 8, nullptr, 10);
+        }
+        else if (arg == "--batch")
+        {
+            batch = true;
+        }
+        else if (arg.compare(0, 8, "--batch=") == 0)
+        {
+            batch = true;
+            batchGroups = std::max<size_t>(std::strtoul(arg.c_str() + 8, nullptr, 10), 1);
+        }
+        else
+        {
+            paths.push_back(arg);
+        }
+    }
 
-    // set up transformation functions
+    if (weights.empty())
+    {
+        weights.push_back(QualityWeights());
+    }
+
+    if (bands && batch)
+    {
+        throw std::invalid_argument("Images are either merged in bands or in batches.");
+    }
 
-    auto toFloatImage =
-        [&]( std::shared_ptr<vigra::BRGBImage> im )
+    if (bands)
+    {
+        if (slidingWindow || align || frameMode || cache)
         {
-            return transformToFloat4(*im);
-        };
+            throw std::invalid_argument("Merging in bands only merges separate groups, as they are.");
+        }
+        mergeInBands(paths, 3, previewLevel, bandLevels, weights, budget);
+        return 0;
+    }
 
-    int currentIndex = 1;
+    if (batch)
+    {
+        if (slidingWindow || align || frameMode || cache)
+        {
+            throw std::invalid_argument("Merging in batches only merges separate groups, as they are.");
+        }
+        mergeInBatches(gpu, paths, 3, previewLevel, batchGroups, weights, budget);
+        return 0;
+    }
+
+    std::string const parameters = pyramidParameters(gpu, variant, previewLevel, weights);
+
+    std::unique_ptr<FrameBuffers> frames;
+    if (frameMode)
+    {
+        frames.reset(new FrameBuffers);
+    }
+
+    // image memory this program allocates is counted, but not the small
+    // allocations of operator new, which only the test suite hooks
+    AllocationCounts lastCounts = AllocationCounts::current();
+
+    // set up transformation functions
+
+    size_t currentIndex = 1;
     auto saveImage =
         [&]( std::shared_ptr<FloatImage> im )
         {
@@ -193,16 +614,44 @@ int main(int argc, char const *argv[])
 
             // save image
             saveTiff16(im->view(), sstr.str());
+
+            if (frameMode)
+            {
+                AllocationCounts counts = AllocationCounts::current();
+                std::cout << "Frame " << currentIndex << ": " << (counts - lastCounts) << std::endl;
+                lastCounts = counts;
+            }
             ++currentIndex;
         };
 
+    // inputs opened ahead of the merge, as many as the memory plan allows
+    PipelineGate gate;
+
     // create pipeline
     std::future<void> fut =
           Plumbing::makeSource(paths)
-          >> loadImage
-          >> toFloatImage
-          >> Plumbing::makeIteratorFilter<std::shared_ptr<FloatImage>,
-                                          std::shared_ptr<FloatImage>>(mergeHDR{ 3, gpu, program })
+          >> [&](std::string const& path)
+             {
+                 PipelineGate::Ticket ticket = gate.enter();
+
+                 // an image whose pyramid is cached is not decoded at all
+                 std::string key;
+                 bool cached = false;
+                 if (cache)
+                 {
+                     key = PyramidCache::key(path, parameters);
+                     cached = cache->contains(key);
+                 }
+
+                 auto opened = openImage(path, previewLevel, budget, frames.get(), cached);
+                 opened->ticket = std::move(ticket);
+                 opened->cacheKey = std::move(key);
+                 return opened;
+             }
+          >> Plumbing::makeIteratorFilter<std::shared_ptr<OpenedImage>,
+                                          std::shared_ptr<FloatImage>>(
+                  mergeHDR{ 3, gpu, program, previewLevel, cache.get(), weights, budget, gate, maxGroups,
+                           frames.get(), slidingWindow, align, alignLevel })
           >> saveImage;
 
     // wait for pipeline to complete
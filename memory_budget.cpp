@@ -0,0 +1,355 @@
+#include "memory_budget.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <unistd.h>
+
+namespace
+{
+    using namespace DynamiCL;
+
+    // most inputs opened ahead of the groups waiting for them
+    size_t const s_maxPipelineDepth = 16;
+
+    // how often to check whether other processes released host memory
+    std::chrono::milliseconds const s_pollInterval(100);
+
+    size_t physicalBytes()
+    {
+        return static_cast<size_t>(::sysconf(_SC_PHYS_PAGES))
+             * static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    }
+
+    /**
+     * Lower @a limit to the value of environment variable @a name, if set
+     */
+    size_t limitFromEnv(char const* name, size_t limit)
+    {
+        if (char const* value = std::getenv(name))
+        {
+            return std::min(limit, MemoryBudget::parseBytes(value));
+        }
+        return limit;
+    }
+}
+
+namespace DynamiCL
+{
+
+    MemoryBudget::Limits MemoryBudget::Limits::fromSystem(DeviceCapabilities const& caps)
+    {
+        Limits limits;
+        limits.hostBytes = limitFromEnv("DYNAMICL_HOST_MEMORY", physicalBytes());
+        limits.deviceBytes = limitFromEnv("DYNAMICL_DEVICE_MEMORY", caps.memSize);
+        limits.maxAllocBytes = std::min<size_t>(caps.maxAllocSize, limits.deviceBytes);
+        return limits;
+    }
+
+    /***************************************************************************
+     *                               Reservation                               *
+     ***************************************************************************/
+
+    MemoryBudget::Reservation::Reservation()
+        : budget_(nullptr),
+          hostBytes_(0),
+          deviceBytes_(0)
+    { }
+
+    MemoryBudget::Reservation::Reservation(MemoryBudget* budget, size_t hostBytes, size_t deviceBytes)
+        : budget_(budget),
+          hostBytes_(hostBytes),
+          deviceBytes_(deviceBytes)
+    { }
+
+    MemoryBudget::Reservation::Reservation(Reservation&& other)
+        : budget_(other.budget_),
+          hostBytes_(other.hostBytes_),
+          deviceBytes_(other.deviceBytes_)
+    {
+        other.budget_ = nullptr;
+        other.hostBytes_ = 0;
+        other.deviceBytes_ = 0;
+    }
+
+    MemoryBudget::Reservation& MemoryBudget::Reservation::operator =(Reservation&& other)
+    {
+        if (this != &other)
+        {
+            release();
+            std::swap(budget_, other.budget_);
+            std::swap(hostBytes_, other.hostBytes_);
+            std::swap(deviceBytes_, other.deviceBytes_);
+        }
+        return *this;
+    }
+
+    MemoryBudget::Reservation::~Reservation()
+    {
+        release();
+    }
+
+    void MemoryBudget::Reservation::release()
+    {
+        if (budget_)
+        {
+            budget_->release(hostBytes_, deviceBytes_);
+        }
+        budget_ = nullptr;
+        hostBytes_ = 0;
+        deviceBytes_ = 0;
+    }
+
+    /***************************************************************************
+     *                              MemoryBudget                               *
+     ***************************************************************************/
+
+    MemoryBudget::MemoryBudget(Limits const& limits, AvailableFunc available)
+        : limits_(limits),
+          available_(available ? available : AvailableFunc(&MemoryBudget::systemAvailableBytes)),
+          hostReserved_(0),
+          deviceReserved_(0)
+    { }
+
+    MemoryBudget::Plan MemoryBudget::plan(Footprint const& footprint, size_t inputBytes) const
+    {
+        if (footprint.hostBytes > limits_.hostBytes)
+        {
+            throw std::runtime_error("Merging these images needs more host memory than the budget allows.");
+        }
+        if (footprint.deviceBytes > limits_.deviceBytes)
+        {
+            throw std::runtime_error("Merging these images needs more device memory than the budget allows.");
+        }
+
+        Plan plan;
+
+        plan.bandRows = footprint.rows;
+        if (footprint.bytesPerRow > 0)
+        {
+            plan.bandRows = std::min(plan.bandRows, limits_.maxAllocBytes / footprint.bytesPerRow);
+        }
+        if (plan.bandRows == 0)
+        {
+            throw std::runtime_error("A single row of these images is larger than the device can allocate.");
+        }
+
+        plan.concurrency = limits_.hostBytes / std::max<size_t>(footprint.hostBytes, 1);
+        if (footprint.deviceBytes > 0)
+        {
+            plan.concurrency = std::min(plan.concurrency, limits_.deviceBytes / footprint.deviceBytes);
+        }
+
+        // groups are reserved while an input waits for them, so at least
+        // one input has to fit next to all of them
+        while (plan.concurrency > 1
+               && limits_.hostBytes - plan.concurrency * footprint.hostBytes < inputBytes)
+        {
+            --plan.concurrency;
+        }
+        if (limits_.hostBytes - plan.concurrency * footprint.hostBytes < inputBytes)
+        {
+            throw std::runtime_error("Merging these images leaves no host memory for the input of a group.");
+        }
+
+        // inputs get whatever the groups leave
+        size_t const spare = limits_.hostBytes - plan.concurrency * footprint.hostBytes;
+        plan.pipelineDepth = s_maxPipelineDepth;
+        if (inputBytes > 0)
+        {
+            plan.pipelineDepth = std::min(plan.pipelineDepth, spare / inputBytes);
+        }
+        plan.pipelineDepth = std::max<size_t>(plan.pipelineDepth, 1);
+
+        return plan;
+    }
+
+    bool MemoryBudget::fits(size_t hostBytes, size_t deviceBytes) const
+    {
+        return hostReserved_ + hostBytes <= limits_.hostBytes
+            && deviceReserved_ + deviceBytes <= limits_.deviceBytes
+            && (hostBytes == 0 || hostBytes <= available_());
+    }
+
+    MemoryBudget::Reservation MemoryBudget::reserve(size_t hostBytes, size_t deviceBytes)
+    {
+        if (hostBytes > limits_.hostBytes || deviceBytes > limits_.deviceBytes)
+        {
+            throw std::invalid_argument("Reservation is larger than the whole memory budget.");
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        // other processes do not notify us, so check again now and then
+        while (!fits(hostBytes, deviceBytes))
+        {
+            released_.wait_for(lock, s_pollInterval);
+        }
+
+        hostReserved_ += hostBytes;
+        deviceReserved_ += deviceBytes;
+        return Reservation(this, hostBytes, deviceBytes);
+    }
+
+    MemoryBudget::Reservation MemoryBudget::tryReserve(size_t hostBytes, size_t deviceBytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!fits(hostBytes, deviceBytes))
+        {
+            return Reservation();
+        }
+
+        hostReserved_ += hostBytes;
+        deviceReserved_ += deviceBytes;
+        return Reservation(this, hostBytes, deviceBytes);
+    }
+
+    void MemoryBudget::release(size_t hostBytes, size_t deviceBytes)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            hostReserved_ -= hostBytes;
+            deviceReserved_ -= deviceBytes;
+        }
+        released_.notify_all();
+    }
+
+    size_t MemoryBudget::hostReserved() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return hostReserved_;
+    }
+
+    size_t MemoryBudget::deviceReserved() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return deviceReserved_;
+    }
+
+    size_t MemoryBudget::parseBytes(std::string const& s)
+    {
+        std::istringstream in(s);
+        unsigned long long value = 0;
+        if (!(in >> value))
+        {
+            throw std::invalid_argument("Not a memory size: " + s);
+        }
+
+        char unit = 0;
+        if (in >> unit)
+        {
+            size_t shift = 0;
+            switch (unit)
+            {
+                case 'k': case 'K': shift = 10; break;
+                case 'm': case 'M': shift = 20; break;
+                case 'g': case 'G': shift = 30; break;
+                default:
+                    throw std::invalid_argument("Not a memory size: " + s);
+            }
+            value <<= shift;
+        }
+
+        if (!(in >> std::ws).eof())
+        {
+            throw std::invalid_argument("Not a memory size: " + s);
+        }
+        return value;
+    }
+
+    size_t MemoryBudget::systemAvailableBytes()
+    {
+        std::ifstream meminfo("/proc/meminfo");
+        std::string line;
+        while (std::getline(meminfo, line))
+        {
+            // "MemAvailable:   12345678 kB"
+            if (line.compare(0, 13, "MemAvailable:") == 0)
+            {
+                return std::strtoull(line.c_str() + 13, nullptr, 10) * 1024;
+            }
+        }
+        return physicalBytes();
+    }
+
+    /***************************************************************************
+     *                              PipelineGate                               *
+     ***************************************************************************/
+
+    PipelineGate::Ticket::Ticket(Ticket&& other)
+        : gate_(other.gate_)
+    {
+        other.gate_ = nullptr;
+    }
+
+    PipelineGate::Ticket& PipelineGate::Ticket::operator =(Ticket&& other)
+    {
+        if (this != &other)
+        {
+            release();
+            std::swap(gate_, other.gate_);
+        }
+        return *this;
+    }
+
+    PipelineGate::Ticket::~Ticket()
+    {
+        release();
+    }
+
+    void PipelineGate::Ticket::release()
+    {
+        if (gate_)
+        {
+            gate_->leave();
+        }
+        gate_ = nullptr;
+    }
+
+    PipelineGate::PipelineGate(size_t capacity)
+        : capacity_(std::max<size_t>(capacity, 1)),
+          held_(0)
+    { }
+
+    PipelineGate::Ticket PipelineGate::enter()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        released_.wait(lock, [this]() { return held_ < capacity_; });
+        ++held_;
+        return Ticket(this);
+    }
+
+    void PipelineGate::setCapacity(size_t capacity)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            capacity_ = std::max<size_t>(capacity, 1);
+        }
+        released_.notify_all();
+    }
+
+    size_t PipelineGate::capacity() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return capacity_;
+    }
+
+    size_t PipelineGate::held() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return held_;
+    }
+
+    void PipelineGate::leave()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            --held_;
+        }
+        released_.notify_all();
+    }
+
+}
@@ -0,0 +1,242 @@
+#ifndef MEMORY_BUDGET_H_T3NW8RZC
+#define MEMORY_BUDGET_H_T3NW8RZC
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#include "cl_common.h"
+
+namespace DynamiCL
+{
+
+    /**
+     * Keeps track of the host and device memory that the stages of a job
+     * have reserved, so that new work waits for memory to be released
+     * instead of failing with an allocation error halfway through.
+     *
+     * Several processes may share a host, so on top of its own limit, a
+     * host reservation also waits until the system has that much memory
+     * available. Devices offer no such query, so device reservations are
+     * only accounted within the process.
+     */
+    class MemoryBudget
+    {
+    public:
+
+        /**
+         * Memory a job may use in total
+         */
+        struct Limits
+        {
+            size_t hostBytes;
+            size_t deviceBytes;
+            size_t maxAllocBytes; ///< largest single device allocation
+
+            /**
+             * Limits of the host, and of the device described by @a caps.
+             * The environment variables DYNAMICL_HOST_MEMORY and
+             * DYNAMICL_DEVICE_MEMORY lower them, e.g. to "2G", for hosts
+             * running several jobs at once.
+             */
+            static Limits fromSystem(DeviceCapabilities const& caps);
+        };
+
+        /**
+         * Memory used by one merge group, as estimated by
+         * MergeGroup::footprint()
+         */
+        struct Footprint
+        {
+            size_t hostBytes;
+            size_t deviceBytes;      ///< peak usage, over all operations
+            size_t bytesPerRow;      ///< of the largest single device allocation
+            size_t rows;             ///< of the largest single device allocation
+        };
+
+        /**
+         * How a job should be laid out to stay within the budget
+         */
+        struct Plan
+        {
+            size_t concurrency;   ///< merge groups that fit at once
+            size_t pipelineDepth; ///< inputs that may wait for a group at once
+            size_t bandRows;      ///< rows of the largest image that fit in one allocation
+        };
+
+        /**
+         * A reservation that is given back to its budget on destruction
+         */
+        class Reservation
+        {
+            MemoryBudget* budget_;
+            size_t hostBytes_;
+            size_t deviceBytes_;
+
+            friend class MemoryBudget;
+            Reservation(MemoryBudget* budget, size_t hostBytes, size_t deviceBytes);
+
+        public:
+            Reservation();
+            Reservation(Reservation&& other);
+            Reservation& operator =(Reservation&& other);
+            ~Reservation();
+
+            Reservation(Reservation const&) = delete;
+            Reservation& operator =(Reservation const&) = delete;
+
+            size_t hostBytes() const { return hostBytes_; }
+            size_t deviceBytes() const { return deviceBytes_; }
+
+            /**
+             * Give the reserved memory back early
+             */
+            void release();
+        };
+
+        /**
+         * @Return host memory currently available to new allocations,
+         * according to the system
+         */
+        typedef std::function<size_t()> AvailableFunc;
+
+        /**
+         * Budget within @a limits. @a available tells how much memory the
+         * system has left, and defaults to asking the kernel.
+         */
+        explicit MemoryBudget(Limits const& limits,
+                              AvailableFunc available = AvailableFunc());
+
+        MemoryBudget(MemoryBudget const&) = delete;
+        MemoryBudget& operator =(MemoryBudget const&) = delete;
+
+        Limits const& limits() const { return limits_; }
+
+        /**
+         * Decide how many groups of @a footprint run at once, how many
+         * inputs of @a inputBytes each may be opened ahead of them, and
+         * in bands of how many rows the largest device image has to be
+         * processed. Fewer groups run at once if that leaves no room for
+         * an input, as groups are only started once an input arrives.
+         *
+         * @throws std::runtime_error if a single group does not fit, or
+         * not next to an input.
+         */
+        Plan plan(Footprint const& footprint, size_t inputBytes) const;
+
+        /**
+         * Reserve memory, waiting for other reservations to be released
+         * until it fits.
+         *
+         * @throws std::invalid_argument if it could never fit.
+         */
+        Reservation reserve(size_t hostBytes, size_t deviceBytes);
+
+        /**
+         * Reserve memory if it fits right away.
+         * @Return an empty reservation otherwise.
+         */
+        Reservation tryReserve(size_t hostBytes, size_t deviceBytes);
+
+        size_t hostReserved() const;
+        size_t deviceReserved() const;
+
+        /**
+         * @Return number of bytes in @a s, a number optionally followed by
+         * K, M or G for binary multiples.
+         *
+         * @throws std::invalid_argument if @a s is not such a number.
+         */
+        static size_t parseBytes(std::string const& s);
+
+        /**
+         * @Return host memory available to new allocations, according to
+         * /proc/meminfo, or the physical memory if it cannot be read.
+         */
+        static size_t systemAvailableBytes();
+
+    private:
+        Limits const limits_;
+        AvailableFunc available_;
+
+        mutable std::mutex mutex_;
+        std::condition_variable released_;
+        size_t hostReserved_;
+        size_t deviceReserved_;
+
+        bool fits(size_t hostBytes, size_t deviceBytes) const;
+        void release(size_t hostBytes, size_t deviceBytes);
+    };
+
+    /**
+     * Limits how many inputs are opened ahead of the stage consuming them,
+     * to MemoryBudget::Plan::pipelineDepth, so that the memory they hold
+     * never keeps a group from reserving its own.
+     *
+     * An input holds a ticket from being opened until it is consumed.
+     */
+    class PipelineGate
+    {
+    public:
+        /**
+         * A place in the gate, given back on destruction
+         */
+        class Ticket
+        {
+            PipelineGate* gate_;
+
+            friend class PipelineGate;
+            explicit Ticket(PipelineGate* gate) : gate_(gate) { }
+
+        public:
+            Ticket() : gate_(nullptr) { }
+            Ticket(Ticket&& other);
+            Ticket& operator =(Ticket&& other);
+            ~Ticket();
+
+            Ticket(Ticket const&) = delete;
+            Ticket& operator =(Ticket const&) = delete;
+
+            bool valid() const { return gate_ != nullptr; }
+
+            /**
+             * Give the place back early
+             */
+            void release();
+        };
+
+        /**
+         * Gate letting @a capacity inputs through at once, 1 until the
+         * first input tells how large they are
+         */
+        explicit PipelineGate(size_t capacity = 1);
+
+        PipelineGate(PipelineGate const&) = delete;
+        PipelineGate& operator =(PipelineGate const&) = delete;
+
+        /**
+         * Wait until fewer than capacity() tickets are held, and take one
+         */
+        Ticket enter();
+
+        /**
+         * Let @a capacity inputs through at once from now on, at least one
+         */
+        void setCapacity(size_t capacity);
+
+        size_t capacity() const;
+        size_t held() const;
+
+    private:
+        mutable std::mutex mutex_;
+        std::condition_variable released_;
+        size_t capacity_;
+        size_t held_;
+
+        void leave();
+    };
+
+}
+
+#endif /* end of include guard: MEMORY_BUDGET_H_T3NW8RZC */
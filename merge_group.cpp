@@ -1,5 +1,28 @@
 #include "merge_group.h"
+
+#include <algorithm>
+
 #include "pyr_impl.h"
+#include "host_pyramid.h"
+
+namespace
+{
+    using namespace DynamiCL;
+
+    /**
+     * @Return number of pyramid levels of @a width x @a height images,
+     * from @a startLevel on
+     */
+    size_t levelsFrom(size_t width, size_t height, size_t startLevel)
+    {
+        size_t numLevels = calculateNumLevels(width, height);
+        if (startLevel >= numLevels)
+        {
+            throw std::invalid_argument("Start level is beyond the pyramid of the images.");
+        }
+        return numLevels - startLevel;
+    }
+}
 
 namespace DynamiCL
 {
@@ -8,52 +31,228 @@ namespace DynamiCL
                 cl::Program const& program,
                 size_t width,
                 size_t height,
-                size_t groupSize)
-        : context_(context),
+                size_t groupSize,
+                size_t startLevel,
+                AllocationPolicy const& policy)
+        : context_(context, cl::CommandQueue(context.context, context.device)),
           program_(program),
           width_(width),
           height_(height),
-          numLevels_(calculateNumLevels(width, height)),
-          pixelsPerPyramid_(pyramidSize(width, height, numLevels_)),
+          startLevel_(startLevel),
+          numLevels_(levelsFrom(width, height, startLevel)),
+          pixelsPerPyramid_(pyramidSize(levelDimension(width, startLevel),
+                                        levelDimension(height, startLevel),
+                                        numLevels_)),
           groupSize_(groupSize),
-          arena_(pixelsPerPyramid_ * groupSize_) // total pixel count of all pyramids for merge
+          smallLevels_(supportsSmallLevels(context)),
+          policy_(policy),
+          arena_(pixelsPerPyramid_ * groupSize_, // total pixel count of all pyramids for merge
+                 policy_),
+          measuresSlotTaken_(false),
+          numMeasured_(0),
+          slidingWindow_(false),
+          oldest_(0),
+          numBuilt_(0),
+          align_(false),
+          alignLevel_(0)
     { 
         // Have to create views into memory arena that will be used by
         // the image pyramids
-        size_t levelWidth = width_;
-        size_t levelHeight = height_;
-        pixel_type* dataptr = arena_.ptr();
+        fuseViews_ = createFuseViews(arena_.ptr());
+    }
+
+    std::vector<MergeGroup::fuse_view_type> MergeGroup::createFuseViews(pixel_type* dataptr) const
+    {
+        std::vector<fuse_view_type> views;
+
+        size_t levelWidth = levelDimension(width_, startLevel_);
+        size_t levelHeight = levelDimension(height_, startLevel_);
 
         // create views level by level
         for (size_t level = 0; level < numLevels_; ++level)
         {
-            fuseViews_.emplace_back(std::array<size_t, 3>{{levelWidth, levelHeight, groupSize_}},
-                                    dataptr);
+            views.emplace_back(std::array<size_t, 3>{{levelWidth, levelHeight, groupSize_}},
+                               dataptr);
 
             // move the data ptr forward in the arena
-            dataptr += fuseViews_.back().totalSize();
+            dataptr += views.back().totalSize();
             // halve the dimensions for the next level
             levelWidth = halveDimension(levelWidth);
             levelHeight = halveDimension(levelHeight);
         }
+
+        return views;
+    }
+
+    MemoryBudget::Footprint MergeGroup::footprint(size_t width,
+                                                  size_t height,
+                                                  size_t groupSize,
+                                                  size_t startLevel,
+                                                  size_t numVariants,
+                                                  bool slidingWindow,
+                                                  bool align,
+                                                  bool spill)
+    {
+        size_t const levelWidth = levelDimension(width, startLevel);
+        size_t const levelHeight = levelDimension(height, startLevel);
+        size_t const pyramidPixels = pyramidSize(levelWidth, levelHeight,
+                                                 levelsFrom(width, height, startLevel));
+        size_t const imagePixels = levelWidth * levelHeight;
+
+        // arena, and the merged image
+        size_t hostPixels = (spill ? 0 : pyramidPixels * groupSize) + imagePixels;
+        if (numVariants > 1)
+        {
+            // measures, fused pyramid, and the other merged images
+            hostPixels += (spill ? 0 : pyramidPixels * groupSize + pyramidPixels)
+                        + (numVariants - 1) * imagePixels;
+        }
+        else if ((slidingWindow || align) && !spill)
+        {
+            // fused pyramid
+            hostPixels += pyramidPixels;
+        }
+
+        MemoryBudget::Footprint footprint;
+        footprint.hostBytes = hostPixels * sizeof(pixel_type);
+        if (align)
+        {
+            // two bytes per pixel of the bitmaps, at most from the first level
+            footprint.hostBytes += 2 * pyramidPixels * groupSize;
+        }
+        // fusing the largest level takes all its layers and the fused level,
+        // building it takes the level, its laplacian and downsampled rows
+        footprint.deviceBytes = std::max<size_t>(groupSize + 1, 3) * imagePixels * sizeof(pixel_type);
+        // the largest allocation is the array of layers of the largest level
+        footprint.bytesPerRow = levelWidth * groupSize * sizeof(pixel_type);
+        footprint.rows = levelHeight;
+        return footprint;
     }
 
     MergeGroup::MergeGroup(MergeGroup&& other)
-        : context_(other.context_),
+        : context_(other.context_, other.context_.queue),
           program_(other.program_),
           width_(other.width_),
           height_(other.height_),
+          startLevel_(other.startLevel_),
           numLevels_(other.numLevels_),
           pixelsPerPyramid_(other.pixelsPerPyramid_),
           groupSize_(other.groupSize_),
+          smallLevels_(other.smallLevels_),
+          policy_(other.policy_),
           arena_(std::move(other.arena_)),
           fuseViews_(std::move(other.fuseViews_)),
-          pyramids_(std::move(other.pyramids_))
+          pyramids_(std::move(other.pyramids_)),
+          measuresArena_(std::move(other.measuresArena_)),
+          measureViews_(std::move(other.measureViews_)),
+          measuresSlotTaken_(other.measuresSlotTaken_),
+          numMeasured_(other.numMeasured_),
+          fusedArena_(std::move(other.fusedArena_)),
+          slidingWindow_(other.slidingWindow_),
+          oldest_(other.oldest_),
+          numBuilt_(other.numBuilt_),
+          align_(other.align_),
+          alignLevel_(other.alignLevel_),
+          bitmaps_(std::move(other.bitmaps_)),
+          shifts_(std::move(other.shifts_))
     {
+        context_.imagePool = std::move(other.context_.imagePool);
         // TODO: invalidate other
     }
 
 
+    void MergeGroup::releaseHostMemory() const
+    {
+        if (context_.zeroCopy)
+        {
+            context_.queue.finish();
+        }
+    }
+
+    void MergeGroup::reuseDeviceImages()
+    {
+        if (!context_.imagePool)
+        {
+            context_.imagePool.reset(new DeviceImagePool);
+        }
+    }
+
+    void MergeGroup::releaseDeviceImages()
+    {
+        if (context_.imagePool)
+        {
+            context_.imagePool->releaseAll(context_.queue);
+        }
+    }
+
+    void MergeGroup::enableAlignment(size_t level)
+    {
+        align_ = true;
+        alignLevel_ = std::min(level, numLevels_ - 1);
+        bitmaps_.resize(groupSize_);
+    }
+
+    std::array<size_t, 2> MergeGroup::outputDimensions() const
+    {
+        return {{ levelDimension(width_, startLevel_), levelDimension(height_, startLevel_) }};
+    }
+
+    MergeGroup::view_type MergeGroup::nextSlot()
+    {
+        if (pyramids_.size() == groupSize_)
+        {
+            throw std::invalid_argument("Group already contains enough images to fuse. Cannot add another.");
+        }
+
+        // a slot of the ring, or of a frame before, may still be in use
+        releaseHostMemory();
+        return fuseViews_.front()[nextSlotIndex()];
+    }
+
+    MergeGroup::view_type MergeGroup::nextMeasuresSlot()
+    {
+        if (pyramids_.size() == groupSize_)
+        {
+            throw std::invalid_argument("Group already contains enough images to fuse. Cannot add another.");
+        }
+
+        view_type slot = measureViews().front()[nextSlotIndex()];
+
+        releaseHostMemory();
+        measuresSlotTaken_ = true;
+        return slot;
+    }
+
+    std::vector<MergeGroup::fuse_view_type>& MergeGroup::measureViews()
+    {
+        if (measureViews_.empty())
+        {
+            measuresArena_ = array_ptr<pixel_type, 256>(pixelsPerPyramid_ * groupSize_, policy_);
+            measureViews_ = createFuseViews(measuresArena_.ptr());
+        }
+        return measureViews_;
+    }
+
+    std::vector<MergeGroup::view_type> MergeGroup::measureLevels(size_t index) const
+    {
+        if (index >= pyramids_.size())
+        {
+            throw std::out_of_range("No such image in the group.");
+        }
+        if (numMeasured_ != pyramids_.size())
+        {
+            throw std::logic_error("Images of the group were added without their quality measures.");
+        }
+
+        releaseHostMemory();
+        std::vector<view_type> levels;
+        for (fuse_view_type measureView : measureViews_)
+        {
+            levels.push_back(measureView[(oldest_ + index) % groupSize_]);
+        }
+        return levels;
+    }
+
     void MergeGroup::addImage(view_type const& image)
     {
         if (image.width() != width_ || image.height() != height_)
@@ -61,6 +260,16 @@ namespace DynamiCL
             throw std::invalid_argument("Dimensions of image passed in differ to others in the sequence.");
         }
 
+        // transfer input image into first level of pyramid,
+        // skipping levels before the start level
+        view_type slot = nextSlot();
+        downscaleHostImage(image, slot);
+
+        addImage();
+    }
+
+    void MergeGroup::addImage()
+    {
         if (pyramids_.size() == groupSize_)
         {
             throw std::invalid_argument("Group already contains enough images to fuse. Cannot add another.");
@@ -68,64 +277,363 @@ namespace DynamiCL
 
         // TODO: do quality mask here, then create pyramid from Pending image
 
-        // which image in the group is this
-        size_t imageNum = pyramids_.size();
+        // which slot of the group is this
+        size_t imageNum = nextSlotIndex();
 
-        // create subviews from arena for a single pyramid
+        // create subviews from arena for a single pyramid.
+        // the first level already holds the image.
         std::vector< view_type > subviews;
         for (auto& fuseView : fuseViews_)
         {
             subviews.push_back(fuseView[imageNum]);
         }
 
-        // transfer input image into first level of pyramid
-        std::copy(image.begin(), image.end(), subviews.front().begin());
-
         std::cout << "========================\n"
                      "Creating Pyramid.\n"
                      "========================"
                   << std::endl;
-        ImagePyramid pyramid(context_, std::move(subviews),
-                [=](Pending2DImage const& im)
+
+        if (context_.storage == ImageStorage::BUFFER)
+        {
+            buildPyramid<BufferImage2D>(std::move(subviews));
+        }
+        else
+        {
+            buildPyramid<cl::Image2D>(std::move(subviews));
+        }
+
+        // weights at lower levels are gaussians of the measures
+        if (measuresSlotTaken_)
+        {
+            std::vector< view_type > measureLevels;
+            for (auto& measureView : measureViews_)
+            {
+                measureLevels.push_back(measureView[imageNum]);
+            }
+            buildGaussianHostLevels(measureLevels);
+
+            measuresSlotTaken_ = false;
+            ++numMeasured_;
+        }
+
+        if (align_)
+        {
+            thresholdSlot(imageNum);
+        }
+
+        // the pyramid, and the quality mask before it, are done with
+        releaseDeviceImages();
+    }
+
+    bool MergeGroup::addCachedImage(PyramidCache const& cache, std::string const& key,
+                                    bool measures)
+    {
+        if (pyramids_.size() == groupSize_)
+        {
+            throw std::invalid_argument("Group already contains enough images to fuse. Cannot add another.");
+        }
+
+        std::vector< view_type > subviews;
+        for (auto& fuseView : fuseViews_)
+        {
+            subviews.push_back(fuseView[nextSlotIndex()]);
+        }
+        if (measures)
+        {
+            for (auto& measureView : measureViews())
+            {
+                subviews.push_back(measureView[nextSlotIndex()]);
+            }
+        }
+
+        releaseHostMemory();
+        if (!cache.load(key, subviews))
+        {
+            return false;
+        }
+        subviews.resize(numLevels_);
+
+        // memory belongs to the arena
+        pyramids_.push_back(ImagePyramid(array_ptr<pixel_type>(), context_, std::move(subviews)));
+        if (measures)
+        {
+            ++numMeasured_;
+        }
+
+        if (align_)
+        {
+            thresholdSlot((oldest_ + pyramids_.size() - 1) % groupSize_);
+        }
+        return true;
+    }
+
+    void MergeGroup::thresholdSlot(size_t slot)
+    {
+        std::vector<view_type> gaussians = fusedPyramid().levels();
+        gaussians.erase(gaussians.begin(), gaussians.begin() + alignLevel_);
+
+        for (size_t i = 0; i < gaussians.size(); ++i)
+        {
+            view_type laplacian = fuseViews_[alignLevel_ + i][slot];
+            std::copy(laplacian.begin(), laplacian.end(), gaussians[i].begin());
+        }
+        collapseHostLevels(gaussians);
+
+        bitmaps_[slot].assign(gaussians);
+    }
+
+    std::vector<Translation> MergeGroup::alignmentShifts() const
+    {
+        if (!align_ || pyramids_.size() < 2)
+        {
+            return std::vector<Translation>();
+        }
+
+        // the middle exposure overlaps most with both ends of the bracket
+        ThresholdBitmaps const& reference = bitmaps_[(oldest_ + pyramids_.size() / 2) % groupSize_];
+
+        std::vector<Translation> shifts(groupSize_, Translation{ 0, 0 });
+        bool moved = false;
+        for (size_t i = 0; i < pyramids_.size(); ++i)
+        {
+            size_t slot = (oldest_ + i) % groupSize_;
+            Translation shift = bitmaps_[slot].offsetFrom(reference);
+
+            shifts[slot].x = shift.x * (1 << alignLevel_);
+            shifts[slot].y = shift.y * (1 << alignLevel_);
+            moved = moved || !shift.isZero();
+
+            std::cout << "Translation of slot " << slot << ": "
+                      << shifts[slot].x << ", " << shifts[slot].y << std::endl;
+        }
+
+        return moved ? shifts : std::vector<Translation>();
+    }
+
+    template <typename CLImage>
+    void MergeGroup::buildPyramid(std::vector<view_type>&& subviews)
+    {
+        ImagePyramid::BuildSmallLevelsFunc<CLImage> buildSmall;
+        if (smallLevels_)
+        {
+            buildSmall =
+                [=](PendingImage<CLImage> const& im, std::vector<view_type>& levels)
+                {
+                    buildSmallLevels(im, levels, program_);
+                };
+        }
+
+        ImagePyramid pyramid = ImagePyramid::build<CLImage>(context_, std::move(subviews),
+                [=](PendingImage<CLImage> const& im, void* upper)
                 {
-                    return createPyramidLevel(im, program_);
-                });
+                    return createPyramidLevel(im, program_, upper);
+                },
+                buildSmall,
+                context_.tuning.hostLevelPixels);
 
         pyramids_.push_back(std::move(pyramid));
+        ++numBuilt_;
     }
 
     void MergeGroup::mergeInto(view_type& dest)
     {
-        std::cout << "========================\n"
-                     "Fusing Pyramids.\n"
-                     "========================"
-                  << std::endl;
+        if (context_.storage == ImageStorage::BUFFER)
+        {
+            mergeIntoImpl<BufferImage2D>(dest);
+        }
+        else
+        {
+            mergeIntoImpl<cl::Image2D>(dest);
+        }
+    }
+
+    template <typename CLImage>
+    void MergeGroup::mergeIntoImpl(view_type& dest)
+    {
+        std::vector<Translation> shifts = alignmentShifts();
+
+        // pyramids of the group make up the next window too, and
+        // translated ones are read around where the fused one goes
+        if (slidingWindow_ || !shifts.empty())
+        {
+            ImagePyramid fused = fusedPyramid();
+            fuseAndCollapse<CLImage>(fused, dest, shifts);
+        }
+        else
+        {
+            // "borrow" first pyramid for destination
+            ImagePyramid fused( std::move(pyramids_[0]) );
+            fuseAndCollapse<CLImage>(fused, dest, shifts);
+        }
+
+        finishMerge();
+    }
+
+    ImagePyramid MergeGroup::fusedPyramid()
+    {
+        if (!fusedArena_.ptr())
+        {
+            fusedArena_ = array_ptr<pixel_type, 256>(pixelsPerPyramid_, policy_);
+        }
+
+        std::array<size_t, 2> dims = outputDimensions();
+        return ImagePyramid(array_ptr<pixel_type>(), context_,
+                            ImagePyramid::createPyramidViews(dims[0], dims[1], numLevels_,
+                                                             halveDimension, fusedArena_.ptr()));
+    }
+
+    void MergeGroup::finishMerge()
+    {
+        releaseDeviceImages();
+
+        if (!slidingWindow_)
+        {
+            pyramids_.clear();
+            numMeasured_ = 0;
+            oldest_ = 0;
+            return;
+        }
+
+        pyramids_.erase(pyramids_.begin());
+        numMeasured_ = std::min(numMeasured_, pyramids_.size());
+        oldest_ = (oldest_ + 1) % groupSize_;
+    }
+
+    void MergeGroup::mergeVariantsInto(std::vector<QualityWeights> const& weights,
+                                       std::vector<view_type>& dests)
+    {
+        if (weights.size() != dests.size())
+        {
+            throw std::invalid_argument("Need a destination for every variant of the merge.");
+        }
+
+        if (pyramids_.empty() || numMeasured_ != pyramids_.size())
+        {
+            throw std::logic_error("Images of the group were added without their quality measures.");
+        }
+
+        if (context_.storage == ImageStorage::BUFFER)
+        {
+            mergeVariantsIntoImpl<BufferImage2D>(weights, dests);
+        }
+        else
+        {
+            mergeVariantsIntoImpl<cl::Image2D>(weights, dests);
+        }
+    }
 
-        // "borrow" first pyramid for destination
-        ImagePyramid fused( std::move(pyramids_[0]) );
+    template <typename CLImage>
+    void MergeGroup::mergeVariantsIntoImpl(std::vector<QualityWeights> const& weights,
+                                           std::vector<view_type>& dests)
+    {
+        std::vector<Translation> shifts = alignmentShifts();
+
+        // pyramids of the group are kept intact for the next variant,
+        // so fuse into a pyramid of its own
+        for (size_t variant = 0; variant < weights.size(); ++variant)
+        {
+            std::array<float, 3> const w = {{ weights[variant].contrast,
+                                              weights[variant].saturation,
+                                              weights[variant].exposedness }};
 
-        ImagePyramid::fuseInto(context_, fuseViews_,
-            [&](Pending2DImageArray const& im)
+            // only the weights in alpha differ between variants
+            for (size_t level = 0; level < numLevels_; ++level)
             {
-                return fusePyramidLevel(im, program_);
-            },
-            // TODO: get rid of hack
-            const_cast<std::vector<view_type>&>(fused.levels())
-        );
+                for (size_t image = 0; image < pyramids_.size(); ++image)
+                {
+                    view_type levelView = fuseViews_[level][image];
+                    weighHostLevel(measureViews_[level][image], w, levelView);
+                }
+            }
+
+            ImagePyramid fused = fusedPyramid();
+            fuseAndCollapse<CLImage>(fused, dests[variant], shifts);
+        }
+
+        finishMerge();
+    }
+
+    template <typename CLImage>
+    void MergeGroup::fuseAndCollapse(ImagePyramid& fused, view_type& dest,
+                                     std::vector<Translation> const& shifts)
+    {
+        typedef typename detail::image_traits<CLImage>::array_type array_type;
 
         std::cout << "========================\n"
-                     "Collapsing Pyramid.\n"
+                     "Fusing and Collapsing Pyramids.\n"
                      "========================"
                   << std::endl;
 
-        fused.collapseInto(
-                [&](ImagePyramid::LevelPair const& pair)
+        ImagePyramid::FuseSmallLevelsFunc fuseSmall;
+        ImagePyramid::CollapseSmallLevelsFunc<CLImage> collapseSmall;
+        if (smallLevels_)
+        {
+            fuseSmall =
+                [&](std::vector<fuse_view_type> const& arrays, std::vector<view_type>& levels)
                 {
-                    return collapsePyramidLevel(pair, program_);
-                },
-                dest
-            );
-        pyramids_.clear();
+                    fuseSmallLevels(context_, arrays, levels, program_);
+                };
+            collapseSmall =
+                [&](std::vector<view_type> const& levels)
+                {
+                    return collapseSmallLevels<CLImage>(context_, levels, program_);
+                };
+        }
+
+        ImagePyramid::FuseLevelsFunc<CLImage> fuseLevel =
+            [&](PendingImage<array_type> const& im, size_t)
+            {
+                return fusePyramidLevel<CLImage>(im, program_);
+            };
+        ImagePyramid::FuseCollapseLevelFunc<CLImage> fuseCollapseLevel =
+            [&](PendingImage<array_type> const& im, PendingImage<CLImage> const& lower, size_t)
+            {
+                return fuseCollapsePyramidLevel<CLImage>(im, lower, program_);
+            };
+        if (!shifts.empty())
+        {
+            if (!shifts_())
+            {
+                shifts_ = cl::Buffer(context_.context, CL_MEM_READ_ONLY,
+                                     groupSize_ * sizeof(cl_int2));
+            }
+
+            std::vector<cl_int2> clshifts(groupSize_);
+            for (size_t i = 0; i < groupSize_; ++i)
+            {
+                clshifts[i].s[0] = shifts[i].x;
+                clshifts[i].s[1] = shifts[i].y;
+            }
+            context_.queue.enqueueWriteBuffer(shifts_, CL_TRUE, 0,
+                                              groupSize_ * sizeof(cl_int2), clshifts.data());
+
+            fuseLevel =
+                [&](PendingImage<array_type> const& im, size_t level)
+                {
+                    return fuseAlignedPyramidLevel<CLImage>(im, program_, shifts_, level);
+                };
+            fuseCollapseLevel =
+                [&](PendingImage<array_type> const& im, PendingImage<CLImage> const& lower,
+                    size_t level)
+                {
+                    return fuseCollapseAlignedPyramidLevel<CLImage>(im, lower, program_,
+                                                                    shifts_, level);
+                };
+        }
+
+        // only host and small levels are fused into the pyramid, the
+        // others are fused and collapsed in one kernel per level
+        ImagePyramid::fuseCollapseInto<CLImage>(context_, fuseViews_,
+            fuseLevel,
+            fuseCollapseLevel,
+            // TODO: get rid of hack
+            const_cast<std::vector<view_type>&>(fused.levels()),
+            dest,
+            fuseSmall,
+            collapseSmall,
+            context_.tuning.hostLevelPixels,
+            shifts
+        );
     }
     
 } /* DynamiCL */ 
@@ -3,10 +3,13 @@
 
 #include <vector>
 
+#include "alignment.h"
 #include "utils.h"
 #include "cl_common.h"
 #include "image_pyramid.h"
 #include "host_image.hpp"
+#include "pyramid_cache.h"
+#include "memory_budget.h"
 
 namespace DynamiCL
 {
@@ -20,15 +23,27 @@ namespace DynamiCL
         typedef pyramid_type::climage_type climage_type;
         typedef HostImageView<pixel_type, 3> fuse_view_type;
 
-        ComputeContext const& context_;
+        ComputeContext const context_; ///< with a command queue of the group's own
         cl::Program program_;
         size_t const width_;      ///< width of images in merge
         size_t const height_;     ///< height of images in merge
+        size_t const startLevel_; ///< pyramid level the merge starts from, 0 for full resolution
         size_t const numLevels_;  ///< number of levels required to merge images
         size_t const pixelsPerPyramid_; ///< number of pixels for all levels of one pyramid
         size_t const groupSize_;
+        bool const smallLevels_; ///< whether small levels are processed in single launches
+        /**
+         * Where the arenas come from: by default AllocationPolicy::local(),
+         * so that they sit on the node of the thread that creates the group
+         * and walks through it, or spilled files for groups that do not fit
+         * in memory.
+         */
+        AllocationPolicy const policy_;
         // TODO: create single reusable arena
-        array_ptr<pixel_type, 256> arena_; ///< memory arena for pyramid images
+        /**
+         * Memory arena for pyramid images
+         */
+        array_ptr<pixel_type, 256> arena_;
 
         /**
          * Contiguous views of memory that represent an array of
@@ -37,18 +52,156 @@ namespace DynamiCL
         std::vector<fuse_view_type> fuseViews_;
         std::vector<ImagePyramid> pyramids_;
 
+        /**
+         * Gaussian pyramids of the quality measures of each image, laid out
+         * like fuseViews_, so that one group can be merged with several
+         * QualityWeights. Only allocated once measures are asked for.
+         */
+        array_ptr<pixel_type, 256> measuresArena_;
+        std::vector<fuse_view_type> measureViews_;
+        bool measuresSlotTaken_; ///< whether the next image comes with measures
+        size_t numMeasured_;     ///< images whose measures are in the arena
+
+        /// fused pyramid of merges that keep the pyramids of the group
+        array_ptr<pixel_type, 256> fusedArena_;
+
+        bool slidingWindow_; ///< whether merges only drop the oldest image
+        size_t oldest_;      ///< slot of the oldest image, slots being a ring
+        size_t numBuilt_;    ///< pyramids built, rather than loaded from a cache
+
+        bool align_;        ///< whether images are translated onto each other
+        size_t alignLevel_; ///< level the smallest translations are of
+        std::vector<ThresholdBitmaps> bitmaps_; ///< of the image in each slot
+        cl::Buffer shifts_; ///< cl_int2 translation of each slot, for the kernels
+
+        std::vector<fuse_view_type> createFuseViews(pixel_type* dataptr) const;
+
+        /**
+         * In zero-copy mode, images over the arenas may still be in use on
+         * the device, which leaves their memory undefined to the host.
+         * Waits for the queue of the group before the host reads or writes
+         * the arenas again.
+         */
+        void releaseHostMemory() const;
+
+        /**
+         * Give the device images taken from the pool back to it, once
+         * nothing holds them anymore
+         */
+        void releaseDeviceImages();
+
+        /**
+         * @Return views of the gaussian pyramids of measures, allocating
+         * their arena if needed
+         */
+        std::vector<fuse_view_type>& measureViews();
+
+        /**
+         * @Return slot in the arena of the next image added
+         */
+        size_t nextSlotIndex() const
+        {
+            return (oldest_ + pyramids_.size()) % groupSize_;
+        }
+
+        /**
+         * @Return a pyramid over fusedArena_, allocating it if needed
+         */
+        ImagePyramid fusedPyramid();
+
+        /**
+         * Reset the group after a merge, or drop its oldest image
+         * in a sliding window
+         */
+        void finishMerge();
+
+        /**
+         * Threshold the gaussian levels of the pyramid in @a slot, from the
+         * alignment level on. They come from collapsing its laplacians in
+         * fusedArena_, which merges only need later.
+         */
+        void thresholdSlot(size_t slot);
+
+        /**
+         * @Return translation of each slot onto the middle image of the
+         * group, in pixels of its first level, or nothing if there is no
+         * alignment or no image has moved
+         */
+        std::vector<Translation> alignmentShifts() const;
+
+        /**
+         * Implementations for a particular device storage,
+         * picked according to the context.
+         */
+        template <typename CLImage>
+        void buildPyramid(std::vector<view_type>&& subviews);
+
+        template <typename CLImage>
+        void mergeIntoImpl(view_type& dest);
+
+        template <typename CLImage>
+        void mergeVariantsIntoImpl(std::vector<QualityWeights> const& weights,
+                                   std::vector<view_type>& dests);
+
+        /**
+         * Fuse the pyramids of the group and collapse them into @a dest, only
+         * going through the levels of @a fused for host and small levels.
+         * Pyramids are translated by @a shifts, if any, as from alignmentShifts().
+         */
+        template <typename CLImage>
+        void fuseAndCollapse(ImagePyramid& fused, view_type& dest,
+                             std::vector<Translation> const& shifts);
+
 
     public:
 
         /**
          * Create a new image group for HDR merging,
          * of specified dimensiobality
+         *
+         * @a program has to be built with buildProgram(context, variant),
+         * so that it includes the kernels for small levels.
+         *
+         * For previews, a @a startLevel above 0 skips the largest levels of
+         * the pyramids of @a width x @a height images. Images are merged at
+         * the dimensions of that level, 1/2^startLevel of the full ones, and
+         * are weighted just like in a full resolution merge.
+         *
+         * The group enqueues work on a command queue of its own, so that
+         * several groups can be processed at the same time.
+         *
+         * Pyramids, and the other arenas, are allocated with @a policy.
+         * Groups too large for memory can map them from spilled files with
+         * AllocationPolicy::spill(), which merges read level by level.
          */
         MergeGroup(ComputeContext const& context,
                 cl::Program const& program,
                 size_t width,
                 size_t height,
-                size_t groupSize);
+                size_t groupSize,
+                size_t startLevel = 0,
+                AllocationPolicy const& policy = AllocationPolicy::local());
+
+        /**
+         * @Return memory a group with these parameters uses, merging
+         * @a numVariants times, as with mergeVariantsInto(), if above 1,
+         * merging in a sliding window, if @a slidingWindow, and aligning
+         * images, if @a align. Arenas spilled to files, if @a spill, take
+         * no host memory of the budget, as the kernel drops their pages
+         * whenever memory runs low. Their pages still fill the memory the
+         * budget leaves though, so only one spilled group should be in
+         * flight at a time.
+         * Lets a MemoryBudget decide whether it fits before any of it is
+         * allocated.
+         */
+        static MemoryBudget::Footprint footprint(size_t width,
+                                                 size_t height,
+                                                 size_t groupSize,
+                                                 size_t startLevel = 0,
+                                                 size_t numVariants = 1,
+                                                 bool slidingWindow = false,
+                                                 bool align = false,
+                                                 bool spill = false);
 
         // move constructor
         MergeGroup(MergeGroup&& other);
@@ -60,6 +213,104 @@ namespace DynamiCL
         MergeGroup(MergeGroup const&) = delete;
         MergeGroup& operator = (MergeGroup const&) = delete;
 
+        /**
+         * @Return the context of the group, which shares everything with
+         * the one it was created with but the command queue. Work on
+         * images of the group, like their quality masks, should go there.
+         */
+        ComputeContext const& context() const { return context_; }
+
+        /**
+         * Keep device images the group is done with in a pool, for the
+         * next images to reuse. They are given back to the pool whenever
+         * a pyramid is built, and when a merge is through, at which point
+         * the queue of the group is finished. Once a merge is through, the
+         * next merges of images of the same dimensions allocate no device
+         * memory.
+         */
+        void reuseDeviceImages();
+
+        /**
+         * Merge overlapping windows of images, as from continuous
+         * bracketing: merges keep the pyramids of the group, and only
+         * drop the oldest image, whose slot the next image added takes.
+         * Each merge after the first then only builds one new pyramid.
+         *
+         * Images are fused in any order, so the ring of slots they end up
+         * in gives the same merge as a group filled from scratch.
+         */
+        void enableSlidingWindow() { slidingWindow_ = true; }
+
+        /**
+         * Translate images onto the middle one of the group before fusing
+         * them, to make up for a camera that moved between exposures.
+         *
+         * Translations are searched on median threshold bitmaps of the
+         * levels of each pyramid from @a level on, so they come in steps of
+         * 2^level pixels, and reach up to 2^levels pixels, levels being
+         * those of at least 16 pixels a side. Level 1 balances both for
+         * most images; higher levels are quicker, but coarser.
+         *
+         * Only affects images added afterwards.
+         */
+        void enableAlignment(size_t level = 1);
+
+        /**
+         * @Return a view onto the first level of the next free pyramid in
+         * the arena. Write an image into it, and then call addImage() to
+         * build its pyramid in place, avoiding an extra full-frame copy.
+         *
+         * The view has the dimensions of outputDimensions(), so images
+         * have to be downscaled already, e.g. while decoding.
+         */
+        view_type nextSlot();
+
+        /**
+         * @Return a view the size of nextSlot(), for the quality measures
+         * of the next image, as written by the compute_measures kernel.
+         * Images added with measures can be merged with any weights
+         * through mergeVariantsInto().
+         */
+        view_type nextMeasuresSlot();
+
+        /**
+         * Build a pyramid from the image previously written into the
+         * view returned by nextSlot(), along with a gaussian pyramid of
+         * its measures, if they were written to nextMeasuresSlot().
+         */
+        void addImage();
+
+        /**
+         * Load the pyramid stored under @a key in @a cache into the next
+         * free slot, instead of building one. With @a measures, the entry
+         * holds the gaussian pyramid of the measures of the image after
+         * its levels, as stored from levels() and measureLevels(), and the
+         * image counts as added with its measures.
+         * @Return false if the cache has no such pyramid.
+         */
+        bool addCachedImage(PyramidCache const& cache, std::string const& key,
+                            bool measures = false);
+
+        /**
+         * @Return levels of the pyramid of image @a index in the group,
+         * the oldest being 0, e.g. to store them in a PyramidCache.
+         */
+        std::vector<view_type> const& levels(size_t index) const
+        {
+            releaseHostMemory();
+            return pyramids_.at(index).levels();
+        }
+
+        /**
+         * @Return levels of the gaussian pyramid of the measures of image
+         * @a index in the group, which must have been added with them.
+         */
+        std::vector<view_type> measureLevels(size_t index) const;
+
+        /**
+         * Copy @a image into the next free slot, and build its pyramid.
+         * Full resolution images are downscaled to the start level.
+         */
         void addImage(view_type const& image);
 
         /**
@@ -69,10 +320,24 @@ namespace DynamiCL
 
         bool empty() const { return numImages() == 0; }
 
+        /**
+         * @Return the number of pyramids built since the group was
+         * created, leaving out those loaded from a cache. In a sliding
+         * window, it goes up by one for each image added.
+         */
+        size_t numPyramidsBuilt() const { return numBuilt_; }
+
+        /**
+         * @Return dimensions of the merged image, which are those of the
+         * start level
+         */
+        std::array<size_t, 2> outputDimensions() const;
+
         /**
          * Merge the images in this group into an HDR image.
          *
-         * This resets the images in this group.
+         * This resets the images in this group, or in a sliding window,
+         * drops the oldest one.
          */
         void mergeInto(view_type &);
         void mergeInto(view_type&& view)
@@ -81,6 +346,20 @@ namespace DynamiCL
             mergeInto(v);
         }
 
+        /**
+         * Merge the images in this group once for each of @a weights,
+         * into the matching view of @a dests. All images must have been
+         * added with their measures.
+         *
+         * Pyramids are only built once, so each extra variant costs just
+         * the weighting of the levels, fusing and collapsing.
+         *
+         * This resets the images in this group, or in a sliding window,
+         * drops the oldest one.
+         */
+        void mergeVariantsInto(std::vector<QualityWeights> const& weights,
+                               std::vector<view_type>& dests);
+
     };
     
 } /* DynamiCL */ 
@@ -0,0 +1,46 @@
+#include "merge_pipeline.h"
+
+#include <sstream>
+
+namespace DynamiCL
+{
+
+    std::string pyramidParameters(ComputeContext const& context,
+                                  ProgramVariant const& variant,
+                                  size_t previewLevel,
+                                  std::vector<QualityWeights> const& weights)
+    {
+        std::stringstream parameters;
+        parameters << kernelFile(context) << ' '
+                   << context.device.getInfo<CL_DEVICE_NAME>() << ' '
+                   << variant.defines() << ' '
+                   << context.tuning.buildOptions << ' '
+                   << "host_levels=" << context.tuning.hostLevelPixels << ' '
+                   << "preview=" << previewLevel << ' ';
+        if (weights.size() > 1)
+        {
+            parameters << "measures";
+        }
+        else
+        {
+            parameters << "weights=" << weights.front().contrast << ','
+                                     << weights.front().saturation << ','
+                                     << weights.front().exposedness;
+        }
+        return parameters.str();
+    }
+
+    std::shared_ptr<FloatImage>
+    newFloatImage(std::array<size_t, 2> const& dims, FrameBuffers* frames)
+    {
+        if (!frames)
+        {
+            return std::make_shared<FloatImage>(dims);
+        }
+
+        return frames->floatImages.acquire(
+            [&](FloatImage const& image) { return image.view().dimensions() == dims; },
+            [&]() { return std::unique_ptr<FloatImage>(new FloatImage(dims)); });
+    }
+
+}
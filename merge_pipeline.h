@@ -0,0 +1,325 @@
+#ifndef MERGE_PIPELINE_H_R8VJ2NCU
+#define MERGE_PIPELINE_H_R8VJ2NCU
+
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <vigra/stdimage.hxx>
+
+#include "cl_utils.h"
+#include "host_image.hpp"
+#include "memory_budget.h"
+#include "merge_group.h"
+#include "pyramid_cache.h"
+#include "recycler.hpp"
+#include "save_image.h"
+
+namespace DynamiCL
+{
+    typedef HostImage<RGBA<float>, 2> FloatImage;
+    typedef vigra::BasicImage< vigra::RGBValue< vigra::UInt8 >> InputImage;
+
+    /**
+     * Images that a sequence of frames of the same dimensions, like a
+     * timelapse, passes from one frame to the next, instead of allocating
+     * them anew for each frame.
+     */
+    struct FrameBuffers
+    {
+        Recycler<InputImage> inputs;
+        Recycler<FloatImage> floatImages;
+    };
+
+    /**
+     * @Return a float image of @a dims, recycled from @a frames, if given
+     */
+    std::shared_ptr<FloatImage>
+    newFloatImage(std::array<size_t, 2> const& dims, FrameBuffers* frames);
+
+    /**
+     * @Return everything apart from an input image that goes into the
+     * pyramids mergeHDR builds on @a context, with a program of @a variant,
+     * merging from @a previewLevel with @a weights: the parameters to key
+     * their PyramidCache entries with. Those of other devices, or of
+     * other levels processed on the host, never match.
+     *
+     * With a single weight, entries hold pyramids weighed by it. With
+     * several, they hold the pyramids with the gaussian pyramids of their
+     * measures, which any weights apply to, so they leave the weights out.
+     */
+    std::string pyramidParameters(ComputeContext const& context,
+                                  ProgramVariant const& variant,
+                                  size_t previewLevel,
+                                  std::vector<QualityWeights> const& weights);
+
+    /**
+     * An input image whose dimensions are known, but whose pixels have not
+     * been written out as floats yet. Lets the merge stage decode straight
+     * into the arena of a MergeGroup.
+     */
+    struct OpenedImage
+    {
+        std::array<size_t, 2> dimensions;
+        std::function<void(FloatImageView&)> decodeInto;
+        std::string cacheKey; ///< key of its pyramid, if pyramids are cached
+        MemoryBudget::Reservation memory; ///< for pixels held until decodeInto
+        PipelineGate::Ticket ticket; ///< place among the inputs opened ahead
+    };
+
+    /**
+     * Function object for merging exposures
+     *
+     * Several groups are in flight at once, each on a command queue of its
+     * own. While one group fuses, collapses and reads back its merge, the
+     * next one gets its quality masks and pyramids, so the device keeps
+     * busy across group boundaries. Merged images still come out in the
+     * order of their inputs.
+     *
+     * In a sliding window, every input from the group size on gives a
+     * merge of itself and the inputs just before it. A single group then
+     * keeps the pyramids they share from one merge to the next.
+     */
+    struct mergeHDR
+    {
+        typedef std::vector<std::shared_ptr<FloatImage>> merged_type;
+
+        const size_t numExposures;
+        ComputeContext const& context;
+        cl::Program const& program;
+        const size_t previewLevel; ///< pyramid level to merge from, 0 for full resolution
+        PyramidCache const* cache; ///< where pyramids of inputs are kept, if anywhere
+        std::vector<QualityWeights> const& weights; ///< one merged image for each
+        MemoryBudget& budget;
+        PipelineGate& gate; ///< inputs are opened through, as many as the budget plans for
+        const size_t maxGroups; ///< groups in flight at once, if memory allows
+        FrameBuffers* frames; ///< to recycle images from, in frame mode
+        const bool slidingWindow; ///< whether groups of consecutive merges overlap
+        const bool align;         ///< whether images are translated onto each other
+        const size_t alignLevel;  ///< pyramid level alignment is searched from
+
+        /**
+         * A group, and the merge it may have in flight
+         */
+        struct GroupSlot
+        {
+            std::unique_ptr<MergeGroup> group;
+            MemoryBudget::Reservation memory;
+            std::future<merged_type> merged;
+        };
+
+        /**
+         * Merge the full @a group, once for each of the weights
+         */
+        merged_type merge(MergeGroup& group) const
+        {
+            merged_type outs;
+            std::vector<FloatImageView> views;
+            for (size_t i = 0; i < weights.size(); ++i)
+            {
+                outs.push_back(newFloatImage(group.outputDimensions(), frames));
+                views.push_back(outs.back()->view());
+            }
+
+            if (weights.size() > 1)
+            {
+                group.mergeVariantsInto(weights, views);
+            }
+            else
+            {
+                group.mergeInto(views.front());
+            }
+
+            std::cout << "========================\n"
+                         "HDR Merge complete.\n"
+                         "========================"
+                      << std::endl;
+            return outs;
+        }
+
+        /**
+         * Wait for the merge in flight in @a slot, if any, and pass on
+         * its images
+         */
+        template <typename OutputIt>
+        static void emit(GroupSlot& slot, OutputIt& dest)
+        {
+            if (!slot.merged.valid())
+            {
+                return;
+            }
+
+            for (auto& out : slot.merged.get())
+            {
+                *dest = out;
+                dest++;
+            }
+            std::cout << std::endl;
+        }
+
+        // from shared_ptr of opened image to shared_ptr of merged image
+        template <typename InputIt, typename OutputIt>
+        void operator() (InputIt cur, InputIt last, OutputIt dest)
+        {
+            // a single weight is applied right away, several go through measures
+            Kernel quality = {program, "compute_quality", Kernel::Range::SOURCE,
+                              { weights.front().toFloat4() }};
+            Kernel measures = {program, "compute_measures", Kernel::Range::SOURCE};
+
+            // with several weights, measures are kept and weighed per merge,
+            // so that cache entries hold them, rather than weighed pyramids
+            bool const variants = weights.size() > 1;
+
+            size_t width = 1;
+            size_t height = 1;
+            MemoryBudget::Footprint footprint;
+            AllocationPolicy policy = AllocationPolicy::local();
+            bool spill = false;
+
+            // filled round robin, so the next slot always holds the oldest merge
+            std::vector<GroupSlot> slots;
+            size_t current = 0;
+            while(cur != last)
+            {
+                std::shared_ptr<OpenedImage> in = *cur++;
+
+                // determine pyramid depth if this is a first image received
+                if (slots.empty())
+                {
+                    width = in->dimensions[0];
+                    height = in->dimensions[1];
+
+                    footprint = MergeGroup::footprint(width, height, numExposures,
+                                                      previewLevel, weights.size(),
+                                                      slidingWindow, align);
+                    if (footprint.hostBytes > budget.limits().hostBytes)
+                    {
+                        // rather than fail, let the kernel page pyramids in and out
+                        footprint = MergeGroup::footprint(width, height, numExposures,
+                                                          previewLevel, weights.size(),
+                                                          slidingWindow, align, true);
+                        policy = AllocationPolicy::spill();
+                        spill = true;
+                        std::cout << "Pyramids do not fit in memory, spilling them to "
+                                  << spillDirectory() << ", one group at a time" << std::endl;
+                    }
+                    MemoryBudget::Plan plan = budget.plan(footprint, width * height * 3);
+                    if (plan.bandRows < footprint.rows)
+                    {
+                        throw std::runtime_error("Images are too large for the device, try a preview, "
+                                                 "or merging in bands.");
+                    }
+
+                    // a window is only ever in one group. spilled arenas
+                    // take no budget, but their pages take the memory the
+                    // budget leaves, so a second group would only thrash it.
+                    slots.resize(slidingWindow || spill
+                                 ? 1
+                                 : std::max<size_t>(std::min(maxGroups, plan.concurrency), 1));
+                    gate.setCapacity(plan.pipelineDepth);
+                    std::cout << "Memory plan: " << slots.size() << " group(s) in flight, "
+                              << plan.pipelineDepth << " input(s) ahead" << std::endl;
+                }
+                // if subsequent images in sequence, check that sizes match
+                else if (width != in->dimensions[0] || height != in->dimensions[1]) {
+                    throw std::runtime_error("Image dimensions in sequence are not equal!");
+                }
+
+                GroupSlot& slot = slots[current];
+                if (!slot.group)
+                {
+                    // wait for other groups to leave enough memory
+                    slot.memory = budget.reserve(footprint.hostBytes, footprint.deviceBytes);
+                    slot.group.reset(new MergeGroup(context, program, width, height,
+                                                    numExposures, previewLevel, policy));
+                    if (frames)
+                    {
+                        slot.group->reuseDeviceImages();
+                    }
+                    if (slidingWindow)
+                    {
+                        slot.group->enableSlidingWindow();
+                    }
+                    if (align)
+                    {
+                        slot.group->enableAlignment(alignLevel);
+                    }
+                }
+                // arena is only free once its last merge is done.
+                // in a sliding window, that merge still reads the oldest
+                // slot, which the next image takes.
+                emit(slot, dest);
+
+                MergeGroup& group = *slot.group;
+
+                // an earlier run may already have built the pyramid
+                if (cache && group.addCachedImage(*cache, in->cacheKey, variants))
+                {
+                    std::cout << "Loaded pyramid from cache." << std::endl;
+                }
+                else
+                {
+                    // decode straight into the group's memory arena
+                    FloatImageView slotView = group.nextSlot();
+                    in->decodeInto(slotView);
+
+                    // create quality mask in image, on the queue of the group
+                    // TODO: move this into merge group
+                    std::cout << "========================\n"
+                                 "Creating Quality Mask.\n"
+                                 "========================"
+                              << std::endl;
+                    if (variants)
+                    {
+                        FloatImageView measuresSlot = group.nextMeasuresSlot();
+                        processImageInto(slotView, measures, group.context(), measuresSlot);
+                    }
+                    else
+                    {
+                        processImageInPlace(std::move(slotView), quality, group.context());
+                    }
+
+                    // build pyramid from image in slot
+                    group.addImage();
+
+                    if (cache)
+                    {
+                        size_t const index = group.numImages() - 1;
+                        std::vector<FloatImageView> levels = group.levels(index);
+                        if (variants)
+                        {
+                            for (FloatImageView const& measures : group.measureLevels(index))
+                            {
+                                levels.push_back(measures);
+                            }
+                        }
+                        cache->store(in->cacheKey, levels);
+                    }
+                }
+                in.reset(); // release decoder and its place in the gate as early as possible
+
+                // as soon as we can merge, do so, while the next group fills
+                if (group.numImages() == numExposures)
+                {
+                    MergeGroup* full = &group;
+                    slot.merged = std::async(std::launch::async,
+                                             [this, full]() { return merge(*full); });
+                    current = (current + 1) % slots.size();
+                }
+            }
+
+            // remaining merges, oldest first
+            for (size_t i = 0; i < slots.size(); ++i)
+            {
+                emit(slots[(current + i) % slots.size()], dest);
+            }
+        }
+
+    };
+
+} /* DynamiCL */
+
+#endif /* end of include guard: MERGE_PIPELINE_H_R8VJ2NCU */
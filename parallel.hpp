@@ -0,0 +1,112 @@
+#ifndef PARALLEL_HPP_N2CW7FTA
+#define PARALLEL_HPP_N2CW7FTA
+
+#include <algorithm>
+#include <iterator>
+
+#include "thread_pool.h"
+
+namespace DynamiCL
+{
+
+    /**
+     * Parallel versions of the standard algorithms used on pixels, run on
+     * the shared ThreadPool. Images are split into blocks of whole rows,
+     * each large enough to be worth a task, but small enough for idle
+     * workers to steal some from a busy one.
+     */
+
+    namespace detail
+    {
+        // pixels per task, about 1 MB of float4 pixels
+        size_t const parallel_grain = 1 << 16;
+
+        /**
+         * @Return rows per task for rows of @a width pixels
+         */
+        inline size_t rows_per_task(size_t width)
+        {
+            return std::max<size_t>(parallel_grain / std::max<size_t>(width, 1), 1);
+        }
+    }
+
+    /**
+     * Same as std::transform, for random access iterators
+     */
+    template <typename InputIt, typename OutputIt, typename UnaryOp>
+    OutputIt parallelTransform(InputIt first, InputIt last, OutputIt dest, UnaryOp op)
+    {
+        size_t const count = std::distance(first, last);
+        parallelFor(count, detail::parallel_grain,
+                    [&](size_t begin, size_t end)
+                    {
+                        std::transform(first + begin, first + end, dest + begin, op);
+                    });
+        return dest + count;
+    }
+
+    /**
+     * Same as std::copy, for random access iterators
+     */
+    template <typename InputIt, typename OutputIt>
+    OutputIt parallelCopy(InputIt first, InputIt last, OutputIt dest)
+    {
+        size_t const count = std::distance(first, last);
+        parallelFor(count, detail::parallel_grain,
+                    [&](size_t begin, size_t end)
+                    {
+                        std::copy(first + begin, first + end, dest + begin);
+                    });
+        return dest + count;
+    }
+
+    /**
+     * Call @a f with blocks of rows [first, last) of an image of
+     * @a width x @a height pixels, in parallel
+     */
+    template <typename RowFunc>
+    void parallelForRows(size_t width, size_t height, RowFunc f)
+    {
+        parallelFor(height, detail::rows_per_task(width),
+                    [&](size_t first, size_t last)
+                    {
+                        f(first, last);
+                    });
+    }
+
+    /**
+     * Transform the pixels of view @a in into @a dest, a row-major image
+     * of the same dimensions, in blocks of rows
+     */
+    template <typename View, typename OutputIt, typename UnaryOp>
+    OutputIt parallelTransform(View const& in, OutputIt dest, UnaryOp op)
+    {
+        size_t const width = in.width();
+        auto first = in.begin();
+        parallelForRows(width, in.totalSize() / std::max<size_t>(width, 1),
+                        [&](size_t firstRow, size_t lastRow)
+                        {
+                            std::transform(first + firstRow * width, first + lastRow * width,
+                                           dest + firstRow * width, op);
+                        });
+        return dest + in.totalSize();
+    }
+
+    /**
+     * Apply @a f to every pixel of @a view, in blocks of rows
+     */
+    template <typename View, typename UnaryFunc>
+    void parallelForEach(View& view, UnaryFunc f)
+    {
+        size_t const width = view.width();
+        auto first = view.begin();
+        parallelForRows(width, view.totalSize() / std::max<size_t>(width, 1),
+                        [&](size_t firstRow, size_t lastRow)
+                        {
+                            std::for_each(first + firstRow * width, first + lastRow * width, f);
+                        });
+    }
+
+}
+
+#endif /* end of include guard: PARALLEL_HPP_N2CW7FTA */
@@ -0,0 +1,82 @@
+#include "pending_graph.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace DynamiCL
+{
+
+    const size_t BufferPlan::none;
+
+    BufferPlan BufferPlan::make(std::vector<Step> const& steps)
+    {
+        size_t const numSteps = steps.size();
+
+        // results are never written over, so live past the last step
+        std::vector<size_t> lastUse(numSteps);
+        for (size_t i = 0; i < numSteps; ++i)
+        {
+            lastUse[i] = steps[i].output ? numSteps : i;
+            for (size_t input : steps[i].inputs)
+            {
+                if (input >= i)
+                {
+                    throw std::invalid_argument("Steps can only read earlier steps.");
+                }
+                lastUse[input] = std::max(lastUse[input], i);
+            }
+        }
+
+        BufferPlan plan;
+        plan.buffers.assign(numSteps, none);
+
+        std::vector<size_t> free;      // buffers nothing live is in
+        std::vector<bool> released(numSteps, false);
+        for (size_t i = 0; i < numSteps; ++i)
+        {
+            // images last read before this step are done with. those read
+            // by it are not, as it would write over its own inputs.
+            for (size_t j = 0; j < i; ++j)
+            {
+                if (!released[j] && lastUse[j] < i && plan.buffers[j] != none)
+                {
+                    free.push_back(plan.buffers[j]);
+                    released[j] = true;
+                }
+            }
+
+            if (steps[i].external)
+            {
+                continue;
+            }
+
+            // the most recently freed buffer, which is the likeliest to
+            // still be in a cache
+            auto it = std::find_if(free.rbegin(), free.rend(),
+                                   [&](size_t b) { return plan.bufferDims[b] == steps[i].dims; });
+            if (it != free.rend())
+            {
+                plan.buffers[i] = *it;
+                free.erase(std::next(it).base());
+            }
+            else
+            {
+                plan.buffers[i] = plan.bufferDims.size();
+                plan.bufferDims.push_back(steps[i].dims);
+            }
+        }
+
+        return plan;
+    }
+
+    size_t BufferPlan::numPixels() const
+    {
+        size_t pixels = 0;
+        for (auto const& dims : bufferDims)
+        {
+            pixels += dims[0] * dims[1] * dims[2];
+        }
+        return pixels;
+    }
+
+}
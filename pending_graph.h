@@ -0,0 +1,284 @@
+#ifndef PENDING_GRAPH_H_J5RW8CQL
+#define PENDING_GRAPH_H_J5RW8CQL
+
+#include "pending_image.h"
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <memory>
+#include <stdexcept>
+
+namespace DynamiCL
+{
+
+    /**
+     * Assignment of the images of a graph of kernels to device images,
+     * so that images whose last reader is done are written over by the
+     * next ones of the same dimensions, instead of each kernel getting a
+     * fresh one. Device memory of the graph is then that of the images
+     * live at the same time, at most.
+     */
+    struct BufferPlan
+    {
+        static const size_t none = std::numeric_limits<size_t>::max();
+
+        /**
+         * An image of the graph, either given to it or written by a kernel
+         * from images of earlier steps
+         */
+        struct Step
+        {
+            std::array<size_t, 3> dims;   ///< padded with 1s
+            std::vector<size_t> inputs;   ///< steps read, none for images given
+            bool external;                ///< whether the image is given, and owns its memory
+            bool output;                  ///< whether it is a result, which nothing writes over
+        };
+
+        std::vector<size_t> buffers;                 ///< of each step, none for external ones
+        std::vector<std::array<size_t, 3>> bufferDims; ///< of each buffer
+
+        /**
+         * Plan buffers for @a steps, which only read earlier steps.
+         * A kernel never writes into a buffer it reads.
+         *
+         * @throws std::invalid_argument if a step reads a later one.
+         */
+        static BufferPlan make(std::vector<Step> const& steps);
+
+        /**
+         * @Return pixels of all buffers, which all exist until the graph
+         * is done
+         */
+        size_t numPixels() const;
+    };
+
+    /**
+     * Kernels on images, recorded instead of enqueued, like a chain of
+     * PendingImage::process calls that waits to be submitted as a whole.
+     * The graph knows when each image is read for the last time, so
+     * intermediate images share device memory as BufferPlan lays out.
+     *
+     * Nodes refer to their graph, which must outlive them and stay put.
+     */
+    template <typename CLImage>
+    class PendingGraph
+    {
+    public:
+        typedef typename detail::image_traits<CLImage>::climage_type climage_type;
+        static const size_t N = detail::image_traits<climage_type>::N;
+        typedef std::array<size_t, N> dims_type;
+
+        /**
+         * An image of the graph, valid once it is submitted
+         */
+        class Node
+        {
+            PendingGraph* graph_;
+            size_t index_;
+
+            friend class PendingGraph;
+            Node(PendingGraph* graph, size_t index) : graph_(graph), index_(index) { }
+
+        public:
+            dims_type dimensions() const { return graph_->dims_[index_]; }
+
+            /**
+             * Record @a kernel processing this image into a new one of
+             * @a dims, over the range of whichever the kernel says
+             */
+            Node process(Kernel const& kernel, dims_type const& dims) const
+            {
+                cl::NDRange range = toNDRange(kernel.range == Kernel::Range::SOURCE
+                                              ? dimensions() : dims);
+                return graph_->process(kernel, dims, range, std::vector<Node>(1, *this));
+            }
+
+            /**
+             * Record @a kernel processing this image into a new one of the
+             * same dimensions
+             */
+            Node process(Kernel const& kernel) const
+            {
+                return process(kernel, dimensions());
+            }
+        };
+
+        explicit PendingGraph(ComputeContext const& context)
+            : context_(context),
+              submitted_(false)
+        { }
+
+        PendingGraph(PendingGraph const&) = delete;
+        PendingGraph& operator =(PendingGraph const&) = delete;
+
+        /**
+         * Take @a image as an input of the graph. Kernels reading it wait
+         * for its events.
+         */
+        Node input(PendingImage<CLImage> const& image)
+        {
+            BufferPlan::Step step = { detail::pool_key(image.dimensions()), {}, true, false };
+            return addStep(step, image.dimensions(), nullptr, cl::NDRange(),
+                           image.image, image.events);
+        }
+
+        /**
+         * Record @a kernel reading @a inputs, in order, and writing a new
+         * image of @a dims, over @a kernelRange, like Pending::process
+         */
+        Node process(Kernel const& kernel,
+                     dims_type const& dims,
+                     cl::NDRange const& kernelRange,
+                     std::vector<Node> const& inputs)
+        {
+            BufferPlan::Step step = { detail::pool_key(dims), {}, false, false };
+            for (Node const& input : inputs)
+            {
+                if (input.graph_ != this)
+                {
+                    throw std::invalid_argument("Kernels can only read images of their own graph.");
+                }
+                step.inputs.push_back(input.index_);
+            }
+            return addStep(step, dims, &kernel, kernelRange, climage_type(), {});
+        }
+
+        /**
+         * Make @a node a result of the graph, returned by submit() in the
+         * order of these calls. If it is read back to @a hostPtr, its image
+         * is created over that memory when the host shares it with the
+         * device, so that reading it back copies nothing.
+         */
+        void output(Node const& node, void* hostPtr = nullptr)
+        {
+            steps_[node.index_].output = true;
+            outputs_.push_back(node.index_);
+            if (sharesHostMemory(context_, hostPtr))
+            {
+                outputMemory_[node.index_] = hostPtr;
+            }
+        }
+
+        /**
+         * @Return the plan of the buffers of the graph so far
+         */
+        BufferPlan plan() const { return BufferPlan::make(steps_); }
+
+        /**
+         * Create the buffers of the graph, and enqueue all of its kernels
+         * at once. Can only be called once.
+         *
+         * @Return the images passed to output()
+         */
+        std::vector<PendingImage<CLImage>> submit()
+        {
+            if (submitted_)
+            {
+                throw std::logic_error("Graph has already been submitted.");
+            }
+            submitted_ = true;
+
+            BufferPlan const plan = this->plan();
+
+            // the buffer of an output may have been that of earlier steps,
+            // which then write into its memory before it does
+            std::vector<void*> bufferMemory(plan.bufferDims.size(), nullptr);
+            for (auto const& memory : outputMemory_)
+            {
+                bufferMemory[plan.buffers[memory.first]] = memory.second;
+            }
+
+            std::vector<climage_type> buffers;
+            for (size_t b = 0; b < plan.bufferDims.size(); ++b)
+            {
+                dims_type d;
+                std::copy(plan.bufferDims[b].begin(), plan.bufferDims[b].begin() + N, d.begin());
+                buffers.push_back(createCLImage<climage_type>(context_, d, bufferMemory[b]));
+            }
+
+            // kernels that last touched each buffer, which the next kernel
+            // writing it waits for, on queues that are not in order
+            std::vector<EventList> accesses(buffers.size());
+
+            std::vector<climage_type> inputs;
+            for (size_t i = 0; i < steps_.size(); ++i)
+            {
+                if (steps_[i].external)
+                {
+                    continue;
+                }
+
+                size_t const buffer = plan.buffers[i];
+                images_[i] = buffers[buffer];
+
+                inputs.clear();
+                EventList waitFor = accesses[buffer];
+                for (size_t input : steps_[i].inputs)
+                {
+                    inputs.push_back(images_[input]);
+                    waitFor.append(events_[input]);
+                }
+
+                cl::Kernel clkernel = kernels_[i]->buildWith(inputs, images_[i]);
+                cl::Event done = kernels_[i]->enqueue(context_, clkernel, ranges_[i], &waitFor);
+                events_[i].clear();
+                events_[i].push_back(done);
+
+                accesses[buffer].clear();
+                accesses[buffer].push_back(done);
+                for (size_t input : steps_[i].inputs)
+                {
+                    if (!steps_[input].external)
+                    {
+                        accesses[plan.buffers[input]].push_back(done);
+                    }
+                }
+            }
+
+            std::vector<PendingImage<CLImage>> results;
+            for (size_t index : outputs_)
+            {
+                results.emplace_back(context_, images_[index]);
+                results.back().events = events_[index];
+            }
+            return results;
+        }
+
+    private:
+        ComputeContext const& context_;
+        std::vector<BufferPlan::Step> steps_;
+        std::vector<dims_type> dims_;
+        std::vector<std::unique_ptr<Kernel>> kernels_;  ///< of each step, none for inputs
+        std::vector<cl::NDRange> ranges_;
+        std::vector<climage_type> images_;              ///< of inputs, and of kernels once submitted
+        std::vector<EventList> events_;                 ///< signalling each image is written
+        std::vector<size_t> outputs_;
+        std::map<size_t, void*> outputMemory_;          ///< host memory outputs are created over
+        bool submitted_;
+
+        Node addStep(BufferPlan::Step const& step,
+                     dims_type const& dims,
+                     Kernel const* kernel,
+                     cl::NDRange const& range,
+                     climage_type const& image,
+                     EventList const& events)
+        {
+            if (submitted_)
+            {
+                throw std::logic_error("Graph has already been submitted.");
+            }
+
+            steps_.push_back(step);
+            dims_.push_back(dims);
+            kernels_.emplace_back(kernel ? new Kernel(*kernel) : nullptr);
+            ranges_.push_back(range);
+            images_.push_back(image);
+            events_.push_back(events);
+            return Node(this, steps_.size() - 1);
+        }
+    };
+
+}
+
+#endif /* end of include guard: PENDING_GRAPH_H_J5RW8CQL */
@@ -4,6 +4,8 @@
 #include "cl_common.h"
 #include "kernel.hpp"
 
+#include <cstring>
+
 namespace DynamiCL
 {
     template <typename CLImage>
@@ -30,7 +32,7 @@ namespace DynamiCL
 
         ComputeContext const& context;
         climage_type image;
-        std::vector<cl::Event> events;
+        EventList events;
 
         PendingImage(PendingImage&& other)
             : context(other.context),
@@ -60,23 +62,9 @@ namespace DynamiCL
               events()
         { }
 
-        size_t width() const {
-            return this->image.template getImageInfo<
-                        detail::image_traits<climage_type>::dim_info[0]
-                    >();
-        }
-
-        size_t height() const {
-            return this->image.template getImageInfo<
-                        detail::image_traits<climage_type>::dim_info[1]
-                    >();
-        }
-
-        size_t depth() const {
-            return this->image.template getImageInfo<
-                        detail::image_traits<climage_type>::dim_info[2]
-                    >();
-        }
+        size_t width()  const { return dimensions()[0]; }
+        size_t height() const { return dimensions()[1]; }
+        size_t depth()  const { return dimensions()[2]; }
 
         std::array<size_t, N> dimensions() const
         {
@@ -102,15 +90,8 @@ namespace DynamiCL
             cl::Kernel clkernel = kernel.build(this->image, result.image);
 
             // enqueue kernel computation
-            cl::Event complete;
-            context.queue.enqueueNDRangeKernel(clkernel,
-                                       cl::NullRange,
-                                       kernelRange,
-                                       cl::NullRange, 
-                                       &this->events,
-                                       &complete);
-
-            result.events.push_back(complete);
+            result.events.push_back(
+                    kernel.enqueue(context, clkernel, kernelRange, &this->events));
 
             return result;
         }
@@ -170,36 +151,61 @@ namespace DynamiCL
         PendingImage process(Kernel const& kernel) const;
 
         /**
-         * Read image into host memory
+         * Read image into host memory.
+         *
+         * In zero-copy mode, the image is mapped instead, so images
+         * created over @a hostPtr are read without copying at all.
          */
         void readInto(void* hostPtr) const;
-        
+
+        /**
+         * Start reading the image into host memory, without waiting for
+         * it. @a hostPtr has to stay valid until the returned event is
+         * complete, e.g. once waitForEvents() returns for it.
+         *
+         * In zero-copy mode, images created over @a hostPtr are mapped
+         * instead, which copies nothing.
+         */
+        cl::Event readIntoAsync(void* hostPtr) const;
+
     };
 
     namespace detail
     {
 
-        inline void aggregate_events_impl(std::vector<cl::Event>& vec)
+        inline void aggregate_events_impl(EventList& events)
         { }
 
         template <typename T, typename... Ts>
-        void aggregate_events_impl(std::vector<cl::Event>& vec, 
+        void aggregate_events_impl(EventList& events,
                                    PendingImage<T> const& first,
                                    PendingImage<Ts> const&... rest)
         {
-            vec.insert(end(vec), begin(first.events), end(first.events));
-            aggregate_events_impl(vec, rest...);
+            events.append(first.events);
+            aggregate_events_impl(events, rest...);
         }
 
     }
 
     template <typename... Ts>
-    std::vector<cl::Event>
+    EventList
     aggregateEvents(PendingImage<Ts> const&... images)
     {
-        std::vector<cl::Event> vec;
-        detail::aggregate_events_impl(vec, images...);
-        return vec;
+        EventList events;
+        detail::aggregate_events_impl(events, images...);
+        return events;
+    }
+
+    /**
+     * Wait until all @a events are complete
+     */
+    inline void waitForEvents(EventList const& events)
+    {
+        if (!events.empty())
+        {
+            WaitList wait(events);
+            cl::Event::waitForEvents(*wait.get());
+        }
     }
 
     /**
@@ -225,17 +231,11 @@ namespace DynamiCL
 
             cl::Kernel clkernel = kernel.build(inputs.image... , result);
                         
-            cl::Event complete;
-            std::vector<cl::Event> waitfor = aggregateEvents(inputs...);
-            context.queue.enqueueNDRangeKernel(clkernel,
-                                       cl::NullRange,
-                                       kernelRange,
-                                       cl::NullRange, 
-                                       &waitfor,
-                                       &complete);
+            EventList waitfor = aggregateEvents(inputs...);
 
             pending_type pendingResult(context, result);
-            pendingResult.events.push_back(complete);
+            pendingResult.events.push_back(
+                    kernel.enqueue(context, clkernel, kernelRange, &waitfor));
 
             return pendingResult;
         }
@@ -246,7 +246,7 @@ namespace DynamiCL
     template <typename CLImage>
     PendingImage<CLImage> PendingImage<CLImage>::process(Kernel const& kernel) const
     {
-        return this->process<CLImage>(kernel, getDims<climage_type>(this->image));
+        return this->process<CLImage>(kernel, getDims(this->image));
     }
 
     template <typename CLImage>
@@ -261,22 +261,230 @@ namespace DynamiCL
         return this->process(kernel, image, kernelRange);
     }
 
+    namespace detail
+    {
+
+        template <typename CLImage>
+        void enqueue_read(cl::CommandQueue const& queue,
+                          CLImage const& image,
+                          void* hostPtr,
+                          EventList const& events,
+                          cl_bool blocking = CL_TRUE,
+                          cl::Event* complete = nullptr)
+        {
+            WaitList wait(events);
+            queue.enqueueReadImage(image,
+                    blocking,
+                    VectorConstructor<size_t>::construct(0, 0, 0),
+                    toSizeVector(getDims(image), 1),
+                    0,
+                    0,
+                    hostPtr,
+                    wait.get(),
+                    complete);
+        }
+
+        template <size_t N>
+        void enqueue_read(cl::CommandQueue const& queue,
+                          BufferImage<N> const& image,
+                          void* hostPtr,
+                          EventList const& events,
+                          cl_bool blocking = CL_TRUE,
+                          cl::Event* complete = nullptr)
+        {
+            WaitList wait(events);
+            queue.enqueueReadBuffer(image.buffer,
+                    blocking,
+                    0,
+                    image.bytes(),
+                    hostPtr,
+                    wait.get(),
+                    complete);
+        }
+
+        /**
+         * Copy the rows of a mapped image with pitches @a rowPitch and
+         * @a slicePitch into tightly packed @a hostPtr, unless the image
+         * was created over @a hostPtr in the first place
+         */
+        inline void copy_mapped(void const* mapped, size_t rowPitch, size_t slicePitch,
+                                cl::size_t<3> const& region, void* hostPtr)
+        {
+            if (mapped == hostPtr)
+            {
+                return;
+            }
+
+            size_t const rowBytes = region[0] * sizeof(cl_float4);
+            char const* src = static_cast<char const*>(mapped);
+            char* dst = static_cast<char*>(hostPtr);
+            for (size_t z = 0; z < region[2]; ++z)
+            {
+                for (size_t y = 0; y < region[1]; ++y)
+                {
+                    std::memcpy(dst, src + z * slicePitch + y * rowPitch, rowBytes);
+                    dst += rowBytes;
+                }
+            }
+        }
+
+        template <typename CLImage>
+        void map_read(cl::CommandQueue const& queue,
+                      CLImage const& image,
+                      void* hostPtr,
+                      EventList const& events)
+        {
+            cl::size_t<3> region = toSizeVector(getDims(image), 1);
+            size_t rowPitch = 0;
+            size_t slicePitch = 0;
+            WaitList wait(events);
+            void* mapped = queue.enqueueMapImage(image,
+                    CL_TRUE,
+                    CL_MAP_READ,
+                    VectorConstructor<size_t>::construct(0, 0, 0),
+                    region,
+                    &rowPitch,
+                    &slicePitch,
+                    wait.get());
+
+            copy_mapped(mapped, rowPitch, slicePitch ? slicePitch : rowPitch * region[1],
+                        region, hostPtr);
+
+            // the host may write into memory the image uses once this returns
+            cl::Event unmapped;
+            queue.enqueueUnmapMemObject(image, mapped, nullptr, &unmapped);
+            unmapped.wait();
+        }
+
+        template <size_t N>
+        void map_read(cl::CommandQueue const& queue,
+                      BufferImage<N> const& image,
+                      void* hostPtr,
+                      EventList const& events)
+        {
+            WaitList wait(events);
+            void* mapped = queue.enqueueMapBuffer(image.buffer,
+                    CL_TRUE,
+                    CL_MAP_READ,
+                    0,
+                    image.bytes(),
+                    wait.get());
+
+            if (mapped != hostPtr)
+            {
+                std::memcpy(hostPtr, mapped, image.bytes());
+            }
+
+            cl::Event unmapped;
+            queue.enqueueUnmapMemObject(image.buffer, mapped, nullptr, &unmapped);
+            unmapped.wait();
+        }
+
+
+        /**
+         * @Return whether @a image was created over @a hostPtr
+         */
+        template <typename CLImage>
+        bool is_over(CLImage const& image, void const* hostPtr)
+        {
+            return hostPtr && image.template getInfo<CL_MEM_HOST_PTR>() == hostPtr;
+        }
+
+        template <size_t N>
+        bool is_over(BufferImage<N> const& image, void const* hostPtr)
+        {
+            return hostPtr && image.buffer.template getInfo<CL_MEM_HOST_PTR>() == hostPtr;
+        }
+
+        /**
+         * Like map_read, for an image created over @a hostPtr, but
+         * @Return the event of the unmap instead of waiting for it. Once
+         * it is complete, @a hostPtr holds the image, without any copy.
+         */
+        template <typename CLImage>
+        cl::Event map_read_async(cl::CommandQueue const& queue,
+                                 CLImage const& image,
+                                 EventList const& events)
+        {
+            size_t rowPitch = 0;
+            size_t slicePitch = 0;
+            WaitList wait(events);
+            void* mapped = queue.enqueueMapImage(image,
+                    CL_FALSE,
+                    CL_MAP_READ,
+                    VectorConstructor<size_t>::construct(0, 0, 0),
+                    toSizeVector(getDims(image), 1),
+                    &rowPitch,
+                    &slicePitch,
+                    wait.get());
+
+            cl::Event unmapped;
+            queue.enqueueUnmapMemObject(image, mapped, nullptr, &unmapped);
+            return unmapped;
+        }
+
+        template <size_t N>
+        cl::Event map_read_async(cl::CommandQueue const& queue,
+                                 BufferImage<N> const& image,
+                                 EventList const& events)
+        {
+            WaitList wait(events);
+            void* mapped = queue.enqueueMapBuffer(image.buffer,
+                    CL_FALSE,
+                    CL_MAP_READ,
+                    0,
+                    image.bytes(),
+                    wait.get());
+
+            cl::Event unmapped;
+            queue.enqueueUnmapMemObject(image.buffer, mapped, nullptr, &unmapped);
+            return unmapped;
+        }
+
+    }
+
     template <typename CLImage>
     void PendingImage<CLImage>::readInto(void* hostPtr) const
     {
-        context.queue.enqueueReadImage(this->image,
-                CL_TRUE,
-                VectorConstructor<size_t>::construct(0, 0, 0),
-                toSizeVector(getDims(this->image), 1),
-                0,
-                0,
-                hostPtr,
-                &this->events);
+        // device memory is host memory, so skip the copy of the driver,
+        // and any copy at all if the image is already over hostPtr
+        if (context.zeroCopy)
+        {
+            detail::map_read(context.queue, this->image, hostPtr, this->events);
+            return;
+        }
+
+        detail::enqueue_read(context.queue, this->image, hostPtr, this->events);
+    }
+
+    template <typename CLImage>
+    cl::Event PendingImage<CLImage>::readIntoAsync(void* hostPtr) const
+    {
+        // images over hostPtr are only mapped. others have memory of
+        // their own, which the host would have to wait for to copy from
+        // a mapping, so the driver copies it instead.
+        cl::Event complete;
+        if (context.zeroCopy && detail::is_over(this->image, hostPtr))
+        {
+            complete = detail::map_read_async(context.queue, this->image, this->events);
+        }
+        else
+        {
+            detail::enqueue_read(context.queue, this->image, hostPtr, this->events,
+                                 CL_FALSE, &complete);
+        }
+
+        // nothing waits on the queue, so make sure the read gets going
+        context.queue.flush();
+
+        return complete;
     }
 
     // some commonly used types
     typedef PendingImage<cl::Image2D> Pending2DImage;
     typedef PendingImage<cl::Image2DArray> Pending2DImageArray;
+    typedef PendingImage<BufferImage2D> Pending2DBuffer;
+    typedef PendingImage<BufferImage2DArray> Pending2DBufferArray;
 
 }
 
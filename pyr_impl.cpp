@@ -1,23 +1,193 @@
 #include "pyr_impl.h"
+#include "cl_utils.h"
+#include "pending_graph.h"
 #include <iostream>
 
 namespace
 {
+    using namespace DynamiCL;
 
+    typedef ImagePyramid::pixel_type pixel_type;
+
+    // work-items in the single work-group that processes small levels
+    size_t const s_smallLevelGroupSize = 256;
+
+    // local memory used by build_small_levels: a small level,
+    // plus images of half and a quarter of its size
+    size_t const s_smallLevelLocalMem =
+        ImagePyramid::smallLevelDim * ImagePyramid::smallLevelDim * 7 / 4 * sizeof(cl_float4);
+
+    cl_int2 toInt2(size_t width, size_t height)
+    {
+        cl_int2 out = {{ static_cast<cl_int>(width), static_cast<cl_int>(height) }};
+        return out;
+    }
+
+    /**
+     * Buffer for @a numPixels pixels, holding many images one after another
+     */
+    BufferImage2D packedBuffer(ComputeContext const& context, size_t numPixels,
+                               void* hostPtr = nullptr)
+    {
+        return createCLImage<BufferImage2D>(context, {{ numPixels, 1 }}, hostPtr);
+    }
+
+    /**
+     * Copy the pixels of @a views one after another into a single vector.
+     * Small levels are tiny, so this is cheaper than a transfer per view.
+     */
+    template <typename View>
+    std::vector<pixel_type> pack(std::vector<View> const& views)
+    {
+        std::vector<pixel_type> packed;
+        for (View const& view : views)
+        {
+            packed.insert(packed.end(), view.begin(), view.end());
+        }
+        return packed;
+    }
+
+    /**
+     * Read @a packed once @a ready, and scatter its pixels into @a views
+     */
+    void unpack(ComputeContext const& context,
+                BufferImage2D const& packed,
+                cl::Event const& ready,
+                std::vector<ImagePyramid::view_type>& views)
+    {
+        std::vector<pixel_type> pixels(packed.dims[0]);
+
+        PendingImage<BufferImage2D> pending(context, packed);
+        pending.events.push_back(ready);
+        pending.readInto(pixels.data());
+
+        auto it = pixels.cbegin();
+        for (ImagePyramid::view_type& view : views)
+        {
+            std::copy(it, it + view.totalSize(), view.begin());
+            it += view.totalSize();
+        }
+    }
+
+    /**
+     * Enqueue @a kernel as a single work-group
+     */
+    cl::Event launchSingleGroup(ComputeContext const& context,
+                                cl::Kernel const& kernel,
+                                EventList const* waitFor)
+    {
+        size_t maxSize = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(context.device);
+        size_t groupSize = std::min(s_smallLevelGroupSize, maxSize);
+
+        WaitList wait(waitFor ? *waitFor : EventList());
+
+        cl::Event complete;
+        context.queue.enqueueNDRangeKernel(kernel,
+                                   cl::NullRange,
+                                   cl::NDRange(groupSize),
+                                   cl::NDRange(groupSize),
+                                   wait.get(),
+                                   &complete);
+        return complete;
+    }
+
+    /**
+     * Buffer holding the pixels of @a image once @a events complete.
+     * Small level kernels only deal with buffers, so images get copied.
+     */
+    cl::Buffer inputBuffer(PendingImage<BufferImage2D> const& image,
+                           EventList& events)
+    {
+        events = image.events;
+        return image.image.buffer;
+    }
+
+    cl::Buffer inputBuffer(PendingImage<cl::Image2D> const& image,
+                           EventList& events)
+    {
+        ComputeContext const& context = image.context;
+        BufferImage2D buffer = createCLImage<BufferImage2D>(context, image.dimensions());
+
+        WaitList wait(image.events);
+        cl::Event copied;
+        context.queue.enqueueCopyImageToBuffer(image.image,
+                buffer.buffer,
+                VectorConstructor<size_t>::construct(0, 0, 0),
+                toSizeVector(image.dimensions(), 1),
+                0,
+                wait.get(),
+                &copied);
+
+        events.clear();
+        events.push_back(copied);
+        return buffer.buffer;
+    }
+
+    /**
+     * Buffer for a small level kernel to write @a image into
+     */
+    cl::Buffer outputBuffer(ComputeContext const&, BufferImage2D const& image)
+    {
+        return image.buffer;
+    }
+
+    cl::Buffer outputBuffer(ComputeContext const& context, cl::Image2D const& image)
+    {
+        return createCLImage<BufferImage2D>(context, getDims(image)).buffer;
+    }
+
+    /**
+     * Make @a image hold the contents of @a buffer, once @a written.
+     * @Return event signalling @a image is ready
+     */
+    cl::Event finishOutput(ComputeContext const&,
+                           cl::Buffer const&,
+                           BufferImage2D const&,
+                           cl::Event const& written)
+    {
+        return written;
+    }
+
+    cl::Event finishOutput(ComputeContext const& context,
+                           cl::Buffer const& buffer,
+                           cl::Image2D const& image,
+                           cl::Event const& written)
+    {
+        EventList waitFor;
+        waitFor.push_back(written);
+        WaitList wait(waitFor);
+
+        cl::Event copied;
+        context.queue.enqueueCopyBufferToImage(buffer,
+                image,
+                0,
+                VectorConstructor<size_t>::construct(0, 0, 0),
+                toSizeVector(getDims(image), 1),
+                wait.get(),
+                &copied);
+        return copied;
+    }
 
 }
 
 namespace DynamiCL
 {
 
-    ImagePyramid::LevelPair
-    createPyramidLevel(Pending2DImage const& inputImage,
-                       cl::Program const& program )
+    template <typename CLImage>
+    ImagePyramid::LevelPair<CLImage>
+    createPyramidLevel(PendingImage<CLImage> const& inputImage,
+                       cl::Program const& program,
+                       void* upperHostPtr)
     {
         ComputeContext const& gpu = inputImage.context;
         size_t width = inputImage.width();
         size_t height = inputImage.height();
 
+        // recorded first, so that the rows halved and then doubled again
+        // share an image, as they are never needed at the same time
+        PendingGraph<CLImage> graph(gpu);
+        auto input = graph.input(inputImage);
+
         /********************
          *  Downsample row  *
          ********************/
@@ -27,69 +197,53 @@ namespace DynamiCL
 
         // row downsampling kernel
         Kernel row = {program, "downsample_row", Kernel::Range::DESTINATION};
-
-        // process image with kernel
-        Pending2DImage pendingInterImage =
-            inputImage.process<cl::Image2D>(row, {{ halfWidth, height }});
-
-        std::cout << "Downsampled Rows" << std::endl;
+        auto halfRows = input.process(row, {{ halfWidth, height }});
 
         /********************
          *  Downsample col  *
          ********************/
 
-        // Create an output image in compute device
         size_t halfHeight = halveDimension(height);
 
         Kernel col = {program, "downsample_col", Kernel::Range::DESTINATION};
-        Pending2DImage downsampled =
-            pendingInterImage.process<cl::Image2D>(col, {{halfWidth, halfHeight}});
-
-        std::cout << "Downsampled Cols" << std::endl;
+        auto downsampled = halfRows.process(col, {{ halfWidth, halfHeight }});
 
         /******************
          *  Upsample col  *
          ******************/
 
         Kernel upcol = {program, "upsample_col", Kernel::Range::SOURCE};
-        Pending2DImage pendingUpCol =
-            downsampled.process(upcol, pendingInterImage.image);
-
-        std::cout << "Upsampled Cols" << std::endl;
+        auto upCols = downsampled.process(upcol, {{ halfWidth, height }});
 
         /******************
          *  Upsample row  *
          ******************/
 
         Kernel uprow = {program, "upsample_row", Kernel::Range::SOURCE};
-        Pending2DImage pendingUpRow =
-            pendingUpCol.process<cl::Image2D>(uprow, {{width, height}});
-
-        std::cout << "Upsampled Rows" << std::endl;
+        auto upRows = upCols.process(uprow, {{ width, height }});
 
         /**********************
          *  Create Laplacian  *
          **********************/
 
         Kernel createLaplacian = {program, "create_laplacian", Kernel::Range::SOURCE};
+        auto laplacian = graph.process(createLaplacian,
+                                       inputImage.dimensions(), // dimensions
+                                       toNDRange(inputImage.dimensions()), // problem range
+                                       { input, upRows }); // input images
 
-        Pending2DImage pendingResult = 
-            Pending::process<cl::Image2D>
-            (
-                    gpu,
-                    createLaplacian,
-                    inputImage.dimensions(), // dimensions
-                    toNDRange(inputImage.dimensions()), // problem range
-                    inputImage, pendingUpRow // input images
-            );
+        graph.output(laplacian, upperHostPtr);
+        graph.output(downsampled);
+        std::vector<PendingImage<CLImage>> results = graph.submit();
 
         std::cout << "Created Laplacian" << std::endl;
 
-        return {std::move(pendingResult), std::move(downsampled)};
+        return {std::move(results[0]), std::move(results[1])};
     }
 
-    Pending2DImage
-    collapsePyramidLevel(ImagePyramid::LevelPair const& pair,
+    template <typename CLImage>
+    PendingImage<CLImage>
+    collapsePyramidLevel(ImagePyramid::LevelPair<CLImage> const& pair,
                          cl::Program const& program )
     {
         ComputeContext const& context = pair.upper.context;
@@ -99,49 +253,45 @@ namespace DynamiCL
         size_t upperHeight = pair.upper.height();
         size_t lowerWidth  = pair.lower.width();
 
+        PendingGraph<CLImage> graph(context);
+        auto upper = graph.input(pair.upper);
+        auto lower = graph.input(pair.lower);
+
         /******************
          *  Upsample col  *
          ******************/
 
         Kernel upcol = {program, "upsample_col", Kernel::Range::SOURCE};
-        Pending2DImage pendingUpCol =
-            pair.lower.process<cl::Image2D>(upcol, {{lowerWidth, upperHeight}});
-
-        std::cout << "Upsampled Cols" << std::endl;
+        auto upCols = lower.process(upcol, {{ lowerWidth, upperHeight }});
 
         /******************
          *  Upsample row  *
          ******************/
 
         Kernel uprow = {program, "upsample_row", Kernel::Range::SOURCE};
-        Pending2DImage pendingUpRow =
-            pendingUpCol.process<cl::Image2D>(uprow, {{upperWidth, upperHeight}});
-
-        std::cout << "Upsampled Rows" << std::endl;
+        auto upRows = upCols.process(uprow, {{ upperWidth, upperHeight }});
 
         /**********************
          *  Create Laplacian  *
          **********************/
 
         Kernel collapse= {program, "collapse_level", Kernel::Range::SOURCE};
+        auto collapsed = graph.process(collapse,
+                                       pair.upper.dimensions(),
+                                       toNDRange(pair.upper.dimensions()),
+                                       { upRows, upper });
 
-        auto pendingResult =
-            Pending::process<cl::Image2D>
-            (
-                context,
-                collapse,
-                pair.upper.dimensions(),
-                toNDRange(pair.upper.dimensions()),
-                pendingUpRow, pair.upper
-            );
+        graph.output(collapsed);
+        std::vector<PendingImage<CLImage>> results = graph.submit();
 
-        std::cout << "Created Laplacian" << std::endl;
+        std::cout << "Collapsed Level" << std::endl;
 
-        return pendingResult;
+        return std::move(results[0]);
     }
 
-    Pending2DImage
-    fusePyramidLevel(Pending2DImageArray const& array,
+    template <typename CLImage>
+    PendingImage<CLImage>
+    fusePyramidLevel(PendingImage<typename detail::image_traits<CLImage>::array_type> const& array,
                          cl::Program const& program )
     {
         ComputeContext const& context = array.context;
@@ -155,11 +305,8 @@ namespace DynamiCL
          *  Fuse the level  *
          ********************/
 
-        cl::Image2D resultImage(context.context,
-                CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY,
-                cl::ImageFormat(CL_RGBA, CL_FLOAT),
-                width,
-                height);
+        std::array<size_t, 2> dims = {{ width, height }};
+        CLImage resultImage = createCLImage<CLImage>(context, dims);
 
         Kernel kernel = {program, "fuse_level", Kernel::Range::DESTINATION};
         cl::Kernel clkernel = kernel.build(array.image, resultImage);
@@ -171,20 +318,182 @@ namespace DynamiCL
                   << width  << " x "
                   << height << std::endl;
 
-        cl::Event complete;
-        context.queue.enqueueNDRangeKernel(clkernel,
-                                   cl::NullRange,
-                                   cl::NDRange(width, height, 1),
-                                   cl::NullRange, 
-                                   &array.events,
-                                   &complete);
+        PendingImage<CLImage> fused(context, resultImage);
+        fused.events.push_back(
+                kernel.enqueue(context, clkernel, toNDRange(dims), &array.events));
 
-        Pending2DImage fused(context, resultImage);
-        fused.events.push_back(complete);
+        return fused;
+    }
+
+    template <typename CLImage>
+    PendingImage<CLImage>
+    fuseAlignedPyramidLevel(PendingImage<typename detail::image_traits<CLImage>::array_type> const& array,
+                            cl::Program const& program,
+                            cl::Buffer const& shifts,
+                            size_t level )
+    {
+        ComputeContext const& context = array.context;
+
+        std::array<size_t, 2> dims = {{ array.width(), array.height() }};
+        CLImage resultImage = createCLImage<CLImage>(context, dims);
+
+        Kernel kernel = {program, "fuse_level_aligned", Kernel::Range::DESTINATION};
+        cl::Kernel clkernel = kernel.build(array.image, resultImage,
+                                           shifts, static_cast<cl_int>(level));
+
+        PendingImage<CLImage> fused(context, resultImage);
+        fused.events.push_back(
+                kernel.enqueue(context, clkernel, toNDRange(dims), &array.events));
 
         return fused;
     }
 
+    template <typename CLImage>
+    PendingImage<CLImage>
+    fuseCollapsePyramidLevel(PendingImage<typename detail::image_traits<CLImage>::array_type> const& array,
+                             PendingImage<CLImage> const& lower,
+                             cl::Program const& program )
+    {
+        ComputeContext const& context = array.context;
+
+        std::array<size_t, 2> dims = {{ array.width(), array.height() }};
+        CLImage resultImage = createCLImage<CLImage>(context, dims);
+
+        Kernel kernel = {program, "fuse_collapse_level", Kernel::Range::DESTINATION};
+        cl::Kernel clkernel = kernel.build(array.image, lower.image, resultImage);
+
+        std::cout << "Fused and Collapsed Level :"
+                  << dims[0] << " x "
+                  << dims[1] << std::endl;
+
+        EventList waitFor = aggregateEvents(array, lower);
+
+        PendingImage<CLImage> collapsed(context, resultImage);
+        collapsed.events.push_back(
+                kernel.enqueue(context, clkernel, toNDRange(dims), &waitFor));
+
+        return collapsed;
+    }
+
+    template <typename CLImage>
+    PendingImage<CLImage>
+    fuseCollapseAlignedPyramidLevel(PendingImage<typename detail::image_traits<CLImage>::array_type> const& array,
+                                    PendingImage<CLImage> const& lower,
+                                    cl::Program const& program,
+                                    cl::Buffer const& shifts,
+                                    size_t level )
+    {
+        ComputeContext const& context = array.context;
+
+        std::array<size_t, 2> dims = {{ array.width(), array.height() }};
+        CLImage resultImage = createCLImage<CLImage>(context, dims);
+
+        Kernel kernel = {program, "fuse_collapse_level_aligned", Kernel::Range::DESTINATION};
+        cl::Kernel clkernel = kernel.build(array.image, lower.image, resultImage,
+                                           shifts, static_cast<cl_int>(level));
+
+        EventList waitFor = aggregateEvents(array, lower);
+
+        PendingImage<CLImage> collapsed(context, resultImage);
+        collapsed.events.push_back(
+                kernel.enqueue(context, clkernel, toNDRange(dims), &waitFor));
+
+        return collapsed;
+    }
+
+    bool supportsSmallLevels(ComputeContext const& context)
+    {
+        return context.device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() >= s_smallLevelLocalMem;
+    }
+
+    template <typename CLImage>
+    void buildSmallLevels(PendingImage<CLImage> const& inputImage,
+                          std::vector<ImagePyramid::view_type>& levels,
+                          cl::Program const& program )
+    {
+        ComputeContext const& context = inputImage.context;
+
+        EventList waitFor;
+        cl::Buffer input = inputBuffer(inputImage, waitFor);
+
+        size_t numPixels = 0;
+        for (ImagePyramid::view_type const& level : levels)
+        {
+            numPixels += level.totalSize();
+        }
+        BufferImage2D packed = packedBuffer(context, numPixels);
+
+        Kernel kernel = {program, "build_small_levels", Kernel::Range::SOURCE};
+        cl::Kernel clkernel = kernel.build(input,
+                                           toInt2(inputImage.width(), inputImage.height()),
+                                           static_cast<cl_int>(levels.size()),
+                                           packed.buffer);
+
+        std::cout << "Building " << levels.size() << " small levels" << std::endl;
+
+        unpack(context, packed, launchSingleGroup(context, clkernel, &waitFor), levels);
+    }
+
+    template <typename CLImage>
+    PendingImage<CLImage>
+    collapseSmallLevels(ComputeContext const& context,
+                        std::vector<ImagePyramid::view_type> const& levels,
+                        cl::Program const& program )
+    {
+        ImagePyramid::view_type const& top = levels.front();
+
+        std::vector<pixel_type> pixels = pack(levels);
+        BufferImage2D packed = packedBuffer(context, pixels.size(), pixels.data());
+
+        CLImage resultImage = createCLImage<CLImage>(context, top.dimensions());
+        cl::Buffer output = outputBuffer(context, resultImage);
+
+        Kernel kernel = {program, "collapse_small_levels", Kernel::Range::SOURCE};
+        cl::Kernel clkernel = kernel.build(packed.buffer,
+                                           toInt2(top.width(), top.height()),
+                                           static_cast<cl_int>(levels.size()),
+                                           output);
+
+        std::cout << "Collapsing " << levels.size() << " small levels" << std::endl;
+
+        cl::Event collapsed = launchSingleGroup(context, clkernel, nullptr);
+
+        PendingImage<CLImage> result(context, resultImage);
+        result.events.push_back(finishOutput(context, output, resultImage, collapsed));
+
+        return result;
+    }
+
+    void fuseSmallLevels(ComputeContext const& context,
+                         std::vector<ImagePyramid::fuse_view_type> const& arrays,
+                         std::vector<ImagePyramid::view_type>& dest,
+                         cl::Program const& program )
+    {
+        ImagePyramid::fuse_view_type const& top = arrays.front();
+
+        std::vector<pixel_type> pixels = pack(arrays);
+        BufferImage2D packed = packedBuffer(context, pixels.size(), pixels.data());
+
+        size_t numPixels = 0;
+        for (ImagePyramid::view_type const& level : dest)
+        {
+            numPixels += level.totalSize();
+        }
+        BufferImage2D fused = packedBuffer(context, numPixels);
+
+        Kernel kernel = {program, "fuse_small_levels", Kernel::Range::SOURCE};
+        cl::Kernel clkernel = kernel.build(packed.buffer,
+                                           toInt2(top.width(), top.height()),
+                                           static_cast<cl_int>(arrays.size()),
+                                           static_cast<cl_int>(top.depth()),
+                                           fused.buffer);
+
+        std::cout << "Fusing " << arrays.size() << " small levels" << std::endl;
+
+        cl::Event complete = kernel.enqueue(context, clkernel, cl::NDRange(numPixels), nullptr);
+        unpack(context, fused, complete, dest);
+    }
+
     size_t calculateNumLevels(size_t width, size_t height)
     {
         size_t shortDim = std::min(width, height);
@@ -217,4 +526,54 @@ namespace DynamiCL
         return numPixels;
     }
 
+    /***************************************************************************
+     *                    Instantiations for each storage                      *
+     ***************************************************************************/
+
+    template ImagePyramid::LevelPair<cl::Image2D>
+    createPyramidLevel(Pending2DImage const&, cl::Program const&, void*);
+    template Pending2DImage
+    collapsePyramidLevel(ImagePyramid::LevelPair<cl::Image2D> const&, cl::Program const&);
+    template Pending2DImage
+    fusePyramidLevel<cl::Image2D>(Pending2DImageArray const&, cl::Program const&);
+    template Pending2DImage
+    fuseAlignedPyramidLevel<cl::Image2D>(Pending2DImageArray const&, cl::Program const&,
+                                         cl::Buffer const&, size_t);
+    template Pending2DImage
+    fuseCollapsePyramidLevel<cl::Image2D>(Pending2DImageArray const&, Pending2DImage const&,
+                                          cl::Program const&);
+    template Pending2DImage
+    fuseCollapseAlignedPyramidLevel<cl::Image2D>(Pending2DImageArray const&, Pending2DImage const&,
+                                                 cl::Program const&, cl::Buffer const&, size_t);
+    template void
+    buildSmallLevels(Pending2DImage const&, std::vector<ImagePyramid::view_type>&,
+                     cl::Program const&);
+    template Pending2DImage
+    collapseSmallLevels<cl::Image2D>(ComputeContext const&,
+                                     std::vector<ImagePyramid::view_type> const&,
+                                     cl::Program const&);
+
+    template ImagePyramid::LevelPair<BufferImage2D>
+    createPyramidLevel(Pending2DBuffer const&, cl::Program const&, void*);
+    template Pending2DBuffer
+    collapsePyramidLevel(ImagePyramid::LevelPair<BufferImage2D> const&, cl::Program const&);
+    template Pending2DBuffer
+    fusePyramidLevel<BufferImage2D>(Pending2DBufferArray const&, cl::Program const&);
+    template Pending2DBuffer
+    fuseAlignedPyramidLevel<BufferImage2D>(Pending2DBufferArray const&, cl::Program const&,
+                                           cl::Buffer const&, size_t);
+    template Pending2DBuffer
+    fuseCollapsePyramidLevel<BufferImage2D>(Pending2DBufferArray const&, Pending2DBuffer const&,
+                                            cl::Program const&);
+    template Pending2DBuffer
+    fuseCollapseAlignedPyramidLevel<BufferImage2D>(Pending2DBufferArray const&, Pending2DBuffer const&,
+                                                   cl::Program const&, cl::Buffer const&, size_t);
+    template void
+    buildSmallLevels(Pending2DBuffer const&, std::vector<ImagePyramid::view_type>&,
+                     cl::Program const&);
+    template Pending2DBuffer
+    collapseSmallLevels<BufferImage2D>(ComputeContext const&,
+                                       std::vector<ImagePyramid::view_type> const&,
+                                       cl::Program const&);
+
 }
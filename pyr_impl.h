@@ -14,16 +14,110 @@ namespace DynamiCL
         return (n + 1) / 2;
     }
 
-    ImagePyramid::LevelPair
-    createPyramidLevel(Pending2DImage const& inputImage,
-                       cl::Program const& program );
+    /**
+     * Return a dimension at @a level of a pyramid, whose first
+     * level has dimension @a n.
+     */
+    inline size_t levelDimension(size_t n, size_t level)
+    {
+        for (; level > 0; --level)
+        {
+            n = halveDimension(n);
+        }
+        return n;
+    }
+
+    /**
+     * The following are implemented for both cl::Image2D and BufferImage2D.
+     * @a program has to be built from the kernel file for that storage.
+     */
+    /**
+     * Build the laplacian of @a inputImage, as the upper level, and the
+     * image downsampled from it, as the lower one. If the upper level is
+     * read back to @a upperHostPtr, it is created over that memory, where
+     * the host shares it with the device.
+     */
+    template <typename CLImage>
+    ImagePyramid::LevelPair<CLImage>
+    createPyramidLevel(PendingImage<CLImage> const& inputImage,
+                       cl::Program const& program,
+                       void* upperHostPtr = nullptr);
+
+    template <typename CLImage>
+    PendingImage<CLImage>
+    collapsePyramidLevel(ImagePyramid::LevelPair<CLImage> const& pair,
+                         cl::Program const& program );
 
-    Pending2DImage
-    collapsePyramidLevel(ImagePyramid::LevelPair const& pair,
+    template <typename CLImage>
+    PendingImage<CLImage>
+    fusePyramidLevel(PendingImage<typename detail::image_traits<CLImage>::array_type> const& array,
                          cl::Program const& program );
 
-    Pending2DImage
-    fusePyramidLevel(Pending2DImageArray const& array,
+    /**
+     * Fuse @a array like fusePyramidLevel, reading each of its layers
+     * translated by the matching cl_int2 of @a shifts, which are in pixels
+     * of the first level of the pyramid, while @a array is at @a level.
+     */
+    template <typename CLImage>
+    PendingImage<CLImage>
+    fuseAlignedPyramidLevel(PendingImage<typename detail::image_traits<CLImage>::array_type> const& array,
+                            cl::Program const& program,
+                            cl::Buffer const& shifts,
+                            size_t level );
+
+    /**
+     * Fuse @a array like fusePyramidLevel, and collapse the result with
+     * @a lower, the collapsed level below, like collapsePyramidLevel, in a
+     * single kernel that never writes out the fused level.
+     */
+    template <typename CLImage>
+    PendingImage<CLImage>
+    fuseCollapsePyramidLevel(PendingImage<typename detail::image_traits<CLImage>::array_type> const& array,
+                             PendingImage<CLImage> const& lower,
+                             cl::Program const& program );
+
+    /**
+     * Same as fuseCollapsePyramidLevel, fusing like fuseAlignedPyramidLevel.
+     */
+    template <typename CLImage>
+    PendingImage<CLImage>
+    fuseCollapseAlignedPyramidLevel(PendingImage<typename detail::image_traits<CLImage>::array_type> const& array,
+                                    PendingImage<CLImage> const& lower,
+                                    cl::Program const& program,
+                                    cl::Buffer const& shifts,
+                                    size_t level );
+
+    /**
+     * Whether the device of @a context has enough local memory to process
+     * small pyramid levels in a single work-group.
+     */
+    bool supportsSmallLevels(ComputeContext const& context);
+
+    /**
+     * Build all levels of a pyramid from @a inputImage, the first of the
+     * small levels, in a single launch. Reads them into @a levels.
+     */
+    template <typename CLImage>
+    void buildSmallLevels(PendingImage<CLImage> const& inputImage,
+                          std::vector<ImagePyramid::view_type>& levels,
+                          cl::Program const& program );
+
+    /**
+     * Collapse all of the small @a levels of a pyramid in a single launch.
+     */
+    template <typename CLImage>
+    PendingImage<CLImage>
+    collapseSmallLevels(ComputeContext const& context,
+                        std::vector<ImagePyramid::view_type> const& levels,
+                        cl::Program const& program );
+
+    /**
+     * Fuse the small levels of several pyramids, laid out as image arrays
+     * in @a arrays, into @a dest in a single launch.
+     */
+    void fuseSmallLevels(ComputeContext const& context,
+                         std::vector<ImagePyramid::fuse_view_type> const& arrays,
+                         std::vector<ImagePyramid::view_type>& dest,
                          cl::Program const& program );
 
     /**
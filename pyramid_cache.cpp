@@ -0,0 +1,284 @@
+#include "pyramid_cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sha256.h"
+
+namespace
+{
+    using namespace DynamiCL;
+
+    char const s_magic[8] = { 'D', 'C', 'L', 'P', 'Y', 'R', '0', '2' };
+
+    /**
+     * Precedes the levels of a pyramid in a cache entry
+     */
+    struct EntryHeader
+    {
+        char magic[8];
+        Sha256::digest_type digest; ///< of the key the entry is stored under
+        std::uint64_t numLevels;
+    };
+
+    /**
+     * @Return digest @a key is the hex of, or all zeros if it is not one,
+     * which no key digests to
+     */
+    Sha256::digest_type parseKey(std::string const& key)
+    {
+        Sha256::digest_type digest = {{ 0 }};
+        if (key.size() != 2 * digest.size())
+        {
+            return digest;
+        }
+        for (size_t i = 0; i < digest.size(); ++i)
+        {
+            std::string byte = key.substr(2 * i, 2);
+            if (byte.find_first_not_of("0123456789abcdef") != std::string::npos)
+            {
+                return Sha256::digest_type{{ 0 }};
+            }
+            digest[i] = std::uint8_t(std::stoul(byte, nullptr, 16));
+        }
+        return digest;
+    }
+
+    /**
+     * Write all @a bytes from @a data to @a fd
+     *
+     * @Return false on failure
+     */
+    bool writeAll(int fd, void const* data, size_t bytes)
+    {
+        char const* cur = static_cast<char const*>(data);
+        while (bytes > 0)
+        {
+            ssize_t written = ::write(fd, cur, bytes);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            cur += written;
+            bytes -= written;
+        }
+        return true;
+    }
+
+    /**
+     * Dimensions of a level, following the header once per level
+     */
+    struct LevelHeader
+    {
+        std::uint64_t width;
+        std::uint64_t height;
+    };
+
+    /**
+     * A read-only mapping of a whole file, unmapped on destruction
+     */
+    class MappedFile
+    {
+        void* data_;
+        size_t size_;
+
+    public:
+        explicit MappedFile(std::string const& path)
+            : data_(MAP_FAILED),
+              size_(0)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+            {
+                return;
+            }
+
+            struct stat info;
+            if (::fstat(fd, &info) == 0 && info.st_size > 0)
+            {
+                size_ = info.st_size;
+                data_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            ::close(fd); // mapping stays valid
+        }
+
+        ~MappedFile()
+        {
+            if (valid())
+            {
+                ::munmap(data_, size_);
+            }
+        }
+
+        MappedFile(MappedFile const&) = delete;
+        MappedFile& operator =(MappedFile const&) = delete;
+
+        bool valid() const { return data_ != MAP_FAILED; }
+        char const* data() const { return static_cast<char const*>(data_); }
+        size_t size() const { return size_; }
+    };
+}
+
+namespace DynamiCL
+{
+
+    PyramidCache::PyramidCache(std::string const& directory)
+        : directory_(directory)
+    {
+        ::mkdir(directory_.c_str(), 0755);
+    }
+
+    std::string PyramidCache::key(std::string const& path, std::string const& parameters)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+        {
+            throw std::runtime_error("Could not open image file: " + path);
+        }
+
+        // stream the file rather than holding all of it
+        Sha256 content;
+        std::vector<char> chunk(1 << 16);
+        while (in.read(chunk.data(), chunk.size()) || in.gcount() > 0)
+        {
+            content.update(chunk.data(), in.gcount());
+        }
+        if (in.bad())
+        {
+            throw std::runtime_error("Could not read image file: " + path);
+        }
+
+        // the content digest has a fixed size, so that no other pair of
+        // content and parameters hashes the same bytes
+        Sha256 key;
+        Sha256::digest_type const contentDigest = content.finish();
+        key.update(contentDigest.data(), contentDigest.size());
+        key.update(parameters.data(), parameters.size());
+        return Sha256::toHex(key.finish());
+    }
+
+    std::string PyramidCache::entryPath(std::string const& key) const
+    {
+        return directory_ + "/" + key + ".pyr";
+    }
+
+    bool PyramidCache::contains(std::string const& key) const
+    {
+        struct stat info;
+        return ::stat(entryPath(key).c_str(), &info) == 0 && S_ISREG(info.st_mode);
+    }
+
+    bool PyramidCache::load(std::string const& key, std::vector<view_type>& levels) const
+    {
+        MappedFile file(entryPath(key));
+        if (!file.valid())
+        {
+            return false;
+        }
+
+        // validate the whole layout before touching any level
+        size_t expectedSize = sizeof(EntryHeader) + levels.size() * sizeof(LevelHeader);
+        for (view_type const& level : levels)
+        {
+            expectedSize += level.totalSize() * sizeof(pixel_type);
+        }
+        if (file.size() != expectedSize)
+        {
+            return false;
+        }
+
+        EntryHeader header;
+        std::memcpy(&header, file.data(), sizeof(header));
+        if (!std::equal(s_magic, s_magic + sizeof(s_magic), header.magic)
+            || header.digest != parseKey(key)
+            || header.numLevels != levels.size())
+        {
+            return false;
+        }
+
+        char const* cur = file.data() + sizeof(EntryHeader);
+        for (view_type const& level : levels)
+        {
+            LevelHeader dims;
+            std::memcpy(&dims, cur, sizeof(dims));
+            if (dims.width != level.width() || dims.height != level.height())
+            {
+                return false;
+            }
+            cur += sizeof(LevelHeader);
+        }
+
+        for (view_type& level : levels)
+        {
+            size_t bytes = level.totalSize() * sizeof(pixel_type);
+            std::memcpy(level.rawData(), cur, bytes);
+            cur += bytes;
+        }
+
+        return true;
+    }
+
+    void PyramidCache::store(std::string const& key, std::vector<view_type> const& levels) const
+    {
+        std::string path = entryPath(key);
+
+        // a file of its own, as other processes may store the same key
+        std::string const pattern = path + ".XXXXXX";
+        std::vector<char> tempPath(pattern.begin(), pattern.end());
+        tempPath.push_back('\0');
+
+        int fd = ::mkstemp(tempPath.data());
+        if (fd < 0)
+        {
+            throw std::runtime_error("Could not write pyramid to cache: " + pattern);
+        }
+        ::fchmod(fd, 0644);
+
+        EntryHeader header;
+        std::copy(s_magic, s_magic + sizeof(s_magic), header.magic);
+        header.digest = parseKey(key);
+        header.numLevels = levels.size();
+        bool ok = writeAll(fd, &header, sizeof(header));
+
+        for (view_type const& level : levels)
+        {
+            LevelHeader dims = { level.width(), level.height() };
+            ok = ok && writeAll(fd, &dims, sizeof(dims));
+        }
+
+        for (view_type const& level : levels)
+        {
+            ok = ok && writeAll(fd, level.rawData(), level.totalSize() * sizeof(pixel_type));
+        }
+
+        ok = ::close(fd) == 0 && ok;
+        if (!ok)
+        {
+            std::remove(tempPath.data());
+            throw std::runtime_error("Could not write pyramid to cache: " + std::string(tempPath.data()));
+        }
+
+        // readers never see a partially written entry
+        if (std::rename(tempPath.data(), path.c_str()) != 0)
+        {
+            std::remove(tempPath.data());
+            throw std::runtime_error("Could not write pyramid to cache: " + path);
+        }
+    }
+
+}
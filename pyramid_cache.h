@@ -0,0 +1,74 @@
+#ifndef PYRAMID_CACHE_H_6QHD2VXM
+#define PYRAMID_CACHE_H_6QHD2VXM
+
+#include <string>
+#include <vector>
+
+#include "host_image.hpp"
+
+namespace DynamiCL
+{
+
+    /**
+     * An on-disk cache of the weighted pyramids of input images, so that
+     * jobs repeated on the same exposures skip decoding, quality masks and
+     * pyramid construction.
+     *
+     * Entries are addressed by the content of the input file, together
+     * with the parameters of the pipeline that produced the pyramid.
+     * Each is a small header followed by the levels of the pyramid as
+     * packed float4 pixels, exactly as they are laid out in memory, so
+     * that loading is a matter of mapping the file and copying.
+     */
+    class PyramidCache
+    {
+    public:
+        typedef RGBA<float> pixel_type;
+        typedef HostImageView<pixel_type, 2> view_type;
+
+        /**
+         * Use @a directory for cache entries, creating it if needed
+         */
+        explicit PyramidCache(std::string const& directory);
+
+        /**
+         * @Return the key of the pyramid of the image file at @a path,
+         * built with @a parameters: the hex SHA-256 digest of both.
+         * Parameters should describe everything that influences the
+         * pyramid, apart from the image itself.
+         *
+         * @throws std::runtime_error if the file cannot be read.
+         */
+        static std::string key(std::string const& path, std::string const& parameters);
+
+        /**
+         * @Return whether an entry is stored under @a key, without reading
+         * it, e.g. to skip decoding an image whose pyramid will be loaded.
+         * The entry may still fail to load into a particular pyramid.
+         */
+        bool contains(std::string const& key) const;
+
+        /**
+         * Read the pyramid stored under @a key into @a levels.
+         *
+         * @Return false if there is no entry for @a key, it was stored
+         * under another key, or its levels differ in number or dimensions
+         * from @a levels.
+         */
+        bool load(std::string const& key, std::vector<view_type>& levels) const;
+
+        /**
+         * Store the pyramid in @a levels under @a key, replacing any
+         * previous entry atomically.
+         */
+        void store(std::string const& key, std::vector<view_type> const& levels) const;
+
+    private:
+        std::string directory_;
+
+        std::string entryPath(std::string const& key) const;
+    };
+
+}
+
+#endif /* end of include guard: PYRAMID_CACHE_H_6QHD2VXM */
@@ -0,0 +1,86 @@
+#ifndef RECYCLER_HPP_W4JX9BQE
+#define RECYCLER_HPP_W4JX9BQE
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace DynamiCL
+{
+
+    /**
+     * Hands out objects that come back to it once their last shared_ptr
+     * is gone, instead of being destroyed. A loop asking for the same
+     * kinds of objects over and over, like one over the frames of a
+     * timelapse, only creates them in its first iterations.
+     *
+     * Objects may outlive the recycler, and are destroyed as usual then.
+     */
+    template <typename T>
+    class Recycler
+    {
+        struct FreeList
+        {
+            std::mutex mutex;
+            std::vector<std::unique_ptr<T>> objects;
+        };
+
+        std::shared_ptr<FreeList> free_;
+
+    public:
+        Recycler()
+            : free_(std::make_shared<FreeList>())
+        { }
+
+        /**
+         * @Return a free object for which @a matches is true, or else the
+         * new one returned by @a make, as a std::unique_ptr<T>
+         */
+        template <typename Match, typename Make>
+        std::shared_ptr<T> acquire(Match matches, Make make)
+        {
+            std::unique_ptr<T> object;
+            {
+                std::lock_guard<std::mutex> lock(free_->mutex);
+                auto& objects = free_->objects;
+                auto it = std::find_if(objects.begin(), objects.end(),
+                                       [&](std::unique_ptr<T> const& o) { return matches(*o); });
+                if (it != objects.end())
+                {
+                    object = std::move(*it);
+                    objects.erase(it);
+                }
+            }
+
+            if (!object)
+            {
+                object = make();
+            }
+
+            std::weak_ptr<FreeList> home = free_;
+            return std::shared_ptr<T>(object.release(),
+                [home](T* p)
+                {
+                    std::unique_ptr<T> returned(p);
+                    if (auto free = home.lock())
+                    {
+                        std::lock_guard<std::mutex> lock(free->mutex);
+                        free->objects.push_back(std::move(returned));
+                    }
+                });
+        }
+
+        /**
+         * @Return number of objects waiting to be handed out again
+         */
+        size_t numFree() const
+        {
+            std::lock_guard<std::mutex> lock(free_->mutex);
+            return free_->objects.size();
+        }
+    };
+
+}
+
+#endif /* end of include guard: RECYCLER_HPP_W4JX9BQE */
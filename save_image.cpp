@@ -1,11 +1,23 @@
 #include "save_image.h"
+#include "parallel.hpp"
 
 #include <vigra/impex.hxx>
 #include <vigra/stdimage.hxx>
 #include <vigra/transformimage.hxx>
 
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include <tiffio.h>
+
 namespace
 {
+    // images of more 16 bit samples than this are written as BigTIFF, as
+    // classic TIFF offsets end at 4 GiB, and compression is no guarantee
+    // of smaller strips
+    uint64_t const s_classicTiffBytes = uint64_t(1) << 31;
+
     template <typename OutComponentType>
     vigra::RGBValue< OutComponentType >
     convertPixelFromFloat4(DynamiCL::RGBA<float> const& in)
@@ -43,16 +55,91 @@ namespace DynamiCL
         exportInfo.setPixelType("UINT16");
         exportInfo.setCompression("LZW"); // TODO: major bottleneck
 
-        OutImgType out(in.width(), in.height());
+        // kept per thread, so that saving a sequence of images of the
+        // same size only allocates it for the first
+        thread_local OutImgType out;
+        if (out.width() != static_cast<int>(in.width())
+            || out.height() != static_cast<int>(in.height()))
+        {
+            out.resize(in.width(), in.height());
+        }
 
         // transform
-        std::transform(in.begin(), in.end(), out.begin(),
-                       convertPixelFromFloat4<OutComponentType>);
+        parallelTransform(in, out.begin(), convertPixelFromFloat4<OutComponentType>);
 
         // write the image to the file given as second argument
         // the file type will be determined from the file name's extension
         exportImage(srcImageRange(out), exportInfo);
     }
 
+    struct TiffRowWriter::Impl
+    {
+        TIFF* tiff;
+        size_t width;
+        size_t height;
+        size_t numRows; ///< rows written so far
+        std::vector<uint16_t> samples; ///< of a single row
+    };
+
+    TiffRowWriter::TiffRowWriter(std::string const& outPath, size_t width, size_t height)
+        : impl_(new Impl)
+    {
+        if (width > UINT32_MAX || height > UINT32_MAX)
+        {
+            throw std::invalid_argument("Image is too large for a TIFF file: " + outPath);
+        }
+
+        // classic TIFF for images small enough, which more readers take
+        uint64_t const bytes = uint64_t(width) * height * 3 * sizeof(uint16_t);
+        impl_->tiff = TIFFOpen(outPath.c_str(), bytes > s_classicTiffBytes ? "w8" : "w");
+        if (!impl_->tiff)
+        {
+            throw std::runtime_error("Could not create TIFF file: " + outPath);
+        }
+        impl_->width = width;
+        impl_->height = height;
+        impl_->numRows = 0;
+        impl_->samples.resize(width * 3);
+
+        TIFF* tiff = impl_->tiff;
+        TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, static_cast<uint32_t>(width));
+        TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, static_cast<uint32_t>(height));
+        TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, 3);
+        TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, 16);
+        TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+        TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+        TIFFSetField(tiff, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+        TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tiff, 0));
+    }
+
+    TiffRowWriter::~TiffRowWriter()
+    {
+        TIFFClose(impl_->tiff);
+    }
+
+    void TiffRowWriter::writeRow(RGBA<float> const* row)
+    {
+        if (impl_->numRows == impl_->height)
+        {
+            throw std::runtime_error("All rows of the TIFF image have been written.");
+        }
+
+        uint16_t* out = impl_->samples.data();
+        for (size_t x = 0; x < impl_->width; ++x)
+        {
+            vigra::RGBValue<vigra::UInt16> pixel = convertPixelFromFloat4<vigra::UInt16>(row[x]);
+            for (size_t i = 0; i < 3; ++i)
+            {
+                *out++ = pixel[i];
+            }
+        }
+
+        if (TIFFWriteScanline(impl_->tiff, impl_->samples.data(), impl_->numRows, 0) < 0)
+        {
+            throw std::runtime_error("Could not write a row of the TIFF image.");
+        }
+        ++impl_->numRows;
+    }
+
 } /* DynamiCL */ 
 
@@ -1,6 +1,7 @@
 #ifndef SAVE_IMAGE_H_RNXX0VQG
 #define SAVE_IMAGE_H_RNXX0VQG
 
+#include <memory>
 #include <string>
 #include "host_image.hpp"
 
@@ -10,6 +11,38 @@ namespace DynamiCL
     typedef HostImageView<RGBA<float>, 2> FloatImageView;
 
     void saveTiff16(FloatImageView const& in, std::string const& outPath);
+
+    /**
+     * Writes a TIFF like saveTiff16 does, but one row at a time, for
+     * images that are never whole in memory (see BandMerge)
+     */
+    class TiffRowWriter
+    {
+    public:
+        /**
+         * Create @a outPath for an image of @a width x @a height, as a
+         * BigTIFF if its samples take more than 2 GiB, so that images of
+         * any size can be written
+         * @throws std::invalid_argument if a dimension is beyond those of TIFF
+         * @throws std::runtime_error if it cannot be created
+         */
+        TiffRowWriter(std::string const& outPath, size_t width, size_t height);
+        ~TiffRowWriter();
+
+        TiffRowWriter(TiffRowWriter const&) = delete;
+        TiffRowWriter& operator =(TiffRowWriter const&) = delete;
+
+        /**
+         * Write the next row, of width pixels
+         * @throws std::runtime_error if it could not be written, or all
+         * rows have been already
+         */
+        void writeRow(RGBA<float> const* row);
+
+    private:
+        struct Impl;
+        std::unique_ptr<Impl> impl_;
+    };
 }
 
 #endif /* end of include guard: SAVE_IMAGE_H_RNXX0VQG */
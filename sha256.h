@@ -0,0 +1,45 @@
+#ifndef SHA256_H_K4NX8TQE
+#define SHA256_H_K4NX8TQE
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+namespace DynamiCL
+{
+
+    /**
+     * SHA-256 digest of a stream of bytes, fed in chunks of any size
+     */
+    class Sha256
+    {
+    public:
+        typedef std::array<std::uint8_t, 32> digest_type;
+
+        Sha256();
+
+        void update(void const* data, size_t bytes);
+
+        /**
+         * @Return digest of everything passed to update() so far. Ends
+         * the stream: update() must not be called afterwards.
+         */
+        digest_type finish();
+
+        /**
+         * @Return @a digest as lower case hex
+         */
+        static std::string toHex(digest_type const& digest);
+
+    private:
+        std::array<std::uint32_t, 8> state_;
+        std::array<std::uint8_t, 64> block_;
+        size_t blockBytes_;   ///< used in block_
+        std::uint64_t totalBytes_;
+
+        void processBlock(std::uint8_t const* block);
+    };
+
+}
+
+#endif /* end of include guard: SHA256_H_K4NX8TQE */
@@ -0,0 +1,255 @@
+// Kernels that process all the small levels at the bottom of a pyramid in
+// a single launch. This file is appended to kernels.cl or buffer_kernels.cl
+// when programs are built, and shares sampling_kernel with them.
+//
+// Levels are packed one after another, from the largest down to the
+// smallest. Building and collapsing happens in a single work-group that
+// keeps intermediate images in local memory, so small levels cost neither
+// a launch each, nor a round trip to the host each.
+
+#ifndef SMALL_LEVEL_DIM
+#define SMALL_LEVEL_DIM 32
+#endif
+
+#define SMALL_LEVEL_PIXELS (SMALL_LEVEL_DIM * SMALL_LEVEL_DIM)
+#define MAX_SMALL_LEVELS 16
+
+inline int2 halve_dim(int2 dim)
+{
+    return (dim + 1) / 2;
+}
+
+inline float4 read_local(__local const float4* image, int2 dim, int2 coord)
+{
+    coord = clamp(coord, (int2)(0, 0), dim - 1);
+    return image[coord.y * dim.x + coord.x];
+}
+
+/**
+ * Downsample along @a step, which is (1,0) for rows and (0,1) for columns.
+ * Same as downsample_row/downsample_col, but over a whole local image.
+ */
+inline void downsample_local(__local const float4* input, int2 input_dim,
+                             __local float4* output, int2 output_dim,
+                             int2 step)
+{
+    for (int i = get_local_id(0); i < output_dim.x * output_dim.y; i += get_local_size(0))
+    {
+        int2 out_coord = (int2)( i % output_dim.x, i / output_dim.x );
+        int2 in_coord = out_coord * (1 + step);
+
+        float4 sample = 0.0f;
+        for (int k = -2; k < 3; ++k)
+        {
+            sample += read_local(input, input_dim, in_coord + step * k) * sampling_kernel[2+k];
+        }
+
+        output[i] = sample;
+    }
+}
+
+/**
+ * Value of pixel @a out_coord of @a input upsampled along @a step.
+ * Same as upsample_row/upsample_col, but one output pixel at a time.
+ */
+inline float4 upsampled_pixel(__local const float4* input, int2 input_dim,
+                              int2 out_coord, int2 step)
+{
+    int2 in_coord = out_coord / (1 + step);
+    int odd = (step.x ? out_coord.x : out_coord.y) & 1;
+
+    float4 in1 = read_local(input, input_dim, in_coord);
+    float4 in2 = read_local(input, input_dim, in_coord + step);
+
+    if (odd)
+    {
+        return (   in1 * sampling_kernel[1]
+                 + in2 * sampling_kernel[1])
+               * 2;
+    }
+
+    float4 in0 = read_local(input, input_dim, in_coord - step);
+    return (   in0 * sampling_kernel[0]
+             + in1 * sampling_kernel[2]
+             + in2 * sampling_kernel[0])
+           * 2;
+}
+
+inline void upsample_local(__local const float4* input, int2 input_dim,
+                           __local float4* output, int2 output_dim,
+                           int2 step)
+{
+    for (int i = get_local_id(0); i < output_dim.x * output_dim.y; i += get_local_size(0))
+    {
+        int2 out_coord = (int2)( i % output_dim.x, i / output_dim.x );
+        output[i] = upsampled_pixel(input, input_dim, out_coord, step);
+    }
+}
+
+/**
+ * Build @a num_levels levels of a pyramid, starting from @a input of
+ * dimensions @a dim. Writes the laplacians of all but the last level, and
+ * then the last level itself.
+ *
+ * Must be launched as a single work-group.
+ */
+__kernel void build_small_levels(__global const float4* input, int2 dim, int num_levels,
+                                 __global float4* levels)
+{
+    __local float4 gaussian[SMALL_LEVEL_PIXELS];
+    __local float4 half_res[SMALL_LEVEL_PIXELS / 2];
+    __local float4 quarter_res[SMALL_LEVEL_PIXELS / 4];
+
+    for (int i = get_local_id(0); i < dim.x * dim.y; i += get_local_size(0))
+    {
+        gaussian[i] = input[i];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int level = 0; level < num_levels - 1; ++level)
+    {
+        int2 half_dim = halve_dim(dim);
+        int2 row_dim = (int2)( half_dim.x, dim.y );
+
+        downsample_local(gaussian, dim, half_res, row_dim, (int2)(1, 0));
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        downsample_local(half_res, row_dim, quarter_res, half_dim, (int2)(0, 1));
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        upsample_local(quarter_res, half_dim, half_res, row_dim, (int2)(0, 1));
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        // upsample rows on the fly while creating the laplacian
+        for (int i = get_local_id(0); i < dim.x * dim.y; i += get_local_size(0))
+        {
+            int2 coord = (int2)( i % dim.x, i / dim.x );
+
+            float4 o = gaussian[i];
+            float4 l = o - upsampled_pixel(half_res, row_dim, coord, (int2)(1, 0));
+            l.s3 = o.s3; // preserve original alpha;
+
+            levels[i] = l;
+        }
+        levels += dim.x * dim.y;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        // downsampled image is the start of the next level
+        for (int i = get_local_id(0); i < half_dim.x * half_dim.y; i += get_local_size(0))
+        {
+            gaussian[i] = quarter_res[i];
+        }
+        dim = half_dim;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    for (int i = get_local_id(0); i < dim.x * dim.y; i += get_local_size(0))
+    {
+        levels[i] = gaussian[i];
+    }
+}
+
+/**
+ * Collapse @a num_levels packed levels, the first of which has dimensions
+ * @a dim, into @a collapsed.
+ *
+ * Must be launched as a single work-group.
+ */
+__kernel void collapse_small_levels(__global const float4* levels, int2 dim, int num_levels,
+                                    __global float4* collapsed)
+{
+    __local float4 result[SMALL_LEVEL_PIXELS];
+    __local float4 half_res[SMALL_LEVEL_PIXELS / 2];
+
+    int2 dims[MAX_SMALL_LEVELS];
+    int offsets[MAX_SMALL_LEVELS];
+
+    int offset = 0;
+    for (int level = 0; level < num_levels; ++level)
+    {
+        dims[level] = dim;
+        offsets[level] = offset;
+        offset += dim.x * dim.y;
+        dim = halve_dim(dim);
+    }
+
+    // start from the smallest level
+    int last = num_levels - 1;
+    for (int i = get_local_id(0); i < dims[last].x * dims[last].y; i += get_local_size(0))
+    {
+        result[i] = levels[offsets[last] + i];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int level = num_levels - 2; level >= 0; --level)
+    {
+        int2 upper_dim = dims[level];
+        int2 col_dim = (int2)( dims[level+1].x, upper_dim.y );
+
+        upsample_local(result, dims[level+1], half_res, col_dim, (int2)(0, 1));
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        __global const float4* laplacian = levels + offsets[level];
+        for (int i = get_local_id(0); i < upper_dim.x * upper_dim.y; i += get_local_size(0))
+        {
+            int2 coord = (int2)( i % upper_dim.x, i / upper_dim.x );
+
+            float4 c = upsampled_pixel(half_res, col_dim, coord, (int2)(1, 0)) + laplacian[i];
+            // small levels collapse just like large ones
+            c = clamp(c, 0.0f, 1.0f);
+
+            result[i] = c;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    for (int i = get_local_id(0); i < dims[0].x * dims[0].y; i += get_local_size(0))
+    {
+        collapsed[i] = result[i];
+    }
+}
+
+/**
+ * Fuse @a num_levels levels at once. For each level, @a arrays holds the
+ * layers of all @a depth images one after another. Pixels are independent,
+ * so this takes a single range over all levels, without local memory.
+ */
+__kernel void fuse_small_levels(__global const float4* arrays, int2 dim, int num_levels, int depth,
+                                __global float4* fused)
+{
+#ifdef GROUP_SIZE
+    depth = GROUP_SIZE;
+#endif
+
+    int index = get_global_id(0);
+
+    for (int level = 0; level < num_levels; ++level)
+    {
+        int level_size = dim.x * dim.y;
+        if (index < level_size)
+        {
+            float4 acc = 0.0f;
+            float weight_sum = 0.0f; // sum of all weights in alpha channel
+
+#ifdef GROUP_SIZE
+            #pragma unroll
+#endif
+            for (int i = 0; i < depth; ++i)
+            {
+                float4 pix = arrays[i * level_size + index];
+
+                weight_sum += pix.s3;
+                acc += pix * pix.s3;
+            }
+
+            fused[index] = acc / weight_sum;
+            return;
+        }
+
+        // move on to the next level
+        index -= level_size;
+        arrays += level_size * depth;
+        fused += level_size;
+        dim = halve_dim(dim);
+    }
+}
@@ -4,10 +4,28 @@
 #include <boost/test/test_case_template.hpp>
 #include <boost/mpl/list.hpp>
 #include <random>
+#include <thread>
+
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "cl_utils.h"
 #include "utils.h"
 #include "pyr_impl.h"
+#include "pending_graph.h"
+#include "host_pyramid.h"
+#include "band_merge.h"
+#include "batch_merge.h"
+#include "merge_group.h"
+#include "merge_pipeline.h"
+#include "jpeg_decoder.h"
+#include "autotune.h"
+#include "pyramid_cache.h"
+#include "sha256.h"
+#include "memory_budget.h"
+#include "parallel.hpp"
+#include "recycler.hpp"
+#include "alloc_counters.h"
 
 using namespace DynamiCL;
 
@@ -85,6 +103,19 @@ BOOST_AUTO_TEST_CASE( stripExtension_test )
     BOOST_CHECK_EQUAL( "hello.jpg", stripExtension("hello.jpg.bmp") );
 }
 
+BOOST_AUTO_TEST_CASE( getExtension_test )
+{
+    using namespace std;
+
+    BOOST_CHECK_EQUAL( "", getExtension("") );
+    BOOST_CHECK_EQUAL( "", getExtension("a") );
+    BOOST_CHECK_EQUAL( "", getExtension(".") );
+    BOOST_CHECK_EQUAL( "jpg", getExtension(".jpg") );
+    BOOST_CHECK_EQUAL( "jpg", getExtension("hello.jpg") );
+    BOOST_CHECK_EQUAL( "jpg", getExtension("hello.JPG") );
+    BOOST_CHECK_EQUAL( "bmp", getExtension("hello.jpg.bmp") );
+}
+
 BOOST_AUTO_TEST_CASE_TEMPLATE( array_ptr_tests, PixType, pix_types)
 {
     typedef array_ptr<PixType> array_type;
@@ -144,6 +175,259 @@ BOOST_AUTO_TEST_CASE_TEMPLATE( array_ptr_alignment_tests, AlignConst, alignment_
 
 }
 
+BOOST_AUTO_TEST_CASE( array_ptr_policy_tests )
+{
+    typedef AllocationPolicy::Pages Pages;
+    typedef array_ptr<float, 256> array_type;
+
+    static size_t size = 3 << 20; // spans several huge pages
+
+    for (Pages pages : { Pages::SMALL, Pages::TRANSPARENT, Pages::HUGE })
+    {
+        array_type a(size, AllocationPolicy(pages, currentNumaNode()));
+
+        BOOST_CHECK_EQUAL( a.size(), size );
+        BOOST_CHECK_GE( alignment(a.ptr()), 256 );
+        std::fill(a.begin(), a.end(), 1.0f);
+        BOOST_CHECK_EQUAL( std::accumulate(a.begin(), a.end(), 0.0), double(size) );
+
+        // moving keeps the mapping, and assigning releases the old one
+        array_type b(16);
+        float* data = a.ptr();
+        b = std::move(a);
+        BOOST_CHECK_EQUAL( b.size(), size );
+        BOOST_CHECK( b.ptr() == data );
+        BOOST_CHECK( a.ptr() == nullptr );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( array_ptr_spill_test )
+{
+    typedef array_ptr<float, 256> array_type;
+
+    static size_t size = 3 << 20;
+
+    ::mkdir("test_spill.tmp", 0700);
+    ::setenv("DYNAMICL_SPILL_DIR", "test_spill.tmp", 1);
+    BOOST_CHECK_EQUAL( spillDirectory(), "test_spill.tmp" );
+
+    {
+        array_type a(size, AllocationPolicy::spill());
+        BOOST_CHECK_EQUAL( a.size(), size );
+        BOOST_CHECK_GE( alignment(a.ptr()), 256 );
+
+        // advice keeps what was written, even on unaligned ranges
+        std::fill(a.begin(), a.end(), 1.0f);
+        retirePages(a.ptr() + 3, (size / 2) * sizeof(float));
+        prefetchPages(a.ptr() + 3, (size / 2) * sizeof(float));
+        BOOST_CHECK_EQUAL( std::accumulate(a.begin(), a.end(), 0.0), double(size) );
+
+        // the file is only reachable through the mapping
+        BOOST_CHECK_EQUAL( ::rmdir("test_spill.tmp"), 0 );
+
+        // nowhere to spill to
+        BOOST_CHECK_THROW( array_type(size, AllocationPolicy::spill()), std::runtime_error );
+    }
+
+    ::unsetenv("DYNAMICL_SPILL_DIR");
+}
+
+BOOST_AUTO_TEST_CASE( parallel_for_test )
+{
+    ThreadPool pool(3);
+
+    // every index exactly once, however ranges get stolen
+    std::vector<std::atomic<int>> visits(1000);
+    parallelFor(visits.size(), 7,
+                [&](size_t begin, size_t end)
+                {
+                    BOOST_REQUIRE_LE( end - begin, 7 );
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        ++visits[i];
+                    }
+                },
+                pool);
+    BOOST_CHECK( std::all_of(visits.begin(), visits.end(),
+                             [](std::atomic<int> const& v) { return v == 1; }) );
+
+    // loops nest without running out of threads
+    std::atomic<size_t> total(0);
+    parallelFor(16, 1,
+                [&](size_t, size_t)
+                {
+                    parallelFor(100, 10, [&](size_t begin, size_t end) { total += end - begin; }, pool);
+                },
+                pool);
+    BOOST_CHECK_EQUAL( total, 1600 );
+
+    BOOST_CHECK_THROW( parallelFor(100, 1,
+                                   [](size_t begin, size_t)
+                                   {
+                                       if (begin == 42)
+                                       {
+                                           throw std::runtime_error("failed range");
+                                       }
+                                   },
+                                   pool),
+                       std::runtime_error );
+}
+
+BOOST_AUTO_TEST_CASE( parallel_algorithms_test )
+{
+    typedef RGBA<float> pixel_type;
+    typedef HostImage<pixel_type, 2> image_type;
+
+    // large enough to be split into several tasks
+    size_t width = 300;
+    size_t height = 700;
+    image_type image(width, height);
+    image_type out(width, height);
+
+    auto view = image.view();
+    float n = 0.0f;
+    for (pixel_type& p : view)
+    {
+        p = {{ n, n, n, 1.0f }};
+        n += 1.0f;
+    }
+
+    auto outView = out.view();
+    parallelTransform(view, outView.begin(),
+                      [](pixel_type p) { p.r *= 2.0f; return p; });
+    parallelForEach(outView, [](pixel_type& p) { p.g = -p.g; });
+
+    bool matching = true;
+    for (size_t i = 0; i < view.totalSize(); ++i)
+    {
+        pixel_type const& in = view.begin()[i];
+        pixel_type const& o = outView.begin()[i];
+        matching = matching && o.r == 2.0f * in.r && o.g == -in.g && o.b == in.b;
+    }
+    BOOST_CHECK( matching );
+
+    std::vector<pixel_type> copied(view.totalSize());
+    BOOST_CHECK( parallelCopy(view.begin(), view.end(), copied.begin()) == copied.end() );
+    BOOST_CHECK( std::equal(copied.begin(), copied.end(), view.begin(),
+                            [](pixel_type const& a, pixel_type const& b) { return a.r == b.r; }) );
+}
+
+BOOST_AUTO_TEST_CASE( allocation_counters_test )
+{
+    size_t const bytes = 1 << 20;
+
+    AllocationCounts before = AllocationCounts::current();
+
+    // every allocation counts, however small
+    std::vector<int> small(16);
+
+    AllocationCounts counts = AllocationCounts::current() - before;
+    BOOST_CHECK_EQUAL( counts.hostAllocations, 1 );
+    BOOST_CHECK_EQUAL( counts.hostBytes, 16 * sizeof(int) );
+
+    // whether from new, malloc or mmap
+    before = AllocationCounts::current();
+    std::unique_ptr<char[]> fromNew(new char[bytes]);
+    array_ptr<float, 256> fromMalloc(bytes);
+    array_ptr<float, 256> fromMmap(bytes, AllocationPolicy(AllocationPolicy::Pages::SMALL, 0));
+
+    counts = AllocationCounts::current() - before;
+    BOOST_CHECK_EQUAL( counts.hostAllocations, 3 );
+    BOOST_CHECK( counts.hostBytes >= bytes * 9 );
+    BOOST_CHECK_EQUAL( counts.deviceAllocations, 0 );
+
+    before = AllocationCounts::current();
+    countDeviceAllocation(1000);
+    counts = AllocationCounts::current() - before;
+    BOOST_CHECK_EQUAL( counts.deviceAllocations, 1 );
+    BOOST_CHECK_EQUAL( counts.deviceBytes, 1000 );
+}
+
+BOOST_AUTO_TEST_CASE( event_list_test )
+{
+    EventList events;
+    BOOST_CHECK( events.empty() );
+
+    std::vector<cl::Event> some(3);
+    events.append(some.begin(), some.end());
+    BOOST_CHECK_EQUAL( events.size(), 3 );
+
+    EventList copy = events;
+    copy.push_back(cl::Event());
+    BOOST_CHECK_EQUAL( copy.size(), 4 );
+    BOOST_CHECK_EQUAL( events.size(), 3 );
+
+    // once the wait list of the thread has grown, lists allocate nothing
+    {
+        WaitList wait(copy);
+        BOOST_CHECK_EQUAL( wait.get()->size(), 4 );
+        BOOST_CHECK_THROW( WaitList nested(events), std::logic_error );
+    }
+
+    AllocationCounts before = AllocationCounts::current();
+    for (int i = 0; i < 10; ++i)
+    {
+        EventList waitFor = events;
+        waitFor.append(copy);
+        WaitList wait(copy);
+    }
+    BOOST_CHECK( (AllocationCounts::current() - before).empty() );
+
+    EventList full;
+    for (size_t i = 0; i < EventList::capacity; ++i)
+    {
+        full.push_back(cl::Event());
+    }
+    BOOST_CHECK_THROW( full.push_back(cl::Event()), std::length_error );
+
+    full.clear();
+    BOOST_CHECK( full.empty() );
+}
+
+BOOST_AUTO_TEST_CASE( recycler_test )
+{
+    typedef HostImage<RGBA<float>, 2> image_type;
+    typedef std::array<size_t, 2> dims_type;
+
+    std::unique_ptr<Recycler<image_type>> recycler(new Recycler<image_type>);
+    size_t made = 0;
+    auto acquire =
+        [&](dims_type dims)
+        {
+            return recycler->acquire(
+                [&](image_type const& image) { return image.view().dimensions() == dims; },
+                [&]() { ++made; return std::unique_ptr<image_type>(new image_type(dims)); });
+        };
+
+    dims_type const dims = {{ 640, 480 }};
+    RGBA<float>* first = acquire(dims)->view().begin();
+    BOOST_CHECK_EQUAL( recycler->numFree(), 1 );
+
+    // a sequence of frames gets the same image back each time
+    for (int frame = 0; frame < 10; ++frame)
+    {
+        auto image = acquire(dims);
+        BOOST_CHECK( image->view().begin() == first );
+        BOOST_CHECK_EQUAL( recycler->numFree(), 0 );
+    }
+    BOOST_CHECK_EQUAL( made, 1 );
+
+    // images in use at once are distinct, and others do not match
+    {
+        auto a = acquire(dims);
+        auto b = acquire(dims);
+        auto c = acquire(dims_type{{ 320, 240 }});
+        BOOST_CHECK( a->view().begin() != b->view().begin() );
+        BOOST_CHECK_EQUAL( made, 3 );
+    }
+    BOOST_CHECK_EQUAL( recycler->numFree(), 3 );
+
+    // images may outlive their recycler
+    auto survivor = acquire(dims);
+    recycler.reset();
+    survivor.reset();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 // ========================================================
 
@@ -343,42 +627,1611 @@ BOOST_AUTO_TEST_CASE( halve_test )
 }
 
 
-BOOST_AUTO_TEST_SUITE_END()
-// ========================================================
+BOOST_AUTO_TEST_CASE( halve_buffer_test )
+{
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> d(0, 1);
 
+    // create random image, with a width that is not a power of two
+    typedef RGBA<float> pixel_type;
+    typedef HostImage<pixel_type, 2> image_type;
+    image_type image(1023, 517);
+    std::generate(image.view().begin(), image.view().end(),
+                  [&]() -> pixel_type { return {{d(gen), d(gen), d(gen), d(gen) }}; });
 
-BOOST_AUTO_TEST_SUITE( pyramid_tests )
+    auto pendinginput = makePendingImage<BufferImage2D>(clcontext, image.view());
 
-BOOST_AUTO_TEST_CASE( pyramid_views )
+    BOOST_CHECK_EQUAL( pendinginput.width(), 1023 );
+    BOOST_CHECK_EQUAL( pendinginput.height(), 517 );
+
+    image_type result(image.view().dimensions());
+
+    Kernel halve = { testprogram, "halve_buffer", Kernel::Range::SOURCE };
+
+    // process input with halving kernel
+    pendinginput.process(halve).readInto(result.view().rawData());
+
+    for (size_t i = 0; i < result.view().totalSize(); ++i)
+    {
+        pixel_type const& pixel = *(image.view().begin() + i);
+        pixel_type expected = {{ pixel.r/2, pixel.g/2, pixel.b/2, pixel.a/2 }};
+        BOOST_REQUIRE( *(result.view().begin() + i) == expected );
+    }
+
+}
+
+BOOST_AUTO_TEST_CASE( async_read_test )
+{
+    typedef RGBA<float> pixel_type;
+    typedef HostImage<pixel_type, 2> image_type;
+    image_type image(301, 129);
+    float n = 0.0f;
+    for (pixel_type& p : image.view())
+    {
+        p = {{ n, n + 1.0f, n + 2.0f, 1.0f }};
+        n += 1.0f;
+    }
+
+    Kernel halve = { testprogram, "halve_buffer", Kernel::Range::SOURCE };
+    auto halved = makePendingImage<BufferImage2D>(clcontext, image.view()).process(halve);
+
+    image_type read(image.view().dimensions());
+    cl::Event complete = halved.readIntoAsync(read.view().rawData());
+    complete.wait();
+
+    for (size_t i = 0; i < image.view().totalSize(); ++i)
+    {
+        pixel_type const& pixel = *(image.view().begin() + i);
+        pixel_type expected = {{ pixel.r/2, pixel.g/2, pixel.b/2, pixel.a/2 }};
+        BOOST_REQUIRE( *(read.view().begin() + i) == expected );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( zero_copy_test )
+{
+    ::setenv("DYNAMICL_ZERO_COPY", "1", 1);
+    ComputeContext zeroCopyContext(ImageStorage::BUFFER);
+    ::unsetenv("DYNAMICL_ZERO_COPY");
+    BOOST_REQUIRE( zeroCopyContext.zeroCopy );
+
+    cl::Program program = buildProgram(zeroCopyContext.context, zeroCopyContext.device, "tests.cl");
+    Kernel halve = { program, "halve_buffer", Kernel::Range::SOURCE };
+
+    typedef RGBA<float> pixel_type;
+    typedef HostImage<pixel_type, 2> image_type;
+    image_type image(257, 64);
+    float n = 0.0f;
+    for (pixel_type& p : image.view())
+    {
+        p = {{ n, n + 1.0f, n + 2.0f, 1.0f }};
+        n += 1.0f;
+    }
+
+    // aligned storage is shared, and views into it at odd offsets are not
+    image_type result(image.view().dimensions());
+    auto resultView = result.view();
+    BOOST_CHECK( sharesHostMemory(zeroCopyContext, resultView.rawData()) );
+    BOOST_CHECK( !sharesHostMemory(zeroCopyContext, resultView.begin() + 1) );
+
+    processImageInto(image.view(), halve, zeroCopyContext, resultView);
+
+    for (size_t i = 0; i < image.view().totalSize(); ++i)
+    {
+        pixel_type const& pixel = *(image.view().begin() + i);
+        pixel_type expected = {{ pixel.r/2, pixel.g/2, pixel.b/2, pixel.a/2 }};
+        BOOST_REQUIRE( *(resultView.begin() + i) == expected );
+    }
+
+    // results of kernels in memory of their own are mapped and copied
+    image_type copied(image.view().dimensions());
+    makePendingImage<BufferImage2D>(zeroCopyContext, image.view())
+        .process(halve)
+        .readInto(copied.view().rawData());
+    BOOST_CHECK( std::equal(copied.view().begin(), copied.view().end(), resultView.begin(),
+                            [](pixel_type const& a, pixel_type const& b) { return a == b; }) );
+
+    // results over the memory they are read back to are mapped, not read,
+    // also without waiting for them
+    image_type mapped(image.view().dimensions());
+    auto over = createCLImage<BufferImage2D>(zeroCopyContext, image.view().dimensions(),
+                                             mapped.view().rawData());
+    cl::Event read = makePendingImage<BufferImage2D>(zeroCopyContext, image.view())
+                         .process(halve, over)
+                         .readIntoAsync(mapped.view().rawData());
+    BOOST_CHECK_EQUAL( read.getInfo<CL_EVENT_COMMAND_TYPE>(), CL_COMMAND_UNMAP_MEM_OBJECT );
+    read.wait();
+    BOOST_CHECK( std::equal(mapped.view().begin(), mapped.view().end(), resultView.begin(),
+                            [](pixel_type const& a, pixel_type const& b) { return a == b; }) );
+
+    // which is how pyramid levels are read back
+    cl::Program pyramidProgram = buildProgram(zeroCopyContext, ProgramVariant());
+    image_type upper(image.view().dimensions());
+    ImagePyramid::LevelPair<BufferImage2D> pair =
+        createPyramidLevel(makePendingImage<BufferImage2D>(zeroCopyContext, image.view()),
+                           pyramidProgram, upper.view().rawData());
+    BOOST_CHECK( detail::is_over(pair.upper.image, upper.view().rawData()) );
+    cl::Event levelRead = pair.upper.readIntoAsync(upper.view().rawData());
+    BOOST_CHECK_EQUAL( levelRead.getInfo<CL_EVENT_COMMAND_TYPE>(), CL_COMMAND_UNMAP_MEM_OBJECT );
+    levelRead.wait();
+}
+
+BOOST_AUTO_TEST_CASE( device_image_pool_test )
+{
+    ComputeContext context(clcontext, clcontext.queue);
+    context.imagePool.reset(new DeviceImagePool);
+
+    std::array<size_t, 2> const dims = {{ 64, 32 }};
+    AllocationCounts before = AllocationCounts::current();
+
+    // images that are released are handed out again
+    cl_mem first = createCLImage<cl::Image2D>(context, dims)();
+    for (int frame = 0; frame < 5; ++frame)
+    {
+        context.imagePool->releaseAll(context.queue);
+        cl::Image2D image = createCLImage<cl::Image2D>(context, dims);
+        BOOST_CHECK( image() == first );
+    }
+    BOOST_CHECK_EQUAL( (AllocationCounts::current() - before).deviceAllocations, 1 );
+
+    // but not until then, even once nothing refers to them
+    cl_mem unreleased = createCLImage<cl::Image2D>(context, dims)();
+    BOOST_CHECK( unreleased != first );
+    BOOST_CHECK_EQUAL( context.imagePool->size(), 2 );
+    context.imagePool->releaseAll(context.queue);
+
+    // reused images are filled from the host like new ones,
+    // unless they are created over host memory, which is never pooled
+    typedef RGBA<float> pixel_type;
+    typedef HostImage<pixel_type, 2> image_type;
+    image_type image(dims);
+    image_type result(dims);
+    if (!sharesHostMemory(context, image.view().rawData()))
+    {
+        std::fill(image.view().begin(), image.view().end(), pixel_type{{ 0.0f, 0.0f, 0.0f, 0.0f }});
+        cl_mem copied = createCLImage<cl::Image2D>(context, dims, image.view().rawData())();
+        context.imagePool->releaseAll(context.queue);
+
+        std::fill(image.view().begin(), image.view().end(), pixel_type{{ 1.0f, 2.0f, 3.0f, 4.0f }});
+        cl::Image2D filled = createCLImage<cl::Image2D>(context, dims, image.view().rawData());
+        BOOST_CHECK( filled() == copied );
+
+        PendingImage<cl::Image2D>(context, filled).readInto(result.view().rawData());
+        BOOST_CHECK( std::equal(result.view().begin(), result.view().end(), image.view().begin(),
+                                [](pixel_type const& a, pixel_type const& b) { return a == b; }) );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( frame_allocations_test )
+{
+    ComputeContext context(clcontext, clcontext.queue);
+    context.imagePool.reset(new DeviceImagePool);
+
+    typedef RGBA<float> pixel_type;
+    typedef HostImage<pixel_type, 2> image_type;
+    image_type image(64, 32);
+    image_type result(image.view().dimensions());
+    auto resultView = result.view();
+    std::fill(image.view().begin(), image.view().end(), pixel_type{{ 2.0f, 4.0f, 6.0f, 8.0f }});
+
+    Kernel halve = { testprogram,
+                     context.storage == ImageStorage::BUFFER ? "halve_buffer" : "halve_image",
+                     Kernel::Range::SOURCE };
+
+    // once the first frame is done, frames allocate nothing at all,
+    // not even lists of events
+    AllocationCounts warm = AllocationCounts::current();
+    for (int frame = 0; frame < 5; ++frame)
+    {
+        if (frame == 1)
+        {
+            warm = AllocationCounts::current();
+        }
+        processImageInto(image.view(), halve, context, resultView);
+        context.imagePool->releaseAll(context.queue);
+    }
+    AllocationCounts counts = AllocationCounts::current() - warm;
+    BOOST_CHECK_EQUAL( counts.hostAllocations, 0 );
+    BOOST_CHECK_EQUAL( counts.deviceAllocations, 0 );
+    BOOST_CHECK( result.view().begin()->g == 2.0f );
+}
+
+/**
+ * Fuse and collapse a level in one kernel, and in two, with images of the
+ * storage of @a context
+ */
+template <typename CLImage>
+void checkFuseCollapse(ComputeContext const& context)
 {
+    typedef typename detail::image_traits<CLImage>::array_type array_type;
+    typedef RGBA<float> pixel_type;
+
     std::random_device rd;
     std::mt19937 gen(rd());
-    std::uniform_int_distribution<size_t> d(0, 500);
+    std::uniform_real_distribution<float> d(0, 1);
+    auto random = [&]() -> pixel_type { return {{ d(gen), d(gen), d(gen), d(gen) + 0.1f }}; };
 
-    typedef ImagePyramid::pixel_type pixel_type;
+    // odd dimensions, so that the last upsampled pixels come from one alone
+    HostImage<pixel_type, 3> layers(67, 45, 3);
+    std::generate(layers.view().begin(), layers.view().end(), random);
+    HostImage<pixel_type, 2> lower(34, 23);
+    std::generate(lower.view().begin(), lower.view().end(), random);
 
-    for (size_t example = 0; example < 10; ++example)
+    cl::Program program = buildProgram(context, ProgramVariant());
+    auto array = makePendingImage<array_type>(context, layers.view());
+
+    HostImage<pixel_type, 2> expected(67, 45);
+    ImagePyramid::LevelPair<CLImage> pair{ fusePyramidLevel<CLImage>(array, program),
+                                           makePendingImage<CLImage>(context, lower.view()) };
+    collapsePyramidLevel(pair, program).readInto(expected.view().rawData());
+
+    HostImage<pixel_type, 2> result(67, 45);
+    fuseCollapsePyramidLevel<CLImage>(array, makePendingImage<CLImage>(context, lower.view()), program)
+        .readInto(result.view().rawData());
+
+    for (size_t i = 0; i < result.view().totalSize(); ++i)
     {
-        size_t width = d(gen);
-        size_t height = d(gen);
-        size_t numLevels = calculateNumLevels(width, height);
+        for (size_t c = 0; c < 4; ++c)
+        {
+            BOOST_REQUIRE_SMALL( result.view().begin()[i].components[c]
+                                 - expected.view().begin()[i].components[c], 1e-5f );
+        }
+    }
+}
 
-        array_ptr<pixel_type> ar(pyramidSize(width, height, numLevels));
+BOOST_AUTO_TEST_CASE( fuse_collapse_test )
+{
+    if (clcontext.storage == ImageStorage::BUFFER)
+    {
+        checkFuseCollapse<BufferImage2D>(clcontext);
+    }
+    else
+    {
+        checkFuseCollapse<cl::Image2D>(clcontext);
+    }
+}
 
-        auto views =
-            ImagePyramid::createPyramidViews(width, height, numLevels, halveDimension, ar.ptr());
+BOOST_AUTO_TEST_CASE( concurrent_groups_test )
+{
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> d(0.05f, 0.95f);
 
-        size_t totalBytes = std::accumulate(views.begin(), views.end(), 0,
-                [](size_t acc, ImagePyramid::view_type const& v)
-                {
-                    return acc + v.totalSize();
-                });
+    size_t const width = 61;
+    size_t const height = 43;
+    size_t const numExposures = 3;
+    size_t const numGroups = 3;
 
-        BOOST_CHECK_EQUAL( totalBytes, ar.size() );
+    // every group of its own content
+    std::vector<std::shared_ptr<FloatImage>> images;
+    for (size_t i = 0; i < numGroups * numExposures; ++i)
+    {
+        images.push_back(std::make_shared<FloatImage>(width, height));
+        FloatImageView view = images.back()->view();
+        std::generate(view.begin(), view.end(),
+                      [&]() -> RGBA<float> { return {{ d(gen), d(gen), d(gen), 1.0f }}; });
+    }
+
+    cl::Program program = buildProgram(clcontext, ProgramVariant(numExposures));
+    MemoryBudget::Limits limits = { size_t(1) << 32, size_t(1) << 32, size_t(1) << 30 };
+    MemoryBudget budget(limits, []() { return size_t(1) << 32; });
+    PipelineGate gate;
+    std::vector<QualityWeights> const weights(1);
+
+    auto mergeAll =
+        [&](size_t maxGroups)
+        {
+            std::vector<std::shared_ptr<OpenedImage>> inputs;
+            for (auto const& image : images)
+            {
+                inputs.push_back(std::make_shared<OpenedImage>());
+                inputs.back()->dimensions = {{ width, height }};
+                inputs.back()->decodeInto =
+                    [image](FloatImageView& dest)
+                    {
+                        std::copy(image->view().begin(), image->view().end(), dest.begin());
+                    };
+            }
+
+            mergeHDR::merged_type merged;
+            mergeHDR merge = { numExposures, clcontext, program, 0, nullptr, weights, budget, gate,
+                               maxGroups, nullptr, false, false, 1 };
+            merge(inputs.begin(), inputs.end(), std::back_inserter(merged));
+            return merged;
+        };
+
+    // groups in flight at once come out as if merged one after the other
+    mergeHDR::merged_type sequential = mergeAll(1);
+    mergeHDR::merged_type concurrent = mergeAll(2);
+    BOOST_REQUIRE_EQUAL( sequential.size(), numGroups );
+    BOOST_REQUIRE_EQUAL( concurrent.size(), numGroups );
+
+    for (size_t i = 0; i < numGroups; ++i)
+    {
+        FloatImageView a = sequential[i]->view();
+        FloatImageView b = concurrent[i]->view();
+        BOOST_CHECK( std::equal(a.begin(), a.end(), b.begin(),
+                                [](RGBA<float> const& x, RGBA<float> const& y) { return x == y; }) );
+    }
+
+    // and in the order of their inputs
+    for (size_t i = 0; i < numGroups; ++i)
+    {
+        MergeGroup group(clcontext, program, width, height, numExposures);
+        for (size_t j = 0; j < numExposures; ++j)
+        {
+            FloatImageView slot = group.nextSlot();
+            std::copy(images[i * numExposures + j]->view().begin(),
+                      images[i * numExposures + j]->view().end(), slot.begin());
+            processImageInPlace(std::move(slot),
+                                Kernel{program, "compute_quality", Kernel::Range::SOURCE,
+                                       { weights.front().toFloat4() }},
+                                group.context());
+            group.addImage();
+        }
+        FloatImage expected(width, height);
+        group.mergeInto(expected.view());
+
+        FloatImageView a = expected.view();
+        FloatImageView b = concurrent[i]->view();
+        BOOST_CHECK( std::equal(a.begin(), a.end(), b.begin(),
+                                [](RGBA<float> const& x, RGBA<float> const& y) { return x == y; }) );
     }
 }
 
+/**
+ * Output iterator that records the allocation counts as of each merged
+ * image it is given, and drops the image, so that it can be recycled
+ */
+struct AllocationRecorder
+{
+    std::vector<AllocationCounts>* counts;
 
-BOOST_AUTO_TEST_SUITE_END()
-// ========================================================
+    AllocationRecorder& operator *() { return *this; }
+    AllocationRecorder& operator ++() { return *this; }
+    AllocationRecorder& operator ++(int) { return *this; }
+    AllocationRecorder& operator =(std::shared_ptr<FloatImage> const&)
+    {
+        counts->push_back(AllocationCounts::current());
+        return *this;
+    }
+};
+
+BOOST_AUTO_TEST_CASE( frame_sequence_allocations_test )
+{
+    size_t const width = 256;
+    size_t const height = 128;
+    size_t const numExposures = 3;
+    size_t const numFrames = 6;
+
+    std::vector<std::shared_ptr<FloatImage>> images;
+    for (size_t i = 0; i < numExposures; ++i)
+    {
+        images.push_back(std::make_shared<FloatImage>(width, height));
+        FloatImageView view = images.back()->view();
+        float const value = 0.2f + 0.3f * i;
+        std::fill(view.begin(), view.end(), RGBA<float>{{ value, value, value, 1.0f }});
+    }
+
+    std::vector<std::shared_ptr<OpenedImage>> inputs;
+    for (size_t i = 0; i < numFrames * numExposures; ++i)
+    {
+        std::shared_ptr<FloatImage> image = images[i % numExposures];
+        inputs.push_back(std::make_shared<OpenedImage>());
+        inputs.back()->dimensions = {{ width, height }};
+        inputs.back()->decodeInto =
+            [image](FloatImageView& dest)
+            {
+                std::copy(image->view().begin(), image->view().end(), dest.begin());
+            };
+    }
 
+    cl::Program program = buildProgram(clcontext, ProgramVariant(numExposures));
+    MemoryBudget::Limits limits = { size_t(1) << 32, size_t(1) << 32, size_t(1) << 30 };
+    MemoryBudget budget(limits, []() { return size_t(1) << 32; });
+    PipelineGate gate;
+    std::vector<QualityWeights> const weights(1);
+    FrameBuffers frames;
+
+    std::vector<AllocationCounts> counts;
+    mergeHDR merge = { numExposures, clcontext, program, 0, nullptr, weights, budget, gate,
+                       1, &frames, false, false, 1 };
+    merge(inputs.begin(), inputs.end(), AllocationRecorder{ &counts });
+    BOOST_REQUIRE_EQUAL( counts.size(), numFrames );
+
+    // the first frame allocates the images of all the others. those still
+    // record their kernels, which only takes small allocations.
+    size_t const imageBytes = width * height * sizeof(RGBA<float>);
+    for (size_t frame = 2; frame < numFrames; ++frame)
+    {
+        AllocationCounts const perFrame = counts[frame] - counts[frame - 1];
+        BOOST_CHECK_EQUAL( perFrame.deviceAllocations, 0 );
+        BOOST_CHECK_LT( perFrame.hostBytes, imageBytes );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( cached_variants_test )
+{
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> d(0.05f, 0.95f);
+
+    size_t const width = 61;
+    size_t const height = 43;
+    size_t const numExposures = 3;
+
+    std::vector<std::shared_ptr<FloatImage>> images;
+    for (size_t i = 0; i < numExposures; ++i)
+    {
+        images.push_back(std::make_shared<FloatImage>(width, height));
+        FloatImageView view = images.back()->view();
+        std::generate(view.begin(), view.end(),
+                      [&]() -> RGBA<float> { return {{ d(gen), d(gen), d(gen), 1.0f }}; });
+    }
+
+    cl::Program program = buildProgram(clcontext, ProgramVariant(numExposures));
+    MemoryBudget::Limits limits = { size_t(1) << 32, size_t(1) << 32, size_t(1) << 30 };
+    MemoryBudget budget(limits, []() { return size_t(1) << 32; });
+    PipelineGate gate;
+    PyramidCache cache("test_cached_variants.tmp");
+
+    size_t numDecoded = 0;
+    auto mergeAll =
+        [&](std::vector<QualityWeights> const& weights)
+        {
+            std::vector<std::shared_ptr<OpenedImage>> inputs;
+            for (size_t i = 0; i < images.size(); ++i)
+            {
+                std::shared_ptr<FloatImage> image = images[i];
+                std::string const name = "input" + std::to_string(i);
+                Sha256 key;
+                key.update(name.data(), name.size());
+
+                inputs.push_back(std::make_shared<OpenedImage>());
+                inputs.back()->dimensions = {{ width, height }};
+                inputs.back()->cacheKey = Sha256::toHex(key.finish());
+                inputs.back()->decodeInto =
+                    [image, &numDecoded](FloatImageView& dest)
+                    {
+                        ++numDecoded;
+                        std::copy(image->view().begin(), image->view().end(), dest.begin());
+                    };
+            }
+
+            mergeHDR::merged_type merged;
+            mergeHDR merge = { numExposures, clcontext, program, 0, &cache, weights, budget, gate,
+                               1, nullptr, false, false, 1 };
+            merge(inputs.begin(), inputs.end(), std::back_inserter(merged));
+            return merged;
+        };
+
+    // entries of measures serve any weights
+    std::vector<QualityWeights> const weights = { QualityWeights(), QualityWeights(0.0f, 1.0f, 1.0f) };
+    std::vector<QualityWeights> const others = { QualityWeights(1.0f, 0.0f, 1.0f), QualityWeights() };
+    mergeHDR::merged_type built = mergeAll(weights);
+    BOOST_CHECK_EQUAL( numDecoded, numExposures );
+    mergeHDR::merged_type loaded = mergeAll(others);
+    BOOST_CHECK_EQUAL( numDecoded, numExposures );
+
+    BOOST_REQUIRE_EQUAL( built.size(), 2 );
+    BOOST_REQUIRE_EQUAL( loaded.size(), 2 );
+    FloatImageView a = built[0]->view();
+    FloatImageView b = loaded[1]->view();
+    BOOST_CHECK( std::equal(a.begin(), a.end(), b.begin(),
+                            [](RGBA<float> const& x, RGBA<float> const& y) { return x == y; }) );
+
+    for (size_t i = 0; i < images.size(); ++i)
+    {
+        std::string const name = "input" + std::to_string(i);
+        Sha256 key;
+        key.update(name.data(), name.size());
+        std::string const entry = "test_cached_variants.tmp/" + Sha256::toHex(key.finish()) + ".pyr";
+        std::remove(entry.c_str());
+    }
+    ::rmdir("test_cached_variants.tmp");
+}
+
+BOOST_AUTO_TEST_CASE( sliding_window_test )
+{
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> d(0.05f, 0.95f);
+
+    size_t const width = 61;
+    size_t const height = 43;
+    size_t const numExposures = 3;
+    size_t const numFrames = 6;
+
+    std::vector<std::shared_ptr<FloatImage>> frames;
+    for (size_t i = 0; i < numFrames; ++i)
+    {
+        frames.push_back(std::make_shared<FloatImage>(width, height));
+        FloatImageView view = frames.back()->view();
+        std::generate(view.begin(), view.end(),
+                      [&]() -> RGBA<float> { return {{ d(gen), d(gen), d(gen), 1.0f }}; });
+    }
+
+    cl::Program program = buildProgram(clcontext, ProgramVariant(numExposures));
+    Kernel quality = {program, "compute_quality", Kernel::Range::SOURCE,
+                      { QualityWeights().toFloat4() }};
+
+    auto add =
+        [&](MergeGroup& group, size_t frame)
+        {
+            FloatImageView slot = group.nextSlot();
+            std::copy(frames[frame]->view().begin(), frames[frame]->view().end(), slot.begin());
+            processImageInPlace(std::move(slot), quality, group.context());
+            group.addImage();
+        };
+
+    // fused in a different order of slots, so only equal up to rounding
+    auto close =
+        [](RGBA<float> const& x, RGBA<float> const& y)
+        {
+            return std::abs(x.r - y.r) < 1e-5f && std::abs(x.g - y.g) < 1e-5f
+                && std::abs(x.b - y.b) < 1e-5f;
+        };
+
+    MergeGroup window(clcontext, program, width, height, numExposures);
+    window.enableSlidingWindow();
+    for (size_t i = 0; i + 1 < numExposures; ++i)
+    {
+        add(window, i);
+    }
+
+    for (size_t last = numExposures - 1; last < numFrames; ++last)
+    {
+        // every step only builds the pyramid of the new exposure
+        size_t built = window.numPyramidsBuilt();
+        add(window, last);
+        BOOST_CHECK_EQUAL( window.numPyramidsBuilt(), built + 1 );
+        BOOST_CHECK_EQUAL( window.numImages(), numExposures );
+
+        FloatImage merged(width, height);
+        window.mergeInto(merged.view());
+        BOOST_CHECK_EQUAL( window.numImages(), numExposures - 1 );
+
+        // and merges like the last exposures from scratch
+        MergeGroup scratch(clcontext, program, width, height, numExposures);
+        for (size_t i = last + 1 - numExposures; i <= last; ++i)
+        {
+            add(scratch, i);
+        }
+        FloatImage expected(width, height);
+        scratch.mergeInto(expected.view());
+
+        FloatImageView a = merged.view();
+        FloatImageView b = expected.view();
+        BOOST_CHECK( std::equal(a.begin(), a.end(), b.begin(), close) );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( batch_merge_test )
+{
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> d(0.05f, 0.95f);
+
+    typedef ImagePyramid::pixel_type pixel_type;
+    typedef HostImage<pixel_type, 2> image_type;
+
+    QualityWeights const weights;
+    std::array<float, 3> const w = {{ weights.contrast, weights.saturation, weights.exposedness }};
+    size_t const width = 45;
+    size_t const height = 37;
+    size_t const numInputs = 3;
+    size_t const numLevels = calculateNumLevels(width, height);
+
+    // batches are only merged in buffers
+    std::unique_ptr<ComputeContext> buffers;
+    if (clcontext.storage != ImageStorage::BUFFER)
+    {
+        buffers.reset(new ComputeContext(ImageStorage::BUFFER));
+    }
+    ComputeContext const& context = buffers ? *buffers : clcontext;
+    cl::Program program = buildProgram(context, ProgramVariant(numInputs));
+
+    BatchMerge batch(context, program, width, height, numInputs, 2, weights);
+
+    // two groups, and what merging them on the host gives
+    std::vector<image_type> expected;
+    std::vector<std::vector<pixel_type>> inputs;
+    for (size_t group = 0; group < 2; ++group)
+    {
+        size_t pyramidPixels = pyramidSize(width, height, numLevels);
+        array_ptr<pixel_type> ar((numInputs + 1) * pyramidPixels);
+        std::vector<std::vector<ImagePyramid::view_type>> pyramids;
+        for (size_t i = 0; i < numInputs; ++i)
+        {
+            ImagePyramid::view_type slot = batch.nextSlot();
+            std::generate(slot.begin(), slot.end(),
+                          [&]() -> pixel_type { return {{ d(gen), d(gen), d(gen), 1.0f }}; });
+            inputs.emplace_back(slot.begin(), slot.end());
+
+            pyramids.push_back(ImagePyramid::createPyramidViews(width, height, numLevels, halveDimension,
+                                                                ar.ptr() + i * pyramidPixels));
+            image_type measures(width, height);
+            ImagePyramid::view_type measuresView = measures.view();
+            measureHostLevel(slot, measuresView);
+
+            std::copy(slot.begin(), slot.end(), pyramids[i][0].begin());
+            weighHostLevel(measuresView, w, pyramids[i][0]);
+            buildHostLevels(pyramids[i]);
+        }
+
+        auto fused = ImagePyramid::createPyramidViews(width, height, numLevels, halveDimension,
+                                                      ar.ptr() + numInputs * pyramidPixels);
+        for (size_t level = 0; level < numLevels; ++level)
+        {
+            std::vector<ImagePyramid::view_type> layers;
+            for (auto& pyramid : pyramids)
+            {
+                layers.push_back(pyramid[level]);
+            }
+            HostImage<pixel_type, 3> array(layers);
+            fuseHostLevel(array.view(), fused[level]);
+        }
+        collapseHostLevels(fused);
+
+        expected.emplace_back(width, height);
+        std::copy(fused[0].begin(), fused[0].end(), expected.back().view().begin());
+    }
+    BOOST_CHECK( batch.full() );
+    BOOST_CHECK_THROW( batch.nextSlot(), std::invalid_argument );
+
+    std::vector<image_type> merged;
+    std::vector<ImagePyramid::view_type> dests;
+    for (size_t group = 0; group < 2; ++group)
+    {
+        merged.emplace_back(width, height);
+        dests.push_back(merged.back().view());
+    }
+
+    std::vector<ImagePyramid::view_type> tooFew(dests.begin(), dests.begin() + 1);
+    BOOST_CHECK_THROW( batch.mergeInto(tooFew), std::invalid_argument );
+
+    batch.mergeInto(dests);
+    BOOST_CHECK_EQUAL( batch.numImages(), 0 );
+
+    for (size_t group = 0; group < 2; ++group)
+    {
+        for (size_t i = 0; i < width * height; ++i)
+        {
+            for (size_t ch = 0; ch < 3; ++ch)
+            {
+                BOOST_REQUIRE_SMALL( merged[group].view().begin()[i].components[ch]
+                                     - expected[group].view().begin()[i].components[ch], 1e-3f );
+            }
+        }
+    }
+
+    // several weights share a batch, each merging like a batch of its own
+    QualityWeights const other(0.5f, 2.0f, 1.0f);
+    BatchMerge shared(context, program, width, height, numInputs, 2,
+                      std::vector<QualityWeights>{ weights, other });
+    BatchMerge single(context, program, width, height, numInputs, 2, other);
+    BOOST_CHECK_EQUAL( shared.numVariants(), 2 );
+    for (auto const& input : inputs)
+    {
+        std::copy(input.begin(), input.end(), shared.nextSlot().begin());
+        std::copy(input.begin(), input.end(), single.nextSlot().begin());
+    }
+
+    std::vector<image_type> singleMerged;
+    std::vector<ImagePyramid::view_type> singleDests;
+    std::vector<image_type> sharedMerged;
+    std::vector<ImagePyramid::view_type> sharedDests;
+    for (size_t group = 0; group < 2; ++group)
+    {
+        singleMerged.emplace_back(width, height);
+        singleDests.push_back(singleMerged.back().view());
+        for (size_t variant = 0; variant < 2; ++variant)
+        {
+            sharedMerged.emplace_back(width, height);
+            sharedDests.push_back(sharedMerged.back().view());
+        }
+    }
+    BOOST_CHECK_THROW( shared.mergeInto(dests), std::invalid_argument );
+    shared.mergeInto(sharedDests);
+    single.mergeInto(singleDests);
+
+    for (size_t group = 0; group < 2; ++group)
+    {
+        for (size_t i = 0; i < width * height; ++i)
+        {
+            for (size_t ch = 0; ch < 3; ++ch)
+            {
+                BOOST_REQUIRE_SMALL( sharedMerged[2 * group].view().begin()[i].components[ch]
+                                     - merged[group].view().begin()[i].components[ch], 1e-3f );
+                BOOST_REQUIRE_SMALL( sharedMerged[2 * group + 1].view().begin()[i].components[ch]
+                                     - singleMerged[group].view().begin()[i].components[ch], 1e-3f );
+            }
+        }
+    }
+
+    // only whole groups are merged
+    batch.nextSlot();
+    BOOST_CHECK_THROW( batch.mergeInto(tooFew), std::logic_error );
+}
+
+BOOST_AUTO_TEST_CASE( program_variant_test )
+{
+    ProgramVariant variant(3);
+    variant.saturation = false;
+
+    BOOST_CHECK_EQUAL( variant.defines(),
+        "-D GROUP_SIZE=3 -D QUALITY_CONTRAST=1 -D QUALITY_SATURATION=0 -D QUALITY_EXPOSEDNESS=1" );
+    BOOST_CHECK_EQUAL( ProgramVariant().defines().find("GROUP_SIZE"), std::string::npos );
+
+    // variants are cached per configuration
+    cl::Program program = buildProgram(clcontext, variant);
+    BOOST_CHECK( buildProgram(clcontext, variant)() == program() );
+    BOOST_CHECK( buildProgram(clcontext, ProgramVariant(3))() != program() );
+}
+
+BOOST_AUTO_TEST_CASE( pyramid_parameters_test )
+{
+    std::vector<QualityWeights> const weights(1);
+    std::string const parameters = pyramidParameters(clcontext, ProgramVariant(3), 0, weights);
+    BOOST_CHECK_NE( parameters.find(clcontext.device.getInfo<CL_DEVICE_NAME>()), std::string::npos );
+    BOOST_CHECK_NE( parameters, pyramidParameters(clcontext, ProgramVariant(3), 1, weights) );
+
+    // levels built on the host differ slightly from those of the device
+    ComputeContext hostLevels(clcontext, clcontext.queue);
+    hostLevels.tuning.hostLevelPixels = clcontext.tuning.hostLevelPixels + 1024;
+    BOOST_CHECK_NE( parameters, pyramidParameters(hostLevels, ProgramVariant(3), 0, weights) );
+
+    // entries of several weights hold measures, which any weights apply to
+    std::vector<QualityWeights> const variants = { QualityWeights(), QualityWeights(0.0f, 1.0f, 1.0f) };
+    std::vector<QualityWeights> const others = { QualityWeights(1.0f, 0.0f, 1.0f), QualityWeights() };
+    BOOST_CHECK_NE( parameters, pyramidParameters(clcontext, ProgramVariant(3), 0, variants) );
+    BOOST_CHECK_EQUAL( pyramidParameters(clcontext, ProgramVariant(3), 0, variants),
+                       pyramidParameters(clcontext, ProgramVariant(3), 0, others) );
+    BOOST_CHECK_NE( parameters, pyramidParameters(clcontext, ProgramVariant(3), 0,
+                                                  std::vector<QualityWeights>(1, variants[1])) );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+// ========================================================
+
+
+BOOST_AUTO_TEST_SUITE( jpeg_decoder_tests )
+
+BOOST_AUTO_TEST_CASE( decode_test )
+{
+    typedef JpegDecoder::pixel_type pixel_type;
+
+    JpegDecoder decoder("images/trafalgar-hdr.jpg");
+
+    BOOST_CHECK_EQUAL( decoder.width(), 5184 );
+    BOOST_CHECK_EQUAL( decoder.height(), 4608 );
+
+    HostImage<pixel_type, 2> image(decoder.dimensions());
+    decoder.decodeInto(image.view());
+
+    // converted pixels are normalized and opaque
+    for (pixel_type const& pixel : image.view())
+    {
+        BOOST_REQUIRE( pixel.r >= 0.0f && pixel.r <= 1.0f );
+        BOOST_REQUIRE( pixel.g >= 0.0f && pixel.g <= 1.0f );
+        BOOST_REQUIRE( pixel.b >= 0.0f && pixel.b <= 1.0f );
+        BOOST_REQUIRE( pixel.a == 1.0f );
+    }
+
+    // can only decode once
+    BOOST_CHECK_THROW( decoder.decodeInto(image.view()), std::logic_error );
+
+    // mismatched destination
+    JpegDecoder other("images/trafalgar-hdr.jpg");
+    HostImage<pixel_type, 2> small(16, 16);
+    BOOST_CHECK_THROW( other.decodeInto(small.view()), std::invalid_argument );
+}
+
+BOOST_AUTO_TEST_CASE( scaled_decode_test )
+{
+    typedef JpegDecoder::pixel_type pixel_type;
+
+    JpegDecoder decoder("images/trafalgar-hdr.jpg");
+    BOOST_CHECK_THROW( decoder.setScaleLevel(JpegDecoder::maxScaleLevel + 1), std::invalid_argument );
+
+    // dimensions match those of the pyramid level
+    decoder.setScaleLevel(3);
+    BOOST_CHECK_EQUAL( decoder.width(), levelDimension(5184, 3) );
+    BOOST_CHECK_EQUAL( decoder.height(), levelDimension(4608, 3) );
+
+    HostImage<pixel_type, 2> image(decoder.dimensions());
+    decoder.decodeInto(image.view());
+    BOOST_CHECK_THROW( decoder.setScaleLevel(0), std::logic_error );
+}
+
+BOOST_AUTO_TEST_CASE( band_decode_test )
+{
+    typedef JpegDecoder::pixel_type pixel_type;
+
+    JpegDecoder whole("images/trafalgar-hdr.jpg");
+    whole.setScaleLevel(3);
+    HostImage<pixel_type, 2> image(whole.dimensions());
+    whole.decodeInto(image.view());
+
+    JpegDecoder bands("images/trafalgar-hdr.jpg");
+    bands.setScaleLevel(3);
+    size_t const width = bands.width();
+
+    // bands of 100 rows, and whatever is left
+    HostImage<pixel_type, 2> band(width, 100);
+    for (size_t y = 0; y < bands.height(); y += 100)
+    {
+        size_t numRows = std::min<size_t>(100, bands.height() - y);
+        JpegDecoder::view_type rows(std::array<size_t, 2>{{ width, numRows }}, band.view().begin());
+        bands.decodeRows(rows);
+
+        pixel_type const* expected = image.view().begin() + y * width;
+        for (size_t i = 0; i < width * numRows; ++i)
+        {
+            BOOST_REQUIRE_EQUAL( rows.begin()[i].g, expected[i].g );
+        }
+    }
+
+    BOOST_CHECK_THROW( bands.decodeRows(band.view()), std::invalid_argument );
+    BOOST_CHECK_THROW( bands.decodeInto(image.view()), std::logic_error );
+}
+
+BOOST_AUTO_TEST_CASE( invalid_file_test )
+{
+    BOOST_CHECK_THROW( JpegDecoder("does_not_exist.jpg"), std::runtime_error );
+    BOOST_CHECK_THROW( JpegDecoder("tests.cl"), std::runtime_error );
+
+    BOOST_CHECK( isJpegPath("a.jpg") );
+    BOOST_CHECK( isJpegPath("a.JPEG") );
+    BOOST_CHECK( !isJpegPath("a.tiff") );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+// ========================================================
+
+
+BOOST_AUTO_TEST_SUITE( pyramid_tests )
+
+BOOST_AUTO_TEST_CASE( buffer_plan_test )
+{
+    typedef BufferPlan::Step Step;
+    size_t const none = BufferPlan::none;
+
+    // the kernels of a pyramid level of 8x6
+    std::vector<Step> steps = {
+        { {{ 8, 6, 1 }}, {},     true,  false }, // input
+        { {{ 4, 6, 1 }}, { 0 },  false, false }, // rows halved
+        { {{ 4, 3, 1 }}, { 1 },  false, true  }, // downsampled
+        { {{ 4, 6, 1 }}, { 2 },  false, false }, // columns doubled
+        { {{ 8, 6, 1 }}, { 3 },  false, false }, // rows doubled
+        { {{ 8, 6, 1 }}, { 0, 4 }, false, true } // laplacian
+    };
+
+    BufferPlan plan = BufferPlan::make(steps);
+    std::vector<size_t> expected = { none, 0, 1, 0, 2, 3 };
+    BOOST_CHECK_EQUAL_COLLECTIONS( plan.buffers.begin(), plan.buffers.end(),
+                                   expected.begin(), expected.end() );
+    BOOST_CHECK_EQUAL( plan.numPixels(), 4*6 + 4*3 + 8*6 + 8*6 );
+
+    // a chain only ever needs two buffers, and results keep theirs
+    std::vector<Step> chain = { { {{ 5, 5, 1 }}, {}, true, false } };
+    for (size_t i = 1; i < 6; ++i)
+    {
+        chain.push_back({ {{ 5, 5, 1 }}, { i - 1 }, false, i == 3 });
+    }
+    plan = BufferPlan::make(chain);
+    expected = { none, 0, 1, 0, 1, 2 };
+    BOOST_CHECK_EQUAL_COLLECTIONS( plan.buffers.begin(), plan.buffers.end(),
+                                   expected.begin(), expected.end() );
+
+    chain.back().inputs.push_back(5);
+    BOOST_CHECK_THROW( BufferPlan::make(chain), std::invalid_argument );
+}
+
+BOOST_AUTO_TEST_CASE( pyramid_views )
+{
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_int_distribution<size_t> d(0, 500);
+
+    typedef ImagePyramid::pixel_type pixel_type;
+
+    for (size_t example = 0; example < 10; ++example)
+    {
+        size_t width = d(gen);
+        size_t height = d(gen);
+        size_t numLevels = calculateNumLevels(width, height);
+
+        array_ptr<pixel_type> ar(pyramidSize(width, height, numLevels));
+
+        auto views =
+            ImagePyramid::createPyramidViews(width, height, numLevels, halveDimension, ar.ptr());
+
+        size_t totalBytes = std::accumulate(views.begin(), views.end(), 0,
+                [](size_t acc, ImagePyramid::view_type const& v)
+                {
+                    return acc + v.totalSize();
+                });
+
+        BOOST_CHECK_EQUAL( totalBytes, ar.size() );
+    }
+}
+
+BOOST_AUTO_TEST_CASE( first_small_level )
+{
+    typedef ImagePyramid::pixel_type pixel_type;
+
+    size_t numLevels = calculateNumLevels(100, 40);
+    array_ptr<pixel_type> ar(pyramidSize(100, 40, numLevels));
+    auto views = ImagePyramid::createPyramidViews(100, 40, numLevels, halveDimension, ar.ptr());
+
+    // 100x40, 50x20, 25x10, 13x5
+    BOOST_REQUIRE_EQUAL( views.size(), 4 );
+    BOOST_CHECK_EQUAL( ImagePyramid::firstSmallLevel(views), 2 );
+
+    views.resize(2);
+    BOOST_CHECK_EQUAL( ImagePyramid::firstSmallLevel(views), 2 );
+}
+
+BOOST_FIXTURE_TEST_CASE( small_levels_round_trip, CLFixtureLocal )
+{
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> d(0, 1);
+
+    typedef ImagePyramid::pixel_type pixel_type;
+    typedef HostImage<pixel_type, 2> image_type;
+
+    // odd dimensions, within a single small level
+    size_t width = 31;
+    size_t height = 19;
+    size_t numLevels = calculateNumLevels(width, height);
+
+    image_type image(width, height);
+    std::generate(image.view().begin(), image.view().end(),
+                  [&]() -> pixel_type { return {{d(gen), d(gen), d(gen), d(gen) }}; });
+
+    array_ptr<pixel_type> ar(pyramidSize(width, height, numLevels));
+    auto views = ImagePyramid::createPyramidViews(width, height, numLevels, halveDimension, ar.ptr());
+
+    cl::Program program = buildProgram(clcontext, ProgramVariant());
+
+    // build all levels at once, then collapse them all at once
+    buildSmallLevels(makePendingImage<BufferImage2D>(clcontext, image.view()), views, program);
+
+    image_type result(width, height);
+    collapseSmallLevels<BufferImage2D>(clcontext, views, program)
+        .readInto(result.view().rawData());
+
+    // colour channels come back out, while alpha is not reconstructed
+    for (size_t i = 0; i < result.view().totalSize(); ++i)
+    {
+        pixel_type const& expected = *(image.view().begin() + i);
+        pixel_type const& actual = *(result.view().begin() + i);
+        for (size_t c = 0; c < 3; ++c)
+        {
+            BOOST_REQUIRE_SMALL( actual.components[c] - expected.components[c], 1e-5f );
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( downscale_test )
+{
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> d(0, 1);
+
+    typedef ImagePyramid::pixel_type pixel_type;
+    typedef HostImage<pixel_type, 2> image_type;
+
+    size_t width = 37;
+    size_t height = 20;
+
+    image_type image(width, height);
+    std::generate(image.view().begin(), image.view().end(),
+                  [&]() -> pixel_type { return {{d(gen), d(gen), d(gen), d(gen) }}; });
+
+    // gaussian at level 2 of a pyramid
+    array_ptr<pixel_type> ar(pyramidSize(width, height, 3));
+    auto views = ImagePyramid::createPyramidViews(width, height, 3, halveDimension, ar.ptr());
+    std::copy(image.view().begin(), image.view().end(), views[0].begin());
+    buildHostLevels(views);
+
+    image_type scaled(levelDimension(width, 2), levelDimension(height, 2));
+    ImagePyramid::view_type scaledView = scaled.view();
+    downscaleHostImage(image.view(), scaledView);
+    BOOST_CHECK( std::equal(scaledView.begin(), scaledView.end(), views[2].begin(),
+                            [](pixel_type const& a, pixel_type const& b)
+                            {
+                                return std::equal(a.components, a.components + 4, b.components);
+                            }) );
+
+    // not a level of the image
+    image_type odd(width / 2, height / 2);
+    ImagePyramid::view_type oddView = odd.view();
+    BOOST_CHECK_THROW( downscaleHostImage(image.view(), oddView), std::invalid_argument );
+}
+
+BOOST_AUTO_TEST_CASE( weighed_levels_test )
+{
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> d(0, 1);
+
+    typedef ImagePyramid::pixel_type pixel_type;
+
+    BOOST_CHECK_EQUAL( QualityWeights::parse("default").contrast, QualityWeights().contrast );
+    BOOST_CHECK_EQUAL( QualityWeights::parse("vivid").saturation, 3.0f );
+    QualityWeights parsed = QualityWeights::parse("1,0.5,2");
+    BOOST_CHECK_EQUAL( parsed.contrast, 1.0f );
+    BOOST_CHECK_EQUAL( parsed.saturation, 0.5f );
+    BOOST_CHECK_EQUAL( parsed.exposedness, 2.0f );
+    BOOST_CHECK_THROW( QualityWeights::parse("1,2"), std::invalid_argument );
+    BOOST_CHECK_THROW( QualityWeights::parse("garish"), std::invalid_argument );
+
+    size_t width = 37;
+    size_t height = 20;
+    size_t numLevels = calculateNumLevels(width, height);
+    size_t numPixels = pyramidSize(width, height, numLevels);
+    std::array<float, 3> const w = {{ parsed.contrast, parsed.saturation, parsed.exposedness }};
+
+    array_ptr<pixel_type> image(numPixels);
+    array_ptr<pixel_type> measures(numPixels);
+    auto imageViews = ImagePyramid::createPyramidViews(width, height, numLevels, halveDimension, image.ptr());
+    auto measureViews = ImagePyramid::createPyramidViews(width, height, numLevels, halveDimension, measures.ptr());
+
+    std::generate(imageViews[0].begin(), imageViews[0].end(),
+                  [&]() -> pixel_type { return {{d(gen), d(gen), d(gen), 0 }}; });
+    std::generate(measureViews[0].begin(), measureViews[0].end(),
+                  [&]() -> pixel_type { return {{d(gen), d(gen), d(gen), 0 }}; });
+
+    // weighing the gaussians of the measures at every level gives the
+    // weights of a pyramid built from an image weighed at the top
+    weighHostLevel(measureViews[0], w, imageViews[0]);
+    buildHostLevels(imageViews);
+    buildGaussianHostLevels(measureViews);
+
+    for (size_t level = 0; level < numLevels; ++level)
+    {
+        HostImage<pixel_type, 2> expected(imageViews[level].width(), imageViews[level].height());
+        ImagePyramid::view_type expectedView = expected.view();
+        weighHostLevel(measureViews[level], w, expectedView);
+
+        for (size_t i = 0; i < expectedView.totalSize(); ++i)
+        {
+            BOOST_REQUIRE_SMALL( (expectedView.begin() + i)->a - (imageViews[level].begin() + i)->a, 1e-5f );
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( host_levels_round_trip )
+{
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> d(0.05f, 1);
+
+    typedef ImagePyramid::pixel_type pixel_type;
+    typedef HostImage<pixel_type, 2> image_type;
+
+    size_t width = 45;
+    size_t height = 22;
+    size_t numLevels = calculateNumLevels(width, height);
+
+    image_type image(width, height);
+    std::generate(image.view().begin(), image.view().end(),
+                  [&]() -> pixel_type { return {{d(gen), d(gen), d(gen), d(gen) }}; });
+
+    array_ptr<pixel_type> ar(pyramidSize(width, height, numLevels));
+    auto views = ImagePyramid::createPyramidViews(width, height, numLevels, halveDimension, ar.ptr());
+
+    // 45x22, 23x11, 12x6, 6x3
+    BOOST_CHECK_EQUAL( ImagePyramid::firstHostLevel(views, 0), views.size() );
+    BOOST_CHECK_EQUAL( ImagePyramid::firstHostLevel(views, 23*11), 1 );
+    BOOST_CHECK_EQUAL( ImagePyramid::firstHostLevel(views, 23*11 - 1), 2 );
+
+    std::copy(image.view().begin(), image.view().end(), views[0].begin());
+    buildHostLevels(views);
+
+    // alpha is kept in laplacians, so fusing a pyramid with itself is a no-op
+    image_type fused(views.back().width(), views.back().height());
+    HostImage<pixel_type, 3> layers(std::vector<ImagePyramid::view_type>{ views.back(), views.back() });
+    ImagePyramid::view_type fusedView = fused.view();
+    fuseHostLevel(layers.view(), fusedView);
+    for (size_t i = 0; i < fused.view().totalSize(); ++i)
+    {
+        for (size_t c = 0; c < 4; ++c)
+        {
+            BOOST_CHECK_CLOSE( (fused.view().begin() + i)->components[c],
+                               (views.back().begin() + i)->components[c], 1e-3f );
+        }
+    }
+
+    collapseHostLevels(views);
+
+    // colour channels come back out, while alpha is not reconstructed
+    for (size_t i = 0; i < image.view().totalSize(); ++i)
+    {
+        pixel_type const& expected = *(image.view().begin() + i);
+        pixel_type const& actual = *(views[0].begin() + i);
+        for (size_t c = 0; c < 3; ++c)
+        {
+            BOOST_REQUIRE_SMALL( actual.components[c] - expected.components[c], 1e-5f );
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( alignment_test )
+{
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> d(0, 1);
+
+    typedef ImagePyramid::pixel_type pixel_type;
+
+    size_t width = 96;
+    size_t height = 64;
+    size_t numLevels = calculateNumLevels(width, height);
+    Translation const shift = { 5, -3 };
+
+    Translation const halved = shift.atLevel(1);
+    BOOST_CHECK_EQUAL( halved.x, 3 );
+    BOOST_CHECK_EQUAL( halved.y, -1 );
+
+    // blocks of 4x4 pixels, so that coarse levels still show something
+    std::vector<float> blocks((width / 4) * (height / 4));
+    std::generate(blocks.begin(), blocks.end(), [&]() { return d(gen); });
+    auto scene =
+        [&](long x, long y) -> float
+        {
+            x = std::min(std::max(x, 0L), static_cast<long>(width) - 1);
+            y = std::min(std::max(y, 0L), static_cast<long>(height) - 1);
+            return blocks[(y / 4) * (width / 4) + x / 4];
+        };
+
+    // the other image is darker, and its camera moved
+    array_ptr<pixel_type> ar(2 * pyramidSize(width, height, numLevels));
+    auto reference = ImagePyramid::createPyramidViews(width, height, numLevels, halveDimension, ar.ptr());
+    auto moved = ImagePyramid::createPyramidViews(width, height, numLevels, halveDimension,
+                                                  ar.ptr() + pyramidSize(width, height, numLevels));
+    for (size_t y = 0; y < height; ++y)
+    {
+        for (size_t x = 0; x < width; ++x)
+        {
+            float r = scene(x, y);
+            float m = 0.5f * scene(x - shift.x, y - shift.y);
+            reference[0].begin()[y * width + x] = {{ r, r, r, 1.0f }};
+            moved[0].begin()[y * width + x] = {{ m, m, m, 1.0f }};
+        }
+    }
+
+    // fusing with the translation puts every pixel back where it was
+    HostImage<pixel_type, 2> fused(width, height);
+    HostImage<pixel_type, 3> layers(std::vector<ImagePyramid::view_type>{ moved[0], reference[0] });
+    ImagePyramid::view_type fusedView = fused.view();
+    fuseHostLevel(layers.view(), fusedView, std::vector<Translation>{ shift, Translation{ 0, 0 } });
+    for (size_t y = 8; y + 8 < height; ++y)
+    {
+        for (size_t x = 8; x + 8 < width; ++x)
+        {
+            BOOST_REQUIRE_CLOSE( fusedView.begin()[y * width + x].r, 0.75f * scene(x, y), 1e-3f );
+        }
+    }
+
+    buildGaussianHostLevels(reference);
+    buildGaussianHostLevels(moved);
+
+    ThresholdBitmaps referenceBitmaps(reference);
+    ThresholdBitmaps movedBitmaps(moved);
+    BOOST_CHECK( !movedBitmaps.empty() );
+
+    Translation found = movedBitmaps.offsetFrom(referenceBitmaps);
+    BOOST_CHECK_EQUAL( found.x, shift.x );
+    BOOST_CHECK_EQUAL( found.y, shift.y );
+    BOOST_CHECK( referenceBitmaps.offsetFrom(referenceBitmaps).isZero() );
+
+    // bitmaps of images of other sizes cannot be compared
+    std::vector<ImagePyramid::view_type> smaller(reference.begin() + 1, reference.end());
+    BOOST_CHECK_THROW( ThresholdBitmaps(smaller).offsetFrom(referenceBitmaps), std::invalid_argument );
+}
+
+BOOST_AUTO_TEST_CASE( translation_levels_test )
+{
+    for (int x = -40; x <= 40; ++x)
+    {
+        Translation const shift = { x, -x };
+        for (size_t level = 0; level < 6; ++level)
+        {
+            // at most half a pixel of the level off
+            Translation const t = shift.atLevel(level);
+            int const scale = 1 << level;
+            BOOST_REQUIRE_LE( std::abs(t.x * scale - shift.x), scale / 2 );
+            BOOST_REQUIRE_LE( std::abs(t.y * scale - shift.y), scale / 2 );
+
+            // and exact for whole pixels of the level
+            Translation const whole = { x * scale, -x * scale };
+            BOOST_REQUIRE_EQUAL( whole.atLevel(level).x, x );
+            BOOST_REQUIRE_EQUAL( whole.atLevel(level).y, -x );
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( band_merge_test )
+{
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> d(0.05f, 0.95f);
+
+    typedef ImagePyramid::pixel_type pixel_type;
+    typedef HostImage<pixel_type, 2> image_type;
+
+    QualityWeights const weights;
+    std::array<float, 3> const w = {{ weights.contrast, weights.saturation, weights.exposedness }};
+    size_t const numInputs = 3;
+
+    // wide, tall, and with fewer levels than there could be
+    std::array<std::array<size_t, 3>, 3> const cases = {{ {{ 45, 37, 0 }},
+                                                          {{ 37, 90, 0 }},
+                                                          {{ 70, 20, 2 }} }};
+    for (auto const& c : cases)
+    {
+        size_t width = c[0];
+        size_t height = c[1];
+        size_t numLevels = c[2] ? c[2] : calculateNumLevels(width, height);
+
+        std::vector<image_type> inputs;
+        for (size_t i = 0; i < numInputs; ++i)
+        {
+            inputs.emplace_back(width, height);
+            std::generate(inputs.back().view().begin(), inputs.back().view().end(),
+                          [&]() -> pixel_type { return {{ d(gen), d(gen), d(gen), 1.0f }}; });
+        }
+
+        // merge whole images on the host
+        size_t pyramidPixels = pyramidSize(width, height, numLevels);
+        array_ptr<pixel_type> ar((numInputs + 1) * pyramidPixels);
+        std::vector<std::vector<ImagePyramid::view_type>> pyramids;
+        for (size_t i = 0; i < numInputs; ++i)
+        {
+            pyramids.push_back(ImagePyramid::createPyramidViews(width, height, numLevels, halveDimension,
+                                                                ar.ptr() + i * pyramidPixels));
+            image_type measures(width, height);
+            ImagePyramid::view_type measuresView = measures.view();
+            measureHostLevel(inputs[i].view(), measuresView);
+
+            std::copy(inputs[i].view().begin(), inputs[i].view().end(), pyramids[i][0].begin());
+            weighHostLevel(measuresView, w, pyramids[i][0]);
+            buildHostLevels(pyramids[i]);
+        }
+
+        auto fused = ImagePyramid::createPyramidViews(width, height, numLevels, halveDimension,
+                                                      ar.ptr() + numInputs * pyramidPixels);
+        for (size_t level = 0; level < numLevels; ++level)
+        {
+            std::vector<ImagePyramid::view_type> layers;
+            for (auto& pyramid : pyramids)
+            {
+                layers.push_back(pyramid[level]);
+            }
+            HostImage<pixel_type, 3> array(layers);
+            fuseHostLevel(array.view(), fused[level]);
+        }
+        collapseHostLevels(fused);
+
+        // and in bands, row by row
+        std::vector<BandMerge::RowReader> readers;
+        for (size_t i = 0; i < numInputs; ++i)
+        {
+            pixel_type const* next = inputs[i].view().begin();
+            readers.push_back(
+                [=](pixel_type* row) mutable
+                {
+                    std::copy(next, next + width, row);
+                    next += width;
+                });
+        }
+
+        size_t numRows = 0;
+        BandMerge merge(width, height, numInputs, numLevels, weights);
+        merge.merge(readers,
+            [&](pixel_type const* row)
+            {
+                pixel_type const* expected = fused[0].begin() + numRows * width;
+                for (size_t x = 0; x < width; ++x)
+                {
+                    for (size_t ch = 0; ch < 3; ++ch)
+                    {
+                        BOOST_REQUIRE_SMALL( row[x].components[ch] - expected[x].components[ch], 1e-5f );
+                    }
+                }
+                ++numRows;
+            });
+        BOOST_CHECK_EQUAL( numRows, height );
+        BOOST_CHECK_THROW( merge.merge(readers, [](pixel_type const*) { }), std::logic_error );
+
+        // memory only depends on the width
+        size_t bytes = BandMerge::footprint(width, numInputs, numLevels);
+        BOOST_CHECK_EQUAL( BandMerge::levelsWithin(width, 4 * height, numInputs, bytes), numLevels );
+        BOOST_CHECK_LT( bytes, BandMerge::footprint(2 * width, numInputs, numLevels) );
+    }
+
+    BOOST_CHECK_THROW( BandMerge(45, 37, numInputs, calculateNumLevels(45, 37) + 1), std::invalid_argument );
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
+// ========================================================
+
+
+BOOST_AUTO_TEST_SUITE( pyramid_cache_tests )
+
+BOOST_AUTO_TEST_CASE( sha256_test )
+{
+    Sha256 empty;
+    BOOST_CHECK_EQUAL( Sha256::toHex(empty.finish()),
+                       "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" );
+
+    // fed in pieces, across block boundaries
+    std::string const text = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    Sha256 pieces;
+    pieces.update(text.data(), 5);
+    pieces.update(text.data() + 5, text.size() - 5);
+    BOOST_CHECK_EQUAL( Sha256::toHex(pieces.finish()),
+                       "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" );
+
+    std::string const million(1000000, 'a');
+    Sha256 many;
+    many.update(million.data(), million.size());
+    BOOST_CHECK_EQUAL( Sha256::toHex(many.finish()),
+                       "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" );
+}
+
+BOOST_AUTO_TEST_CASE( store_load_test )
+{
+    typedef PyramidCache::pixel_type pixel_type;
+
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> d(0, 1);
+
+    size_t width = 37;
+    size_t height = 20;
+    size_t numLevels = calculateNumLevels(width, height);
+    size_t numPixels = pyramidSize(width, height, numLevels);
+
+    array_ptr<pixel_type> stored(numPixels);
+    array_ptr<pixel_type> loaded(numPixels);
+    std::generate(stored.begin(), stored.end(),
+                  [&]() -> pixel_type { return {{d(gen), d(gen), d(gen), d(gen) }}; });
+
+    auto storedViews = ImagePyramid::createPyramidViews(width, height, numLevels, halveDimension, stored.ptr());
+    auto loadedViews = ImagePyramid::createPyramidViews(width, height, numLevels, halveDimension, loaded.ptr());
+
+    // keys depend on content and parameters
+    std::string key = PyramidCache::key("images/trafalgar-hdr.jpg", "preview=0");
+    BOOST_CHECK_EQUAL( key.size(), 64 );
+    BOOST_CHECK_EQUAL( key, PyramidCache::key("images/trafalgar-hdr.jpg", "preview=0") );
+    BOOST_CHECK_NE( key, PyramidCache::key("images/trafalgar-hdr.jpg", "preview=1") );
+    BOOST_CHECK_THROW( PyramidCache::key("does_not_exist.jpg", ""), std::runtime_error );
+
+    PyramidCache cache("test_pyramid_cache.tmp");
+    BOOST_CHECK( !cache.contains(key) );
+    BOOST_CHECK( !cache.load(key, loadedViews) );
+
+    cache.store(key, storedViews);
+    BOOST_CHECK( cache.contains(key) );
+    BOOST_REQUIRE( cache.load(key, loadedViews) );
+    BOOST_CHECK( std::equal(stored.begin(), stored.end(), loaded.begin(),
+                            [](pixel_type const& a, pixel_type const& b)
+                            {
+                                return std::equal(a.components, a.components + 4, b.components);
+                            }) );
+
+    // entries only load under the key they were stored with
+    std::string otherKey = PyramidCache::key("images/trafalgar-hdr.jpg", "preview=1");
+    std::string entry = "test_pyramid_cache.tmp/" + key + ".pyr";
+    std::string otherEntry = "test_pyramid_cache.tmp/" + otherKey + ".pyr";
+    BOOST_REQUIRE( std::rename(entry.c_str(), otherEntry.c_str()) == 0 );
+    BOOST_CHECK( !cache.load(otherKey, loadedViews) );
+    BOOST_REQUIRE( std::rename(otherEntry.c_str(), entry.c_str()) == 0 );
+
+    // and only into pyramids of the same shape
+    loadedViews.pop_back();
+    BOOST_CHECK( !cache.load(key, loadedViews) );
+
+    std::remove(entry.c_str());
+    ::rmdir("test_pyramid_cache.tmp");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+// ========================================================
+
+BOOST_AUTO_TEST_SUITE( memory_budget_tests )
+
+BOOST_AUTO_TEST_CASE( parse_bytes_test )
+{
+    BOOST_CHECK_EQUAL( MemoryBudget::parseBytes("1234"), 1234 );
+    BOOST_CHECK_EQUAL( MemoryBudget::parseBytes("3K"), 3 << 10 );
+    BOOST_CHECK_EQUAL( MemoryBudget::parseBytes("512m"), 512 << 20 );
+    BOOST_CHECK_EQUAL( MemoryBudget::parseBytes("2G"), size_t(2) << 30 );
+    BOOST_CHECK_THROW( MemoryBudget::parseBytes("lots"), std::invalid_argument );
+    BOOST_CHECK_THROW( MemoryBudget::parseBytes("2T"), std::invalid_argument );
+    BOOST_CHECK_THROW( MemoryBudget::parseBytes("2G extra"), std::invalid_argument );
+}
+
+BOOST_AUTO_TEST_CASE( plan_test )
+{
+    MemoryBudget::Limits limits = { 1000, 400, 100 };
+    MemoryBudget budget(limits, []() { return size_t(1000); });
+
+    MemoryBudget::Footprint footprint = { 300, 100, 20, 8 };
+    MemoryBudget::Plan plan = budget.plan(footprint, 40);
+    BOOST_CHECK_EQUAL( plan.concurrency, 3 );   // host bound
+    BOOST_CHECK_EQUAL( plan.pipelineDepth, 2 ); // 100 bytes left
+    BOOST_CHECK_EQUAL( plan.bandRows, 5 );      // 100 / 20
+
+    footprint.deviceBytes = 300;
+    BOOST_CHECK_EQUAL( budget.plan(footprint, 40).concurrency, 1 ); // device bound
+
+    // an input has to fit next to the groups
+    footprint.deviceBytes = 100;
+    plan = budget.plan(footprint, 150);
+    BOOST_CHECK_EQUAL( plan.concurrency, 2 );
+    BOOST_CHECK_EQUAL( plan.pipelineDepth, 2 ); // 400 bytes left
+    BOOST_CHECK_THROW( budget.plan(footprint, 800), std::runtime_error );
+
+    footprint.hostBytes = 2000;
+    BOOST_CHECK_THROW( budget.plan(footprint, 40), std::runtime_error );
+}
+
+BOOST_AUTO_TEST_CASE( pipeline_gate_test )
+{
+    // a single input until the plan is known
+    PipelineGate gate;
+    PipelineGate::Ticket first = gate.enter();
+    BOOST_CHECK_EQUAL( gate.held(), 1 );
+
+    PipelineGate::Ticket second;
+    std::thread waiting([&]() { second = gate.enter(); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    BOOST_CHECK( !second.valid() );
+
+    // more are let through once the plan allows
+    gate.setCapacity(2);
+    waiting.join();
+    BOOST_CHECK( second.valid() );
+    BOOST_CHECK_EQUAL( gate.held(), 2 );
+
+    PipelineGate::Ticket third;
+    waiting = std::thread([&]() { third = gate.enter(); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    BOOST_CHECK( !third.valid() );
+
+    first.release();
+    waiting.join();
+    BOOST_CHECK( third.valid() );
+
+    second = PipelineGate::Ticket();
+    third.release();
+    BOOST_CHECK_EQUAL( gate.held(), 0 );
+}
+
+BOOST_AUTO_TEST_CASE( batch_size_test )
+{
+    MemoryBudget::Footprint one = BatchMerge::footprint(320, 240, 3, 1);
+    MemoryBudget::Footprint four = BatchMerge::footprint(320, 240, 3, 4);
+    BOOST_CHECK_EQUAL( four.hostBytes, 4 * one.hostBytes );
+    BOOST_CHECK_EQUAL( four.bytesPerRow * four.rows, 4 * one.bytesPerRow * one.rows );
+
+    // the stack of all images has to fit in one allocation
+    MemoryBudget::Limits limits = { size_t(1) << 40, size_t(1) << 40,
+                                    four.bytesPerRow * four.rows };
+    BOOST_CHECK_EQUAL( BatchMerge::batchSizeWithin(320, 240, 3, 64, limits), 4 );
+    BOOST_CHECK_EQUAL( BatchMerge::batchSizeWithin(320, 240, 3, 2, limits), 2 );
+
+    limits.hostBytes = one.hostBytes - 1;
+    BOOST_CHECK_EQUAL( BatchMerge::batchSizeWithin(320, 240, 3, 64, limits), 0 );
+    // variants share the images, but keep their pyramids on the device
+    MemoryBudget::Footprint variants = BatchMerge::footprint(320, 240, 3, 4, 3);
+    BOOST_CHECK_EQUAL( variants.hostBytes, four.hostBytes );
+    BOOST_CHECK_GT( variants.deviceBytes, four.deviceBytes );
+}
+
+BOOST_AUTO_TEST_CASE( reserve_test )
+{
+    MemoryBudget::Limits limits = { 1000, 400, 400 };
+    MemoryBudget budget(limits, []() { return size_t(1000); });
+
+    BOOST_CHECK_THROW( budget.reserve(2000, 0), std::invalid_argument );
+
+    MemoryBudget::Reservation first = budget.reserve(600, 300);
+    BOOST_CHECK_EQUAL( budget.hostReserved(), 600 );
+    BOOST_CHECK_EQUAL( budget.deviceReserved(), 300 );
+    BOOST_CHECK_EQUAL( budget.tryReserve(600, 0).hostBytes(), 0 );
+    BOOST_CHECK_EQUAL( budget.tryReserve(0, 200).deviceBytes(), 0 );
+
+    // a second group waits for the first one to be released
+    MemoryBudget::Reservation second;
+    std::thread waiting([&]() { second = budget.reserve(600, 300); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    BOOST_CHECK_EQUAL( second.hostBytes(), 0 );
+
+    first.release();
+    waiting.join();
+    BOOST_CHECK_EQUAL( second.hostBytes(), 600 );
+    BOOST_CHECK_EQUAL( budget.hostReserved(), 600 );
+
+    second = MemoryBudget::Reservation();
+    BOOST_CHECK_EQUAL( budget.hostReserved(), 0 );
+    BOOST_CHECK_EQUAL( budget.deviceReserved(), 0 );
+}
+
+BOOST_AUTO_TEST_CASE( system_memory_test )
+{
+    // other processes hold on to memory until a poll finds it released
+    size_t available = 100;
+    std::mutex availableMutex;
+    MemoryBudget::Limits limits = { 1000, 1000, 1000 };
+    MemoryBudget budget(limits,
+                        [&]()
+                        {
+                            std::lock_guard<std::mutex> lock(availableMutex);
+                            return available;
+                        });
+
+    BOOST_CHECK_EQUAL( budget.tryReserve(500, 0).hostBytes(), 0 );
+    BOOST_CHECK_EQUAL( budget.tryReserve(0, 500).deviceBytes(), 500 );
+
+    std::thread releasing([&]()
+                          {
+                              std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                              std::lock_guard<std::mutex> lock(availableMutex);
+                              available = 800;
+                          });
+    MemoryBudget::Reservation reservation = budget.reserve(500, 0);
+    releasing.join();
+    BOOST_CHECK_EQUAL( reservation.hostBytes(), 500 );
+
+    BOOST_CHECK( MemoryBudget::systemAvailableBytes() > 0 );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+// ========================================================
+
+BOOST_AUTO_TEST_SUITE( autotune_tests )
+
+BOOST_AUTO_TEST_CASE( tuning_file_test )
+{
+    std::string path = "test_tuning.tmp";
+
+    KernelTuning tuning;
+    tuning.buildOptions = "-cl-fast-relaxed-math -cl-mad-enable";
+    tuning.localSizes["downsample_row"] = {{ 32, 8 }};
+    tuning.localSizes["fuse_level"] = {{ 256, 1 }};
+    tuning.hostLevelPixels = 1024;
+
+    saveTuning(path, tuning);
+
+    KernelTuning loaded;
+    BOOST_REQUIRE( loadTuning(path, loaded) );
+    BOOST_CHECK_EQUAL( loaded.buildOptions, tuning.buildOptions );
+    BOOST_CHECK( loaded.localSizes == tuning.localSizes );
+    BOOST_CHECK_EQUAL( loaded.hostLevelPixels, 1024 );
+
+    KernelTuning::local_size_type local;
+    BOOST_CHECK( loaded.find("fuse_level", local) );
+    BOOST_CHECK_EQUAL( local[0], 256 );
+    BOOST_CHECK( !loaded.find("compute_quality", local) );
+
+    // defaults round trip too
+    saveTuning(path, KernelTuning());
+    BOOST_REQUIRE( loadTuning(path, loaded) );
+    BOOST_CHECK( loaded.buildOptions.empty() );
+    BOOST_CHECK( loaded.localSizes.empty() );
+    BOOST_CHECK_EQUAL( loaded.hostLevelPixels, 0 );
+
+    std::remove(path.c_str());
+
+    BOOST_CHECK( !loadTuning(path, loaded) );
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -17,3 +17,12 @@ __kernel void halve_image(__read_only image2d_t input_image, __write_only image2
 
     write_imagef (output_image, coord, val);
 }
+
+__kernel void halve_buffer(__global const float4* input, int2 input_dim,
+                           __global float4* output, int2 output_dim)
+{
+    int2 coord = (int2)( get_global_id(0), get_global_id(1) );
+    int index = coord.y * output_dim.x + coord.x;
+
+    output[index] = input[index] / 2;
+}
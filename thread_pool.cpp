@@ -0,0 +1,219 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+
+namespace
+{
+    using namespace DynamiCL;
+
+    // worker the current thread belongs to, if any
+    thread_local ThreadPool const* s_currentPool = nullptr;
+    thread_local size_t s_currentIndex = 0;
+
+    size_t sharedPoolThreads()
+    {
+        if (char const* threads = std::getenv("DYNAMICL_THREADS"))
+        {
+            return std::strtoul(threads, nullptr, 10);
+        }
+
+        size_t cores = std::thread::hardware_concurrency();
+        return cores > 1 ? cores - 1 : 1;
+    }
+}
+
+namespace DynamiCL
+{
+
+    ThreadPool::ThreadPool(size_t numThreads)
+        : pending_(0),
+          nextQueue_(0),
+          stop_(false)
+    {
+        // at least one queue, so that tasks have somewhere to go
+        for (size_t i = 0; i < std::max<size_t>(numThreads, 1); ++i)
+        {
+            queues_.emplace_back(new Queue);
+        }
+
+        for (size_t i = 0; i < numThreads; ++i)
+        {
+            threads_.emplace_back(&ThreadPool::work, this, i);
+        }
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+
+        for (std::thread& thread : threads_)
+        {
+            thread.join();
+        }
+    }
+
+    ThreadPool& ThreadPool::shared()
+    {
+        static ThreadPool pool(sharedPoolThreads());
+        return pool;
+    }
+
+    void ThreadPool::submit(Task task)
+    {
+        size_t index = s_currentPool == this
+                     ? s_currentIndex
+                     : nextQueue_++ % queues_.size();
+
+        // counted first, so that it never drops below the queued tasks,
+        // and under the lock, so that a worker about to sleep sees it
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex_);
+            ++pending_;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+            queues_[index]->tasks.push_back(std::move(task));
+        }
+        wake_.notify_one();
+    }
+
+    bool ThreadPool::takeTask(size_t index, Task& task)
+    {
+        // newest task of our own first
+        {
+            Queue& own = *queues_[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty())
+            {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                --pending_;
+                return true;
+            }
+        }
+
+        // then the oldest task of someone else
+        for (size_t i = 1; i < queues_.size(); ++i)
+        {
+            Queue& other = *queues_[(index + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(other.mutex);
+            if (!other.tasks.empty())
+            {
+                task = std::move(other.tasks.front());
+                other.tasks.pop_front();
+                --pending_;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool ThreadPool::runPendingTask()
+    {
+        if (pending_ == 0)
+        {
+            return false;
+        }
+
+        size_t index = s_currentPool == this ? s_currentIndex : 0;
+
+        Task task;
+        if (!takeTask(index, task))
+        {
+            return false;
+        }
+        task();
+        return true;
+    }
+
+    void ThreadPool::work(size_t index)
+    {
+        s_currentPool = this;
+        s_currentIndex = index;
+
+        Task task;
+        while (true)
+        {
+            if (takeTask(index, task))
+            {
+                task();
+                task = nullptr; // release whatever it holds before sleeping
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleepMutex_);
+            wake_.wait(lock, [this]() { return stop_ || pending_ > 0; });
+            if (stop_)
+            {
+                return;
+            }
+        }
+    }
+
+    void parallelFor(size_t count, size_t grain,
+                     std::function<void(size_t, size_t)> const& body,
+                     ThreadPool& pool)
+    {
+        grain = std::max<size_t>(grain, 1);
+        size_t const numRanges = (count + grain - 1) / grain;
+        if (numRanges <= 1 || pool.numThreads() == 0)
+        {
+            if (count > 0)
+            {
+                body(0, count);
+            }
+            return;
+        }
+
+        std::atomic<size_t> remaining(numRanges);
+        std::mutex errorMutex;
+        std::exception_ptr error;
+
+        auto runRange =
+            [&](size_t range)
+            {
+                try
+                {
+                    body(range * grain, std::min(count, (range + 1) * grain));
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(errorMutex);
+                    if (!error)
+                    {
+                        error = std::current_exception();
+                    }
+                }
+                --remaining;
+            };
+
+        for (size_t range = 1; range < numRanges; ++range)
+        {
+            pool.submit([&runRange, range]() { runRange(range); });
+        }
+        runRange(0);
+
+        // help out until the last range is done, wherever it runs
+        while (remaining > 0)
+        {
+            if (!pool.runPendingTask())
+            {
+                std::this_thread::yield();
+            }
+        }
+
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+
+}
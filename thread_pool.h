@@ -0,0 +1,90 @@
+#ifndef THREAD_POOL_H_K8VQ3HJD
+#define THREAD_POOL_H_K8VQ3HJD
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace DynamiCL
+{
+
+    /**
+     * A pool of worker threads, each with its own queue of tasks. Workers
+     * take their most recent task first, and once their queue runs dry,
+     * steal the oldest tasks of the others.
+     *
+     * Threads waiting for tasks of their own help out by running queued
+     * tasks, so parallel loops can nest without deadlocking.
+     */
+    class ThreadPool
+    {
+    public:
+        typedef std::function<void()> Task;
+
+        explicit ThreadPool(size_t numThreads);
+        ~ThreadPool();
+
+        ThreadPool(ThreadPool const&) = delete;
+        ThreadPool& operator =(ThreadPool const&) = delete;
+
+        /**
+         * @Return the pool shared by all host-side pixel loops. It has one
+         * thread less than the host has cores, since the threads waiting
+         * on loops work too, unless DYNAMICL_THREADS says otherwise.
+         */
+        static ThreadPool& shared();
+
+        size_t numThreads() const { return threads_.size(); }
+
+        /**
+         * Queue @a task. From a worker of this pool, it goes to the
+         * worker's own queue, so that it runs while its data is hot.
+         */
+        void submit(Task task);
+
+        /**
+         * Run one queued task on the calling thread.
+         * @Return false if there was none.
+         */
+        bool runPendingTask();
+
+    private:
+        struct Queue
+        {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        std::vector<std::unique_ptr<Queue>> queues_;
+        std::vector<std::thread> threads_;
+
+        std::atomic<size_t> pending_; ///< tasks queued, but not taken yet
+        std::atomic<size_t> nextQueue_; ///< for tasks from outside the pool
+        bool stop_;
+        std::mutex sleepMutex_;
+        std::condition_variable wake_;
+
+        bool takeTask(size_t index, Task& task);
+        void work(size_t index);
+    };
+
+    /**
+     * Call @a body with consecutive ranges [begin, end) that together
+     * cover [0, @a count), none longer than @a grain, in parallel on
+     * @a pool. The calling thread runs ranges too.
+     *
+     * The first exception thrown by @a body is rethrown once all ranges
+     * are done.
+     */
+    void parallelFor(size_t count, size_t grain,
+                     std::function<void(size_t, size_t)> const& body,
+                     ThreadPool& pool = ThreadPool::shared());
+
+}
+
+#endif /* end of include guard: THREAD_POOL_H_K8VQ3HJD */
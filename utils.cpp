@@ -1,5 +1,119 @@
 #include "utils.h"
 
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <initializer_list>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+
+// size of the huge pages of x86-64 and aarch64
+size_t const s_hugePageSize = 2 << 20;
+
+// from <numaif.h>, to do without libnuma
+int const s_mpolPreferred = 1;
+
+size_t roundUpTo(size_t n, size_t multiple)
+{
+    return ((n + multiple - 1) / multiple) * multiple;
+}
+
+/**
+ * Map @a bytes starting at a multiple of @a alignment, which is
+ * a multiple of the page size
+ */
+char* mapAligned(size_t bytes, size_t alignment)
+{
+    size_t total = bytes + alignment;
+    void* p = ::mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        throw std::bad_alloc();
+    }
+
+    // give back what lies outside the aligned range
+    char* start = static_cast<char*>(p);
+    char* aligned = reinterpret_cast<char*>(roundUpTo(reinterpret_cast<size_t>(start), alignment));
+    if (aligned != start)
+    {
+        ::munmap(start, aligned - start);
+    }
+    size_t tail = (start + total) - (aligned + bytes);
+    if (tail)
+    {
+        ::munmap(aligned + bytes, tail);
+    }
+    return aligned;
+}
+
+/**
+ * Map @a bytes, a multiple of the page size, of a new file in
+ * spillDirectory(), which is gone once they are unmapped
+ */
+char* mapSpillFile(size_t bytes)
+{
+    std::string const directory = DynamiCL::spillDirectory();
+    std::string const pattern = directory + "/dynamicl-spill-XXXXXX";
+    std::vector<char> path(pattern.begin(), pattern.end());
+    path.push_back('\0');
+
+    int fd = ::mkstemp(path.data());
+    if (fd < 0)
+    {
+        throw std::runtime_error("Cannot create a file to spill to in " + directory + ".");
+    }
+    // the mapping keeps the file alive, and nothing else has to find it
+    ::unlink(path.data());
+
+    // take the blocks now, as running out of them later is a SIGBUS
+    int error = ::posix_fallocate(fd, 0, bytes);
+    void* p = MAP_FAILED;
+    if (error == 0)
+    {
+        p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+
+    if (error)
+    {
+        throw std::runtime_error("Not enough room to spill to in " + directory + ".");
+    }
+    if (p == MAP_FAILED)
+    {
+        throw std::bad_alloc();
+    }
+
+    // levels are walked through from start to end
+    ::madvise(p, bytes, MADV_SEQUENTIAL);
+    return static_cast<char*>(p);
+}
+
+/**
+ * Give advice on the whole pages that hold @a bytes from @a data
+ */
+void advisePages(void const* data, size_t bytes, int advice)
+{
+    if (!data || bytes == 0)
+    {
+        return;
+    }
+    size_t const pageSize = ::sysconf(_SC_PAGESIZE);
+    size_t const start = reinterpret_cast<size_t>(data) & ~(pageSize - 1);
+    size_t const end = reinterpret_cast<size_t>(data) + bytes;
+    ::madvise(reinterpret_cast<void*>(start), end - start, advice);
+}
+
+}
+
 namespace DynamiCL
 {
 
@@ -8,4 +122,148 @@ std::string stripExtension(std::string const& path)
     return path.substr(0, path.rfind('.'));
 }
 
+std::string getExtension(std::string const& path)
+{
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos)
+    {
+        return "";
+    }
+
+    std::string ext = path.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext;
+}
+
+AllocationPolicy AllocationPolicy::local()
+{
+    Pages pages = Pages::TRANSPARENT;
+    if (char const* value = std::getenv("DYNAMICL_PAGES"))
+    {
+        std::string name = value;
+        if (name == "small")
+        {
+            pages = Pages::SMALL;
+        }
+        else if (name == "huge")
+        {
+            pages = Pages::HUGE;
+        }
+        else if (name != "transparent")
+        {
+            throw std::invalid_argument("Unknown kind of pages: " + name);
+        }
+    }
+
+    return AllocationPolicy(pages, currentNumaNode());
+}
+
+std::string spillDirectory()
+{
+    for (char const* variable : { "DYNAMICL_SPILL_DIR", "TMPDIR" })
+    {
+        char const* value = std::getenv(variable);
+        if (value && *value)
+        {
+            return value;
+        }
+    }
+    return "/tmp";
+}
+
+void prefetchPages(void const* data, size_t bytes)
+{
+    advisePages(data, bytes, MADV_WILLNEED);
+}
+
+void retirePages(void const* data, size_t bytes)
+{
+#ifdef MADV_COLD
+    advisePages(data, bytes, MADV_COLD);
+#else
+    (void)data;
+    (void)bytes;
+#endif
+}
+
+int currentNumaNode()
+{
+#ifdef SYS_getcpu
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (::syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)
+    {
+        return node;
+    }
+#endif
+    return -1;
+}
+
+namespace detail
+{
+
+char* map_pages(size_t bytes, AllocationPolicy const& policy, size_t& mappedBytes)
+{
+    typedef AllocationPolicy::Pages Pages;
+
+    char* data = nullptr;
+    if (policy.pages == Pages::FILE)
+    {
+        mappedBytes = roundUpTo(bytes, ::sysconf(_SC_PAGESIZE));
+        data = mapSpillFile(mappedBytes);
+    }
+    else if (policy.pages == Pages::SMALL)
+    {
+        mappedBytes = roundUpTo(bytes, ::sysconf(_SC_PAGESIZE));
+        data = mapAligned(mappedBytes, ::sysconf(_SC_PAGESIZE));
+    }
+    else
+    {
+        mappedBytes = roundUpTo(bytes, s_hugePageSize);
+
+#ifdef MAP_HUGETLB
+        if (policy.pages == Pages::HUGE)
+        {
+            void* p = ::mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED)
+            {
+                data = static_cast<char*>(p);
+            }
+        }
+#endif
+
+        // no reserved huge pages left, so hope for transparent ones
+        if (!data)
+        {
+            data = mapAligned(mappedBytes, s_hugePageSize);
+#ifdef MADV_HUGEPAGE
+            ::madvise(data, mappedBytes, MADV_HUGEPAGE);
+#endif
+        }
+    }
+
+#ifdef SYS_mbind
+    // takes effect on first touch, so has to happen before anything is written
+    if (policy.numaNode >= 0 && policy.numaNode < 64)
+    {
+        unsigned long nodeMask = 1UL << policy.numaNode;
+        ::syscall(SYS_mbind, data, mappedBytes, s_mpolPreferred, &nodeMask, 64, 0);
+    }
+#endif
+
+    countHostAllocation(mappedBytes);
+    return data;
+}
+
+void unmap_pages(char* data, size_t mappedBytes)
+{
+    if (data)
+    {
+        ::munmap(data, mappedBytes);
+    }
+}
+
+}
+
 }
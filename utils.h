@@ -4,13 +4,99 @@
 #include <string>
 #include <type_traits>
 
+#include "alloc_counters.h"
+
 namespace DynamiCL
 {
     std::string stripExtension(std::string const& path);
 
+    /**
+     * Return the extension of @a path in lower case, without the dot.
+     * Empty if the path has no extension.
+     */
+    std::string getExtension(std::string const& path);
+
+    /**
+     * Where the memory of large arrays comes from: the pages backing it,
+     * and the NUMA node it is placed on.
+     */
+    struct AllocationPolicy
+    {
+        enum class Pages
+        {
+            SMALL,       ///< plain malloc, or mapped 4 KB pages preferring numaNode, if set
+            TRANSPARENT, ///< mapping eligible for transparent 2 MB pages
+            HUGE,        ///< reserved 2 MB pages, or transparent ones if none are left
+            FILE         ///< pages of a temporary file in spillDirectory(), for arrays larger than memory
+        };
+
+        Pages pages;
+        int numaNode; ///< node pages are preferably placed on, -1 for first touch
+
+        explicit AllocationPolicy(Pages pages = Pages::SMALL, int numaNode = -1)
+            : pages(pages),
+              numaNode(numaNode)
+        { }
+
+        /**
+         * The pages set by the environment variable DYNAMICL_PAGES, one of
+         * "small", "transparent" or "huge", on the node of the calling
+         * thread. Transparent pages if unset.
+         */
+        static AllocationPolicy local();
+
+        /**
+         * Pages of a temporary file, which the kernel writes back and
+         * drops under memory pressure instead of failing the allocation.
+         * Placed wherever their first touch happens.
+         */
+        static AllocationPolicy spill()
+        {
+            return AllocationPolicy(Pages::FILE);
+        }
+    };
+
+    /**
+     * @Return directory of the files arrays spill to: the environment
+     * variable DYNAMICL_SPILL_DIR, or else TMPDIR, or else /tmp
+     */
+    std::string spillDirectory();
+
+    /**
+     * Hint that the pages from @a data to @a data + @a bytes are read
+     * soon, so that those of spilled arrays are read ahead of time.
+     * Harmless for any other memory.
+     */
+    void prefetchPages(void const* data, size_t bytes);
+
+    /**
+     * Hint that the pages from @a data to @a data + @a bytes are done
+     * with for a while, so that those of spilled arrays are the first to
+     * be written back and dropped. Their contents stay as they are.
+     */
+    void retirePages(void const* data, size_t bytes);
+
+    /**
+     * @Return NUMA node of the CPU the calling thread runs on, or -1 if
+     * unknown
+     */
+    int currentNumaNode();
+
     namespace detail
     {
 
+        /**
+         * Map at least @a bytes of memory according to @a policy.
+         * @a mappedBytes receives the size to pass to unmap_pages().
+         *
+         * @throws std::bad_alloc if there is no memory left.
+         * @throws std::runtime_error if there is no room left for a file
+         * to spill to.
+         */
+        char* map_pages(size_t bytes, AllocationPolicy const& policy, size_t& mappedBytes);
+
+        void unmap_pages(char* data, size_t mappedBytes);
+
         template <typename T>
         T* align_ptr(char* unaligned, size_t alignment)
         {
@@ -30,18 +116,27 @@ namespace DynamiCL
         // TODO: add static assert to ensure Align is a power of 2
 
         size_t size_;
+        size_t mappedBytes_; ///< size of the mapping if not from malloc
         char* unalignedData_;
         T* array_;
 
         void dealloc()
         {
-            free(unalignedData_);
+            if (mappedBytes_)
+            {
+                detail::unmap_pages(unalignedData_, mappedBytes_);
+            }
+            else
+            {
+                free(unalignedData_);
+            }
             invalidate();
         }
 
         void invalidate()
         {
             size_ = 0;
+            mappedBytes_ = 0;
             unalignedData_ = nullptr;
             array_ = nullptr;
         }
@@ -57,6 +152,7 @@ namespace DynamiCL
             {
                 throw std::bad_alloc();
             }
+            countHostAllocation(Align + n * sizeof(T));
             return result;
         }
 
@@ -66,18 +162,36 @@ namespace DynamiCL
 
         array_ptr()
             : size_(0),
+              mappedBytes_(0),
               unalignedData_(nullptr),
               array_(nullptr)
         { }
 
         array_ptr(size_t s)
             : size_(s),
+              mappedBytes_(0),
               unalignedData_(malloc_enough(s)),
               array_(detail::align_ptr<T>(unalignedData_, Align))
         { }
 
+        /**
+         * Allocate @a s objects with pages chosen by @a policy.
+         * Worth it for arrays of many megabytes that are walked through
+         * as a whole, where 4 KB pages thrash the TLB.
+         */
+        array_ptr(size_t s, AllocationPolicy const& policy)
+            : size_(s),
+              mappedBytes_(0),
+              unalignedData_(policy.pages == AllocationPolicy::Pages::SMALL
+                             && policy.numaNode < 0
+                                ? malloc_enough(s)
+                                : detail::map_pages(Align + s * sizeof(T), policy, mappedBytes_)),
+              array_(detail::align_ptr<T>(unalignedData_, Align))
+        { }
+
         array_ptr(array_ptr&& other)
             : size_(other.size_),
+              mappedBytes_(other.mappedBytes_),
               unalignedData_(other.unalignedData_),
               array_(other.array_)
         {
@@ -86,9 +200,9 @@ namespace DynamiCL
 
         array_ptr& operator = (array_ptr&& other)
         {
-            size_ = other.size_;
-
             dealloc();
+            size_ = other.size_;
+            mappedBytes_ = other.mappedBytes_;
             unalignedData_ = other.unalignedData_;
             array_ = other.array_;
 